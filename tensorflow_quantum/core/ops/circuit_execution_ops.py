@@ -14,6 +14,7 @@
 # ==============================================================================
 """A module for user-facing generators of tfq ops."""
 import enum
+import weakref
 
 import cirq
 import tensorflow as tf
@@ -24,6 +25,9 @@ from tensorflow_quantum.python import quantum_context
 
 _GLOBAL_OP_LOCK = tf.CriticalSection()
 
+# Ops returned by get_expectation_op that only call the C++ simulator.
+_NATIVE_EXPECTATION_OPS = weakref.WeakSet()
+
 
 class TFQWavefunctionSimulator(enum.Enum):
     """Enum to make specifying TFQ simulators user-friendly."""
@@ -33,6 +37,17 @@ class TFQWavefunctionSimulator(enum.Enum):
     sampled_expectation = tfq_simulate_ops.tfq_simulate_sampled_expectation
 
 
+def is_native_expectation_op(op):
+    """Returns True if `op` came from `get_expectation_op` with the C++
+    simulator and no graph level locking.
+
+    Differentiators that call native simulate ops directly, in place of the
+    op they are given, check this first. Any other op (cirq backends, noisy
+    simulators, ops made by hand) must be differentiated through `op` itself.
+    """
+    return op in _NATIVE_EXPECTATION_OPS
+
+
 def _check_quantum_concurrent(quantum_concurrent):
     if not isinstance(quantum_concurrent, bool):
         raise TypeError("quantum_concurrent must be type bool."
@@ -131,8 +146,13 @@ def get_expectation_op(
     if op is not None:
         if quantum_concurrent is True:
             # Return an op that does not block graph level parallelism.
-            return lambda programs, symbol_names, symbol_values, pauli_sums: \
-                op(programs, symbol_names, symbol_values, pauli_sums)
+            def concurrent_op(programs, symbol_names, symbol_values,
+                              pauli_sums):
+                return op(programs, symbol_names, symbol_values, pauli_sums)
+
+            if backend is None:
+                _NATIVE_EXPECTATION_OPS.add(concurrent_op)
+            return concurrent_op
 
         # Return an op that does block graph level parallelism.
         return lambda programs, symbol_names, symbol_values, pauli_sums: \
@@ -102,6 +102,23 @@ class OpGetterInputChecks(tf.test.TestCase):
                                     expected_regex="must be type bool."):
             circuit_execution_ops.get_expectation_op(quantum_concurrent='junk')
 
+    def test_is_native_expectation_op(self):
+        """Only the lock free C++ expectation op counts as native."""
+        self.assertTrue(
+            circuit_execution_ops.is_native_expectation_op(
+                circuit_execution_ops.get_expectation_op()))
+        self.assertFalse(
+            circuit_execution_ops.is_native_expectation_op(
+                circuit_execution_ops.get_expectation_op(
+                    backend=cirq.DensityMatrixSimulator())))
+        self.assertFalse(
+            circuit_execution_ops.is_native_expectation_op(
+                circuit_execution_ops.get_expectation_op(
+                    quantum_concurrent=False)))
+        self.assertFalse(
+            circuit_execution_ops.is_native_expectation_op(
+                lambda programs, symbol_names, symbol_values, pauli_sums: None))
+
     def test_get_sampled_expectation_inputs(self):
         """Test that get expectation only accepts inputs it should."""
         circuit_execution_ops.get_sampled_expectation_op()
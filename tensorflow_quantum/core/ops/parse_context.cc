@@ -17,16 +17,23 @@ limitations under the License.
 
 #include <google/protobuf/text_format.h>
 
+#include <algorithm>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
 #include "cirq/google/api/v2/program.pb.h"
+#include "tensorflow/core/framework/node_def_util.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/lib/core/error_codes.pb.h"
 #include "tensorflow/core/lib/core/status.h"
 #include "tensorflow/core/lib/core/threadpool.h"
 #include "tensorflow_quantum/core/ops/tfq_simulate_utils.h"
 #include "tensorflow_quantum/core/proto/pauli_sum.pb.h"
+#include "tensorflow_quantum/core/src/circuit_encoding.h"
+#include "tensorflow_quantum/core/src/program_view.h"
 #include "tensorflow_quantum/core/src/program_resolution.h"
 
 namespace tfq {
@@ -36,28 +43,99 @@ using ::cirq::google::api::v2::Program;
 using ::tensorflow::OpKernelContext;
 using ::tensorflow::Status;
 using ::tensorflow::Tensor;
+using ::tfq::proto::PauliQubitPair;
 using ::tfq::proto::PauliSum;
+using ::tfq::proto::PauliTerm;
+
+// Inputs are clipped to this many bytes in error messages, a batch of large
+// circuits would otherwise produce an error the size of the batch.
+constexpr size_t kMaxErrorBytes = 128;
 
 template <typename T>
-Status ParseProto(const std::string& text, T* proto) {
+Status ParseProto(absl::string_view text, T* proto,
+                  const bool allow_text_format = true) {
   // First attempt to parse from the binary representation.
-  if (proto->ParseFromString(text)) {
+  if (proto->ParseFromArray(text.data(), text.size())) {
     return Status::OK();
   }
 
   // If that fails, then try to parse from the human readable representation.
-  if (google::protobuf::TextFormat::ParseFromString(text, proto)) {
+  if (allow_text_format && google::protobuf::TextFormat::ParseFromString(
+                               std::string(text), proto)) {
     return Status::OK();
   }
 
+  if (text.size() > kMaxErrorBytes) {
+    return Status(tensorflow::error::INVALID_ARGUMENT,
+                  absl::StrCat("Unparseable proto: ",
+                               text.substr(0, kMaxErrorBytes), "... (",
+                               text.size(), " bytes)"));
+  }
   return Status(tensorflow::error::INVALID_ARGUMENT,
-                "Unparseable proto: " + text);
+                absl::StrCat("Unparseable proto: ", text));
+}
+
+// Ops that declare allow_text_format can turn off the text format retry,
+// every other op keeps accepting human readable protos.
+bool AllowTextFormat(OpKernelContext* context) {
+  bool allow_text_format = true;
+  tensorflow::TryGetNodeAttr(context->op_kernel().def(), "allow_text_format",
+                             &allow_text_format);
+  return allow_text_format;
+}
+
+// Programs may also arrive in the compact encoding from circuit_encoding.h,
+// which is recognized by its header and read without protobuf parsing.
+Status ParseProgram(absl::string_view text, Program* program,
+                    const bool allow_text_format) {
+  if (IsEncodedProgram(text)) {
+    return DecodeProgram(text, program);
+  }
+  return ParseProto(text, program, allow_text_format);
+}
+
+// ResolveQubitIds for the PauliSums measured on a program read as an
+// EncodedCircuit, whose qubits are numbered already.
+Status ResolveEncodedPauliSums(const EncodedCircuit& circuit,
+                               std::vector<PauliSum>* p_sums) {
+  absl::flat_hash_map<absl::string_view, std::string> id_to_index;
+  for (size_t k = 0; k < circuit.qubit_ids.size(); k++) {
+    id_to_index[circuit.qubit_ids[k]] = absl::StrCat(k);
+  }
+  for (PauliSum& p_sum : *p_sums) {
+    for (PauliTerm& term : *p_sum.mutable_terms()) {
+      for (PauliQubitPair& pair : *term.mutable_paulis()) {
+        const auto result = id_to_index.find(pair.qubit_id());
+        if (result == id_to_index.end()) {
+          return Status(
+              tensorflow::error::INVALID_ARGUMENT,
+              "Found a Pauli sum operating on qubits not found in circuit.");
+        }
+        pair.set_qubit_id(result->second);
+      }
+    }
+  }
+  return Status::OK();
 }
 
 }  // namespace
 
+void ProgramBatch::Reset(const int size) {
+  programs_.clear();
+  encoded_.clear();
+  arena_.Reset();
+  programs_.assign(size, nullptr);
+  encoded_.resize(size);
+}
+
+void ProgramBatch::clear() {
+  programs_.clear();
+  encoded_.clear();
+  arena_.Reset();
+}
+
 Status ParsePrograms(OpKernelContext* context, const std::string& input_name,
-                     std::vector<Program>* programs) {
+                     ProgramBatch* programs) {
   const tensorflow::Tensor* input;
   Status status = context->input(input_name, &input);
   if (!status.ok()) {
@@ -71,13 +149,74 @@ Status ParsePrograms(OpKernelContext* context, const std::string& input_name,
         absl::StrCat("programs must be rank 1. Got rank ", input->dims(), "."));
   }
 
+  const bool allow_text_format = AllowTextFormat(context);
+
   const auto program_strings = input->vec<tensorflow::tstring>();
   const int num_programs = program_strings.dimension(0);
-  programs->assign(num_programs, Program());
+  programs->Reset(num_programs);
 
   auto DoWork = [&](int start, int end) {
     for (int i = start; i < end; i++) {
-      OP_REQUIRES_OK(context, ParseProto(program_strings(i), &programs->at(i)));
+      Program* program = programs->Create(i);
+      const absl::string_view text(program_strings(i).data(),
+                                   program_strings(i).size());
+      if (programs->read_encoded_circuits() && IsEncodedProgram(text)) {
+        EncodedCircuit circuit;
+        bool resolved;
+        OP_REQUIRES_OK(context, DecodeCircuit(text, &circuit, &resolved));
+        if (resolved) {
+          programs->SetEncoded(i, std::move(circuit));
+          continue;
+        }
+      }
+      OP_REQUIRES_OK(context, ParseProgram(text, program, allow_text_format));
+    }
+  };
+
+  // TODO(mbbrough): Determine if this is a good cycle estimate.
+  const int cycle_estimate = 1000;
+  context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
+      num_programs, cycle_estimate, DoWork);
+
+  return Status::OK();
+}
+
+Status GetSerializedPrograms(OpKernelContext* context,
+                             const std::string& input_name,
+                             std::vector<absl::string_view>* programs,
+                             std::vector<std::string>* storage) {
+  const tensorflow::Tensor* input;
+  Status status = context->input(input_name, &input);
+  if (!status.ok()) {
+    return status;
+  }
+
+  if (input->dims() != 1) {
+    // Never parse anything other than a 1d list of circuits.
+    return Status(
+        tensorflow::error::INVALID_ARGUMENT,
+        absl::StrCat("programs must be rank 1. Got rank ", input->dims(), "."));
+  }
+
+  const bool allow_text_format = AllowTextFormat(context);
+
+  const auto program_strings = input->vec<tensorflow::tstring>();
+  const int num_programs = program_strings.dimension(0);
+  programs->assign(num_programs, absl::string_view());
+  storage->assign(num_programs, std::string());
+
+  auto DoWork = [&](int start, int end) {
+    for (int i = start; i < end; i++) {
+      const absl::string_view text(program_strings(i).data(),
+                                   program_strings(i).size());
+      if (!IsEncodedProgram(text) && IsSerializedProgram(text)) {
+        (*programs)[i] = text;
+        continue;
+      }
+      Program program;
+      OP_REQUIRES_OK(context, ParseProgram(text, &program, allow_text_format));
+      program.SerializeToString(&(*storage)[i]);
+      (*programs)[i] = (*storage)[i];
     }
   };
 
@@ -90,8 +229,8 @@ Status ParsePrograms(OpKernelContext* context, const std::string& input_name,
 }
 
 Status GetProgramsAndProgramsToAppend(
-    OpKernelContext* context, std::vector<Program>* programs,
-    std::vector<Program>* programs_to_append) {
+    OpKernelContext* context, ProgramBatch* programs,
+    ProgramBatch* programs_to_append) {
   Status status = ParsePrograms(context, "programs", programs);
   if (!status.ok()) {
     return status;
@@ -111,7 +250,7 @@ Status GetProgramsAndProgramsToAppend(
 }
 
 Status GetProgramsAndNumQubits(
-    OpKernelContext* context, std::vector<Program>* programs,
+    OpKernelContext* context, ProgramBatch* programs,
     std::vector<int>* num_qubits,
     std::vector<std::vector<PauliSum>>* p_sums /*=nullptr*/) {
   // 1. Parse input programs
@@ -133,6 +272,16 @@ Status GetProgramsAndNumQubits(
   num_qubits->assign(programs->size(), -1);
   auto DoWork = [&](int start, int end) {
     for (int i = start; i < end; i++) {
+      const EncodedCircuit* encoded = programs->encoded(i);
+      if (encoded != nullptr) {
+        // Qubits were numbered when the program was encoded.
+        if (p_sums && encoded->num_qubits > 0) {
+          OP_REQUIRES_OK(context,
+                         ResolveEncodedPauliSums(*encoded, &(p_sums->at(i))));
+        }
+        (*num_qubits)[i] = encoded->num_qubits;
+        continue;
+      }
       Program& program = (*programs)[i];
       unsigned int this_num_qubits;
       if (p_sums) {
@@ -153,6 +302,58 @@ Status GetProgramsAndNumQubits(
   return Status::OK();
 }
 
+Status QsimCircuitFromBatch(
+    const ProgramBatch& programs, const int i, const SymbolMap& param_map,
+    const int num_qubits, qsim::Circuit<qsim::Cirq::GateCirq<float>>* circuit,
+    std::vector<qsim::GateFused<qsim::Cirq::GateCirq<float>>>* fused_circuit,
+    std::vector<GateMetaData>* metadata /*=nullptr*/) {
+  const EncodedCircuit* encoded = programs.encoded(i);
+  if (encoded != nullptr) {
+    return QsimCircuitFromEncodedCircuit(*encoded, param_map, num_qubits,
+                                         circuit, fused_circuit, metadata);
+  }
+  return QsimCircuitFromProgram(programs[i], param_map, num_qubits, circuit,
+                                fused_circuit, metadata);
+}
+
+Status PlaceQubitsByActivity(ProgramBatch* programs, const int i,
+                             const unsigned int num_qubits,
+                             std::vector<PauliSum>* p_sums,
+                             std::vector<unsigned int>* placement) {
+  EncodedCircuit* encoded = programs->encoded(i);
+  if (encoded == nullptr) {
+    return PlaceQubitsByActivity(&(*programs)[i], num_qubits, p_sums,
+                                 placement);
+  }
+  if (encoded->num_qubits != num_qubits) {
+    return Status(tensorflow::error::INVALID_ARGUMENT,
+                  "Encoded circuit has a different number of qubits.");
+  }
+
+  std::vector<int> activity(num_qubits, 0);
+  for (const EncodedGate& gate : encoded->gates) {
+    for (unsigned int q = 0; q < gate.num_qubits; q++) {
+      activity[gate.qubits[q]]++;
+    }
+  }
+  Status status = PlaceQubitsByActivity(activity, p_sums, placement);
+  if (!status.ok()) {
+    return status;
+  }
+
+  for (EncodedGate& gate : encoded->gates) {
+    for (unsigned int q = 0; q < gate.num_qubits; q++) {
+      gate.qubits[q] = (*placement)[gate.qubits[q]];
+    }
+  }
+  std::vector<absl::string_view> qubit_ids(num_qubits);
+  for (unsigned int k = 0; k < num_qubits; k++) {
+    qubit_ids[(*placement)[k]] = encoded->qubit_ids[k];
+  }
+  encoded->qubit_ids.swap(qubit_ids);
+  return Status::OK();
+}
+
 Status GetPauliSums(OpKernelContext* context,
                     std::vector<std::vector<PauliSum>>* p_sums) {
   // 1. Parses PauliSum proto.
@@ -168,6 +369,7 @@ Status GetPauliSums(OpKernelContext* context,
                                input->dims(), "."));
   }
 
+  const bool allow_text_format = AllowTextFormat(context);
   const auto sum_specs = input->matrix<tensorflow::tstring>();
   p_sums->assign(sum_specs.dimension(0),
                  std::vector<PauliSum>(sum_specs.dimension(1), PauliSum()));
@@ -177,7 +379,9 @@ Status GetPauliSums(OpKernelContext* context,
       const int i = ii / op_dim;
       const int j = ii % op_dim;
       PauliSum p;
-      OP_REQUIRES_OK(context, ParseProto(sum_specs(i, j), &p));
+      const absl::string_view text(sum_specs(i, j).data(),
+                                   sum_specs(i, j).size());
+      OP_REQUIRES_OK(context, ParseProto(text, &p, allow_text_format));
       (*p_sums)[i][j] = p;
     }
   };
@@ -190,6 +394,34 @@ Status GetPauliSums(OpKernelContext* context,
   return Status::OK();
 }
 
+Status GetPauliSumList(OpKernelContext* context,
+                       std::vector<PauliSum>* p_sums) {
+  const Tensor* input;
+  Status status = context->input("pauli_sums", &input);
+  if (!status.ok()) {
+    return status;
+  }
+
+  if (input->dims() != 1) {
+    return Status(tensorflow::error::INVALID_ARGUMENT,
+                  absl::StrCat("pauli_sums must be rank 1. Got rank ",
+                               input->dims(), "."));
+  }
+
+  const bool allow_text_format = AllowTextFormat(context);
+  const auto sum_specs = input->vec<tensorflow::tstring>();
+  p_sums->assign(sum_specs.dimension(0), PauliSum());
+  for (int i = 0; i < sum_specs.dimension(0); i++) {
+    const absl::string_view text(sum_specs(i).data(), sum_specs(i).size());
+    status = ParseProto(text, &(*p_sums)[i], allow_text_format);
+    if (!status.ok()) {
+      return status;
+    }
+  }
+
+  return Status::OK();
+}
+
 Status GetSymbolMaps(OpKernelContext* context, std::vector<SymbolMap>* maps) {
   // 1. Convert to dictionary representation for param resolution.
   const Tensor* input_names;
@@ -306,4 +538,80 @@ Status GetIndividualSample(tensorflow::OpKernelContext* context,
   return Status::OK();
 }
 
+Status GetInitialStates(OpKernelContext* context,
+                        const std::vector<int>& num_qubits,
+                        InitialStates* initial_states) {
+  tensorflow::OpInputList inputs;
+  Status status = context->input_list("initial_states", &inputs);
+  if (!status.ok()) {
+    return status;
+  }
+
+  *initial_states = InitialStates();
+  if (inputs.size() == 0) {
+    return Status::OK();
+  }
+  if (inputs.size() != 1) {
+    return Status(tensorflow::error::INVALID_ARGUMENT,
+                  absl::StrCat("initial_states must hold at most one tensor. "
+                               "Got ",
+                               inputs.size(), "."));
+  }
+
+  const Tensor* input = &inputs[0];
+  if (input->dims() != 2) {
+    return Status(tensorflow::error::INVALID_ARGUMENT,
+                  absl::StrCat("initial_states must be rank 2. Got rank ",
+                               input->dims(), "."));
+  }
+
+  const int64_t num_rows = input->dim_size(0);
+  if (num_rows != 1 && num_rows != num_qubits.size()) {
+    return Status(tensorflow::error::INVALID_ARGUMENT,
+                  absl::StrCat("initial_states must have 1 row or one row "
+                               "per circuit. Got ",
+                               num_rows, " rows for ", num_qubits.size(),
+                               " circuits."));
+  }
+  int max_num_qubits = 0;
+  for (const int nq : num_qubits) {
+    max_num_qubits = std::max(max_num_qubits, nq);
+  }
+  const int64_t row_size = input->dim_size(1);
+  if (!num_qubits.empty() && row_size != (int64_t(1) << max_num_qubits)) {
+    return Status(tensorflow::error::INVALID_ARGUMENT,
+                  absl::StrCat("initial_states must hold 2 ** ",
+                               max_num_qubits, " amplitudes per row. Got ",
+                               row_size, "."));
+  }
+
+  // Amplitudes past 2 ** num_qubits[i] would be silently dropped, so they
+  // must be zero. A shared row is checked once against its smallest
+  // circuit. (#679) Empty programs are never simulated.
+  std::vector<int> row_num_qubits(num_rows, max_num_qubits);
+  for (int i = 0; i < num_qubits.size(); i++) {
+    if (num_qubits[i] > 0) {
+      const int64_t r = num_rows == 1 ? 0 : i;
+      row_num_qubits[r] = std::min(row_num_qubits[r], num_qubits[i]);
+    }
+  }
+  const auto matrix = input->matrix<std::complex<float>>();
+  for (int64_t r = 0; r < num_rows; r++) {
+    for (int64_t k = int64_t(1) << row_num_qubits[r]; k < row_size; k++) {
+      if (matrix(r, k) != std::complex<float>(0, 0)) {
+        return Status(tensorflow::error::INVALID_ARGUMENT,
+                      absl::StrCat("initial_states row ", r,
+                                   " has a nonzero amplitude at index ", k,
+                                   " past the 2 ** ", row_num_qubits[r],
+                                   " amplitudes of its circuit."));
+      }
+    }
+  }
+
+  initial_states->data = matrix.data();
+  initial_states->num_rows = num_rows;
+  initial_states->row_size = row_size;
+  return Status::OK();
+}
+
 }  // namespace tfq
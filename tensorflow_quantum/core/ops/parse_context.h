@@ -16,27 +16,118 @@ limitations under the License.
 #ifndef TFQ_CORE_OPS_PARSE_CONTEXT
 #define TFQ_CORE_OPS_PARSE_CONTEXT
 
+#include <google/protobuf/arena.h>
+
+#include <complex>
+#include <cstdint>
+#include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
 #include "cirq/google/api/v2/program.pb.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/lib/core/status.h"
 #include "tensorflow_quantum/core/proto/pauli_sum.pb.h"
+#include "tensorflow_quantum/core/src/circuit_encoding.h"
+#include "tensorflow_quantum/core/src/circuit_parser_qsim.h"
 
 namespace tfq {
 
-// Simplest Program proto parsing
-tensorflow::Status ParsePrograms(
+// The Programs parsed by a single op call. Every message is allocated on one
+// protobuf Arena, so parsing a batch makes a handful of block allocations
+// instead of one per operation and arg, and the whole batch is released at
+// once when it goes out of scope. Indexes like the std::vector it replaces.
+//
+// A batch constructed with read_encoded_circuits set lets
+// GetProgramsAndNumQubits read programs in the compact encoding straight
+// into EncodedCircuits (circuit_encoding.h). Program i is then left empty
+// and encoded(i) is set, so only ops that build their circuits through
+// QsimCircuitFromBatch and place qubits through PlaceQubitsByActivity below
+// may ask for it.
+class ProgramBatch {
+ public:
+  ProgramBatch() {}
+  explicit ProgramBatch(const bool read_encoded_circuits)
+      : read_encoded_circuits_(read_encoded_circuits) {}
+  ProgramBatch(const ProgramBatch&) = delete;
+  ProgramBatch& operator=(const ProgramBatch&) = delete;
+
+  // Drops the current programs and makes room for `size` new ones.
+  void Reset(const int size);
+
+  // Allocates program i on the arena. Safe to call from several threads for
+  // distinct i.
+  cirq::google::api::v2::Program* Create(const int i) {
+    programs_[i] =
+        google::protobuf::Arena::CreateMessage<cirq::google::api::v2::Program>(
+            &arena_);
+    return programs_[i];
+  }
+
+  cirq::google::api::v2::Program& operator[](const size_t i) {
+    return *programs_[i];
+  }
+  const cirq::google::api::v2::Program& operator[](const size_t i) const {
+    return *programs_[i];
+  }
+  cirq::google::api::v2::Program& at(const size_t i) {
+    return *programs_.at(i);
+  }
+  const cirq::google::api::v2::Program& at(const size_t i) const {
+    return *programs_.at(i);
+  }
+
+  // The resolved gates of program i if it was read as an EncodedCircuit,
+  // else nullptr.
+  EncodedCircuit* encoded(const size_t i) { return encoded_[i].get(); }
+  const EncodedCircuit* encoded(const size_t i) const {
+    return encoded_[i].get();
+  }
+
+  // Stores `circuit` as the EncodedCircuit of program i. Safe to call from
+  // several threads for distinct i.
+  void SetEncoded(const int i, EncodedCircuit circuit) {
+    encoded_[i].reset(new EncodedCircuit(std::move(circuit)));
+  }
+
+  bool read_encoded_circuits() const { return read_encoded_circuits_; }
+
+  size_t size() const { return programs_.size(); }
+
+  // Frees every program in the batch.
+  void clear();
+
+ private:
+  google::protobuf::Arena arena_;
+  std::vector<cirq::google::api::v2::Program*> programs_;
+  std::vector<std::unique_ptr<EncodedCircuit>> encoded_;
+  bool read_encoded_circuits_ = false;
+};
+
+// Simplest Program proto parsing. Inputs may be binary or text format Program
+// protos or programs from circuit_encoding.h. If the op has a bool attr named
+// allow_text_format set to false, text format inputs are rejected instead of
+// being retried after the binary parse fails.
+tensorflow::Status ParsePrograms(tensorflow::OpKernelContext* context,
+                                 const std::string& input_name,
+                                 ProgramBatch* programs);
+
+// Collects the programs in `input_name` as binary serialized Program protos
+// for the readers in program_view.h. Binary inputs are viewed in place, text
+// format and encoded inputs are parsed and reserialized into `storage`,
+// which must outlive `programs`.
+tensorflow::Status GetSerializedPrograms(
     tensorflow::OpKernelContext* context, const std::string& input_name,
-    std::vector<cirq::google::api::v2::Program>* programs);
+    std::vector<absl::string_view>* programs,
+    std::vector<std::string>* storage);
 
 // Parses a vector of programs along with another vector of programs to append
 tensorflow::Status GetProgramsAndProgramsToAppend(
-    tensorflow::OpKernelContext* context,
-    std::vector<cirq::google::api::v2::Program>* programs,
-    std::vector<cirq::google::api::v2::Program>* programs_to_append);
+    tensorflow::OpKernelContext* context, ProgramBatch* programs,
+    ProgramBatch* programs_to_append);
 
 // A parameter map is a mapping from the name of the parameter to the index in
 // the input parameter value tensor (for gradient computations) and the value
@@ -48,18 +139,42 @@ typedef absl::flat_hash_map<std::string, std::pair<int, float>> SymbolMap;
 // QubitIds found in programs into PauliSums such that they are consistent
 // and correct with the original programs.
 tensorflow::Status GetProgramsAndNumQubits(
-    tensorflow::OpKernelContext* context,
-    std::vector<cirq::google::api::v2::Program>* programs,
+    tensorflow::OpKernelContext* context, ProgramBatch* programs,
     std::vector<int>* num_qubits,
     std::vector<std::vector<tfq::proto::PauliSum>>* p_sums = nullptr);
 
+// QsimCircuitFromProgram for program i of a batch filled by
+// GetProgramsAndNumQubits. Programs read as EncodedCircuits are built
+// straight from their resolved gates.
+tensorflow::Status QsimCircuitFromBatch(
+    const ProgramBatch& programs, const int i, const SymbolMap& param_map,
+    const int num_qubits, qsim::Circuit<qsim::Cirq::GateCirq<float>>* circuit,
+    std::vector<qsim::GateFused<qsim::Cirq::GateCirq<float>>>* fused_circuit,
+    std::vector<GateMetaData>* metadata = nullptr);
+
+// PlaceQubitsByActivity (program_resolution.h) for program i of a batch
+// filled by GetProgramsAndNumQubits.
+tensorflow::Status PlaceQubitsByActivity(
+    ProgramBatch* programs, const int i, const unsigned int num_qubits,
+    std::vector<tfq::proto::PauliSum>* p_sums,
+    std::vector<unsigned int>* placement);
+
 // Parses PauliSum protos out of the 'pauli_sums' input tensor. Note this
 // function does NOT resolve QubitID's as any paulisum needs a reference
 // program to "discover" all of the active qubits and define the ordering.
+// As with ParsePrograms, text format protos are rejected if the op sets
+// allow_text_format to false.
 tensorflow::Status GetPauliSums(
     tensorflow::OpKernelContext* context,
     std::vector<std::vector<tfq::proto::PauliSum>>* p_sums);
 
+// Parses PauliSum protos out of a rank 1 'pauli_sums' input tensor, for ops
+// that measure a single state rather than a batch of circuits. Honors
+// allow_text_format like GetPauliSums.
+tensorflow::Status GetPauliSumList(
+    tensorflow::OpKernelContext* context,
+    std::vector<tfq::proto::PauliSum>* p_sums);
+
 // Parses the input context to construct the SymbolMaps for the entire batch.
 // The two input Tensors are expected to be of size:
 //
@@ -81,6 +196,33 @@ tensorflow::Status GetNumSamples(
 tensorflow::Status GetIndividualSample(tensorflow::OpKernelContext* context,
                                        int* n_samples);
 
+// The optional 'initial_states' input of the simulate ops, viewed in place.
+// Row r holds the amplitudes of a starting state in the order that
+// tfq_simulate_state outputs them. Rows hold 2 ** max(num_qubits)
+// amplitudes and those past 2 ** num_qubits of a circuit must be zero.
+struct InitialStates {
+  const std::complex<float>* data = nullptr;
+  int64_t num_rows = 0;
+  int64_t row_size = 0;
+
+  // True if circuits start from |0...0>.
+  bool empty() const { return num_rows == 0; }
+
+  // The amplitudes circuit i starts from. A single row is shared by every
+  // circuit.
+  const std::complex<float>* row(const int i) const {
+    return data + (num_rows == 1 ? 0 : i) * row_size;
+  }
+};
+
+// Parses the optional 'initial_states' input. When it is not given every
+// circuit starts from |0...0>, otherwise it must have one row or one row per
+// circuit, each with 2 ** max(num_qubits) amplitudes. Nonzero amplitudes
+// past 2 ** num_qubits[i] in the row of circuit i are an error.
+tensorflow::Status GetInitialStates(tensorflow::OpKernelContext* context,
+                                    const std::vector<int>& num_qubits,
+                                    InitialStates* initial_states);
+
 }  // namespace tfq
 
 #endif  // TFQ_CORE_OPS_PARSE_CONTEXT
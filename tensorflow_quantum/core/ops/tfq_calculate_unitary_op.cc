@@ -47,7 +47,7 @@ class TfqSimulateStateOp : public tensorflow::OpKernel {
     // TODO (mbbrough): add more dimension checks for other inputs here.
     DCHECK_EQ(3, context->num_inputs());
 
-    std::vector<Program> programs;
+    ProgramBatch programs;
     std::vector<int> num_qubits;
     OP_REQUIRES_OK(context,
                    GetProgramsAndNumQubits(context, &programs, &num_qubits));
@@ -147,6 +147,7 @@ REGISTER_OP("TfqCalculateUnitary")
     .Input("programs: string")
     .Input("symbol_names: string")
     .Input("symbol_values: float")
+    .Attr("allow_text_format: bool = true")
     .Output("unitary: complex64")
     .SetShapeFn([](tensorflow::shape_inference::InferenceContext *c) {
       tensorflow::shape_inference::ShapeHandle programs_shape;
@@ -14,8 +14,9 @@ limitations under the License.
 ==============================================================================*/
 
 #include <string>
+#include <vector>
 
-#include "cirq/google/api/v2/program.pb.h"
+#include "absl/strings/string_view.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/shape_inference.h"
 #include "tensorflow/core/framework/tensor_shape.h"
@@ -23,28 +24,38 @@ limitations under the License.
 #include "tensorflow/core/lib/core/threadpool.h"
 #include "tensorflow_quantum/core/ops/parse_context.h"
 #include "tensorflow_quantum/core/ops/tfq_simulate_utils.h"
+#include "tensorflow_quantum/core/src/program_view.h"
 
 namespace tfq {
 
-using ::cirq::google::api::v2::Moment;
-using ::cirq::google::api::v2::Program;
-
 class TfqCircuitAppendOp : public tensorflow::OpKernel {
  public:
   explicit TfqCircuitAppendOp(tensorflow::OpKernelConstruction *context)
       : OpKernel(context) {}
 
   void Compute(tensorflow::OpKernelContext *context) override {
-    std::vector<Program> programs;
-    std::vector<Program> programs_to_append;
+    // Appending only concatenates moments, so the serialized programs are
+    // spliced together without parsing them into messages.
+    std::vector<absl::string_view> programs;
+    std::vector<absl::string_view> programs_to_append;
+    std::vector<std::string> storage;
+    std::vector<std::string> storage_to_append;
 
     const int num_inputs = context->num_inputs();
     OP_REQUIRES(context, num_inputs == 2,
                 tensorflow::errors::InvalidArgument(absl::StrCat(
                     "Expected 2 inputs, got ", num_inputs, " inputs.")));
 
-    OP_REQUIRES_OK(context, GetProgramsAndProgramsToAppend(
-                                context, &programs, &programs_to_append));
+    OP_REQUIRES_OK(context, GetSerializedPrograms(context, "programs",
+                                                  &programs, &storage));
+    OP_REQUIRES_OK(context,
+                   GetSerializedPrograms(context, "programs_to_append",
+                                         &programs_to_append,
+                                         &storage_to_append));
+    OP_REQUIRES(context, programs.size() == programs_to_append.size(),
+                tensorflow::errors::InvalidArgument(
+                    "programs and programs_to_append must have matching "
+                    "sizes."));
 
     tensorflow::Tensor *output = nullptr;
     OP_REQUIRES_OK(context, context->allocate_output(
@@ -54,12 +65,8 @@ class TfqCircuitAppendOp : public tensorflow::OpKernel {
     auto DoWork = [&](int start, int end) {
       std::string temp;
       for (int i = start; i < end; i++) {
-        for (int j = 0; j < programs_to_append.at(i).circuit().moments().size();
-             j++) {
-          Moment *new_moment = programs.at(i).mutable_circuit()->add_moments();
-          *new_moment = programs_to_append.at(i).circuit().moments(j);
-        }
-        programs.at(i).SerializeToString(&temp);
+        OP_REQUIRES_OK(context, AppendMoments(programs[i],
+                                              programs_to_append[i], &temp));
         output_tensor(i) = temp;
       }
     };
@@ -79,6 +86,7 @@ REGISTER_KERNEL_BUILDER(Name("TfqAppendCircuit").Device(tensorflow::DEVICE_CPU),
 REGISTER_OP("TfqAppendCircuit")
     .Input("programs: string")
     .Input("programs_to_append: string")
+    .Attr("allow_text_format: bool = true")
     .Output("programs_extended: string")
     .SetShapeFn([](tensorflow::shape_inference::InferenceContext *c) {
       tensorflow::shape_inference::ShapeHandle programs_shape;
@@ -0,0 +1,104 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include <string>
+#include <vector>
+
+#include "cirq/google/api/v2/program.pb.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/framework/tensor_shape.h"
+#include "tensorflow/core/lib/core/error_codes.pb.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow_quantum/core/ops/parse_context.h"
+#include "tensorflow_quantum/core/src/circuit_encoding.h"
+
+namespace tfq {
+
+using ::cirq::google::api::v2::Program;
+using ::tensorflow::Status;
+
+// Converts a batch of programs between the serialized Program proto and the
+// compact encoding in circuit_encoding.h. Both ops accept either form as
+// input, since ParsePrograms recognizes the encoding.
+template <bool kEncode>
+class TfqCircuitEncodingOp : public tensorflow::OpKernel {
+ public:
+  explicit TfqCircuitEncodingOp(tensorflow::OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(tensorflow::OpKernelContext* context) override {
+    const int num_inputs = context->num_inputs();
+    OP_REQUIRES(context, num_inputs == 1,
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "Expected 1 inputs, got ", num_inputs, " inputs.")));
+
+    ProgramBatch programs;
+    OP_REQUIRES_OK(context, ParsePrograms(context, "programs", &programs));
+
+    tensorflow::Tensor* output = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(
+                                0, context->input(0).shape(), &output));
+    auto output_tensor = output->flat<tensorflow::tstring>();
+
+    auto DoWork = [&](int start, int end) {
+      std::string temp;
+      for (int i = start; i < end; i++) {
+        if (kEncode) {
+          OP_REQUIRES_OK(context, EncodeProgram(programs[i], &temp));
+        } else {
+          programs[i].SerializeToString(&temp);
+        }
+        output_tensor(i) = temp;
+      }
+    };
+
+    const int num_cycles = 1000;
+    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
+        programs.size(), num_cycles, DoWork);
+  }
+};
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqEncodePrograms").Device(tensorflow::DEVICE_CPU),
+    TfqCircuitEncodingOp<true>);
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqDecodePrograms").Device(tensorflow::DEVICE_CPU),
+    TfqCircuitEncodingOp<false>);
+
+Status CircuitEncodingShape(tensorflow::shape_inference::InferenceContext* c) {
+  tensorflow::shape_inference::ShapeHandle programs_shape;
+  TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &programs_shape));
+
+  c->set_output(0, c->input(0));
+
+  return tensorflow::Status::OK();
+}
+
+REGISTER_OP("TfqEncodePrograms")
+    .Input("programs: string")
+    .Attr("allow_text_format: bool = true")
+    .Output("encoded_programs: string")
+    .SetShapeFn(CircuitEncodingShape);
+
+REGISTER_OP("TfqDecodePrograms")
+    .Input("programs: string")
+    .Attr("allow_text_format: bool = true")
+    .Output("decoded_programs: string")
+    .SetShapeFn(CircuitEncodingShape);
+
+}  // namespace tfq
@@ -41,7 +41,7 @@ class TfqPsDecomposeOp : public tensorflow::OpKernel {
       : OpKernel(context) {}
 
   void Compute(tensorflow::OpKernelContext *context) override {
-    std::vector<Program> programs;
+    ProgramBatch programs;
 
     const int num_inputs = context->num_inputs();
     OP_REQUIRES(context, num_inputs == 1,
@@ -59,22 +59,25 @@ class TfqPsDecomposeOp : public tensorflow::OpKernel {
 
     auto DoWork = [&](int start, int end) {
       for (int i = start; i < end; i++) {
-        Program cur_program = programs.at(i);
+        const Program &cur_program = programs.at(i);
         Program new_program;
         std::string temp;
         new_program.mutable_language()->set_gate_set("tfq_gate_set");
         new_program.mutable_circuit()->set_scheduling_strategy(
             Circuit::MOMENT_BY_MOMENT);
         for (int j = 0; j < cur_program.circuit().moments().size(); j++) {
-          Moment cur_moment(cur_program.circuit().moments().at(j));
+          const Moment &src_moment = cur_program.circuit().moments().at(j);
+          // cur_moment is rewritten in place below, so operations are read
+          // from the unmodified input.
+          Moment cur_moment(src_moment);
           std::vector<Moment> temp_moment_list(max_buffer_moments, Moment());
           int num_extra_moments = 0;
-          for (int k = 0; k < cur_moment.operations().size(); k++) {
-            Operation cur_op = cur_moment.operations().at(k);
-            auto &cur_op_map = *cur_op.mutable_args();
+          for (int k = 0; k < src_moment.operations().size(); k++) {
+            const Operation &cur_op = src_moment.operations().at(k);
+            const auto &cur_op_map = cur_op.args();
             if (cur_op.gate().id() == "PISP") {
-              auto exponent = cur_op_map.at("exponent");
-              auto phase_exponent = cur_op_map.at("phase_exponent");
+              const Arg &exponent = cur_op_map.at("exponent");
+              const Arg &phase_exponent = cur_op_map.at("phase_exponent");
               if (exponent.arg_case() == Arg::ArgCase::kSymbol ||
                   phase_exponent.arg_case() == Arg::ArgCase::kSymbol) {
                 // Decompose cirq.PhasedISwapPowGate only if it is
@@ -96,7 +99,7 @@ class TfqPsDecomposeOp : public tensorflow::OpKernel {
                 *temp_moment_list[2].add_operations() = new_op;
               }
             } else if (cur_op.gate().id() == "ISP") {
-              auto exponent = cur_op_map.at("exponent");
+              const Arg &exponent = cur_op_map.at("exponent");
               if (exponent.arg_case() == Arg::ArgCase::kSymbol) {
                 // Decompose cirq.ISwapPowGate only if it is parameterized.
                 if (num_extra_moments == 0) num_extra_moments = 1;
@@ -107,8 +110,8 @@ class TfqPsDecomposeOp : public tensorflow::OpKernel {
                 *temp_moment_list[0].add_operations() = new_op;
               }
             } else if (cur_op.gate().id() == "PXP") {
-              auto exponent = cur_op_map.at("exponent");
-              auto phase_exponent = cur_op_map.at("phase_exponent");
+              const Arg &exponent = cur_op_map.at("exponent");
+              const Arg &phase_exponent = cur_op_map.at("phase_exponent");
               if (exponent.arg_case() == Arg::ArgCase::kSymbol ||
                   phase_exponent.arg_case() == Arg::ArgCase::kSymbol) {
                 // Decompose cirq.PhasedXPowGate only if it is parameterized.
@@ -122,8 +125,8 @@ class TfqPsDecomposeOp : public tensorflow::OpKernel {
                 *temp_moment_list[1].add_operations() = new_op;
               }
             } else if (cur_op.gate().id() == "FSIM") {
-              auto theta = cur_op_map.at("theta");
-              auto phi = cur_op_map.at("phi");
+              const Arg &theta = cur_op_map.at("theta");
+              const Arg &phi = cur_op_map.at("phi");
               if (theta.arg_case() == Arg::ArgCase::kSymbol ||
                   phi.arg_case() == Arg::ArgCase::kSymbol) {
                 // Decompose cirq.FSimGate only if it is parameterized.
@@ -159,13 +162,19 @@ class TfqPsDecomposeOp : public tensorflow::OpKernel {
   }
 
  private:
+  // Returns the arg called key, or an empty Arg if the op has none.
+  static const Arg &GetArg(const Operation &cur_op, const std::string &key) {
+    const auto it = cur_op.args().find(key);
+    return it == cur_op.args().end() ? Arg::default_instance() : it->second;
+  }
+
   // Helper functions for decompositions of ISwapPowGate, PhasedX, FSIM,
   //  PhasedISwapPow.
-  Operation getOpForISP(Operation &cur_op, std::string id, std::string symbol) {
+  Operation getOpForISP(const Operation &cur_op, std::string id,
+                        std::string symbol) {
     // Step 1. parse the current op.
-    auto &cur_op_map = *cur_op.mutable_args();
     float cur_exponent_scalar =
-        cur_op_map["exponent_scalar"].arg_value().float_value();
+        GetArg(cur_op, "exponent_scalar").arg_value().float_value();
     auto &cur_op_qubits = cur_op.qubits();
     // Step 2. create a new op.
     Operation new_op;
@@ -181,14 +190,13 @@ class TfqPsDecomposeOp : public tensorflow::OpKernel {
     return new_op;
   }
 
-  Operation getOpForPXP(Operation &cur_op, std::string id, std::string key,
-                        bool sign_flip = false) {
+  Operation getOpForPXP(const Operation &cur_op, std::string id,
+                        std::string key, bool sign_flip = false) {
     // Step 1. parse the current op.
-    auto &cur_op_map = *cur_op.mutable_args();
     auto &cur_op_qubits = cur_op.qubits();
-    auto target_exponent = cur_op_map[key];
+    const Arg &target_exponent = GetArg(cur_op, key);
     float target_exponent_scalar =
-        cur_op_map[absl::StrCat(key, "_scalar")].arg_value().float_value();
+        GetArg(cur_op, absl::StrCat(key, "_scalar")).arg_value().float_value();
     float sign = (sign_flip) ? -1.0 : 1.0;
     // Step 2. create a new op.
     Operation new_op;
@@ -218,13 +226,13 @@ class TfqPsDecomposeOp : public tensorflow::OpKernel {
     return new_op;
   }
 
-  Operation getOpForPISP(Operation &cur_op, bool sign_flip, bool use_target) {
+  Operation getOpForPISP(const Operation &cur_op, bool sign_flip,
+                         bool use_target) {
     // Step 1. parse the current op.
-    auto &cur_op_map = *cur_op.mutable_args();
     auto &cur_op_qubits = cur_op.qubits();
-    auto target_exponent = cur_op_map["phase_exponent"];
+    const Arg &target_exponent = GetArg(cur_op, "phase_exponent");
     float target_exponent_scalar =
-        cur_op_map["phase_exponent_scalar"].arg_value().float_value();
+        GetArg(cur_op, "phase_exponent_scalar").arg_value().float_value();
     float sign = (sign_flip) ? -1.0 : 1.0;
     // Step 2. create a new op.
     Operation new_op;
@@ -254,14 +262,13 @@ class TfqPsDecomposeOp : public tensorflow::OpKernel {
     return new_op;
   }
 
-  Operation getOpForFSIM(Operation &cur_op, std::string id, std::string key,
-                         bool use_global_shift = false) {
+  Operation getOpForFSIM(const Operation &cur_op, std::string id,
+                         std::string key, bool use_global_shift = false) {
     // Step 1. parse the current op.
-    auto &cur_op_map = *cur_op.mutable_args();
     auto &cur_op_qubits = cur_op.qubits();
-    auto target_exponent = cur_op_map[key];
+    const Arg &target_exponent = GetArg(cur_op, key);
     float target_exponent_scalar =
-        cur_op_map[absl::StrCat(key, "_scalar")].arg_value().float_value();
+        GetArg(cur_op, absl::StrCat(key, "_scalar")).arg_value().float_value();
     float global_shift = (use_global_shift) ? -0.5 : 0.0;
     float sign = (key == "theta") ? 1.0 : -1.0;
     // Step 2. create a new op.
@@ -299,6 +306,7 @@ REGISTER_KERNEL_BUILDER(Name("TfqPsDecompose").Device(tensorflow::DEVICE_CPU),
 
 REGISTER_OP("TfqPsDecompose")
     .Input("programs: string")
+    .Attr("allow_text_format: bool = true")
     .Output("ps_programs: string")
     .SetShapeFn([](tensorflow::shape_inference::InferenceContext *c) {
       tensorflow::shape_inference::ShapeHandle programs_shape;
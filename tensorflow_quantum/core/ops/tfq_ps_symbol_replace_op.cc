@@ -40,7 +40,7 @@ class TfqPsSymbolReplaceOp : public tensorflow::OpKernel {
       : OpKernel(context) {}
 
   void Compute(tensorflow::OpKernelContext *context) override {
-    std::vector<Program> programs;
+    ProgramBatch programs;
 
     const int num_inputs = context->num_inputs();
     OP_REQUIRES(context, num_inputs == 3,
@@ -88,14 +88,14 @@ class TfqPsSymbolReplaceOp : public tensorflow::OpKernel {
         int pidx = i / n_symbols;
         std::string symbol_to_replace = symbols(sidx);
         std::string temp_symbol_holder;
-        Program cur_program = programs.at(pidx);
+        const Program &cur_program = programs.at(pidx);
         for (int j = 0; j < cur_program.circuit().moments().size(); j++) {
-          Moment cur_moment = cur_program.circuit().moments().at(j);
+          const Moment &cur_moment = cur_program.circuit().moments().at(j);
           for (int k = 0; k < cur_moment.operations().size(); k++) {
-            Operation cur_op = cur_moment.operations().at(k);
+            const Operation &cur_op = cur_moment.operations().at(k);
             for (auto l = cur_op.args().begin(); l != cur_op.args().end();
                  l++) {
-              const std::string key = (*l).first;
+              const std::string &key = (*l).first;
               const Arg &arg = (*l).second;
               if (arg.symbol() == symbol_to_replace) {
                 // Copy the proto, modify the symbol and append to output.
@@ -188,6 +188,7 @@ REGISTER_OP("TfqPsSymbolReplace")
     .Input("programs: string")
     .Input("symbols: string")
     .Input("replacement_symbols: string")
+    .Attr("allow_text_format: bool = true")
     .Output("ps_programs: string")
     .SetShapeFn([](tensorflow::shape_inference::InferenceContext *c) {
       tensorflow::shape_inference::ShapeHandle programs_shape;
@@ -17,8 +17,10 @@ import numpy as np
 import tensorflow as tf
 import sympy
 import cirq
+from google.protobuf import text_format
 
 from tensorflow_quantum.core.ops import tfq_ps_util_ops
+from tensorflow_quantum.core.serialize import serializer
 from tensorflow_quantum.python import util
 
 
@@ -715,6 +717,18 @@ class PSWeightsFromSymbolTest(tf.test.TestCase):
                                     expected_regex='rank 1. Got rank 2.'):
             tfq_ps_util_ops.tfq_ps_weights_from_symbols(inputs, symbols)
 
+    def test_missing_exponent_scalar(self):
+        """Symbolic gates without an exponent_scalar are an error."""
+        bit = cirq.GridQubit(0, 0)
+        circuit = cirq.Circuit(cirq.X(bit)**(sympy.Symbol('delta') * 2))
+        proto = serializer.serialize_circuit(circuit)
+        del proto.circuit.moments[0].operations[0].args['exponent_scalar']
+        inputs = tf.convert_to_tensor([proto.SerializeToString()])
+        symbols = tf.convert_to_tensor(['delta'])
+        with self.assertRaisesRegex(
+                Exception, expected_regex='missing its exponent_scalar'):
+            tfq_ps_util_ops.tfq_ps_weights_from_symbols(inputs, symbols)
+
     def test_many_values(self):
         """Ensure that padding with few symbols and many values works."""
         bit = cirq.GridQubit(0, 0)
@@ -837,6 +851,21 @@ class PSWeightsFromSymbolTest(tf.test.TestCase):
         # Because there are no weights to be gathered, the last dimension = 0
         self.assertAllClose(tf.shape(res), [len(circuit_batch), 2, 0])
 
+    def test_text_format_input(self):
+        """Text format programs give the same weights as binary ones."""
+        bit = cirq.GridQubit(0, 0)
+        circuit = cirq.Circuit(
+            cirq.X(bit)**(sympy.Symbol('alpha') * 2),
+            cirq.Y(bit)**(sympy.Symbol('beta') * 3))
+        text = text_format.MessageToString(
+            serializer.serialize_circuit(circuit))
+        symbols = tf.convert_to_tensor(['alpha', 'beta'])
+        expected = tfq_ps_util_ops.tfq_ps_weights_from_symbols(
+            util.convert_to_tensor([circuit]), symbols)
+        res = tfq_ps_util_ops.tfq_ps_weights_from_symbols(
+            tf.convert_to_tensor([text]), symbols)
+        self.assertAllClose(expected, res)
+        self.assertAllClose(res, np.array([[[2.0], [3.0]]]))
 
 if __name__ == "__main__":
     tf.test.main()
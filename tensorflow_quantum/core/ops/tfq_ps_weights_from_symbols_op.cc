@@ -14,25 +14,24 @@ limitations under the License.
 ==============================================================================*/
 
 #include <string>
+#include <vector>
 
 #include "absl/container/flat_hash_map.h"
 #include "absl/container/flat_hash_set.h"
 #include "absl/strings/numbers.h"
-#include "cirq/google/api/v2/program.pb.h"
+#include "absl/strings/string_view.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/shape_inference.h"
 #include "tensorflow/core/framework/tensor_shape.h"
+#include "tensorflow/core/lib/core/error_codes.pb.h"
 #include "tensorflow/core/lib/core/status.h"
 #include "tensorflow/core/lib/core/threadpool.h"
 #include "tensorflow_quantum/core/ops/parse_context.h"
 #include "tensorflow_quantum/core/ops/tfq_simulate_utils.h"
+#include "tensorflow_quantum/core/src/program_view.h"
 
 namespace tfq {
 
-using ::cirq::google::api::v2::Arg;
-using ::cirq::google::api::v2::Moment;
-using ::cirq::google::api::v2::Operation;
-using ::cirq::google::api::v2::Program;
 using ::tensorflow::Tensor;
 
 class TfqPsWeightsFromSymbolOp : public tensorflow::OpKernel {
@@ -41,14 +40,18 @@ class TfqPsWeightsFromSymbolOp : public tensorflow::OpKernel {
       : OpKernel(context) {}
 
   void Compute(tensorflow::OpKernelContext *context) override {
-    std::vector<Program> programs;
+    // Only reads the circuits, so they are scanned in their serialized form
+    // instead of being parsed into Program messages.
+    std::vector<absl::string_view> programs;
+    std::vector<std::string> program_storage;
 
     const int num_inputs = context->num_inputs();
     OP_REQUIRES(context, num_inputs == 2,
                 tensorflow::errors::InvalidArgument(absl::StrCat(
                     "Expected 2 inputs, got ", num_inputs, " inputs.")));
 
-    OP_REQUIRES_OK(context, ParsePrograms(context, "programs", &programs));
+    OP_REQUIRES_OK(context, GetSerializedPrograms(context, "programs",
+                                                  &programs, &program_storage));
 
     // Parse the input string here.
     const Tensor *symbols_tensor;
@@ -79,34 +82,43 @@ class TfqPsWeightsFromSymbolOp : public tensorflow::OpKernel {
 
     auto DoWork = [&](int start, int end) {
       for (int i = start; i < end; i++) {
-        Program cur_program = programs.at(i);
-        for (int j = 0; j < cur_program.circuit().moments().size(); j++) {
-          Moment cur_moment = cur_program.circuit().moments().at(j);
-          for (int k = 0; k < cur_moment.operations().size(); k++) {
-            Operation cur_op = cur_moment.operations().at(k);
-            if (ignored_symbol_set.contains(cur_op.gate().id())) continue;
-
-            const auto &cur_op_map = *cur_op.mutable_args();
-            const auto exponent = cur_op_map.at("exponent");
-            if (exponent.arg_case() == Arg::ArgCase::kSymbol) {
-              // this gate has parameterized exponent.
-              const absl::string_view symbol_name = exponent.symbol();
-              if (!symbols_map.contains(symbol_name)) {
-                // Should never happen. raise error.
-                OP_REQUIRES(context, false,
-                            tensorflow::errors::InvalidArgument(
-                                "A circuit contains a sympy.Symbol not found "
-                                "in symbols!"));
-              }
-              output_results.at(i)
-                  .at(symbols_map.at(symbol_name))
-                  .push_back(cur_op.args()
-                                 .at("exponent_scalar")
-                                 .arg_value()
-                                 .float_value());
+        auto ScanOp = [&](int, const OperationView &cur_op) {
+          if (ignored_symbol_set.contains(cur_op.gate_id())) {
+            return tensorflow::Status::OK();
+          }
+
+          ArgView exponent;
+          if (!cur_op.GetArg("exponent", &exponent)) {
+            return tensorflow::Status(
+                tensorflow::error::INVALID_ARGUMENT,
+                absl::StrCat("Gate ", cur_op.gate_id(),
+                             " is missing its exponent."));
+          }
+          if (exponent.kind == ArgView::kSymbol) {
+            // this gate has parameterized exponent.
+            const auto symbol = symbols_map.find(exponent.text);
+            if (symbol == symbols_map.end()) {
+              // Should never happen. raise error.
+              return tensorflow::Status(
+                  tensorflow::error::INVALID_ARGUMENT,
+                  "A circuit contains a sympy.Symbol not found "
+                  "in symbols!");
             }
+            ArgView exponent_scalar;
+            if (!cur_op.GetArg("exponent_scalar", &exponent_scalar)) {
+              return tensorflow::Status(
+                  tensorflow::error::INVALID_ARGUMENT,
+                  absl::StrCat("Gate ", cur_op.gate_id(),
+                               " is missing its exponent_scalar."));
+            }
+            output_results.at(i)
+                .at(symbol->second)
+                .push_back(exponent_scalar.float_value);
           }
-        }
+          return tensorflow::Status::OK();
+        };
+        OP_REQUIRES_OK(context, ForEachOperation(programs[i], ScanOp));
+
         // loop over all index entries of symbols_map and find largest
         // value from output_results.
         for (int j = 0; j < n_symbols; j++) {
@@ -168,6 +180,7 @@ REGISTER_KERNEL_BUILDER(
 REGISTER_OP("TfqPsWeightsFromSymbols")
     .Input("programs: string")
     .Input("symbols: string")
+    .Attr("allow_text_format: bool = true")
     .Output("weights: float")
     .SetShapeFn([](tensorflow::shape_inference::InferenceContext *c) {
       tensorflow::shape_inference::ShapeHandle programs_shape;
@@ -0,0 +1,530 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Ops on a state vector that persists between op calls. Every other
+// simulate op starts each circuit from |0...0>, these let a program that
+// grows step by step only pay for the gates added since the last step.
+
+#include <complex>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "../qsim/lib/circuit.h"
+#include "../qsim/lib/gate_appl.h"
+#include "../qsim/lib/gates_cirq.h"
+#include "../qsim/lib/simmux.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/str_cat.h"
+#include "cirq/google/api/v2/program.pb.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/resource_mgr.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/framework/tensor_shape.h"
+#include "tensorflow/core/lib/core/error_codes.pb.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/mutex.h"
+#include "tensorflow_quantum/core/ops/parse_context.h"
+#include "tensorflow_quantum/core/proto/pauli_sum.pb.h"
+#include "tensorflow_quantum/core/src/circuit_parser_qsim.h"
+#include "tensorflow_quantum/core/src/program_resolution.h"
+#include "tensorflow_quantum/core/src/util_qsim.h"
+
+namespace tfq {
+
+using ::cirq::google::api::v2::Program;
+using ::tensorflow::Status;
+using ::tfq::proto::PauliSum;
+
+typedef qsim::Cirq::GateCirq<float> QsimGate;
+typedef qsim::Circuit<QsimGate> QsimCircuit;
+
+// A qsim state vector over a fixed register of qubits, owned by the
+// ResourceMgr of the device. The register is given as GridQubit ids when
+// the state is created and is numbered the way ResolveQubitIds numbers a
+// circuit using all of those qubits, so snapshots line up with the output
+// of tfq_simulate_state.
+class QuantumStateResource : public tensorflow::ResourceBase {
+ public:
+  using Simulator = qsim::Simulator<const tfq::QsimFor&>;
+  using StateSpace = Simulator::StateSpace;
+  using State = StateSpace::State;
+
+  QuantumStateResource() : state_(nullptr, &free) {}
+
+  std::string DebugString() const override {
+    return absl::StrCat("QuantumState on ", num_qubits_, " qubits");
+  }
+
+  tensorflow::mutex* mu() { return &mu_; }
+
+  // Sets the register to the qubits in id_to_index (see
+  // QubitRegisterIndices) and the state to |0...0>. Requires mu().
+  Status Initialize(tensorflow::OpKernelContext* context,
+                    absl::flat_hash_map<std::string, std::string> id_to_index) {
+    const int num_qubits = id_to_index.size();
+    if (num_qubits == 0) {
+      return Status(tensorflow::error::INVALID_ARGUMENT,
+                    "A quantum state needs at least one qubit.");
+    }
+    const auto tfq_for = tfq::QsimFor(context, num_qubits);
+    StateSpace ss = StateSpace(num_qubits, tfq_for);
+    if (num_qubits != num_qubits_ || state_.get() == nullptr) {
+      state_ = ss.CreateState();
+      if (state_.get() == nullptr) {
+        num_qubits_ = 0;
+        return Status(tensorflow::error::RESOURCE_EXHAUSTED,
+                      absl::StrCat("Unable to allocate a state on ",
+                                   num_qubits, " qubits."));
+      }
+    }
+    num_qubits_ = num_qubits;
+    id_to_index_ = std::move(id_to_index);
+    ss.SetStateZero(state_);
+    return Status::OK();
+  }
+
+  int num_qubits() const { return num_qubits_; }
+
+  const absl::flat_hash_map<std::string, std::string>& id_to_index() const {
+    return id_to_index_;
+  }
+
+  State& state() { return state_; }
+
+ private:
+  tensorflow::mutex mu_;
+  int num_qubits_ = 0;
+  absl::flat_hash_map<std::string, std::string> id_to_index_;
+  State state_;
+};
+
+namespace {
+
+// Looks up the state behind the 'resource' input. The caller owns a
+// reference to the returned resource.
+Status LookupState(tensorflow::OpKernelContext* context,
+                   QuantumStateResource** resource) {
+  Status status = tensorflow::LookupResource(
+      context, tensorflow::HandleFromInput(context, 0), resource);
+  if (!status.ok()) {
+    return status;
+  }
+  bool created;
+  {
+    tensorflow::tf_shared_lock lock(*(*resource)->mu());
+    created = (*resource)->num_qubits() > 0;
+  }
+  if (!created) {
+    (*resource)->Unref();
+    return Status(tensorflow::error::FAILED_PRECONDITION,
+                  "Quantum state has not been created.");
+  }
+  return Status::OK();
+}
+
+}  // namespace
+
+class TfqQuantumStateCreateOp : public tensorflow::OpKernel {
+ public:
+  explicit TfqQuantumStateCreateOp(tensorflow::OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(tensorflow::OpKernelContext* context) override {
+    const tensorflow::Tensor* input;
+    OP_REQUIRES_OK(context, context->input("qubits", &input));
+    OP_REQUIRES(context, input->dims() == 1,
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "qubits must be rank 1. Got rank ", input->dims(), ".")));
+    const auto qubit_ids = input->vec<tensorflow::tstring>();
+    std::vector<std::string> qubits;
+    for (int i = 0; i < qubit_ids.dimension(0); i++) {
+      qubits.push_back(qubit_ids(i));
+    }
+    absl::flat_hash_map<std::string, std::string> id_to_index;
+    OP_REQUIRES_OK(context, QubitRegisterIndices(qubits, &id_to_index));
+
+    QuantumStateResource* resource;
+    OP_REQUIRES_OK(context,
+                   tensorflow::LookupOrCreateResource<QuantumStateResource>(
+                       context, tensorflow::HandleFromInput(context, 0),
+                       &resource, [](QuantumStateResource** r) {
+                         *r = new QuantumStateResource();
+                         return Status::OK();
+                       }));
+    tensorflow::core::ScopedUnref unref(resource);
+
+    tensorflow::mutex_lock lock(*resource->mu());
+    OP_REQUIRES_OK(context,
+                   resource->Initialize(context, std::move(id_to_index)));
+  }
+};
+
+class TfqQuantumStateResetOp : public tensorflow::OpKernel {
+ public:
+  explicit TfqQuantumStateResetOp(tensorflow::OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(tensorflow::OpKernelContext* context) override {
+    QuantumStateResource* resource;
+    OP_REQUIRES_OK(context, LookupState(context, &resource));
+    tensorflow::core::ScopedUnref unref(resource);
+
+    tensorflow::mutex_lock lock(*resource->mu());
+    const int nq = resource->num_qubits();
+    const auto tfq_for = tfq::QsimFor(context, nq);
+    QuantumStateResource::StateSpace ss(nq, tfq_for);
+    ss.SetStateZero(resource->state());
+  }
+};
+
+class TfqQuantumStateApplyOp : public tensorflow::OpKernel {
+ public:
+  explicit TfqQuantumStateApplyOp(tensorflow::OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(tensorflow::OpKernelContext* context) override {
+    DCHECK_EQ(4, context->num_inputs());
+
+    QuantumStateResource* resource;
+    OP_REQUIRES_OK(context, LookupState(context, &resource));
+    tensorflow::core::ScopedUnref unref(resource);
+
+    ProgramBatch programs;
+    OP_REQUIRES_OK(context, ParsePrograms(context, "programs", &programs));
+
+    std::vector<SymbolMap> maps;
+    OP_REQUIRES_OK(context, GetSymbolMaps(context, &maps));
+    OP_REQUIRES(
+        context, maps.size() == programs.size(),
+        tensorflow::errors::InvalidArgument(absl::StrCat(
+            "Number of circuits and values do not match. Got ", programs.size(),
+            " circuits and ", maps.size(), " values.")));
+
+    // Circuits are built against the register outside of the lock, only
+    // applying them to the state has to wait for other users.
+    absl::flat_hash_map<std::string, std::string> id_to_index;
+    int nq;
+    {
+      tensorflow::tf_shared_lock lock(*resource->mu());
+      id_to_index = resource->id_to_index();
+      nq = resource->num_qubits();
+    }
+
+    std::vector<QsimCircuit> qsim_circuits(programs.size(), QsimCircuit());
+    std::vector<std::vector<qsim::GateFused<QsimGate>>> fused_circuits(
+        programs.size(), std::vector<qsim::GateFused<QsimGate>>({}));
+    auto construct_f = [&](int start, int end) {
+      for (int i = start; i < end; i++) {
+        OP_REQUIRES_OK(context,
+                       ResolveQubitIdsWithMap(id_to_index, &programs[i]));
+        OP_REQUIRES_OK(context, QsimCircuitFromProgram(
+                                    programs[i], maps[i], nq,
+                                    &qsim_circuits[i], &fused_circuits[i]));
+      }
+    };
+
+    const int num_cycles = 1000;
+    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
+        programs.size(), num_cycles, construct_f);
+    if (!context->status().ok()) {
+      return;
+    }
+
+    // Programs are applied one after the other in batch order.
+    tensorflow::mutex_lock lock(*resource->mu());
+    OP_REQUIRES(context, resource->id_to_index() == id_to_index,
+                tensorflow::errors::FailedPrecondition(
+                    "Quantum state was recreated while applying programs."));
+    const auto tfq_for = tfq::QsimFor(context, nq);
+    QuantumStateResource::Simulator sim(nq, tfq_for);
+    for (const auto& fused_circuit : fused_circuits) {
+      const uint64_t start_micros = tensorflow::Env::Default()->NowMicros();
+      const uint64_t num_sweeps = ApplyFusedCircuitBlocked(
+          fused_circuit, nq, sim, tfq_for, resource->state());
+      RecordStateBandwidth(
+          nq, num_sweeps,
+          tensorflow::Env::Default()->NowMicros() - start_micros);
+    }
+  }
+};
+
+class TfqQuantumStateExpectationOp : public tensorflow::OpKernel {
+ public:
+  explicit TfqQuantumStateExpectationOp(
+      tensorflow::OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(tensorflow::OpKernelContext* context) override {
+    QuantumStateResource* resource;
+    OP_REQUIRES_OK(context, LookupState(context, &resource));
+    tensorflow::core::ScopedUnref unref(resource);
+
+    std::vector<PauliSum> p_sums;
+    OP_REQUIRES_OK(context, GetPauliSumList(context, &p_sums));
+
+    tensorflow::Tensor* output = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(
+                       0, tensorflow::TensorShape({int64_t(p_sums.size())}),
+                       &output));
+    auto output_tensor = output->vec<float>();
+
+    tensorflow::tf_shared_lock lock(*resource->mu());
+    OP_REQUIRES_OK(context,
+                   ResolveQubitIdsWithMap(resource->id_to_index(), nullptr,
+                                          &p_sums));
+    const int nq = resource->num_qubits();
+    const auto tfq_for = tfq::QsimFor(context, nq);
+    QuantumStateResource::StateSpace ss(nq, tfq_for);
+    for (int i = 0; i < p_sums.size(); i++) {
+      float exp_v = 0.0;
+      OP_REQUIRES_OK(context, ComputeExpectationQsim(p_sums[i], tfq_for, ss,
+                                                     resource->state(),
+                                                     &exp_v));
+      output_tensor(i) = exp_v;
+    }
+  }
+};
+
+class TfqQuantumStateSamplesOp : public tensorflow::OpKernel {
+ public:
+  explicit TfqQuantumStateSamplesOp(tensorflow::OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(tensorflow::OpKernelContext* context) override {
+    QuantumStateResource* resource;
+    OP_REQUIRES_OK(context, LookupState(context, &resource));
+    tensorflow::core::ScopedUnref unref(resource);
+
+    int num_samples = 0;
+    OP_REQUIRES_OK(context, GetIndividualSample(context, &num_samples));
+
+    tensorflow::tf_shared_lock lock(*resource->mu());
+    const int nq = resource->num_qubits();
+    tensorflow::Tensor* output = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(
+                       0, tensorflow::TensorShape({num_samples, nq}), &output));
+    auto output_tensor = output->matrix<int8_t>();
+
+    const auto tfq_for = tfq::QsimFor(context, nq);
+    QuantumStateResource::StateSpace ss(nq, tfq_for);
+    const std::vector<uint64_t> samples =
+        ss.Sample(resource->state(), num_samples, rand() % 123456);
+
+    // Bit b of a sample belongs to register qubit nq - b - 1.
+    for (int j = 0; j < samples.size(); j++) {
+      for (int k = 0; k < nq; k++) {
+        output_tensor(j, k) = (samples[j] >> (nq - k - 1)) & 1;
+      }
+    }
+  }
+};
+
+class TfqQuantumStateSnapshotOp : public tensorflow::OpKernel {
+ public:
+  explicit TfqQuantumStateSnapshotOp(tensorflow::OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(tensorflow::OpKernelContext* context) override {
+    QuantumStateResource* resource;
+    OP_REQUIRES_OK(context, LookupState(context, &resource));
+    tensorflow::core::ScopedUnref unref(resource);
+
+    tensorflow::tf_shared_lock lock(*resource->mu());
+    const int nq = resource->num_qubits();
+    tensorflow::Tensor* output = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(
+                                0, tensorflow::TensorShape({int64_t(1) << nq}),
+                                &output));
+    auto output_tensor = output->vec<std::complex<float>>();
+
+    const auto tfq_for = tfq::QsimFor(context, nq);
+    QuantumStateResource::StateSpace ss(nq, tfq_for);
+    auto& sv = resource->state();
+    auto copy_f = [&output_tensor, &ss, &sv](uint64_t start, uint64_t end) {
+      for (uint64_t j = start; j < end; j++) {
+        output_tensor(j) = ss.GetAmpl(sv, j);
+      }
+    };
+    const int num_cycles_copy = 50;
+    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
+        uint64_t(1) << nq, num_cycles_copy, copy_f);
+  }
+};
+
+class TfqQuantumStateRestoreOp : public tensorflow::OpKernel {
+ public:
+  explicit TfqQuantumStateRestoreOp(tensorflow::OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(tensorflow::OpKernelContext* context) override {
+    QuantumStateResource* resource;
+    OP_REQUIRES_OK(context, LookupState(context, &resource));
+    tensorflow::core::ScopedUnref unref(resource);
+
+    const tensorflow::Tensor* input;
+    OP_REQUIRES_OK(context, context->input("state", &input));
+    OP_REQUIRES(context, input->dims() == 1,
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "state must be rank 1. Got rank ", input->dims(), ".")));
+    const auto input_tensor = input->vec<std::complex<float>>();
+
+    tensorflow::mutex_lock lock(*resource->mu());
+    const int nq = resource->num_qubits();
+    OP_REQUIRES(context, input_tensor.dimension(0) == (int64_t(1) << nq),
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "state must have 2 ** ", nq, " amplitudes. Got ",
+                    input_tensor.dimension(0), ".")));
+
+    const auto tfq_for = tfq::QsimFor(context, nq);
+    QuantumStateResource::StateSpace ss(nq, tfq_for);
+    auto& sv = resource->state();
+    auto copy_f = [&input_tensor, &ss, &sv](uint64_t start, uint64_t end) {
+      for (uint64_t j = start; j < end; j++) {
+        ss.SetAmpl(sv, j, input_tensor(j));
+      }
+    };
+    const int num_cycles_copy = 50;
+    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
+        uint64_t(1) << nq, num_cycles_copy, copy_f);
+  }
+};
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqQuantumStateHandle").Device(tensorflow::DEVICE_CPU),
+    tensorflow::ResourceHandleOp<QuantumStateResource>);
+
+REGISTER_OP("TfqQuantumStateHandle")
+    .Output("resource: resource")
+    .Attr("container: string = ''")
+    .Attr("shared_name: string = ''")
+    .SetIsStateful()
+    .SetShapeFn(tensorflow::shape_inference::ScalarShape);
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqQuantumStateCreate").Device(tensorflow::DEVICE_CPU),
+    TfqQuantumStateCreateOp);
+
+REGISTER_OP("TfqQuantumStateCreate")
+    .Input("resource: resource")
+    .Input("qubits: string")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
+      tensorflow::shape_inference::ShapeHandle qubits_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &qubits_shape));
+      return tensorflow::Status::OK();
+    });
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqQuantumStateReset").Device(tensorflow::DEVICE_CPU),
+    TfqQuantumStateResetOp);
+
+REGISTER_OP("TfqQuantumStateReset")
+    .Input("resource: resource")
+    .SetShapeFn(tensorflow::shape_inference::NoOutputs);
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqQuantumStateApply").Device(tensorflow::DEVICE_CPU),
+    TfqQuantumStateApplyOp);
+
+REGISTER_OP("TfqQuantumStateApply")
+    .Input("resource: resource")
+    .Input("programs: string")
+    .Input("symbol_names: string")
+    .Input("symbol_values: float")
+    .Attr("allow_text_format: bool = true")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
+      tensorflow::shape_inference::ShapeHandle programs_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &programs_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_names_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 1, &symbol_names_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_values_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 2, &symbol_values_shape));
+
+      return tensorflow::Status::OK();
+    });
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqQuantumStateExpectation").Device(tensorflow::DEVICE_CPU),
+    TfqQuantumStateExpectationOp);
+
+REGISTER_OP("TfqQuantumStateExpectation")
+    .Input("resource: resource")
+    .Input("pauli_sums: string")
+    .Attr("allow_text_format: bool = true")
+    .Output("expectations: float")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
+      tensorflow::shape_inference::ShapeHandle pauli_sums_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &pauli_sums_shape));
+
+      c->set_output(0, c->MakeShape({c->Dim(pauli_sums_shape, 0)}));
+
+      return tensorflow::Status::OK();
+    });
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqQuantumStateSamples").Device(tensorflow::DEVICE_CPU),
+    TfqQuantumStateSamplesOp);
+
+REGISTER_OP("TfqQuantumStateSamples")
+    .Input("resource: resource")
+    .Input("num_samples: int32")
+    .Output("samples: int8")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
+      tensorflow::shape_inference::ShapeHandle num_samples_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &num_samples_shape));
+
+      c->set_output(
+          0, c->MakeShape(
+                 {tensorflow::shape_inference::InferenceContext::kUnknownDim,
+                  tensorflow::shape_inference::InferenceContext::kUnknownDim}));
+
+      return tensorflow::Status::OK();
+    });
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqQuantumStateSnapshot").Device(tensorflow::DEVICE_CPU),
+    TfqQuantumStateSnapshotOp);
+
+REGISTER_OP("TfqQuantumStateSnapshot")
+    .Input("resource: resource")
+    .Output("state: complex64")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
+      c->set_output(
+          0, c->MakeShape(
+                 {tensorflow::shape_inference::InferenceContext::kUnknownDim}));
+
+      return tensorflow::Status::OK();
+    });
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqQuantumStateRestore").Device(tensorflow::DEVICE_CPU),
+    TfqQuantumStateRestoreOp);
+
+REGISTER_OP("TfqQuantumStateRestore")
+    .Input("resource: resource")
+    .Input("state: complex64")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
+      tensorflow::shape_inference::ShapeHandle state_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &state_shape));
+      return tensorflow::Status::OK();
+    });
+
+}  // namespace tfq
@@ -47,7 +47,7 @@ class TfqResolveParametersOp : public tensorflow::OpKernel {
                                 0, context->input(0).shape(), &output));
     auto output_tensor = output->flat<tensorflow::tstring>();
 
-    std::vector<Program> programs;
+    ProgramBatch programs;
     OP_REQUIRES_OK(context, ParsePrograms(context, "programs", &programs));
     std::vector<SymbolMap> maps;
     OP_REQUIRES_OK(context, GetSymbolMaps(context, &maps));
@@ -84,6 +84,7 @@ REGISTER_OP("TfqResolveParameters")
     .Input("programs: string")
     .Input("symbol_names: string")
     .Input("symbol_values: float")
+    .Attr("allow_text_format: bool = true")
     .Output("resolved_programs: string")
     .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
       tensorflow::shape_inference::ShapeHandle programs_shape;
@@ -0,0 +1,393 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "../qsim/lib/circuit.h"
+#include "../qsim/lib/gate_appl.h"
+#include "../qsim/lib/gates_cirq.h"
+#include "../qsim/lib/seqfor.h"
+#include "../qsim/lib/simmux.h"
+#include "cirq/google/api/v2/program.pb.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/framework/tensor_shape.h"
+#include "tensorflow/core/lib/core/error_codes.pb.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow_quantum/core/ops/parse_context.h"
+#include "tensorflow_quantum/core/proto/pauli_sum.pb.h"
+#include "tensorflow_quantum/core/src/adj_util.h"
+#include "tensorflow_quantum/core/src/program_resolution.h"
+#include "tensorflow_quantum/core/src/util_qsim.h"
+
+namespace tfq {
+
+using ::cirq::google::api::v2::Program;
+using ::tensorflow::Status;
+using ::tfq::proto::PauliSum;
+
+typedef qsim::Cirq::GateCirq<float> QsimGate;
+typedef qsim::Circuit<QsimGate> QsimCircuit;
+
+// Computes expectation values and their gradients with respect to every
+// symbol in one pass over the parsed programs. Every circuit is simulated
+// once forward, then O|psi> is walked back through the circuit next to
+// |psi> (adjoint differentiation), so the gradient costs about as much as
+// two more simulations no matter how many symbols there are.
+class TfqSimulateExpectationAndGradientOp : public tensorflow::OpKernel {
+ public:
+  explicit TfqSimulateExpectationAndGradientOp(
+      tensorflow::OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(tensorflow::OpKernelContext* context) override {
+    const int num_inputs = context->num_inputs();
+    OP_REQUIRES(context, num_inputs == 4,
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "Expected 4 inputs, got ", num_inputs, " inputs.")));
+
+    // Create the output Tensors.
+    const int output_dim_batch_size = context->input(0).dim_size(0);
+    const int output_dim_op_size = context->input(3).dim_size(1);
+    const int output_dim_symbol_size = context->input(1).dim_size(0);
+    tensorflow::TensorShape output_shape;
+    output_shape.AddDim(output_dim_batch_size);
+    output_shape.AddDim(output_dim_op_size);
+    tensorflow::TensorShape gradient_shape = output_shape;
+    gradient_shape.AddDim(output_dim_symbol_size);
+
+    tensorflow::Tensor* output = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &output));
+    auto output_tensor = output->matrix<float>();
+
+    tensorflow::Tensor* gradient = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(1, gradient_shape, &gradient));
+    auto gradient_tensor = gradient->tensor<float, 3>();
+    gradient_tensor.setZero();
+
+    // Parse program protos.
+    ProgramBatch programs(/*read_encoded_circuits=*/true);
+    std::vector<int> num_qubits;
+    std::vector<std::vector<PauliSum>> pauli_sums;
+    OP_REQUIRES_OK(context, GetProgramsAndNumQubits(context, &programs,
+                                                    &num_qubits, &pauli_sums));
+
+    std::vector<SymbolMap> maps;
+    OP_REQUIRES_OK(context, GetSymbolMaps(context, &maps));
+
+    OP_REQUIRES(context, pauli_sums.size() == programs.size(),
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "Number of circuits and PauliSums do not match. Got ",
+                    programs.size(), " circuits and ", pauli_sums.size(),
+                    " paulisums.")));
+
+    // Construct qsim circuits along with the gates to differentiate and
+    // the circuit pieces between them.
+    std::vector<QsimCircuit> qsim_circuits(programs.size(), QsimCircuit());
+    std::vector<std::vector<qsim::GateFused<QsimGate>>> fused_circuits(
+        programs.size(), std::vector<qsim::GateFused<QsimGate>>({}));
+    std::vector<std::vector<GateMetaData>> gate_meta(
+        programs.size(), std::vector<GateMetaData>({}));
+    std::vector<std::vector<std::vector<qsim::GateFused<QsimGate>>>>
+        partial_fused_circuits(
+            programs.size(),
+            std::vector<std::vector<qsim::GateFused<QsimGate>>>({}));
+    std::vector<std::vector<GradientOfGate>> gradient_gates(
+        programs.size(), std::vector<GradientOfGate>({}));
+
+    auto construct_f = [&](int start, int end) {
+      std::vector<unsigned int> placement;
+      for (int i = start; i < end; i++) {
+        OP_REQUIRES_OK(context, PlaceQubitsByActivity(&programs, i,
+                                                      num_qubits[i],
+                                                      &pauli_sums[i],
+                                                      &placement));
+        OP_REQUIRES_OK(context, QsimCircuitFromBatch(
+                                    programs, i, maps[i], num_qubits[i],
+                                    &qsim_circuits[i], &fused_circuits[i],
+                                    &gate_meta[i]));
+        CreateGradientCircuit(qsim_circuits[i], gate_meta[i],
+                              &partial_fused_circuits[i], &gradient_gates[i]);
+      }
+    };
+
+    const int num_cycles = 1000;
+    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
+        programs.size(), num_cycles, construct_f);
+
+    int max_num_qubits = 0;
+    for (const int num : num_qubits) {
+      max_num_qubits = std::max(max_num_qubits, num);
+    }
+
+    // Column of every symbol differentiated in each circuit.
+    std::vector<std::vector<std::vector<int>>> symbol_columns(
+        programs.size());
+    for (int i = 0; i < programs.size(); i++) {
+      for (const GradientOfGate& grad : gradient_gates[i]) {
+        std::vector<int> columns;
+        for (const std::string& param : grad.params) {
+          // Missing symbols already fail QsimCircuitFromProgram.
+          const auto it = maps[i].find(param);
+          OP_REQUIRES(context, it != maps[i].end(),
+                      tensorflow::errors::InvalidArgument(absl::StrCat(
+                          "Could not find symbol in parameter map: ", param)));
+          columns.push_back(it->second.first);
+        }
+        symbol_columns[i].push_back(columns);
+      }
+    }
+
+    if (max_num_qubits >= 26 || programs.size() == 1) {
+      ComputeLarge(num_qubits, qsim_circuits, partial_fused_circuits,
+                   gradient_gates, symbol_columns, pauli_sums, context,
+                   &output_tensor, &gradient_tensor);
+    } else {
+      ComputeSmall(num_qubits, max_num_qubits, qsim_circuits,
+                   partial_fused_circuits, gradient_gates, symbol_columns,
+                   pauli_sums, context, &output_tensor, &gradient_tensor);
+    }
+
+    RecordStatePoolUsage(type_string(), pool_);
+  }
+
+ private:
+  // Holds |psi>, a scratch state and O_j|psi> for every op j.
+  template <typename StateT>
+  struct RowStates {
+    RowStates(StatePool* pool, const uint64_t state_size, const int num_ops)
+        : psi(pool, state_size), scratch(pool, state_size) {
+      for (int j = 0; j < num_ops; j++) {
+        phis.emplace_back(new PooledState<StateT>(pool, state_size));
+      }
+    }
+
+    PooledState<StateT> psi;
+    PooledState<StateT> scratch;
+    std::vector<std::unique_ptr<PooledState<StateT>>> phis;
+  };
+
+  // Simulates circuit i forward, writes its expectations and then walks
+  // back through the circuit to accumulate d<psi|O_j|psi>/d symbol.
+  template <typename SimT, typename ForT, typename StateT>
+  Status ComputeRow(
+      const int i, const int nq, const ForT& for_obj,
+      const QsimCircuit& circuit,
+      const std::vector<std::vector<qsim::GateFused<QsimGate>>>& partial_fuses,
+      const std::vector<GradientOfGate>& grad_gates,
+      const std::vector<std::vector<int>>& symbol_columns,
+      const std::vector<PauliSum>& p_sums, RowStates<StateT>* states,
+      tensorflow::TTypes<float, 1>::Matrix* output_tensor,
+      tensorflow::TTypes<float, 3>::Tensor* gradient_tensor) {
+    typedef typename SimT::StateSpace StateSpace;
+    SimT sim = SimT(nq, for_obj);
+    StateSpace ss = StateSpace(nq, for_obj);
+    StateT& psi = states->psi.get();
+    StateT& scratch = states->scratch.get();
+
+    ss.SetStateZero(psi);
+    for (int k = 0; k < partial_fuses.size(); k++) {
+      for (const auto& fused_gate : partial_fuses[k]) {
+        qsim::ApplyFusedGate(sim, fused_gate, psi);
+      }
+      if (k < grad_gates.size()) {
+        qsim::ApplyGate(sim, circuit.gates[grad_gates[k].index], psi);
+      }
+    }
+
+    for (int j = 0; j < p_sums.size(); j++) {
+      float exp_v = 0.0;
+      TF_RETURN_IF_ERROR(
+          ComputeExpectationQsim(p_sums[j], for_obj, ss, psi, &exp_v));
+      (*output_tensor)(i, j) = exp_v;
+      TF_RETURN_IF_ERROR(AccumulateOperators({p_sums[j]}, {1.0}, for_obj, ss,
+                                             psi, states->phis[j]->get()));
+    }
+
+    // Walk back one partial circuit and one gradient gate at a time. Before
+    // gradient gate G is undone, phi_j = A^dagger O_j |psi_final> where A is
+    // the rest of the circuit after G, and psi is the state right before G.
+    for (int k = partial_fuses.size() - 1; k >= 0; k--) {
+      for (int l = partial_fuses[k].size() - 1; l >= 0; l--) {
+        ApplyFusedGateDagger(sim, partial_fuses[k][l], psi);
+        for (auto& phi : states->phis) {
+          ApplyFusedGateDagger(sim, partial_fuses[k][l], phi->get());
+        }
+      }
+      if (k == 0) {
+        break;
+      }
+
+      const GradientOfGate& grad = grad_gates[k - 1];
+      const QsimGate& gate = circuit.gates[grad.index];
+      ApplyGateDagger(sim, gate, psi);
+      for (int p = 0; p < grad.grad_gates.size(); p++) {
+        ss.CopyState(psi, scratch);
+        qsim::ApplyGate(sim, grad.grad_gates[p], scratch);
+        const int column = symbol_columns[k - 1][p];
+        for (int j = 0; j < p_sums.size(); j++) {
+          (*gradient_tensor)(i, j, column) +=
+              2.0 * ss.RealInnerProduct(states->phis[j]->get(), scratch);
+        }
+      }
+      for (auto& phi : states->phis) {
+        ApplyGateDagger(sim, gate, phi->get());
+      }
+    }
+
+    return Status::OK();
+  }
+
+  void ComputeLarge(
+      const std::vector<int>& num_qubits,
+      const std::vector<QsimCircuit>& qsim_circuits,
+      const std::vector<std::vector<std::vector<qsim::GateFused<QsimGate>>>>&
+          partial_fused_circuits,
+      const std::vector<std::vector<GradientOfGate>>& gradient_gates,
+      const std::vector<std::vector<std::vector<int>>>& symbol_columns,
+      const std::vector<std::vector<PauliSum>>& pauli_sums,
+      tensorflow::OpKernelContext* context,
+      tensorflow::TTypes<float, 1>::Matrix* output_tensor,
+      tensorflow::TTypes<float, 3>::Tensor* gradient_tensor) {
+    // Instantiate qsim objects.
+    const int max_num_qubits =
+        *std::max_element(num_qubits.begin(), num_qubits.end());
+    const auto tfq_for = tfq::QsimFor(context, max_num_qubits);
+    using Simulator = qsim::Simulator<const tfq::QsimFor&>;
+    using State = Simulator::StateSpace::State;
+
+    const int num_ops = context->input(3).dim_size(1);
+    RowStates<State> states(&pool_, StateRawSize(max_num_qubits), num_ops);
+
+    // Simulate programs one by one. Parallelizing over wavefunctions
+    // we no longer parallelize over circuits.
+    for (int i = 0; i < qsim_circuits.size(); i++) {
+      // (#679) Just ignore empty program
+      if (num_qubits[i] == 0) {
+        for (int j = 0; j < pauli_sums[i].size(); j++) {
+          (*output_tensor)(i, j) = -2.0;
+        }
+        continue;
+      }
+      OP_REQUIRES_OK(context, ComputeRow<Simulator>(
+                                  i, num_qubits[i], tfq_for, qsim_circuits[i],
+                                  partial_fused_circuits[i], gradient_gates[i],
+                                  symbol_columns[i], pauli_sums[i], &states,
+                                  output_tensor, gradient_tensor));
+    }
+  }
+
+  void ComputeSmall(
+      const std::vector<int>& num_qubits, const int max_num_qubits,
+      const std::vector<QsimCircuit>& qsim_circuits,
+      const std::vector<std::vector<std::vector<qsim::GateFused<QsimGate>>>>&
+          partial_fused_circuits,
+      const std::vector<std::vector<GradientOfGate>>& gradient_gates,
+      const std::vector<std::vector<std::vector<int>>>& symbol_columns,
+      const std::vector<std::vector<PauliSum>>& pauli_sums,
+      tensorflow::OpKernelContext* context,
+      tensorflow::TTypes<float, 1>::Matrix* output_tensor,
+      tensorflow::TTypes<float, 3>::Tensor* gradient_tensor) {
+    const auto tfq_for = qsim::SequentialFor(1);
+    using Simulator = qsim::Simulator<const qsim::SequentialFor&>;
+    using State = Simulator::StateSpace::State;
+
+    // The backward walk applies every gate about three times.
+    std::vector<int64_t> costs(qsim_circuits.size(), 0);
+    for (int i = 0; i < qsim_circuits.size(); i++) {
+      uint64_t num_gates = 0;
+      for (const auto& partial : partial_fused_circuits[i]) {
+        num_gates += partial.size();
+      }
+      uint64_t num_terms = 0;
+      for (const PauliSum& p_sum : pauli_sums[i]) {
+        num_terms += p_sum.terms_size();
+      }
+      costs[i] = CircuitCost(num_qubits[i],
+                             (2 + pauli_sums[i].size()) * num_gates,
+                             num_terms);
+    }
+
+    const int num_ops = context->input(3).dim_size(1);
+    auto DoWork = [&](CostOrderedQueue* queue) {
+      RowStates<State> states(&pool_, StateRawSize(max_num_qubits),
+                              num_ops);
+      int i;
+      while (queue->Next(&i)) {
+        // (#679) Just ignore empty program
+        if (num_qubits[i] == 0) {
+          for (int j = 0; j < pauli_sums[i].size(); j++) {
+            (*output_tensor)(i, j) = -2.0;
+          }
+          continue;
+        }
+        OP_REQUIRES_OK(context,
+                       ComputeRow<Simulator>(
+                           i, num_qubits[i], tfq_for, qsim_circuits[i],
+                           partial_fused_circuits[i], gradient_gates[i],
+                           symbol_columns[i], pauli_sums[i], &states,
+                           output_tensor, gradient_tensor));
+      }
+    };
+
+    ParallelForByCost(context, costs, DoWork);
+  }
+
+  // State buffers reused across Compute calls.
+  StatePool pool_;
+};
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqSimulateExpectationAndGradient").Device(tensorflow::DEVICE_CPU),
+    TfqSimulateExpectationAndGradientOp);
+
+REGISTER_OP("TfqSimulateExpectationAndGradient")
+    .Input("programs: string")
+    .Input("symbol_names: string")
+    .Input("symbol_values: float")
+    .Input("pauli_sums: string")
+    .Attr("allow_text_format: bool = true")
+    .Output("expectations: float")
+    .Output("gradients: float")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
+      tensorflow::shape_inference::ShapeHandle programs_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &programs_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_names_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &symbol_names_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_values_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &symbol_values_shape));
+
+      tensorflow::shape_inference::ShapeHandle pauli_sums_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 2, &pauli_sums_shape));
+
+      tensorflow::shape_inference::DimensionHandle output_rows =
+          c->Dim(programs_shape, 0);
+      tensorflow::shape_inference::DimensionHandle output_cols =
+          c->Dim(pauli_sums_shape, 1);
+      tensorflow::shape_inference::DimensionHandle num_symbols =
+          c->Dim(symbol_names_shape, 0);
+      c->set_output(0, c->Matrix(output_rows, output_cols));
+      c->set_output(1, c->MakeShape({output_rows, output_cols, num_symbols}));
+
+      return tensorflow::Status::OK();
+    });
+
+}  // namespace tfq
@@ -13,6 +13,7 @@ See the License for the specific language governing permissions and
 limitations under the License.
 ==============================================================================*/
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 
@@ -28,8 +29,10 @@ limitations under the License.
 #include "tensorflow/core/lib/core/error_codes.pb.h"
 #include "tensorflow/core/lib/core/status.h"
 #include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow/core/platform/env.h"
 #include "tensorflow_quantum/core/ops/parse_context.h"
 #include "tensorflow_quantum/core/proto/pauli_sum.pb.h"
+#include "tensorflow_quantum/core/src/program_resolution.h"
 #include "tensorflow_quantum/core/src/util_qsim.h"
 
 namespace tfq {
@@ -44,14 +47,17 @@ typedef qsim::Circuit<QsimGate> QsimCircuit;
 class TfqSimulateExpectationOp : public tensorflow::OpKernel {
  public:
   explicit TfqSimulateExpectationOp(tensorflow::OpKernelConstruction* context)
-      : OpKernel(context) {}
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("light_cone", &light_cone_));
+  }
 
   void Compute(tensorflow::OpKernelContext* context) override {
     // TODO (mbbrough): add more dimension checks for other inputs here.
     const int num_inputs = context->num_inputs();
-    OP_REQUIRES(context, num_inputs == 4,
+    OP_REQUIRES(context, num_inputs == 4 || num_inputs == 5,
                 tensorflow::errors::InvalidArgument(absl::StrCat(
-                    "Expected 4 inputs, got ", num_inputs, " inputs.")));
+                    "Expected 4 or 5 inputs, got ", num_inputs,
+                    " inputs.")));
 
     // Create the output Tensor.
     const int output_dim_batch_size = context->input(0).dim_size(0);
@@ -65,7 +71,7 @@ class TfqSimulateExpectationOp : public tensorflow::OpKernel {
     auto output_tensor = output->matrix<float>();
 
     // Parse program protos.
-    std::vector<Program> programs;
+    ProgramBatch programs(/*read_encoded_circuits=*/true);
     std::vector<int> num_qubits;
     std::vector<std::vector<PauliSum>> pauli_sums;
     OP_REQUIRES_OK(context, GetProgramsAndNumQubits(context, &programs,
@@ -80,16 +86,36 @@ class TfqSimulateExpectationOp : public tensorflow::OpKernel {
                     programs.size(), " circuits and ", pauli_sums.size(),
                     " paulisums.")));
 
+    // Circuits start from the given states instead of |0...0> if any.
+    InitialStates initial_states;
+    OP_REQUIRES_OK(context,
+                   GetInitialStates(context, num_qubits, &initial_states));
+
     // Construct qsim circuits.
     std::vector<QsimCircuit> qsim_circuits(programs.size(), QsimCircuit());
     std::vector<std::vector<qsim::GateFused<QsimGate>>> fused_circuits(
         programs.size(), std::vector<qsim::GateFused<QsimGate>>({}));
+    std::vector<std::vector<QubitCluster>> clusters(programs.size());
 
+    // Move the busiest qubits onto the lowest state bits. Observables are
+    // renumbered along with the circuit so the expectations do not change.
+    // Given initial states fix the qubit order and may entangle any of the
+    // qubits, so neither placement nor clustering applies to them.
     auto construct_f = [&](int start, int end) {
+      std::vector<unsigned int> placement;
       for (int i = start; i < end; i++) {
-        OP_REQUIRES_OK(context, QsimCircuitFromProgram(
-                                    programs[i], maps[i], num_qubits[i],
+        if (initial_states.empty()) {
+          OP_REQUIRES_OK(context, PlaceQubitsByActivity(&programs, i,
+                                                        num_qubits[i],
+                                                        &pauli_sums[i],
+                                                        &placement));
+        }
+        OP_REQUIRES_OK(context, QsimCircuitFromBatch(
+                                    programs, i, maps[i], num_qubits[i],
                                     &qsim_circuits[i], &fused_circuits[i]));
+        if (initial_states.empty()) {
+          GetQubitClusters(qsim_circuits[i], &clusters[i]);
+        }
       }
     };
 
@@ -107,17 +133,24 @@ class TfqSimulateExpectationOp : public tensorflow::OpKernel {
     // e2s2 = 2 CPU, 8GB -> Can safely do 25 since Memory = 4GB
     // e2s4 = 4 CPU, 16GB -> Can safely do 25 since Memory = 8GB
     // ...
-    if (max_num_qubits >= 26 || programs.size() == 1) {
-      ComputeLarge(num_qubits, fused_circuits, pauli_sums, context,
-                   &output_tensor);
+    if (light_cone_ && initial_states.empty()) {
+      ComputeLightCone(qsim_circuits, fused_circuits, pauli_sums, context,
+                       &output_tensor);
+    } else if (max_num_qubits >= 26 || programs.size() == 1) {
+      ComputeLarge(num_qubits, qsim_circuits, fused_circuits, clusters,
+                   pauli_sums, initial_states, context, &output_tensor);
     } else {
-      ComputeSmall(num_qubits, max_num_qubits, fused_circuits, pauli_sums,
-                   context, &output_tensor);
+      ComputeSmall(num_qubits, max_num_qubits, qsim_circuits, fused_circuits,
+                   clusters, pauli_sums, initial_states, context,
+                   &output_tensor);
     }
 
+    RecordStatePoolUsage(type_string(), pool_);
+
     // just to be on the safe side.
     qsim_circuits.clear();
     fused_circuits.clear();
+    clusters.clear();
     num_qubits.clear();
     maps.clear();
     pauli_sums.clear();
@@ -125,127 +158,285 @@ class TfqSimulateExpectationOp : public tensorflow::OpKernel {
   }
 
  private:
+  bool light_cone_;
+
+  void ComputeLightCone(
+      const std::vector<QsimCircuit>& qsim_circuits,
+      const std::vector<std::vector<qsim::GateFused<QsimGate>>>& fused_circuits,
+      const std::vector<std::vector<PauliSum>>& pauli_sums,
+      tensorflow::OpKernelContext* context,
+      tensorflow::TTypes<float, 1>::Matrix* output_tensor) {
+    const auto tfq_for = qsim::SequentialFor(1);
+    using Simulator = qsim::Simulator<const qsim::SequentialFor&>;
+
+    const int output_dim_op_size = output_tensor->dimension(1);
+
+    // Find the distinct light cones of every circuit. Each cone is an
+    // independent (and usually much smaller) simulation, so we parallelize
+    // over cones instead of over circuits.
+    std::vector<std::vector<LightConeGroup>> groups(qsim_circuits.size());
+    std::vector<std::vector<float>> offsets(qsim_circuits.size());
+    auto group_f = [&](int start, int end) {
+      for (int i = start; i < end; i++) {
+        // (#679) Just ignore empty program, its pauli_sums are unresolved.
+        if (qsim_circuits[i].num_qubits == 0) {
+          continue;
+        }
+        OP_REQUIRES_OK(context,
+                       GetLightConeGroups(pauli_sums[i], qsim_circuits[i],
+                                          &groups[i], &offsets[i]));
+      }
+    };
+    const int num_cycles = 1000;
+    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
+        qsim_circuits.size(), num_cycles, group_f);
+
+    std::vector<std::pair<int, int>> work;
+    for (int i = 0; i < groups.size(); i++) {
+      for (int k = 0; k < groups[i].size(); k++) {
+        work.push_back({i, k});
+      }
+    }
+
+    // Cones differ a lot in size, hand out the largest first.
+    std::vector<int64_t> costs(work.size());
+    for (int w = 0; w < work.size(); w++) {
+      const LightConeGroup& group = groups[work[w].first][work[w].second];
+      costs[w] = CircuitCost(group.qubits.size(), group.gate_indices.size(),
+                             group.terms.size());
+    }
+
+    std::vector<std::vector<float>> partial_values(work.size());
+    auto DoWork = [&](CostOrderedQueue* queue) {
+      int w;
+      while (queue->Next(&w)) {
+        const int i = work[w].first;
+        OP_REQUIRES_OK(context, ComputeLightConeGroupQsim<Simulator>(
+                                    groups[i][work[w].second], pauli_sums[i],
+                                    qsim_circuits[i], tfq_for,
+                                    &partial_values[w]));
+      }
+    };
+    ParallelForByCost(context, costs, DoWork);
+
+    // Sum up the contributions of each cone in a fixed order.
+    for (int i = 0; i < groups.size(); i++) {
+      for (int j = 0; j < output_dim_op_size; j++) {
+        (*output_tensor)(i, j) =
+            qsim_circuits[i].num_qubits == 0 ? -2.0 : offsets[i][j];
+      }
+    }
+    for (int w = 0; w < work.size(); w++) {
+      const int i = work[w].first;
+      const LightConeGroup& group = groups[i][work[w].second];
+      for (int k = 0; k < group.terms.size(); k++) {
+        (*output_tensor)(i, group.terms[k].first) += partial_values[w][k];
+      }
+    }
+  }
+
   void ComputeLarge(
       const std::vector<int>& num_qubits,
+      const std::vector<QsimCircuit>& qsim_circuits,
       const std::vector<std::vector<qsim::GateFused<QsimGate>>>& fused_circuits,
+      const std::vector<std::vector<QubitCluster>>& clusters,
       const std::vector<std::vector<PauliSum>>& pauli_sums,
-      tensorflow::OpKernelContext* context,
+      const InitialStates& initial_states, tensorflow::OpKernelContext* context,
       tensorflow::TTypes<float, 1>::Matrix* output_tensor) {
     // Instantiate qsim objects.
-    const auto tfq_for = tfq::QsimFor(context);
+    const int max_num_qubits =
+        *std::max_element(num_qubits.begin(), num_qubits.end());
+    const auto tfq_for = tfq::QsimFor(context, max_num_qubits);
     using Simulator = qsim::Simulator<const tfq::QsimFor&>;
     using StateSpace = Simulator::StateSpace;
     using State = StateSpace::State;
 
-    // Begin simulation.
-    int largest_nq = 1;
-    State sv = StateSpace(largest_nq, tfq_for).CreateState();
-    State scratch = StateSpace(largest_nq, tfq_for).CreateState();
+    // Begin simulation. State buffers come from the kernel's pool and are
+    // sized for the largest circuit up front.
+    const uint64_t state_size = StateRawSize(max_num_qubits);
+    PooledState<State> pooled_sv(&pool_, state_size);
+    State& sv = pooled_sv.get();
 
     // Simulate programs one by one. Parallelizing over wavefunctions
-    // we no longer parallelize over circuits. Each time we encounter a
-    // a larger circuit we will grow the Statevector as necessary.
+    // we no longer parallelize over circuits.
     for (int i = 0; i < fused_circuits.size(); i++) {
       int nq = num_qubits[i];
+      if (clusters[i].size() > 1) {
+        // Circuit is a product of unentangled clusters, simulate each
+        // cluster in its own smaller state instead.
+        std::vector<float> exp_vs;
+        OP_REQUIRES_OK(context, ComputeClusteredExpectationQsim<Simulator>(
+                                    pauli_sums[i], qsim_circuits[i],
+                                    clusters[i], tfq_for, &exp_vs));
+        for (int j = 0; j < pauli_sums[i].size(); j++) {
+          (*output_tensor)(i, j) = exp_vs[j];
+        }
+        continue;
+      }
       Simulator sim = Simulator(nq, tfq_for);
       StateSpace ss = StateSpace(nq, tfq_for);
-      if (nq > largest_nq) {
-        // need to switch to larger statespace.
-        largest_nq = nq;
-        sv = ss.CreateState();
-        scratch = ss.CreateState();
-      }
       // TODO: add heuristic here so that we do not always recompute
       //  the state if there is a possibility that circuit[i] and
       //  circuit[i + 1] produce the same state.
-      ss.SetStateZero(sv);
-      for (int j = 0; j < fused_circuits[i].size(); j++) {
-        qsim::ApplyFusedGate(sim, fused_circuits[i][j], sv);
+      if (initial_states.empty()) {
+        ss.SetStateZero(sv);
+      } else {
+        LoadAmplitudesQsim(tfq_for, nq, initial_states.row(i), sv.get());
       }
+      const uint64_t start_micros = tensorflow::Env::Default()->NowMicros();
+      const uint64_t num_sweeps =
+          ApplyFusedCircuitBlocked(fused_circuits[i], nq, sim, tfq_for, sv);
+      RecordStateBandwidth(
+          nq, num_sweeps,
+          tensorflow::Env::Default()->NowMicros() - start_micros);
       for (int j = 0; j < pauli_sums[i].size(); j++) {
         // (#679) Just ignore empty program
-        if (fused_circuits[i].size() == 0) {
+        if (num_qubits[i] == 0) {
           (*output_tensor)(i, j) = -2.0;
           continue;
         }
         float exp_v = 0.0;
-        OP_REQUIRES_OK(context,
-                       ComputeExpectationQsim(pauli_sums[i][j], sim, ss, sv,
-                                              scratch, &exp_v));
+        OP_REQUIRES_OK(context, ComputeExpectationQsim(pauli_sums[i][j],
+                                                       tfq_for, ss, sv,
+                                                       &exp_v));
         (*output_tensor)(i, j) = exp_v;
       }
     }
-    sv.release();
-    scratch.release();
   }
 
   void ComputeSmall(
       const std::vector<int>& num_qubits, const int max_num_qubits,
+      const std::vector<QsimCircuit>& qsim_circuits,
       const std::vector<std::vector<qsim::GateFused<QsimGate>>>& fused_circuits,
+      const std::vector<std::vector<QubitCluster>>& clusters,
       const std::vector<std::vector<PauliSum>>& pauli_sums,
-      tensorflow::OpKernelContext* context,
+      const InitialStates& initial_states, tensorflow::OpKernelContext* context,
       tensorflow::TTypes<float, 1>::Matrix* output_tensor) {
     const auto tfq_for = qsim::SequentialFor(1);
     using Simulator = qsim::Simulator<const qsim::SequentialFor&>;
     using StateSpace = Simulator::StateSpace;
     using State = StateSpace::State;
 
-    const int output_dim_op_size = output_tensor->dimension(1);
-
-    auto DoWork = [&](int start, int end) {
-      int old_batch_index = -2;
-      int cur_batch_index = -1;
-      int largest_nq = 1;
-      int cur_op_index;
+    // Rows that share a fused circuit skeleton are simulated together on
+    // one batched state, every other row on its own. Batched states always
+    // start from |0...0>.
+    std::vector<std::vector<int>> items;
+    if (initial_states.empty()) {
+      GetBatchGroups(num_qubits, fused_circuits, pauli_sums, &items);
+    }
+    std::vector<bool> batched(fused_circuits.size(), false);
+    for (const std::vector<int>& group : items) {
+      for (const int i : group) {
+        batched[i] = true;
+      }
+    }
+    for (int i = 0; i < fused_circuits.size(); i++) {
+      if (!batched[i]) {
+        items.push_back({i});
+      }
+    }
 
-      State sv = StateSpace(largest_nq, tfq_for).CreateState();
-      State scratch = StateSpace(largest_nq, tfq_for).CreateState();
-      for (int i = start; i < end; i++) {
-        cur_batch_index = i / output_dim_op_size;
-        cur_op_index = i % output_dim_op_size;
+    // Work is handed out one item at a time, most expensive first, so
+    // a few large circuits in a mixed batch do not leave threads idle.
+    std::vector<int64_t> costs(items.size(), 0);
+    for (int w = 0; w < items.size(); w++) {
+      for (const int i : items[w]) {
+        uint64_t num_terms = 0;
+        for (const PauliSum& p_sum : pauli_sums[i]) {
+          num_terms += p_sum.terms_size();
+        }
+        costs[w] +=
+            CircuitCost(num_qubits[i], fused_circuits[i].size(), num_terms);
+      }
+    }
 
-        const int nq = num_qubits[cur_batch_index];
-        Simulator sim = Simulator(nq, tfq_for);
-        StateSpace ss = StateSpace(nq, tfq_for);
+    auto DoWork = [&](CostOrderedQueue* queue) {
+      std::vector<float> cluster_exp_vs;
+
+      const uint64_t state_size = StateRawSize(max_num_qubits);
+      PooledState<State> pooled_sv(&pool_, state_size);
+      State& sv = pooled_sv.get();
+      int w;
+      while (queue->Next(&w)) {
+        if (items[w].size() > 1) {
+          ComputeBatch(items[w], num_qubits, fused_circuits, pauli_sums,
+                       context, output_tensor);
+          continue;
+        }
+        const int i = items[w][0];
+        if (clusters[i].size() > 1) {
+          // Product of unentangled clusters, all ops of this circuit are
+          // computed at once.
+          OP_REQUIRES_OK(context, ComputeClusteredExpectationQsim<Simulator>(
+                                      pauli_sums[i], qsim_circuits[i],
+                                      clusters[i], tfq_for, &cluster_exp_vs));
+          for (int j = 0; j < pauli_sums[i].size(); j++) {
+            (*output_tensor)(i, j) = cluster_exp_vs[j];
+          }
+          continue;
+        }
 
         // (#679) Just ignore empty program
-        if (fused_circuits[cur_batch_index].size() == 0) {
-          (*output_tensor)(cur_batch_index, cur_op_index) = -2.0;
+        if (num_qubits[i] == 0) {
+          for (int j = 0; j < pauli_sums[i].size(); j++) {
+            (*output_tensor)(i, j) = -2.0;
+          }
           continue;
         }
 
-        if (cur_batch_index != old_batch_index) {
-          // We've run into a new wavefunction we must compute.
-          // Only compute a new wavefunction when we have to.
-          if (nq >= largest_nq) {
-            sv = ss.CreateState();
-            scratch = ss.CreateState();
-            largest_nq = nq;
-          }
-          // no need to update scratch_state since ComputeExpectation
-          // will take care of things for us.
+        const int nq = num_qubits[i];
+        Simulator sim = Simulator(nq, tfq_for);
+        StateSpace ss = StateSpace(nq, tfq_for);
+
+        if (initial_states.empty()) {
           ss.SetStateZero(sv);
-          for (int j = 0; j < fused_circuits[cur_batch_index].size(); j++) {
-            qsim::ApplyFusedGate(sim, fused_circuits[cur_batch_index][j], sv);
-          }
+        } else {
+          LoadAmplitudesQsim(tfq_for, nq, initial_states.row(i), sv.get());
+        }
+        for (int j = 0; j < fused_circuits[i].size(); j++) {
+          qsim::ApplyFusedGate(sim, fused_circuits[i][j], sv);
         }
 
-        float exp_v = 0.0;
-        OP_REQUIRES_OK(context, ComputeExpectationQsim(
-                                    pauli_sums[cur_batch_index][cur_op_index],
-                                    sim, ss, sv, scratch, &exp_v));
-        (*output_tensor)(cur_batch_index, cur_op_index) = exp_v;
-        old_batch_index = cur_batch_index;
+        for (int j = 0; j < pauli_sums[i].size(); j++) {
+          float exp_v = 0.0;
+          OP_REQUIRES_OK(context, ComputeExpectationQsim(pauli_sums[i][j],
+                                                         tfq_for, ss, sv,
+                                                         &exp_v));
+          (*output_tensor)(i, j) = exp_v;
+        }
       }
-      sv.release();
-      scratch.release();
     };
 
-    const int64_t num_cycles =
-        200 * (int64_t(1) << static_cast<int64_t>(max_num_qubits));
-    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
-        fused_circuits.size() * output_dim_op_size, num_cycles, DoWork);
+    ParallelForByCost(context, costs, DoWork);
   }
+
+  void ComputeBatch(
+      const std::vector<int>& rows, const std::vector<int>& num_qubits,
+      const std::vector<std::vector<qsim::GateFused<QsimGate>>>& fused_circuits,
+      const std::vector<std::vector<PauliSum>>& pauli_sums,
+      tensorflow::OpKernelContext* context,
+      tensorflow::TTypes<float, 1>::Matrix* output_tensor) {
+    std::vector<const std::vector<qsim::GateFused<QsimGate>>*> circuits;
+    for (const int i : rows) {
+      circuits.push_back(&fused_circuits[i]);
+    }
+    BatchStateVector state(num_qubits[rows[0]], rows.size());
+    SimulateBatchQsim(circuits, &state);
+
+    // Rows in a group measure the same PauliSums.
+    std::vector<float> exp_vs(rows.size());
+    for (int j = 0; j < pauli_sums[rows[0]].size(); j++) {
+      std::fill(exp_vs.begin(), exp_vs.end(), 0.0);
+      OP_REQUIRES_OK(context, ComputeExpectationBatch(pauli_sums[rows[0]][j],
+                                                      state, &exp_vs));
+      for (int b = 0; b < rows.size(); b++) {
+        (*output_tensor)(rows[b], j) = exp_vs[b];
+      }
+    }
+  }
+
+  // State buffers reused across Compute calls.
+  StatePool pool_;
 };
 
 REGISTER_KERNEL_BUILDER(
@@ -257,7 +448,11 @@ REGISTER_OP("TfqSimulateExpectation")
     .Input("symbol_names: string")
     .Input("symbol_values: float")
     .Input("pauli_sums: string")
+    .Input("initial_states: Tinit")
+    .Attr("allow_text_format: bool = true")
+    .Attr("Tinit: list({complex64}) >= 0 = []")
     .Output("expectations: float")
+    .Attr("light_cone: bool = false")
     .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
       tensorflow::shape_inference::ShapeHandle programs_shape;
       TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &programs_shape));
@@ -271,6 +466,14 @@ REGISTER_OP("TfqSimulateExpectation")
       tensorflow::shape_inference::ShapeHandle pauli_sums_shape;
       TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 2, &pauli_sums_shape));
 
+      std::vector<tensorflow::shape_inference::ShapeHandle>
+          initial_states_shapes;
+      TF_RETURN_IF_ERROR(c->input("initial_states", &initial_states_shapes));
+      for (const auto& shape : initial_states_shapes) {
+        tensorflow::shape_inference::ShapeHandle initial_states_shape;
+        TF_RETURN_IF_ERROR(c->WithRank(shape, 2, &initial_states_shape));
+      }
+
       tensorflow::shape_inference::DimensionHandle output_rows =
           c->Dim(programs_shape, 0);
       tensorflow::shape_inference::DimensionHandle output_cols =
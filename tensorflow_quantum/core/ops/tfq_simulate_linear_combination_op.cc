@@ -0,0 +1,449 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "../qsim/lib/circuit.h"
+#include "../qsim/lib/fuser_basic.h"
+#include "../qsim/lib/gate_appl.h"
+#include "../qsim/lib/gates_cirq.h"
+#include "../qsim/lib/io.h"
+#include "../qsim/lib/seqfor.h"
+#include "../qsim/lib/simmux.h"
+#include "cirq/google/api/v2/program.pb.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/framework/tensor_shape.h"
+#include "tensorflow/core/lib/core/error_codes.pb.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow_quantum/core/ops/parse_context.h"
+#include "tensorflow_quantum/core/proto/pauli_sum.pb.h"
+#include "tensorflow_quantum/core/src/adj_util.h"
+#include "tensorflow_quantum/core/src/program_resolution.h"
+#include "tensorflow_quantum/core/src/util_qsim.h"
+
+namespace tfq {
+
+using ::cirq::google::api::v2::Program;
+using ::tensorflow::Status;
+using ::tfq::proto::PauliSum;
+
+typedef qsim::Cirq::GateCirq<float> QsimGate;
+typedef qsim::Circuit<QsimGate> QsimCircuit;
+
+// Computes sum_k weights[k] * <O_j>(symbol_values + perturbations[k] e_s)
+// for every circuit, op j and symbol s, the finite difference style
+// gradients of LinearCombination. Every program is parsed once. All of its
+// perturbed circuits share the state in front of the first gate that
+// uses the perturbed symbol, only the gates after it are rebuilt from the
+// GateMetaData and simulated again. Zero perturbations reuse the
+// unperturbed expectation values.
+class TfqSimulateLinearCombinationOp : public tensorflow::OpKernel {
+ public:
+  explicit TfqSimulateLinearCombinationOp(
+      tensorflow::OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(tensorflow::OpKernelContext* context) override {
+    const int num_inputs = context->num_inputs();
+    OP_REQUIRES(context, num_inputs == 6,
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "Expected 6 inputs, got ", num_inputs, " inputs.")));
+
+    const tensorflow::Tensor& weights_input = context->input(4);
+    const tensorflow::Tensor& perturbations_input = context->input(5);
+    OP_REQUIRES(context, weights_input.dims() == 1,
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "weights must be rank 1. Got rank ", weights_input.dims(),
+                    ".")));
+    OP_REQUIRES(context, perturbations_input.dims() == 1,
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "perturbations must be rank 1. Got rank ",
+                    perturbations_input.dims(), ".")));
+    OP_REQUIRES(context,
+                weights_input.dim_size(0) == perturbations_input.dim_size(0),
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "weights and perturbations must have the same size. Got ",
+                    weights_input.dim_size(0), " weights and ",
+                    perturbations_input.dim_size(0), " perturbations.")));
+
+    // Split the combination into shifted terms and the unshifted one.
+    const auto weights = weights_input.vec<float>();
+    const auto perturbations = perturbations_input.vec<float>();
+    Combination combination;
+    combination.zero_weight = 0.0;
+    combination.total_weight = 0.0;
+    for (int k = 0; k < weights.size(); k++) {
+      combination.total_weight += weights(k);
+      if (perturbations(k) == 0.0) {
+        combination.zero_weight += weights(k);
+      } else {
+        combination.weights.push_back(weights(k));
+        combination.perturbations.push_back(perturbations(k));
+      }
+    }
+
+    // Create the output Tensor.
+    const int output_dim_batch_size = context->input(0).dim_size(0);
+    const int output_dim_op_size = context->input(3).dim_size(1);
+    const int output_dim_symbol_size = context->input(1).dim_size(0);
+    tensorflow::TensorShape output_shape;
+    output_shape.AddDim(output_dim_batch_size);
+    output_shape.AddDim(output_dim_op_size);
+    output_shape.AddDim(output_dim_symbol_size);
+
+    tensorflow::Tensor* output = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &output));
+    auto output_tensor = output->tensor<float, 3>();
+    output_tensor.setZero();
+
+    // Parse program protos.
+    ProgramBatch programs(/*read_encoded_circuits=*/true);
+    std::vector<int> num_qubits;
+    std::vector<std::vector<PauliSum>> pauli_sums;
+    OP_REQUIRES_OK(context, GetProgramsAndNumQubits(context, &programs,
+                                                    &num_qubits, &pauli_sums));
+
+    std::vector<SymbolMap> maps;
+    OP_REQUIRES_OK(context, GetSymbolMaps(context, &maps));
+
+    OP_REQUIRES(context, pauli_sums.size() == programs.size(),
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "Number of circuits and PauliSums do not match. Got ",
+                    programs.size(), " circuits and ", pauli_sums.size(),
+                    " paulisums.")));
+
+    // Construct qsim circuits. The metadata keeps the gates in program
+    // order, which the shared prefixes rely on.
+    std::vector<QsimCircuit> qsim_circuits(programs.size(), QsimCircuit());
+    std::vector<std::vector<qsim::GateFused<QsimGate>>> fused_circuits(
+        programs.size(), std::vector<qsim::GateFused<QsimGate>>({}));
+    std::vector<std::vector<GateMetaData>> gate_meta(
+        programs.size(), std::vector<GateMetaData>({}));
+
+    auto construct_f = [&](int start, int end) {
+      std::vector<unsigned int> placement;
+      for (int i = start; i < end; i++) {
+        OP_REQUIRES_OK(context, PlaceQubitsByActivity(&programs, i,
+                                                      num_qubits[i],
+                                                      &pauli_sums[i],
+                                                      &placement));
+        OP_REQUIRES_OK(context, QsimCircuitFromBatch(
+                                    programs, i, maps[i], num_qubits[i],
+                                    &qsim_circuits[i], &fused_circuits[i],
+                                    &gate_meta[i]));
+      }
+    };
+
+    const int num_cycles = 1000;
+    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
+        programs.size(), num_cycles, construct_f);
+
+    int max_num_qubits = 0;
+    for (const int num : num_qubits) {
+      max_num_qubits = std::max(max_num_qubits, num);
+    }
+
+    // Gates that use every symbol, ordered by their first gate.
+    std::vector<std::vector<SymbolGates>> symbol_gates(programs.size());
+    for (int i = 0; i < programs.size(); i++) {
+      std::vector<int> slot(output_dim_symbol_size, -1);
+      for (int g = 0; g < gate_meta[i].size(); g++) {
+        for (const std::string& symbol : gate_meta[i][g].symbol_values) {
+          // Missing symbols already fail QsimCircuitFromProgram.
+          const auto it = maps[i].find(symbol);
+          OP_REQUIRES(context, it != maps[i].end(),
+                      tensorflow::errors::InvalidArgument(absl::StrCat(
+                          "Could not find symbol in parameter map: ",
+                          symbol)));
+          const int column = it->second.first;
+          if (slot[column] < 0) {
+            slot[column] = symbol_gates[i].size();
+            symbol_gates[i].push_back({column, symbol, {}});
+          }
+          std::vector<int>& gates = symbol_gates[i][slot[column]].gates;
+          if (gates.empty() || gates.back() != g) {
+            gates.push_back(g);
+          }
+        }
+      }
+    }
+
+    if (max_num_qubits >= 26 || programs.size() == 1) {
+      ComputeLarge(num_qubits, qsim_circuits, gate_meta, symbol_gates,
+                   combination, pauli_sums, context, &output_tensor);
+    } else {
+      ComputeSmall(num_qubits, max_num_qubits, qsim_circuits, gate_meta,
+                   symbol_gates, combination, pauli_sums, context,
+                   &output_tensor);
+    }
+
+    RecordStatePoolUsage(type_string(), pool_);
+  }
+
+ private:
+  // The nonzero perturbations with their weights, the summed weight of
+  // zero perturbations and the sum of all weights.
+  struct Combination {
+    std::vector<float> weights;
+    std::vector<float> perturbations;
+    float zero_weight;
+    float total_weight;
+  };
+
+  // Indices of the gates that use symbol, which fills column.
+  struct SymbolGates {
+    int column;
+    std::string symbol;
+    std::vector<int> gates;
+  };
+
+  // Holds the state shared by every perturbation and a scratch state.
+  template <typename StateT>
+  struct RowStates {
+    RowStates(StatePool* pool, const uint64_t state_size)
+        : psi(pool, state_size), scratch(pool, state_size) {}
+
+    PooledState<StateT> psi;
+    PooledState<StateT> scratch;
+  };
+
+  // Applies circuit.gates[start, end) to state.
+  template <typename SimT, typename StateT>
+  static void ApplyGates(const SimT& sim, const QsimCircuit& circuit,
+                         const int start, const int end, StateT& state) {
+    if (start >= end) {
+      return;
+    }
+    const std::vector<qsim::GateFused<QsimGate>> fused =
+        qsim::BasicGateFuser<qsim::IO, QsimGate>().FuseGates(
+            circuit.num_qubits, circuit.gates.begin() + start,
+            circuit.gates.begin() + end);
+    for (const auto& fused_gate : fused) {
+      qsim::ApplyFusedGate(sim, fused_gate, state);
+    }
+  }
+
+  // Walks psi through circuit i once. At the first gate of every symbol
+  // the rest of the circuit is run again from a copy of psi for every
+  // perturbation of that symbol.
+  template <typename SimT, typename ForT, typename StateT>
+  Status ComputeRow(const int i, const int nq, const ForT& for_obj,
+                    const QsimCircuit& circuit,
+                    const std::vector<GateMetaData>& metadata,
+                    const std::vector<SymbolGates>& symbol_gates,
+                    const Combination& combination,
+                    const std::vector<PauliSum>& p_sums,
+                    RowStates<StateT>* states,
+                    tensorflow::TTypes<float, 3>::Tensor* output_tensor) {
+    typedef typename SimT::StateSpace StateSpace;
+    SimT sim = SimT(nq, for_obj);
+    StateSpace ss = StateSpace(nq, for_obj);
+    StateT& psi = states->psi.get();
+    StateT& scratch = states->scratch.get();
+    const int num_gates = circuit.gates.size();
+    const int num_symbols = output_tensor->dimension(2);
+
+    int walked = 0;
+    ss.SetStateZero(psi);
+    for (const SymbolGates& entry : symbol_gates) {
+      const int first = entry.gates[0];
+      ApplyGates(sim, circuit, walked, first, psi);
+      walked = first;
+
+      std::vector<QsimGate> rest(circuit.gates.begin() + first,
+                                 circuit.gates.end());
+      for (int k = 0; k < combination.perturbations.size(); k++) {
+        for (const int g : entry.gates) {
+          rest[g - first] =
+              ShiftGateSymbol(circuit.gates[g], metadata[g], entry.symbol,
+                              combination.perturbations[k]);
+        }
+        const std::vector<qsim::GateFused<QsimGate>> fused =
+            qsim::BasicGateFuser<qsim::IO, QsimGate>().FuseGates(nq, rest);
+
+        ss.CopyState(psi, scratch);
+        for (const auto& fused_gate : fused) {
+          qsim::ApplyFusedGate(sim, fused_gate, scratch);
+        }
+        for (int j = 0; j < p_sums.size(); j++) {
+          float exp_v = 0.0;
+          TF_RETURN_IF_ERROR(
+              ComputeExpectationQsim(p_sums[j], for_obj, ss, scratch, &exp_v));
+          (*output_tensor)(i, j, entry.column) +=
+              combination.weights[k] * exp_v;
+        }
+      }
+    }
+
+    // Symbols missing from the circuit see the unperturbed values for
+    // every perturbation, the others only for zero perturbations.
+    if (combination.zero_weight == 0.0 &&
+        symbol_gates.size() == num_symbols) {
+      return Status::OK();
+    }
+    ApplyGates(sim, circuit, walked, num_gates, psi);
+    std::vector<bool> present(num_symbols, false);
+    for (const SymbolGates& entry : symbol_gates) {
+      present[entry.column] = true;
+    }
+    for (int j = 0; j < p_sums.size(); j++) {
+      float exp_v = 0.0;
+      TF_RETURN_IF_ERROR(
+          ComputeExpectationQsim(p_sums[j], for_obj, ss, psi, &exp_v));
+      for (int s = 0; s < num_symbols; s++) {
+        (*output_tensor)(i, j, s) +=
+            (present[s] ? combination.zero_weight : combination.total_weight) *
+            exp_v;
+      }
+    }
+
+    return Status::OK();
+  }
+
+  void ComputeLarge(
+      const std::vector<int>& num_qubits,
+      const std::vector<QsimCircuit>& qsim_circuits,
+      const std::vector<std::vector<GateMetaData>>& gate_meta,
+      const std::vector<std::vector<SymbolGates>>& symbol_gates,
+      const Combination& combination,
+      const std::vector<std::vector<PauliSum>>& pauli_sums,
+      tensorflow::OpKernelContext* context,
+      tensorflow::TTypes<float, 3>::Tensor* output_tensor) {
+    // Instantiate qsim objects.
+    const int max_num_qubits =
+        *std::max_element(num_qubits.begin(), num_qubits.end());
+    const auto tfq_for = tfq::QsimFor(context, max_num_qubits);
+    using Simulator = qsim::Simulator<const tfq::QsimFor&>;
+    using State = Simulator::StateSpace::State;
+
+    RowStates<State> states(&pool_, StateRawSize(max_num_qubits));
+
+    // Simulate programs one by one. Parallelizing over wavefunctions
+    // we no longer parallelize over circuits.
+    for (int i = 0; i < qsim_circuits.size(); i++) {
+      // (#679) Just ignore empty program
+      if (num_qubits[i] == 0) {
+        continue;
+      }
+      OP_REQUIRES_OK(context,
+                     ComputeRow<Simulator>(
+                         i, num_qubits[i], tfq_for, qsim_circuits[i],
+                         gate_meta[i], symbol_gates[i], combination,
+                         pauli_sums[i], &states, output_tensor));
+    }
+  }
+
+  void ComputeSmall(
+      const std::vector<int>& num_qubits, const int max_num_qubits,
+      const std::vector<QsimCircuit>& qsim_circuits,
+      const std::vector<std::vector<GateMetaData>>& gate_meta,
+      const std::vector<std::vector<SymbolGates>>& symbol_gates,
+      const Combination& combination,
+      const std::vector<std::vector<PauliSum>>& pauli_sums,
+      tensorflow::OpKernelContext* context,
+      tensorflow::TTypes<float, 3>::Tensor* output_tensor) {
+    const auto tfq_for = qsim::SequentialFor(1);
+    using Simulator = qsim::Simulator<const qsim::SequentialFor&>;
+    using State = Simulator::StateSpace::State;
+
+    // Every perturbed circuit reruns the gates from its symbol onwards.
+    const int num_shifts = combination.perturbations.size();
+    std::vector<int64_t> costs(qsim_circuits.size(), 0);
+    for (int i = 0; i < qsim_circuits.size(); i++) {
+      const uint64_t num_gates = qsim_circuits[i].gates.size();
+      uint64_t num_gate_runs = num_gates;
+      for (const SymbolGates& entry : symbol_gates[i]) {
+        num_gate_runs += num_shifts * (num_gates - entry.gates[0]);
+      }
+      uint64_t num_terms = 0;
+      for (const PauliSum& p_sum : pauli_sums[i]) {
+        num_terms += p_sum.terms_size();
+      }
+      costs[i] =
+          CircuitCost(num_qubits[i], num_gate_runs,
+                      (1 + num_shifts * symbol_gates[i].size()) * num_terms);
+    }
+
+    auto DoWork = [&](CostOrderedQueue* queue) {
+      RowStates<State> states(&pool_, StateRawSize(max_num_qubits));
+      int i;
+      while (queue->Next(&i)) {
+        // (#679) Just ignore empty program
+        if (num_qubits[i] == 0) {
+          continue;
+        }
+        OP_REQUIRES_OK(context,
+                       ComputeRow<Simulator>(
+                           i, num_qubits[i], tfq_for, qsim_circuits[i],
+                           gate_meta[i], symbol_gates[i], combination,
+                           pauli_sums[i], &states, output_tensor));
+      }
+    };
+
+    ParallelForByCost(context, costs, DoWork);
+  }
+
+  // State buffers reused across Compute calls.
+  StatePool pool_;
+};
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqSimulateLinearCombination").Device(tensorflow::DEVICE_CPU),
+    TfqSimulateLinearCombinationOp);
+
+REGISTER_OP("TfqSimulateLinearCombination")
+    .Input("programs: string")
+    .Input("symbol_names: string")
+    .Input("symbol_values: float")
+    .Input("pauli_sums: string")
+    .Input("weights: float")
+    .Input("perturbations: float")
+    .Attr("allow_text_format: bool = true")
+    .Output("partials: float")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
+      tensorflow::shape_inference::ShapeHandle programs_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &programs_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_names_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &symbol_names_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_values_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &symbol_values_shape));
+
+      tensorflow::shape_inference::ShapeHandle pauli_sums_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 2, &pauli_sums_shape));
+
+      tensorflow::shape_inference::ShapeHandle weights_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(4), 1, &weights_shape));
+
+      tensorflow::shape_inference::ShapeHandle perturbations_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(5), 1, &perturbations_shape));
+
+      tensorflow::shape_inference::DimensionHandle output_rows =
+          c->Dim(programs_shape, 0);
+      tensorflow::shape_inference::DimensionHandle output_cols =
+          c->Dim(pauli_sums_shape, 1);
+      tensorflow::shape_inference::DimensionHandle num_symbols =
+          c->Dim(symbol_names_shape, 0);
+      c->set_output(0, c->MakeShape({output_rows, output_cols, num_symbols}));
+
+      return tensorflow::Status::OK();
+    });
+
+}  // namespace tfq
@@ -0,0 +1,464 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include <algorithm>
+#include <complex>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "../qsim/lib/circuit.h"
+#include "../qsim/lib/gates_cirq.h"
+#include "cirq/google/api/v2/program.pb.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/framework/tensor_shape.h"
+#include "tensorflow/core/lib/core/error_codes.pb.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow_quantum/core/ops/parse_context.h"
+#include "tensorflow_quantum/core/proto/pauli_sum.pb.h"
+#include "tensorflow_quantum/core/src/circuit_parser_qsim.h"
+#include "tensorflow_quantum/core/src/mps_simulator.h"
+#include "tensorflow_quantum/core/src/util_qsim.h"
+
+namespace tfq {
+
+using ::cirq::google::api::v2::Program;
+using ::tensorflow::Status;
+using ::tfq::proto::PauliSum;
+
+typedef qsim::Cirq::GateCirq<float> QsimGate;
+typedef qsim::Circuit<QsimGate> QsimCircuit;
+
+namespace {
+
+// Parses programs into qsim circuits for the MPS ops. The MPS applies gates
+// one by one, so the circuits are not fused.
+void MpsCircuitsFromPrograms(
+    tensorflow::OpKernelContext* context, const ProgramBatch& programs,
+    const std::vector<SymbolMap>& maps, const std::vector<int>& num_qubits,
+    std::vector<QsimCircuit>* qsim_circuits) {
+  qsim_circuits->assign(programs.size(), QsimCircuit());
+
+  auto construct_f = [&](int start, int end) {
+    for (int i = start; i < end; i++) {
+      OP_REQUIRES_OK(context,
+                     QsimCircuitFromBatch(programs, i, maps[i], num_qubits[i],
+                                          &(*qsim_circuits)[i],
+                                          /*fused_circuit=*/nullptr));
+    }
+  };
+
+  const int num_cycles = 1000;
+  context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
+      programs.size(), num_cycles, construct_f);
+}
+
+// Rough cost of simulating one circuit: every two qubit gate does an SVD
+// on a (2 chi) x (2 chi) matrix.
+int64_t MpsCost(const int bond_dim, const int max_num_qubits) {
+  const int64_t chi = bond_dim;
+  return 200 * chi * chi * chi * std::max(max_num_qubits, 1);
+}
+
+}  // namespace
+
+class TfqSimulateMpsExpectationOp : public tensorflow::OpKernel {
+ public:
+  explicit TfqSimulateMpsExpectationOp(
+      tensorflow::OpKernelConstruction* context)
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("bond_dim", &bond_dim_));
+    OP_REQUIRES(context, bond_dim_ > 0,
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "bond_dim must be positive. Got ", bond_dim_, ".")));
+  }
+
+  void Compute(tensorflow::OpKernelContext* context) override {
+    const int num_inputs = context->num_inputs();
+    OP_REQUIRES(context, num_inputs == 4,
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "Expected 4 inputs, got ", num_inputs, " inputs.")));
+
+    // Create the output Tensors.
+    const int output_dim_batch_size = context->input(0).dim_size(0);
+    const int output_dim_op_size = context->input(3).dim_size(1);
+    tensorflow::TensorShape output_shape;
+    output_shape.AddDim(output_dim_batch_size);
+    output_shape.AddDim(output_dim_op_size);
+
+    tensorflow::Tensor* output = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &output));
+    auto output_tensor = output->matrix<float>();
+
+    tensorflow::Tensor* errors = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(
+                       1, tensorflow::TensorShape({output_dim_batch_size}),
+                       &errors));
+    auto errors_tensor = errors->vec<float>();
+
+    // Parse program protos.
+    ProgramBatch programs(/*read_encoded_circuits=*/true);
+    std::vector<int> num_qubits;
+    std::vector<std::vector<PauliSum>> pauli_sums;
+    OP_REQUIRES_OK(context, GetProgramsAndNumQubits(context, &programs,
+                                                    &num_qubits, &pauli_sums));
+
+    std::vector<SymbolMap> maps;
+    OP_REQUIRES_OK(context, GetSymbolMaps(context, &maps));
+
+    OP_REQUIRES(context, pauli_sums.size() == programs.size(),
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "Number of circuits and PauliSums do not match. Got ",
+                    programs.size(), " circuits and ", pauli_sums.size(),
+                    " paulisums.")));
+
+    std::vector<QsimCircuit> qsim_circuits;
+    MpsCircuitsFromPrograms(context, programs, maps, num_qubits,
+                            &qsim_circuits);
+    if (!context->status().ok()) {
+      return;
+    }
+
+    int max_num_qubits = 0;
+    for (const int num : num_qubits) {
+      max_num_qubits = std::max(max_num_qubits, num);
+    }
+
+    auto DoWork = [&](int start, int end) {
+      for (int i = start; i < end; i++) {
+        // (#679) Just ignore empty program
+        if (num_qubits[i] == 0) {
+          for (int j = 0; j < pauli_sums[i].size(); j++) {
+            output_tensor(i, j) = -2.0;
+          }
+          errors_tensor(i) = 0.0;
+          continue;
+        }
+        MatrixProductState mps(num_qubits[i], bond_dim_);
+        SimulateMps(qsim_circuits[i], &mps);
+        for (int j = 0; j < pauli_sums[i].size(); j++) {
+          float exp_v = 0.0;
+          OP_REQUIRES_OK(context,
+                         ComputeExpectationMps(pauli_sums[i][j], mps, &exp_v));
+          output_tensor(i, j) = exp_v;
+        }
+        errors_tensor(i) = mps.TruncationError();
+      }
+    };
+
+    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
+        programs.size(), MpsCost(bond_dim_, max_num_qubits), DoWork);
+  }
+
+ private:
+  int bond_dim_;
+};
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqSimulateMpsExpectation").Device(tensorflow::DEVICE_CPU),
+    TfqSimulateMpsExpectationOp);
+
+REGISTER_OP("TfqSimulateMpsExpectation")
+    .Input("programs: string")
+    .Input("symbol_names: string")
+    .Input("symbol_values: float")
+    .Input("pauli_sums: string")
+    .Attr("allow_text_format: bool = true")
+    .Output("expectations: float")
+    .Output("truncation_errors: float")
+    .Attr("bond_dim: int = 16")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
+      tensorflow::shape_inference::ShapeHandle programs_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &programs_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_names_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &symbol_names_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_values_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &symbol_values_shape));
+
+      tensorflow::shape_inference::ShapeHandle pauli_sums_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 2, &pauli_sums_shape));
+
+      tensorflow::shape_inference::DimensionHandle output_rows =
+          c->Dim(programs_shape, 0);
+      tensorflow::shape_inference::DimensionHandle output_cols =
+          c->Dim(pauli_sums_shape, 1);
+      c->set_output(0, c->Matrix(output_rows, output_cols));
+      c->set_output(1, c->Vector(output_rows));
+
+      return tensorflow::Status::OK();
+    });
+
+class TfqSimulateMpsSamplesOp : public tensorflow::OpKernel {
+ public:
+  explicit TfqSimulateMpsSamplesOp(tensorflow::OpKernelConstruction* context)
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("bond_dim", &bond_dim_));
+    OP_REQUIRES(context, bond_dim_ > 0,
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "bond_dim must be positive. Got ", bond_dim_, ".")));
+  }
+
+  void Compute(tensorflow::OpKernelContext* context) override {
+    DCHECK_EQ(4, context->num_inputs());
+
+    // Parse to Program Proto and num_qubits.
+    ProgramBatch programs(/*read_encoded_circuits=*/true);
+    std::vector<int> num_qubits;
+    OP_REQUIRES_OK(context,
+                   GetProgramsAndNumQubits(context, &programs, &num_qubits));
+
+    // Parse symbol maps for parameter resolution in the circuits.
+    std::vector<SymbolMap> maps;
+    OP_REQUIRES_OK(context, GetSymbolMaps(context, &maps));
+    OP_REQUIRES(
+        context, maps.size() == programs.size(),
+        tensorflow::errors::InvalidArgument(absl::StrCat(
+            "Number of circuits and values do not match. Got ", programs.size(),
+            " circuits and ", maps.size(), " values.")));
+
+    int num_samples = 0;
+    OP_REQUIRES_OK(context, GetIndividualSample(context, &num_samples));
+
+    std::vector<QsimCircuit> qsim_circuits;
+    MpsCircuitsFromPrograms(context, programs, maps, num_qubits,
+                            &qsim_circuits);
+    if (!context->status().ok()) {
+      return;
+    }
+
+    int max_num_qubits = 0;
+    for (const int num : num_qubits) {
+      max_num_qubits = std::max(max_num_qubits, num);
+    }
+
+    const int output_dim_size = maps.size();
+    tensorflow::TensorShape output_shape;
+    output_shape.AddDim(output_dim_size);
+    output_shape.AddDim(num_samples);
+    output_shape.AddDim(max_num_qubits);
+
+    tensorflow::Tensor* output = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &output));
+    auto output_tensor = output->tensor<int8_t, 3>();
+
+    tensorflow::Tensor* errors = nullptr;
+    OP_REQUIRES_OK(
+        context, context->allocate_output(
+                     1, tensorflow::TensorShape({output_dim_size}), &errors));
+    auto errors_tensor = errors->vec<float>();
+
+    // Draw seeds up front so the worker threads do not share rand().
+    std::vector<int> seeds(programs.size());
+    for (int i = 0; i < programs.size(); i++) {
+      seeds[i] = rand() % 123456;
+    }
+
+    auto DoWork = [&](int start, int end) {
+      std::vector<std::vector<int8_t>> samples;
+      for (int i = start; i < end; i++) {
+        const int nq = num_qubits[i];
+        MatrixProductState mps(nq, bond_dim_);
+        SimulateMps(qsim_circuits[i], &mps);
+        std::mt19937 gen(seeds[i]);
+        mps.Sample(num_samples, &gen, &samples);
+
+        // Site k is qsim qubit nq - k - 1, padded on the left like the
+        // state vector samples op.
+        const int pad = max_num_qubits - nq;
+        for (int j = 0; j < num_samples; j++) {
+          for (int k = 0; k < pad; k++) {
+            output_tensor(i, j, k) = -2;
+          }
+          for (int k = 0; k < nq; k++) {
+            output_tensor(i, j, pad + k) = samples[j][k];
+          }
+        }
+        errors_tensor(i) = mps.TruncationError();
+      }
+    };
+
+    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
+        programs.size(), MpsCost(bond_dim_, max_num_qubits) * num_samples,
+        DoWork);
+  }
+
+ private:
+  int bond_dim_;
+};
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqSimulateMpsSamples").Device(tensorflow::DEVICE_CPU),
+    TfqSimulateMpsSamplesOp);
+
+REGISTER_OP("TfqSimulateMpsSamples")
+    .Input("programs: string")
+    .Input("symbol_names: string")
+    .Input("symbol_values: float")
+    .Input("num_samples: int32")
+    .Attr("allow_text_format: bool = true")
+    .Output("samples: int8")
+    .Output("truncation_errors: float")
+    .Attr("bond_dim: int = 16")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
+      tensorflow::shape_inference::ShapeHandle programs_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &programs_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_names_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &symbol_names_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_values_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &symbol_values_shape));
+
+      tensorflow::shape_inference::ShapeHandle num_samples_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 1, &num_samples_shape));
+
+      // [batch_size, n_samples, largest_n_qubits]
+      c->set_output(
+          0, c->MakeShape(
+                 {c->Dim(programs_shape, 0),
+                  tensorflow::shape_inference::InferenceContext::kUnknownDim,
+                  tensorflow::shape_inference::InferenceContext::kUnknownDim}));
+      c->set_output(1, c->Vector(c->Dim(programs_shape, 0)));
+
+      return tensorflow::Status::OK();
+    });
+
+class TfqSimulateMpsStateOp : public tensorflow::OpKernel {
+ public:
+  explicit TfqSimulateMpsStateOp(tensorflow::OpKernelConstruction* context)
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("bond_dim", &bond_dim_));
+    OP_REQUIRES(context, bond_dim_ > 0,
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "bond_dim must be positive. Got ", bond_dim_, ".")));
+  }
+
+  void Compute(tensorflow::OpKernelContext* context) override {
+    DCHECK_EQ(3, context->num_inputs());
+
+    // Parse to Program Proto and num_qubits.
+    ProgramBatch programs(/*read_encoded_circuits=*/true);
+    std::vector<int> num_qubits;
+    OP_REQUIRES_OK(context,
+                   GetProgramsAndNumQubits(context, &programs, &num_qubits));
+
+    // Parse symbol maps for parameter resolution in the circuits.
+    std::vector<SymbolMap> maps;
+    OP_REQUIRES_OK(context, GetSymbolMaps(context, &maps));
+    OP_REQUIRES(
+        context, maps.size() == programs.size(),
+        tensorflow::errors::InvalidArgument(absl::StrCat(
+            "Number of circuits and values do not match. Got ", programs.size(),
+            " circuits and ", maps.size(), " values.")));
+
+    std::vector<QsimCircuit> qsim_circuits;
+    MpsCircuitsFromPrograms(context, programs, maps, num_qubits,
+                            &qsim_circuits);
+    if (!context->status().ok()) {
+      return;
+    }
+
+    int max_num_qubits = 0;
+    for (const int num : num_qubits) {
+      max_num_qubits = std::max(max_num_qubits, num);
+    }
+
+    // The full wavefunction still has to fit in memory even if the MPS
+    // does not.
+    OP_REQUIRES(context, max_num_qubits < 30,
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "Cannot contract an MPS with ", max_num_qubits,
+                    " qubits into a wavefunction.")));
+
+    const int output_dim_size = maps.size();
+    tensorflow::TensorShape output_shape;
+    output_shape.AddDim(output_dim_size);
+    output_shape.AddDim(1 << max_num_qubits);
+
+    tensorflow::Tensor* output = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &output));
+    auto output_tensor = output->matrix<std::complex<float>>();
+
+    tensorflow::Tensor* errors = nullptr;
+    OP_REQUIRES_OK(
+        context, context->allocate_output(
+                     1, tensorflow::TensorShape({output_dim_size}), &errors));
+    auto errors_tensor = errors->vec<float>();
+
+    auto DoWork = [&](int start, int end) {
+      std::vector<std::complex<float>> wavefunction;
+      for (int i = start; i < end; i++) {
+        MatrixProductState mps(num_qubits[i], bond_dim_);
+        SimulateMps(qsim_circuits[i], &mps);
+        mps.GetWavefunction(&wavefunction);
+        for (uint64_t j = 0; j < wavefunction.size(); j++) {
+          output_tensor(i, j) = wavefunction[j];
+        }
+        for (uint64_t j = wavefunction.size();
+             j < (uint64_t(1) << max_num_qubits); j++) {
+          output_tensor(i, j) = std::complex<float>(-2, 0);
+        }
+        errors_tensor(i) = mps.TruncationError();
+      }
+    };
+
+    const int64_t num_cycles =
+        MpsCost(bond_dim_, max_num_qubits) +
+        200 * (int64_t(1) << static_cast<int64_t>(max_num_qubits));
+    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
+        programs.size(), num_cycles, DoWork);
+  }
+
+ private:
+  int bond_dim_;
+};
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqSimulateMpsState").Device(tensorflow::DEVICE_CPU),
+    TfqSimulateMpsStateOp);
+
+REGISTER_OP("TfqSimulateMpsState")
+    .Input("programs: string")
+    .Input("symbol_names: string")
+    .Input("symbol_values: float")
+    .Attr("allow_text_format: bool = true")
+    .Output("wavefunction: complex64")
+    .Output("truncation_errors: float")
+    .Attr("bond_dim: int = 16")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
+      tensorflow::shape_inference::ShapeHandle programs_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &programs_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_names_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &symbol_names_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_values_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &symbol_values_shape));
+
+      c->set_output(
+          0, c->MakeShape(
+                 {c->Dim(programs_shape, 0),
+                  tensorflow::shape_inference::InferenceContext::kUnknownDim}));
+      c->set_output(1, c->Vector(c->Dim(programs_shape, 0)));
+
+      return tensorflow::Status::OK();
+    });
+
+}  // namespace tfq
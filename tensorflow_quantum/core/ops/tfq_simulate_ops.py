@@ -13,13 +13,30 @@
 # limitations under the License.
 # ==============================================================================
 """Module to register python op gradient."""
+import uuid
+
+import cirq.google.api.v2 as v2
 import tensorflow as tf
 from tensorflow_quantum.core.ops.load_module import load_module
 
 SIM_OP_MODULE = load_module("_tfq_simulate_ops.so")
 
 
-def tfq_simulate_expectation(programs, symbol_names, symbol_values, pauli_sums):
+def _initial_states(initial_states):
+    """Converts an initial_states argument into the optional op input, where
+    an empty list means starting from |0...0>."""
+    if initial_states is None:
+        return []
+    return [tf.cast(initial_states, tf.complex64)]
+
+
+def tfq_simulate_expectation(programs,
+                             symbol_names,
+                             symbol_values,
+                             pauli_sums,
+                             *,
+                             light_cone=False,
+                             initial_states=None):
     """Calculate the expectation value of circuits wrt some operator(s)
 
     Args:
@@ -36,16 +53,208 @@ def tfq_simulate_expectation(programs, symbol_names, symbol_values, pauli_sums):
         pauli_sums: `tf.Tensor` of strings with shape [batch_size, n_ops]
             containing the string representation of the operators that will
             be used on all of the circuits in the expectation calculations.
+        light_cone: Python `bool`. If True, every term of `pauli_sums` is
+            measured by simulating only the gates in its backward light cone
+            on the qubits inside of that cone. Terms sharing a light cone
+            share a simulation. This is much faster for local operators on
+            shallow circuits. Ignored when `initial_states` is given.
+        initial_states: Optional `tf.Tensor` of complex64 with shape
+            [batch_size, 2 ** n_qubits] or [1, 2 ** n_qubits], where
+            n_qubits is the size of the largest circuit, holding the states
+            the circuits are applied to in the order that
+            `tfq_simulate_state` outputs them. Amplitudes past the qubits of
+            a smaller circuit must be zero. A single row is used for every
+            circuit. Defaults to starting from |0...0>.
     Returns:
         `tf.Tensor` with shape [batch_size, n_ops] that holds the
             expectation value for each circuit with each op applied to it
             (after resolving the corresponding parameters in).
     """
     return SIM_OP_MODULE.tfq_simulate_expectation(
+        programs,
+        symbol_names,
+        tf.cast(symbol_values, tf.float32),
+        pauli_sums,
+        _initial_states(initial_states),
+        light_cone=light_cone)
+
+
+def tfq_simulate_expectation_and_gradient(programs, symbol_names,
+                                          symbol_values, pauli_sums):
+    """Calculate expectation values along with their symbol gradients.
+
+    Same as `tfq_simulate_expectation`, but every circuit is also walked back
+    from its final state (adjoint differentiation) to get the derivative of
+    each expectation value with respect to every symbol. The programs are
+    parsed and simulated once for both outputs.
+
+    Args:
+        programs: `tf.Tensor` of strings with shape [batch_size] containing
+            the string representations of the circuits to be executed.
+        symbol_names: `tf.Tensor` of strings with shape [n_params], which
+            is used to specify the order in which the values in
+            `symbol_values` should be placed inside of the circuits in
+            `programs`.
+        symbol_values: `tf.Tensor` of real numbers with shape
+            [batch_size, n_params] specifying parameter values to resolve
+            into the circuits specificed by programs, following the ordering
+            dictated by `symbol_names`.
+        pauli_sums: `tf.Tensor` of strings with shape [batch_size, n_ops]
+            containing the string representation of the operators that will
+            be used on all of the circuits in the expectation calculations.
+    Returns:
+        A tuple of a `tf.Tensor` with shape [batch_size, n_ops] that holds
+            the expectation values and a `tf.Tensor` with shape
+            [batch_size, n_ops, n_params] where entry [i, j, k] is the
+            derivative of expectation [i, j] with respect to
+            `symbol_values[i, k]`.
+    """
+    return SIM_OP_MODULE.tfq_simulate_expectation_and_gradient(
         programs, symbol_names, tf.cast(symbol_values, tf.float32), pauli_sums)
 
 
-def tfq_simulate_state(programs, symbol_names, symbol_values):
+def tfq_simulate_linear_combination(programs, symbol_names, symbol_values,
+                                    pauli_sums, weights, perturbations):
+    """Linearly combine expectation values at perturbed symbol values.
+
+    Computes sum_k weights[k] * <O_j>(symbol_values + perturbations[k] e_s)
+    for every circuit, op j and symbol s, where e_s is the unit vector of
+    symbol s. Every program is parsed once and all perturbed circuits are
+    evaluated from it, instead of one tiled copy of the program per
+    perturbation and symbol.
+
+    Args:
+        programs: `tf.Tensor` of strings with shape [batch_size] containing
+            the string representations of the circuits to be executed.
+        symbol_names: `tf.Tensor` of strings with shape [n_params], which
+            is used to specify the order in which the values in
+            `symbol_values` should be placed inside of the circuits in
+            `programs`.
+        symbol_values: `tf.Tensor` of real numbers with shape
+            [batch_size, n_params] specifying parameter values to resolve
+            into the circuits specificed by programs, following the ordering
+            dictated by `symbol_names`.
+        pauli_sums: `tf.Tensor` of strings with shape [batch_size, n_ops]
+            containing the string representation of the operators that will
+            be used on all of the circuits in the expectation calculations.
+        weights: `tf.Tensor` of real numbers with shape [n_perturbations]
+            holding the coefficient of every perturbed evaluation.
+        perturbations: `tf.Tensor` of real numbers with shape
+            [n_perturbations] holding the shift of every evaluation.
+    Returns:
+        `tf.Tensor` with shape [batch_size, n_ops, n_params] holding the
+            linear combinations.
+    """
+    return SIM_OP_MODULE.tfq_simulate_linear_combination(
+        programs, symbol_names, tf.cast(symbol_values, tf.float32),
+        pauli_sums, tf.cast(weights, tf.float32),
+        tf.cast(perturbations, tf.float32))
+
+
+def tfq_simulate_qfim(programs,
+                      symbol_names,
+                      symbol_values,
+                      *,
+                      block_diagonal=False):
+    """Calculate the quantum Fisher information matrix of circuits.
+
+    Computes F[i, a, b] = 4 Re[<d_a psi|d_b psi> - <d_a psi|psi><psi|d_b psi>]
+    for the final state |psi> of every circuit, where d_a is the derivative
+    with respect to `symbol_values[i, a]`. F / 4 is the Fubini-Study metric
+    used by quantum natural gradient. The derivative states are swept
+    through the circuit in the C++ simulator, which costs O(n_params) passes
+    over the circuit instead of O(n_params ** 2) circuit simulations.
+
+    Args:
+        programs: `tf.Tensor` of strings with shape [batch_size] containing
+            the string representations of the circuits to be executed.
+        symbol_names: `tf.Tensor` of strings with shape [n_params], which
+            is used to specify the order in which the values in
+            `symbol_values` should be placed inside of the circuits in
+            `programs`.
+        symbol_values: `tf.Tensor` of real numbers with shape
+            [batch_size, n_params] specifying parameter values to resolve
+            into the circuits specificed by programs, following the ordering
+            dictated by `symbol_names`.
+        block_diagonal: Python `bool`. If True, only pairs of parameters of
+            the same gate contribute, which takes a single pass over the
+            circuit.
+    Returns:
+        `tf.Tensor` with shape [batch_size, n_params, n_params] holding the
+            quantum Fisher information matrix of each circuit.
+    """
+    return SIM_OP_MODULE.tfq_simulate_qfim(programs,
+                                           symbol_names,
+                                           tf.cast(symbol_values, tf.float32),
+                                           block_diagonal=block_diagonal)
+
+
+def tfq_simulate_stochastic_gradient(programs,
+                                     symbol_names,
+                                     symbol_values,
+                                     pauli_sums,
+                                     seed,
+                                     *,
+                                     stochastic_coordinate=True,
+                                     stochastic_generator=True,
+                                     stochastic_cost=True,
+                                     uniform_sampling=False):
+    """Sample an unbiased estimate of the gradient of expectation values.
+
+    For every circuit a random subset of the terms of
+    d<psi|O_j|psi>/d symbol is evaluated in the C++ simulator and weighted
+    by the inverse of its probability:
+
+    - `stochastic_coordinate` keeps a single symbol per circuit.
+    - `stochastic_generator` keeps a single gate per kept symbol.
+    - `stochastic_cost` keeps a single op per circuit.
+
+    Terms are picked with probability proportional to their size (the
+    norm of the gate derivative or the sum of |coefficients| of an op), or
+    uniformly if `uniform_sampling` is True. The same `seed` gives the same
+    estimate.
+
+    Args:
+        programs: `tf.Tensor` of strings with shape [batch_size] containing
+            the string representations of the circuits to be executed.
+        symbol_names: `tf.Tensor` of strings with shape [n_params], which
+            is used to specify the order in which the values in
+            `symbol_values` should be placed inside of the circuits in
+            `programs`.
+        symbol_values: `tf.Tensor` of real numbers with shape
+            [batch_size, n_params] specifying parameter values to resolve
+            into the circuits specificed by programs, following the ordering
+            dictated by `symbol_names`.
+        pauli_sums: `tf.Tensor` of strings with shape [batch_size, n_ops]
+            containing the string representation of the operators that will
+            be used on all of the circuits in the expectation calculations.
+        seed: Scalar `tf.Tensor` of int32 seeding the term sampling.
+        stochastic_coordinate: Python `bool`, sample the symbols.
+        stochastic_generator: Python `bool`, sample the gates of a symbol.
+        stochastic_cost: Python `bool`, sample the ops.
+        uniform_sampling: Python `bool`, sample uniformly instead of by
+            the size of the terms.
+    Returns:
+        `tf.Tensor` with shape [batch_size, n_ops, n_params] that holds the
+            sampled d<psi|O_j|psi>/d symbol.
+    """
+    return SIM_OP_MODULE.tfq_simulate_stochastic_gradient(
+        programs,
+        symbol_names,
+        tf.cast(symbol_values, tf.float32),
+        pauli_sums,
+        tf.cast(seed, tf.int32),
+        stochastic_coordinate=stochastic_coordinate,
+        stochastic_generator=stochastic_generator,
+        stochastic_cost=stochastic_cost,
+        uniform_sampling=uniform_sampling)
+
+
+def tfq_simulate_state(programs,
+                       symbol_names,
+                       symbol_values,
+                       *,
+                       initial_states=None):
     """Returns the state of the programs using the C++ wavefunction simulator.
 
     Simulate the final state of `programs` given `symbol_values` are placed
@@ -62,14 +271,102 @@ def tfq_simulate_state(programs, symbol_names, symbol_values):
             [batch_size, n_params] specifying parameter values to resolve
             into the circuits specificed by programs, following the ordering
             dictated by `symbol_names`.
+        initial_states: Optional `tf.Tensor` of complex64 with shape
+            [batch_size, 2 ** n_qubits] or [1, 2 ** n_qubits], where
+            n_qubits is the size of the largest circuit, holding the states
+            the circuits are applied to in the order that
+            `tfq_simulate_state` outputs them. Amplitudes past the qubits of
+            a smaller circuit must be zero. A single row is used for every
+            circuit. Defaults to starting from |0...0>.
     Returns:
         A `tf.Tensor` containing the final state of each circuit in `programs`.
     """
     return SIM_OP_MODULE.tfq_simulate_state(programs, symbol_names,
-                                            tf.cast(symbol_values, tf.float32))
+                                            tf.cast(symbol_values, tf.float32),
+                                            _initial_states(initial_states))
+
+
+def tfq_simulate_state_handle(programs, symbol_names, symbol_values):
+    """Simulate the final states of the programs and keep them in qsim.
+
+    Same as `tfq_simulate_state`, but the states are returned as opaque
+    `tf.variant` elements instead of amplitudes. Pass them to
+    `tfq_state_handle_expectation`, `tfq_state_handle_samples` and
+    `tfq_state_handle_overlap` to measure one simulation several times
+    without copying the amplitudes out. A state is freed with the last
+    tensor that refers to it.
+
+    Args:
+        programs: `tf.Tensor` of strings with shape [batch_size] containing
+            the string representations of the circuits to be executed.
+        symbol_names: `tf.Tensor` of strings with shape [n_params], which
+            is used to specify the order in which the values in
+            `symbol_values` should be placed inside of the circuits in
+            `programs`.
+        symbol_values: `tf.Tensor` of real numbers with shape
+            [batch_size, n_params] specifying parameter values to resolve
+            into the circuits specified by programs, following the ordering
+            dictated by `symbol_names`.
+    Returns:
+        A `tf.Tensor` of `tf.variant` with shape [batch_size] holding the
+        final state of each circuit in `programs`.
+    """
+    return SIM_OP_MODULE.tfq_simulate_state_handle(
+        programs, symbol_names, tf.cast(symbol_values, tf.float32))
+
 
+def tfq_state_handle_expectation(states, pauli_sums):
+    """Calculate expectation values of states from `tfq_simulate_state_handle`.
 
-def tfq_simulate_samples(programs, symbol_names, symbol_values, num_samples):
+    Args:
+        states: `tf.Tensor` of `tf.variant` with shape [batch_size] from
+            `tfq_simulate_state_handle`.
+        pauli_sums: `tf.Tensor` of strings with shape [batch_size, n_ops]
+            containing the string representation of the operators to
+            measure on each state.
+    Returns:
+        `tf.Tensor` with shape [batch_size, n_ops] holding the expectation
+        values.
+    """
+    return SIM_OP_MODULE.tfq_state_handle_expectation(states, pauli_sums)
+
+
+def tfq_state_handle_samples(states, num_samples):
+    """Sample bitstrings from states from `tfq_simulate_state_handle`.
+
+    Args:
+        states: `tf.Tensor` of `tf.variant` with shape [batch_size] from
+            `tfq_simulate_state_handle`.
+        num_samples: `tf.Tensor` with one element indicating the number of
+            samples to draw from each state.
+    Returns:
+        A `tf.Tensor` containing the samples taken from each state, padded
+        like the output of `tfq_simulate_samples`.
+    """
+    return SIM_OP_MODULE.tfq_state_handle_samples(states, num_samples)
+
+
+def tfq_state_handle_overlap(states, other_states):
+    """Calculate <states[i] | other_states[i]> for every i.
+
+    Args:
+        states: `tf.Tensor` of `tf.variant` with shape [batch_size] from
+            `tfq_simulate_state_handle`.
+        other_states: `tf.Tensor` of `tf.variant` with shape [batch_size]
+            holding states on the same qubits as `states`.
+    Returns:
+        `tf.Tensor` of complex numbers with shape [batch_size] holding the
+        overlaps.
+    """
+    return SIM_OP_MODULE.tfq_state_handle_overlap(states, other_states)
+
+
+def tfq_simulate_samples(programs,
+                         symbol_names,
+                         symbol_values,
+                         num_samples,
+                         *,
+                         initial_states=None):
     """Generate samples using the C++ wavefunction simulator.
 
     Simulate the final state of `programs` given `symbol_values` are placed
@@ -90,16 +387,29 @@ def tfq_simulate_samples(programs, symbol_names, symbol_values, num_samples):
             dictated by `symbol_names`.
         num_samples: `tf.Tensor` with one element indicating the number of
             samples to draw.
+        initial_states: Optional `tf.Tensor` of complex64 with shape
+            [batch_size, 2 ** n_qubits] or [1, 2 ** n_qubits], where
+            n_qubits is the size of the largest circuit, holding the states
+            the circuits are applied to in the order that
+            `tfq_simulate_state` outputs them. Amplitudes past the qubits of
+            a smaller circuit must be zero. A single row is used for every
+            circuit. Defaults to starting from |0...0>.
     Returns:
         A `tf.Tensor` containing the samples taken from each circuit in
         `programs`.
     """
     return SIM_OP_MODULE.tfq_simulate_samples(
-        programs, symbol_names, tf.cast(symbol_values, tf.float32), num_samples)
+        programs, symbol_names, tf.cast(symbol_values, tf.float32), num_samples,
+        _initial_states(initial_states))
 
 
-def tfq_simulate_sampled_expectation(programs, symbol_names, symbol_values,
-                                     pauli_sums, num_samples):
+def tfq_simulate_sampled_expectation(programs,
+                                     symbol_names,
+                                     symbol_values,
+                                     pauli_sums,
+                                     num_samples,
+                                     *,
+                                     initial_states=None):
     """Calculate the expectation value of circuits using samples.
 
     Simulate the final state of `programs` given `symbol_values` are placed
@@ -125,6 +435,13 @@ def tfq_simulate_sampled_expectation(programs, symbol_names, symbol_values,
             number of samples to draw in each term of `pauli_sums[i][j]`
             when estimating the expectation. Therefore, `num_samples` must
             have the same shape as `pauli_sums`.
+        initial_states: Optional `tf.Tensor` of complex64 with shape
+            [batch_size, 2 ** n_qubits] or [1, 2 ** n_qubits], where
+            n_qubits is the size of the largest circuit, holding the states
+            the circuits are applied to in the order that
+            `tfq_simulate_state` outputs them. Amplitudes past the qubits of
+            a smaller circuit must be zero. A single row is used for every
+            circuit. Defaults to starting from |0...0>.
     Returns:
         `tf.Tensor` with shape [batch_size, n_ops] that holds the
             expectation value for each circuit with each op applied to it
@@ -132,4 +449,241 @@ def tfq_simulate_sampled_expectation(programs, symbol_names, symbol_values,
     """
     return SIM_OP_MODULE.tfq_simulate_sampled_expectation(
         programs, symbol_names, tf.cast(symbol_values, tf.float32), pauli_sums,
-        tf.cast(num_samples, dtype=tf.int32))
+        tf.cast(num_samples, dtype=tf.int32), _initial_states(initial_states))
+
+
+def tfq_simulate_mps_expectation(programs,
+                                 symbol_names,
+                                 symbol_values,
+                                 pauli_sums,
+                                 *,
+                                 bond_dim=16):
+    """Calculate expectation values with the matrix product state simulator.
+
+    Same as `tfq_simulate_expectation`, but the circuits are simulated as
+    matrix product states whose bond dimension is capped at `bond_dim`.
+    This scales to many more qubits than the wavefunction simulator for
+    circuits that only create a small amount of entanglement.
+
+    Args:
+        programs: `tf.Tensor` of strings with shape [batch_size] containing
+            the string representations of the circuits to be executed.
+        symbol_names: `tf.Tensor` of strings with shape [n_params], which
+            is used to specify the order in which the values in
+            `symbol_values` should be placed inside of the circuits in
+            `programs`.
+        symbol_values: `tf.Tensor` of real numbers with shape
+            [batch_size, n_params] specifying parameter values to resolve
+            into the circuits specificed by programs, following the ordering
+            dictated by `symbol_names`.
+        pauli_sums: `tf.Tensor` of strings with shape [batch_size, n_ops]
+            containing the string representation of the operators that will
+            be used on all of the circuits in the expectation calculations.
+        bond_dim: Python `int`. The largest bond dimension kept after each
+            two qubit gate.
+    Returns:
+        A tuple of a `tf.Tensor` with shape [batch_size, n_ops] that holds
+            the expectation values and a `tf.Tensor` with shape [batch_size]
+            holding the total weight of the singular values discarded while
+            simulating each circuit. An error of zero means the result is
+            exact.
+    """
+    return SIM_OP_MODULE.tfq_simulate_mps_expectation(
+        programs,
+        symbol_names,
+        tf.cast(symbol_values, tf.float32),
+        pauli_sums,
+        bond_dim=bond_dim)
+
+
+def tfq_simulate_mps_state(programs,
+                           symbol_names,
+                           symbol_values,
+                           *,
+                           bond_dim=16):
+    """Returns the state of the programs using the matrix product state simulator.
+
+    Args:
+        programs: `tf.Tensor` of strings with shape [batch_size] containing
+            the string representations of the circuits to be executed.
+        symbol_names: `tf.Tensor` of strings with shape [n_params], which
+            is used to specify the order in which the values in
+            `symbol_values` should be placed inside of the circuits in
+            `programs`.
+        symbol_values: `tf.Tensor` of real numbers with shape
+            [batch_size, n_params] specifying parameter values to resolve
+            into the circuits specificed by programs, following the ordering
+            dictated by `symbol_names`.
+        bond_dim: Python `int`. The largest bond dimension kept after each
+            two qubit gate.
+    Returns:
+        A tuple of a `tf.Tensor` containing the final state of each circuit
+        in `programs` and a `tf.Tensor` with shape [batch_size] holding the
+        truncation error of each circuit.
+    """
+    return SIM_OP_MODULE.tfq_simulate_mps_state(programs,
+                                                symbol_names,
+                                                tf.cast(symbol_values,
+                                                        tf.float32),
+                                                bond_dim=bond_dim)
+
+
+def tfq_simulate_mps_samples(programs,
+                             symbol_names,
+                             symbol_values,
+                             num_samples,
+                             *,
+                             bond_dim=16):
+    """Generate samples using the matrix product state simulator.
+
+    Args:
+        programs: `tf.Tensor` of strings with shape [batch_size] containing
+            the string representations of the circuits to be executed.
+        symbol_names: `tf.Tensor` of strings with shape [n_params], which
+            is used to specify the order in which the values in
+            `symbol_values` should be placed inside of the circuits in
+            `programs`.
+        symbol_values: `tf.Tensor` of real numbers with shape
+            [batch_size, n_params] specifying parameter values to resolve
+            into the circuits specified by programs, following the ordering
+            dictated by `symbol_names`.
+        num_samples: `tf.Tensor` with one element indicating the number of
+            samples to draw.
+        bond_dim: Python `int`. The largest bond dimension kept after each
+            two qubit gate.
+    Returns:
+        A tuple of a `tf.Tensor` containing the samples taken from each
+        circuit in `programs` and a `tf.Tensor` with shape [batch_size]
+        holding the truncation error of each circuit.
+    """
+    return SIM_OP_MODULE.tfq_simulate_mps_samples(programs,
+                                                  symbol_names,
+                                                  tf.cast(symbol_values,
+                                                          tf.float32),
+                                                  num_samples,
+                                                  bond_dim=bond_dim)
+
+
+def tfq_quantum_state(qubits, shared_name=None):
+    """Create a state vector that persists between op calls.
+
+    The state starts out as |0...0> on `qubits` and is only changed by the
+    `tfq_quantum_state_*` ops, so a circuit that grows a few gates at a time
+    can be simulated by applying just the new gates. Amplitudes are ordered
+    like the output of `tfq_simulate_state` for a circuit acting on all of
+    `qubits`.
+
+    Args:
+        qubits: Python `list` of `cirq.GridQubit`s making up the register.
+            Every circuit and operator used with the state may only act on
+            these qubits.
+        shared_name: Optional Python `str`. States created with the same
+            name share the underlying state vector. Defaults to a new
+            unique name.
+    Returns:
+        A scalar resource `tf.Tensor` referring to the state. The state is
+        freed by `tfq_quantum_state_delete`.
+    """
+    if shared_name is None:
+        shared_name = 'tfq_quantum_state_' + uuid.uuid4().hex
+    handle = SIM_OP_MODULE.tfq_quantum_state_handle(shared_name=shared_name)
+    create = SIM_OP_MODULE.tfq_quantum_state_create(
+        handle, [v2.qubit_to_proto_id(q) for q in qubits])
+    with tf.control_dependencies([create]):
+        return tf.identity(handle)
+
+
+def tfq_quantum_state_apply(state, programs, symbol_names, symbol_values):
+    """Apply circuits to a state from `tfq_quantum_state`.
+
+    Args:
+        state: Resource `tf.Tensor` from `tfq_quantum_state`.
+        programs: `tf.Tensor` of strings with shape [batch_size] containing
+            the string representations of the circuits to apply, in order.
+        symbol_names: `tf.Tensor` of strings with shape [n_params], which
+            is used to specify the order in which the values in
+            `symbol_values` should be placed inside of the circuits in
+            `programs`.
+        symbol_values: `tf.Tensor` of real numbers with shape
+            [batch_size, n_params] specifying parameter values to resolve
+            into the circuits specified by programs, following the ordering
+            dictated by `symbol_names`.
+    Returns:
+        The op applying the circuits.
+    """
+    return SIM_OP_MODULE.tfq_quantum_state_apply(
+        state, programs, symbol_names, tf.cast(symbol_values, tf.float32))
+
+
+def tfq_quantum_state_expectation(state, pauli_sums):
+    """Calculate expectation values on a state from `tfq_quantum_state`.
+
+    Args:
+        state: Resource `tf.Tensor` from `tfq_quantum_state`.
+        pauli_sums: `tf.Tensor` of strings with shape [n_ops] containing the
+            string representation of the operators to measure.
+    Returns:
+        `tf.Tensor` with shape [n_ops] holding the expectation values.
+    """
+    return SIM_OP_MODULE.tfq_quantum_state_expectation(state, pauli_sums)
+
+
+def tfq_quantum_state_samples(state, num_samples):
+    """Sample bitstrings from a state from `tfq_quantum_state`.
+
+    Args:
+        state: Resource `tf.Tensor` from `tfq_quantum_state`.
+        num_samples: `tf.Tensor` with one element indicating the number of
+            samples to draw.
+    Returns:
+        `tf.Tensor` with shape [num_samples, n_qubits] holding the samples.
+    """
+    return SIM_OP_MODULE.tfq_quantum_state_samples(state, num_samples)
+
+
+def tfq_quantum_state_snapshot(state):
+    """Copy the amplitudes out of a state from `tfq_quantum_state`.
+
+    Args:
+        state: Resource `tf.Tensor` from `tfq_quantum_state`.
+    Returns:
+        `tf.Tensor` with shape [2 ** n_qubits] holding the amplitudes.
+    """
+    return SIM_OP_MODULE.tfq_quantum_state_snapshot(state)
+
+
+def tfq_quantum_state_restore(state, amplitudes):
+    """Overwrite a state from `tfq_quantum_state` with given amplitudes.
+
+    Args:
+        state: Resource `tf.Tensor` from `tfq_quantum_state`.
+        amplitudes: `tf.Tensor` of complex numbers with shape
+            [2 ** n_qubits], typically from `tfq_quantum_state_snapshot`.
+    Returns:
+        The op writing the amplitudes.
+    """
+    return SIM_OP_MODULE.tfq_quantum_state_restore(
+        state, tf.cast(amplitudes, tf.complex64))
+
+
+def tfq_quantum_state_reset(state):
+    """Set a state from `tfq_quantum_state` back to |0...0>.
+
+    Args:
+        state: Resource `tf.Tensor` from `tfq_quantum_state`.
+    Returns:
+        The op resetting the state.
+    """
+    return SIM_OP_MODULE.tfq_quantum_state_reset(state)
+
+
+def tfq_quantum_state_delete(state):
+    """Free a state from `tfq_quantum_state`.
+
+    Args:
+        state: Resource `tf.Tensor` from `tfq_quantum_state`.
+    Returns:
+        The op freeing the state.
+    """
+    return tf.raw_ops.DestroyResourceOp(resource=state,
+                                        ignore_lookup_error=True)
@@ -17,8 +17,11 @@ import numpy as np
 from absl.testing import parameterized
 import tensorflow as tf
 import cirq
+import sympy
+from google.protobuf import text_format
 
 from tensorflow_quantum.core.ops import tfq_simulate_ops
+from tensorflow_quantum.core.serialize import serializer
 from tensorflow_quantum.python import util
 
 
@@ -177,6 +180,286 @@ class SimulateExpectationTest(tf.test.TestCase):
             util.convert_to_tensor([[x] for x in pauli_sums]))
         self.assertDTypeEqual(res, np.float32)
 
+    def test_simulate_expectation_light_cone(self):
+        """Light cone pruning must match full state simulation."""
+        n_qubits = 6
+        batch_size = 5
+        symbol_names = ['alpha']
+        qubits = cirq.GridQubit.rect(1, n_qubits)
+        circuit_batch, resolver_batch = \
+            util.random_symbol_circuit_resolver_batch(
+                qubits, symbol_names, batch_size)
+
+        symbol_values_array = np.array(
+            [[resolver[symbol]
+              for symbol in symbol_names]
+             for resolver in resolver_batch])
+
+        pauli_sums = [
+            util.random_pauli_sums(qubits, 2, batch_size) for _ in range(3)
+        ]
+        pauli_sums = util.convert_to_tensor(list(zip(*pauli_sums)))
+        programs = util.convert_to_tensor(circuit_batch)
+
+        full = tfq_simulate_ops.tfq_simulate_expectation(
+            programs, symbol_names, symbol_values_array, pauli_sums)
+        pruned = tfq_simulate_ops.tfq_simulate_expectation(
+            programs,
+            symbol_names,
+            symbol_values_array,
+            pauli_sums,
+            light_cone=True)
+        self.assertAllClose(full, pruned, atol=1e-5)
+
+    def test_simulate_expectation_light_cone_empty(self):
+        """Light cone pruning pads empty programs with -2."""
+        qubits = cirq.GridQubit.rect(1, 2)
+        programs = util.convert_to_tensor(
+            [cirq.Circuit(),
+             cirq.Circuit(cirq.X(qubits[0]), cirq.H(qubits[1]))])
+        pauli_sums = util.convert_to_tensor(
+            [[cirq.Z(qubits[0]), cirq.X(qubits[1])]] * 2)
+        pruned = tfq_simulate_ops.tfq_simulate_expectation(programs, [],
+                                                           [[]] * 2,
+                                                           pauli_sums,
+                                                           light_cone=True)
+        self.assertAllClose(pruned, [[-2.0, -2.0], [-1.0, 1.0]], atol=1e-5)
+
+    def test_simulate_expectation_batched_rows(self):
+        """Rows sharing a circuit are simulated together and must match."""
+        n_qubits = 5
+        batch_size = 20
+        symbol_names = ['alpha', 'beta']
+        qubits = cirq.GridQubit.rect(1, n_qubits)
+        circuit = util.random_symbol_circuit(qubits, symbol_names)
+        symbol_values_array = np.random.uniform(
+            size=(batch_size, len(symbol_names))).astype(np.float32)
+        pauli_sums = util.random_pauli_sums(qubits, 3, 2)
+        programs = util.convert_to_tensor([circuit] * batch_size)
+        ops = util.convert_to_tensor([pauli_sums] * batch_size)
+
+        batched = tfq_simulate_ops.tfq_simulate_expectation(
+            programs, symbol_names, symbol_values_array, ops)
+        # A single row takes the unbatched path.
+        for i in range(batch_size):
+            single = tfq_simulate_ops.tfq_simulate_expectation(
+                programs[i:i + 1], symbol_names, symbol_values_array[i:i + 1],
+                ops[i:i + 1])
+            self.assertAllClose(batched[i:i + 1], single, atol=1e-5)
+
+    def test_simulate_expectation_and_gradient(self):
+        """Fused op must match the expectation op and finite differences."""
+        n_qubits = 5
+        batch_size = 4
+        symbol_names = ['alpha', 'beta']
+        qubits = cirq.GridQubit.rect(1, n_qubits)
+        circuit_batch, resolver_batch = \
+            util.random_symbol_circuit_resolver_batch(
+                qubits, symbol_names, batch_size)
+        symbol_values_array = np.array(
+            [[resolver[symbol]
+              for symbol in symbol_names]
+             for resolver in resolver_batch],
+            dtype=np.float32)
+        pauli_sums = [
+            util.random_pauli_sums(qubits, 2, batch_size) for _ in range(3)
+        ]
+        pauli_sums = util.convert_to_tensor(list(zip(*pauli_sums)))
+        programs = util.convert_to_tensor(circuit_batch)
+
+        expectations, gradients = \
+            tfq_simulate_ops.tfq_simulate_expectation_and_gradient(
+                programs, symbol_names, symbol_values_array, pauli_sums)
+        self.assertAllClose(
+            expectations,
+            tfq_simulate_ops.tfq_simulate_expectation(programs, symbol_names,
+                                                      symbol_values_array,
+                                                      pauli_sums),
+            atol=1e-5)
+        self.assertEqual(gradients.shape, (batch_size, 3, len(symbol_names)))
+
+        eps = 1e-2
+        for k in range(len(symbol_names)):
+            shift = np.zeros_like(symbol_values_array)
+            shift[:, k] = eps
+            plus = tfq_simulate_ops.tfq_simulate_expectation(
+                programs, symbol_names, symbol_values_array + shift,
+                pauli_sums)
+            minus = tfq_simulate_ops.tfq_simulate_expectation(
+                programs, symbol_names, symbol_values_array - shift,
+                pauli_sums)
+            self.assertAllClose(gradients[:, :, k], (plus - minus) / (2 * eps),
+                                atol=5e-2)
+
+
+
+
+class SimulateLinearCombinationTest(tf.test.TestCase):
+    """Tests tfq_simulate_linear_combination."""
+
+    def test_simulate_linear_combination(self):
+        """Must match expectations of explicitly perturbed symbols."""
+        n_qubits = 4
+        batch_size = 3
+        symbol_names = ['alpha', 'beta', 'gamma']
+        qubits = cirq.GridQubit.rect(1, n_qubits)
+        circuit_batch, resolver_batch = \
+            util.random_symbol_circuit_resolver_batch(
+                qubits, symbol_names[:2], batch_size)
+        # gamma is not used by any circuit.
+        symbol_values_array = np.array(
+            [[resolver[symbol]
+              for symbol in symbol_names[:2]] + [0.5]
+             for resolver in resolver_batch],
+            dtype=np.float32)
+        pauli_sums = [
+            util.random_pauli_sums(qubits, 2, batch_size) for _ in range(2)
+        ]
+        pauli_sums = util.convert_to_tensor(list(zip(*pauli_sums)))
+        programs = util.convert_to_tensor(circuit_batch)
+        weights = [-1.5, 2.0, 0.5, 1.0]
+        perturbations = [0.0, 0.1, -0.2, 0.3]
+
+        partials = tfq_simulate_ops.tfq_simulate_linear_combination(
+            programs, symbol_names, symbol_values_array, pauli_sums, weights,
+            perturbations)
+        self.assertEqual(partials.shape, (batch_size, 2, len(symbol_names)))
+
+        for k in range(len(symbol_names)):
+            expected = np.zeros((batch_size, 2))
+            for weight, perturbation in zip(weights, perturbations):
+                shift = np.zeros_like(symbol_values_array)
+                shift[:, k] = perturbation
+                expected += weight * tfq_simulate_ops.tfq_simulate_expectation(
+                    programs, symbol_names, symbol_values_array + shift,
+                    pauli_sums).numpy()
+            self.assertAllClose(partials[:, :, k], expected, atol=1e-4)
+
+class SimulateQfimTest(tf.test.TestCase):
+    """Tests tfq_simulate_qfim."""
+
+    def test_simulate_qfim(self):
+        """QFIM must match finite differences of the simulated state."""
+        qubits = cirq.GridQubit.rect(1, 2)
+        symbol_names = ['alpha', 'beta', 'gamma']
+        alpha, beta, gamma = (sympy.Symbol(name) for name in symbol_names)
+        circuit = cirq.Circuit(
+            cirq.H.on_each(*qubits),
+            cirq.Y(qubits[0])**alpha,
+            cirq.CNOT(*qubits),
+            cirq.X(qubits[1])**beta,
+            cirq.PhasedXPowGate(phase_exponent=gamma,
+                                exponent=beta).on(qubits[0]))
+        symbol_values_array = np.array([[0.3, -0.7, 0.45], [1.1, 0.2, -0.5]],
+                                       dtype=np.float32)
+        programs = util.convert_to_tensor([circuit] * 2)
+
+        qfim = tfq_simulate_ops.tfq_simulate_qfim(programs, symbol_names,
+                                                  symbol_values_array)
+        self.assertEqual(qfim.shape, (2, 3, 3))
+
+        eps = 1e-3
+        states = tfq_simulate_ops.tfq_simulate_state(
+            programs, symbol_names, symbol_values_array).numpy()
+        derivatives = []
+        for k in range(len(symbol_names)):
+            shift = np.zeros_like(symbol_values_array)
+            shift[:, k] = eps
+            plus = tfq_simulate_ops.tfq_simulate_state(
+                programs, symbol_names, symbol_values_array + shift).numpy()
+            minus = tfq_simulate_ops.tfq_simulate_state(
+                programs, symbol_names, symbol_values_array - shift).numpy()
+            derivatives.append((plus - minus) / (2 * eps))
+        derivatives = np.stack(derivatives, axis=1)
+        overlaps = np.einsum('bas,bcs->bac', derivatives.conj(), derivatives)
+        projections = np.einsum('bas,bs->ba', derivatives.conj(), states)
+        expected = 4 * np.real(overlaps - np.einsum(
+            'ba,bc->bac', projections, projections.conj()))
+        self.assertAllClose(qfim, expected, atol=5e-2)
+
+        # Every gate holds a single symbol except the PhasedXPowGate, so the
+        # block diagonal approximation keeps the diagonal and the
+        # (beta, gamma) pair that gate contributes.
+        block = tfq_simulate_ops.tfq_simulate_qfim(programs,
+                                                   symbol_names,
+                                                   symbol_values_array,
+                                                   block_diagonal=True)
+        self.assertAllClose(block, tf.transpose(block, [0, 2, 1]), atol=1e-5)
+        self.assertAllClose(block[:, 0, 1], [0.0, 0.0], atol=1e-5)
+        self.assertAllClose(block[:, 0, 2], [0.0, 0.0], atol=1e-5)
+
+    def test_simulate_qfim_empty(self):
+        """Empty circuits have no information about their symbols."""
+        qfim = tfq_simulate_ops.tfq_simulate_qfim(
+            util.convert_to_tensor([cirq.Circuit()]), ['alpha'], [[0.5]])
+        self.assertAllClose(qfim, [[[0.0]]])
+
+
+class SimulateStochasticGradientTest(tf.test.TestCase):
+    """Tests tfq_simulate_stochastic_gradient."""
+
+    def _inputs(self):
+        n_qubits = 4
+        batch_size = 3
+        symbol_names = ['alpha', 'beta']
+        qubits = cirq.GridQubit.rect(1, n_qubits)
+        circuit_batch, resolver_batch = \
+            util.random_symbol_circuit_resolver_batch(
+                qubits, symbol_names, batch_size)
+        symbol_values_array = np.array(
+            [[resolver[symbol]
+              for symbol in symbol_names]
+             for resolver in resolver_batch],
+            dtype=np.float32)
+        pauli_sums = [
+            util.random_pauli_sums(qubits, 2, batch_size) for _ in range(2)
+        ]
+        return (util.convert_to_tensor(circuit_batch), symbol_names,
+                symbol_values_array,
+                util.convert_to_tensor(list(zip(*pauli_sums))))
+
+    def test_simulate_stochastic_gradient_exact(self):
+        """Without sampling the estimate is the full gradient."""
+        programs, symbol_names, symbol_values_array, pauli_sums = \
+            self._inputs()
+        _, expected = tfq_simulate_ops.tfq_simulate_expectation_and_gradient(
+            programs, symbol_names, symbol_values_array, pauli_sums)
+        gradients = tfq_simulate_ops.tfq_simulate_stochastic_gradient(
+            programs,
+            symbol_names,
+            symbol_values_array,
+            pauli_sums,
+            0,
+            stochastic_coordinate=False,
+            stochastic_generator=False,
+            stochastic_cost=False)
+        self.assertAllClose(gradients, expected, atol=1e-3)
+
+    def test_simulate_stochastic_gradient_unbiased(self):
+        """Sampled estimates average to the full gradient."""
+        programs, symbol_names, symbol_values_array, pauli_sums = \
+            self._inputs()
+        _, expected = tfq_simulate_ops.tfq_simulate_expectation_and_gradient(
+            programs, symbol_names, symbol_values_array, pauli_sums)
+
+        first = tfq_simulate_ops.tfq_simulate_stochastic_gradient(
+            programs, symbol_names, symbol_values_array, pauli_sums, 7)
+        self.assertAllClose(
+            first,
+            tfq_simulate_ops.tfq_simulate_stochastic_gradient(
+                programs, symbol_names, symbol_values_array, pauli_sums, 7))
+
+        n_draws = 2000
+        total = np.zeros(expected.shape)
+        for seed in range(n_draws):
+            total += tfq_simulate_ops.tfq_simulate_stochastic_gradient(
+                programs,
+                symbol_names,
+                symbol_values_array,
+                pauli_sums,
+                seed,
+                uniform_sampling=bool(seed % 2)).numpy()
+        self.assertAllClose(total / n_draws, expected, atol=0.3)
 
 class SimulateStateTest(tf.test.TestCase, parameterized.TestCase):
     """Tests tfq_simulate_state."""
@@ -306,6 +589,113 @@ class SimulateStateTest(tf.test.TestCase, parameterized.TestCase):
         self.assertAllClose(tfq_results, manual_padded_results)
 
 
+class SimulateStateHandleTest(tf.test.TestCase):
+    """Tests tfq_simulate_state_handle and the ops consuming its states."""
+
+    def test_state_handle_matches_simulate_ops(self):
+        """Measuring a state handle matches the single shot ops."""
+        n_qubits = 4
+        batch_size = 5
+        symbol_names = ['alpha']
+        qubits = cirq.GridQubit.rect(1, n_qubits)
+        circuit_batch, resolver_batch = \
+            util.random_symbol_circuit_resolver_batch(
+                qubits, symbol_names, batch_size)
+        symbol_values_array = np.array(
+            [[resolver[symbol]
+              for symbol in symbol_names]
+             for resolver in resolver_batch])
+        programs = util.convert_to_tensor(circuit_batch)
+        pauli_sums = util.convert_to_tensor(
+            [[x] for x in util.random_pauli_sums(qubits, 3, batch_size)])
+
+        states = tfq_simulate_ops.tfq_simulate_state_handle(
+            programs, symbol_names, symbol_values_array)
+        self.assertEqual(states.shape, (batch_size,))
+
+        expected = tfq_simulate_ops.tfq_simulate_expectation(
+            programs, symbol_names, symbol_values_array, pauli_sums)
+        self.assertAllClose(
+            tfq_simulate_ops.tfq_state_handle_expectation(states, pauli_sums),
+            expected,
+            atol=1e-5)
+
+        wavefunctions = tfq_simulate_ops.tfq_simulate_state(
+            programs, symbol_names, symbol_values_array).numpy()
+        overlaps = tfq_simulate_ops.tfq_state_handle_overlap(states, states)
+        self.assertAllClose(overlaps, np.ones(batch_size), atol=1e-5)
+
+        samples = tfq_simulate_ops.tfq_state_handle_samples(states, [10])
+        expected_samples = tfq_simulate_ops.tfq_simulate_samples(
+            programs, symbol_names, symbol_values_array, [10])
+        self.assertEqual(samples.shape, expected_samples.shape)
+        # Every sampled bitstring must have nonzero weight in the state.
+        for i in range(batch_size):
+            for sample in samples.numpy()[i]:
+                bits = sample[sample != -2]
+                index = int(''.join(str(b) for b in bits) or '0', 2)
+                self.assertGreater(np.abs(wavefunctions[i][index]), 0)
+
+    def test_state_handle_overlap(self):
+        """Overlaps of different states on the same qubits."""
+        qubit = cirq.GridQubit(0, 0)
+        programs = util.convert_to_tensor([
+            cirq.Circuit(cirq.X(qubit)),
+            cirq.Circuit(cirq.H(qubit)),
+        ])
+        states = tfq_simulate_ops.tfq_simulate_state_handle(
+            programs, [], [[]] * 2)
+        other = tfq_simulate_ops.tfq_simulate_state_handle(
+            util.convert_to_tensor([cirq.Circuit(cirq.H(qubit))] * 2), [],
+            [[]] * 2)
+        self.assertAllClose(
+            tfq_simulate_ops.tfq_state_handle_overlap(states, other),
+            [np.sqrt(0.5), 1.0],
+            atol=1e-5)
+
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'not on the same qubits'):
+            tfq_simulate_ops.tfq_state_handle_overlap(
+                states,
+                tfq_simulate_ops.tfq_simulate_state_handle(
+                    util.convert_to_tensor([
+                        cirq.Circuit(cirq.X(cirq.GridQubit(1, 1))),
+                        cirq.Circuit(cirq.X(cirq.GridQubit(1, 1)))
+                    ]), [], [[]] * 2))
+
+    def test_state_handle_expectation_empty(self):
+        """Empty programs are padded with -2 like the other ops."""
+        qubit = cirq.GridQubit(0, 0)
+        states = tfq_simulate_ops.tfq_simulate_state_handle(
+            util.convert_to_tensor([cirq.Circuit(),
+                                    cirq.Circuit(cirq.X(qubit))]), [],
+            [[]] * 2)
+        pauli_sums = util.convert_to_tensor([[cirq.Z(qubit)]] * 2)
+        self.assertAllClose(
+            tfq_simulate_ops.tfq_state_handle_expectation(states, pauli_sums),
+            [[-2.0], [-1.0]],
+            atol=1e-5)
+
+    def test_state_handle_text_format_pauli_sums(self):
+        """Text format PauliSums parse unless allow_text_format is False."""
+        qubit = cirq.GridQubit(0, 0)
+        psum = cirq.PauliSum.from_pauli_strings([cirq.Z(qubit)])
+        text = text_format.MessageToString(
+            serializer.serialize_paulisum(psum))
+        states = tfq_simulate_ops.tfq_simulate_state_handle(
+            util.convert_to_tensor([cirq.Circuit(cirq.X(qubit))]), [], [[]])
+
+        self.assertAllClose(
+            tfq_simulate_ops.tfq_state_handle_expectation(states, [[text]]),
+            [[-1.0]])
+
+        module = tfq_simulate_ops.SIM_OP_MODULE
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'Unparseable proto'):
+            module.tfq_state_handle_expectation(states, [[text]],
+                                                allow_text_format=False)
+
+
 class SimulateSamplesTest(tf.test.TestCase, parameterized.TestCase):
     """Tests tfq_simulate_samples."""
 
@@ -618,6 +1008,313 @@ class SimulateSampledExpectationTest(tf.test.TestCase):
                 [[-1]] * batch_size)
 
 
+class SimulateMpsTest(tf.test.TestCase):
+    """Tests the matrix product state ops."""
+
+    def test_simulate_mps_matches_state_vector(self):
+        """With a large enough bond dimension the MPS ops are exact."""
+        n_qubits = 6
+        batch_size = 5
+        symbol_names = ['alpha']
+        qubits = cirq.GridQubit.rect(1, n_qubits)
+        circuit_batch, resolver_batch = \
+            util.random_symbol_circuit_resolver_batch(
+                qubits, symbol_names, batch_size)
+
+        symbol_values_array = np.array(
+            [[resolver[symbol]
+              for symbol in symbol_names]
+             for resolver in resolver_batch])
+
+        pauli_sums = util.random_pauli_sums(qubits, 3, batch_size)
+        pauli_sums = util.convert_to_tensor([[x] for x in pauli_sums])
+        programs = util.convert_to_tensor(circuit_batch)
+
+        exact = tfq_simulate_ops.tfq_simulate_expectation(
+            programs, symbol_names, symbol_values_array, pauli_sums)
+        mps, errors = tfq_simulate_ops.tfq_simulate_mps_expectation(
+            programs,
+            symbol_names,
+            symbol_values_array,
+            pauli_sums,
+            bond_dim=2**(n_qubits // 2))
+        self.assertAllClose(exact, mps, atol=1e-4)
+        self.assertAllClose(errors, np.zeros(batch_size), atol=1e-5)
+
+        exact_state = tfq_simulate_ops.tfq_simulate_state(
+            programs, symbol_names, symbol_values_array)
+        mps_state, _ = tfq_simulate_ops.tfq_simulate_mps_state(
+            programs,
+            symbol_names,
+            symbol_values_array,
+            bond_dim=2**(n_qubits // 2))
+        self.assertAllClose(exact_state, mps_state, atol=1e-4)
+
+    def test_simulate_mps_large_chain(self):
+        """A nearest neighbour chain beyond the state vector limit."""
+        qubits = cirq.GridQubit.rect(1, 60)
+        circuit = cirq.Circuit(cirq.H(qubits[0]))
+        for q0, q1 in zip(qubits, qubits[1:]):
+            circuit += cirq.CNOT(q0, q1)
+        programs = util.convert_to_tensor([circuit])
+        pauli_sums = util.convert_to_tensor(
+            [[cirq.Z(qubits[0]) * cirq.Z(qubits[-1])]])
+
+        expectations, errors = tfq_simulate_ops.tfq_simulate_mps_expectation(
+            programs, [], [[]], pauli_sums, bond_dim=2)
+        self.assertAllClose(expectations, [[1.0]], atol=1e-4)
+        self.assertAllClose(errors, [0.0], atol=1e-5)
+
+        samples, _ = tfq_simulate_ops.tfq_simulate_mps_samples(
+            programs, [], [[]], [100], bond_dim=2)
+        self.assertEqual(samples.shape, (1, 100, 60))
+        for sample in samples.numpy()[0]:
+            self.assertTrue(np.all(sample == sample[0]))
+
+    def test_simulate_mps_truncation(self):
+        """A bond dimension cap of one reports the discarded weight."""
+        qubits = cirq.GridQubit.rect(1, 2)
+        circuit = cirq.Circuit(cirq.H(qubits[0]), cirq.CNOT(*qubits))
+        programs = util.convert_to_tensor([circuit])
+        _, errors = tfq_simulate_ops.tfq_simulate_mps_state(programs, [],
+                                                            [[]],
+                                                            bond_dim=1)
+        self.assertAllClose(errors, [0.5], atol=1e-5)
+
+
+class QuantumStateTest(tf.test.TestCase):
+    """Tests the persistent quantum state ops."""
+
+    def test_quantum_state_incremental(self):
+        """Applying a circuit piece by piece matches simulating it whole."""
+        n_qubits = 4
+        symbol_names = ['alpha']
+        qubits = cirq.GridQubit.rect(1, n_qubits)
+        circuit_batch, resolver_batch = \
+            util.random_symbol_circuit_resolver_batch(
+                qubits, symbol_names, 3)
+        symbol_values_array = np.array(
+            [[resolver[symbol]
+              for symbol in symbol_names]
+             for resolver in resolver_batch])
+
+        state = tfq_simulate_ops.tfq_quantum_state(qubits)
+        full_circuit = cirq.Circuit()
+        for circuit, values in zip(circuit_batch, symbol_values_array):
+            tfq_simulate_ops.tfq_quantum_state_apply(
+                state, util.convert_to_tensor([circuit]), symbol_names,
+                [values])
+            full_circuit += cirq.resolve_parameters(
+                circuit, dict(zip(symbol_names, values)))
+
+            # Every circuit leaves all qubits in place so the states line up.
+            expected = tfq_simulate_ops.tfq_simulate_state(
+                util.convert_to_tensor(
+                    [full_circuit + cirq.Circuit(cirq.I.on_each(*qubits))]),
+                [], [[]])
+            self.assertAllClose(
+                tfq_simulate_ops.tfq_quantum_state_snapshot(state),
+                expected[0],
+                atol=1e-5)
+
+        pauli_sums = util.random_pauli_sums(qubits, 3, 2)
+        expected = tfq_simulate_ops.tfq_simulate_expectation(
+            util.convert_to_tensor(
+                [full_circuit + cirq.Circuit(cirq.I.on_each(*qubits))]), [],
+            [[]], util.convert_to_tensor([pauli_sums]))
+        self.assertAllClose(
+            tfq_simulate_ops.tfq_quantum_state_expectation(
+                state, util.convert_to_tensor(pauli_sums)),
+            expected[0],
+            atol=1e-5)
+
+        samples = tfq_simulate_ops.tfq_quantum_state_samples(state, [10])
+        self.assertEqual(samples.shape, (10, n_qubits))
+
+        tfq_simulate_ops.tfq_quantum_state_delete(state)
+
+    def test_quantum_state_text_format_pauli_sums(self):
+        """Text format PauliSums parse unless allow_text_format is False."""
+        qubit = cirq.GridQubit(0, 0)
+        psum = cirq.PauliSum.from_pauli_strings([cirq.Z(qubit)])
+        text = text_format.MessageToString(
+            serializer.serialize_paulisum(psum))
+
+        state = tfq_simulate_ops.tfq_quantum_state([qubit])
+        self.assertAllClose(
+            tfq_simulate_ops.tfq_quantum_state_expectation(state, [text]),
+            [1.0])
+
+        module = tfq_simulate_ops.SIM_OP_MODULE
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'Unparseable proto'):
+            module.tfq_quantum_state_expectation(state, [text],
+                                                 allow_text_format=False)
+
+        tfq_simulate_ops.tfq_quantum_state_delete(state)
+
+    def test_quantum_state_snapshot_restore_reset(self):
+        """Snapshots restore exactly and reset returns to all zeros."""
+        qubits = cirq.GridQubit.rect(1, 2)
+        state = tfq_simulate_ops.tfq_quantum_state(qubits)
+        tfq_simulate_ops.tfq_quantum_state_apply(
+            state, util.convert_to_tensor([cirq.Circuit(cirq.X(qubits[1]))]),
+            [], [[]])
+        snapshot = tfq_simulate_ops.tfq_quantum_state_snapshot(state)
+        self.assertAllClose(snapshot, [0, 1, 0, 0])
+        self.assertAllEqual(
+            tfq_simulate_ops.tfq_quantum_state_samples(state, [3]),
+            [[0, 1]] * 3)
+
+        tfq_simulate_ops.tfq_quantum_state_apply(
+            state, util.convert_to_tensor([cirq.Circuit(cirq.H(qubits[0]))]),
+            [], [[]])
+        tfq_simulate_ops.tfq_quantum_state_restore(state, snapshot)
+        self.assertAllClose(tfq_simulate_ops.tfq_quantum_state_snapshot(state),
+                            snapshot)
+
+        tfq_simulate_ops.tfq_quantum_state_reset(state)
+        self.assertAllClose(tfq_simulate_ops.tfq_quantum_state_snapshot(state),
+                            [1, 0, 0, 0])
+
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'must have 2 \\*\\* 2 amplitudes'):
+            tfq_simulate_ops.tfq_quantum_state_restore(state, [1, 0])
+
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'not found in the register'):
+            tfq_simulate_ops.tfq_quantum_state_apply(
+                state,
+                util.convert_to_tensor(
+                    [cirq.Circuit(cirq.X(cirq.GridQubit(5, 5)))]), [], [[]])
+
+        tfq_simulate_ops.tfq_quantum_state_delete(state)
+
+
+class InitialStatesTest(tf.test.TestCase):
+    """Tests starting the simulate ops from given states."""
+
+    def test_initial_states_match_whole_circuit(self):
+        """Starting from the state of a first circuit matches simulating
+        both circuits one after the other."""
+        n_qubits = 4
+        batch_size = 3
+        symbol_names = ['alpha']
+        qubits = cirq.GridQubit.rect(1, n_qubits)
+        # Every circuit acts on all qubits so the states line up.
+        pad = cirq.Circuit(cirq.I.on_each(*qubits))
+
+        def resolved_batch():
+            circuits, resolvers = util.random_symbol_circuit_resolver_batch(
+                qubits, symbol_names, batch_size)
+            return [
+                cirq.resolve_parameters(c, r) + pad
+                for c, r in zip(circuits, resolvers)
+            ]
+
+        first = resolved_batch()
+        second = resolved_batch()
+        no_values = [[]] * batch_size
+        whole = util.convert_to_tensor([a + b for a, b in zip(first, second)])
+        second = util.convert_to_tensor(second)
+        initial_states = tfq_simulate_ops.tfq_simulate_state(
+            util.convert_to_tensor(first), [], no_values)
+
+        self.assertAllClose(
+            tfq_simulate_ops.tfq_simulate_state(second, [],
+                                                no_values,
+                                                initial_states=initial_states),
+            tfq_simulate_ops.tfq_simulate_state(whole, [], no_values),
+            atol=1e-5)
+
+        pauli_sums = util.random_pauli_sums(qubits, 3, 2)
+        ops = util.convert_to_tensor([pauli_sums] * batch_size)
+        expected = tfq_simulate_ops.tfq_simulate_expectation(
+            whole, [], no_values, ops)
+        for light_cone in [False, True]:
+            self.assertAllClose(
+                tfq_simulate_ops.tfq_simulate_expectation(
+                    second, [],
+                    no_values,
+                    ops,
+                    light_cone=light_cone,
+                    initial_states=initial_states),
+                expected,
+                atol=1e-5)
+
+    def test_initial_states_broadcast(self):
+        """A single basis state row is shared by every circuit."""
+        batch_size = 3
+        qubits = cirq.GridQubit.rect(1, 3)
+        programs = util.convert_to_tensor(
+            [cirq.Circuit(cirq.I.on_each(*qubits))] * batch_size)
+        no_values = [[]] * batch_size
+        # |011>, qubits[0] is the most significant bit.
+        initial_states = np.zeros((1, 8), dtype=np.complex64)
+        initial_states[0, 3] = 1
+
+        samples = tfq_simulate_ops.tfq_simulate_samples(
+            programs, [], no_values, [5], initial_states=initial_states)
+        self.assertAllEqual(samples, [[[0, 1, 1]] * 5] * batch_size)
+
+        ops = util.convert_to_tensor([[
+            cirq.PauliSum.from_pauli_strings(cirq.Z(qubits[0])),
+            cirq.PauliSum.from_pauli_strings(cirq.Z(qubits[2]))
+        ]] * batch_size)
+        self.assertAllClose(
+            tfq_simulate_ops.tfq_simulate_sampled_expectation(
+                programs, [],
+                no_values,
+                ops, [[10, 10]] * batch_size,
+                initial_states=initial_states), [[1.0, -1.0]] * batch_size)
+
+    def test_initial_states_errors(self):
+        """Initial states must cover every circuit and all of its qubits."""
+        qubits = cirq.GridQubit.rect(1, 2)
+        programs = util.convert_to_tensor(
+            [cirq.Circuit(cirq.H.on_each(*qubits))] * 3)
+
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'must hold 2 \\*\\* 2 amplitudes'):
+            tfq_simulate_ops.tfq_simulate_state(programs, [], [[]] * 3,
+                                                initial_states=[[1, 0]])
+
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'must hold 2 \\*\\* 2 amplitudes'):
+            tfq_simulate_ops.tfq_simulate_state(
+                programs, [], [[]] * 3, initial_states=[[1] + [0] * 7])
+
+        two_rows = [[1, 0, 0, 0]] * 2
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    '1 row or one row per circuit'):
+            tfq_simulate_ops.tfq_simulate_state(programs, [], [[]] * 3,
+                                                initial_states=two_rows)
+
+    def test_initial_states_padding(self):
+        """Amplitudes past the qubits of a smaller circuit must be zero."""
+        qubits = cirq.GridQubit.rect(1, 2)
+        programs = util.convert_to_tensor([
+            cirq.Circuit(cirq.I(qubits[0])),
+            cirq.Circuit(cirq.I.on_each(*qubits))
+        ])
+        self.assertAllClose(
+            tfq_simulate_ops.tfq_simulate_state(
+                programs, [], [[]] * 2,
+                initial_states=[[0, 1, 0, 0], [0, 0, 0, 1]]),
+            [[0, 1, -2, -2], [0, 0, 0, 1]])
+
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'row 0 has a nonzero amplitude at index 2'):
+            tfq_simulate_ops.tfq_simulate_state(
+                programs, [], [[]] * 2,
+                initial_states=[[0, 0, 1, 0], [0, 0, 0, 1]])
+
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'row 0 has a nonzero amplitude at index 3'):
+            tfq_simulate_ops.tfq_simulate_state(programs, [], [[]] * 2,
+                                                initial_states=[[0, 0, 0, 1]])
+
+
 class InputTypesTest(tf.test.TestCase, parameterized.TestCase):
     """Tests that different inputs types work for all of the ops. """
 
@@ -663,6 +1360,49 @@ class InputTypesTest(tf.test.TestCase, parameterized.TestCase):
             circuits, symbol_names, symbol_values, pauli_sums, [[100]])
         self.assertDTypeEqual(result, np.float32)
 
+    def test_text_format_programs(self):
+        """Text format programs parse unless allow_text_format is False."""
+        qubit = cirq.GridQubit(0, 0)
+        circuit = cirq.Circuit(cirq.H(qubit))
+        text = text_format.MessageToString(
+            serializer.serialize_circuit(circuit))
+
+        expected = tfq_simulate_ops.tfq_simulate_state(
+            util.convert_to_tensor([circuit]), ['alpha'], [[0.0]])
+        result = tfq_simulate_ops.tfq_simulate_state([text], ['alpha'], [[0.0]])
+        self.assertAllClose(expected, result)
+
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'Unparseable proto'):
+            tfq_simulate_ops.SIM_OP_MODULE.tfq_simulate_state(
+                [text], ['alpha'], [[0.0]], allow_text_format=False)
+
+        # Binary programs are unaffected.
+        result = tfq_simulate_ops.SIM_OP_MODULE.tfq_simulate_state(
+            util.convert_to_tensor([circuit]), ['alpha'], [[0.0]],
+            allow_text_format=False)
+        self.assertAllClose(expected, result)
+
+    def test_text_format_pauli_sums(self):
+        """Text format PauliSums parse unless allow_text_format is False."""
+        qubit = cirq.GridQubit(0, 0)
+        circuit = util.convert_to_tensor([cirq.Circuit(cirq.H(qubit))])
+        psum = cirq.PauliSum.from_pauli_strings([cirq.X(qubit)])
+        text = text_format.MessageToString(
+            serializer.serialize_paulisum(psum))
+
+        expected, _ = tfq_simulate_ops.tfq_simulate_expectation_and_gradient(
+            circuit, ['alpha'], [[0.0]], util.convert_to_tensor([[psum]]))
+        result, _ = tfq_simulate_ops.tfq_simulate_expectation_and_gradient(
+            circuit, ['alpha'], [[0.0]], [[text]])
+        self.assertAllClose(expected, result)
+
+        module = tfq_simulate_ops.SIM_OP_MODULE
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'Unparseable proto'):
+            module.tfq_simulate_expectation_and_gradient(
+                circuit, ['alpha'], [[0.0]], [[text]], allow_text_format=False)
+
 
 if __name__ == "__main__":
     tf.test.main()
@@ -0,0 +1,432 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include <algorithm>
+#include <complex>
+#include <memory>
+#include <vector>
+
+#include "../qsim/lib/circuit.h"
+#include "../qsim/lib/gate_appl.h"
+#include "../qsim/lib/gates_cirq.h"
+#include "../qsim/lib/seqfor.h"
+#include "../qsim/lib/simmux.h"
+#include "cirq/google/api/v2/program.pb.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/framework/tensor_shape.h"
+#include "tensorflow/core/lib/core/error_codes.pb.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow_quantum/core/ops/parse_context.h"
+#include "tensorflow_quantum/core/src/adj_util.h"
+#include "tensorflow_quantum/core/src/util_qsim.h"
+
+namespace tfq {
+
+using ::cirq::google::api::v2::Program;
+using ::tensorflow::Status;
+
+typedef qsim::Cirq::GateCirq<float> QsimGate;
+typedef qsim::Circuit<QsimGate> QsimCircuit;
+
+// Computes the quantum Fisher information matrix
+//   F_ab = 4 Re[<d_a psi | d_b psi> - <d_a psi | psi><psi | d_b psi>]
+// of every circuit with respect to its symbols. |d_k psi> is the circuit
+// with generator gate k of CreateGradientCircuit in place of the gate it
+// differentiates. Every |d_l psi> is walked back through the circuit once
+// to meet all |d_k psi> with k < l, so a circuit with P parameterized gates
+// costs O(P) passes over its gates. With block_diagonal only pairs of
+// parameters of the same gate are kept and the cost is a single pass.
+class TfqSimulateQfimOp : public tensorflow::OpKernel {
+ public:
+  explicit TfqSimulateQfimOp(tensorflow::OpKernelConstruction* context)
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context,
+                   context->GetAttr("block_diagonal", &block_diagonal_));
+  }
+
+  void Compute(tensorflow::OpKernelContext* context) override {
+    const int num_inputs = context->num_inputs();
+    OP_REQUIRES(context, num_inputs == 3,
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "Expected 3 inputs, got ", num_inputs, " inputs.")));
+
+    // Create the output Tensor.
+    const int output_dim_batch_size = context->input(0).dim_size(0);
+    const int output_dim_symbol_size = context->input(1).dim_size(0);
+    tensorflow::TensorShape output_shape;
+    output_shape.AddDim(output_dim_batch_size);
+    output_shape.AddDim(output_dim_symbol_size);
+    output_shape.AddDim(output_dim_symbol_size);
+
+    tensorflow::Tensor* output = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &output));
+    auto output_tensor = output->tensor<float, 3>();
+    output_tensor.setZero();
+
+    // Parse program protos.
+    ProgramBatch programs(/*read_encoded_circuits=*/true);
+    std::vector<int> num_qubits;
+    OP_REQUIRES_OK(context,
+                   GetProgramsAndNumQubits(context, &programs, &num_qubits));
+
+    std::vector<SymbolMap> maps;
+    OP_REQUIRES_OK(context, GetSymbolMaps(context, &maps));
+
+    OP_REQUIRES(context, programs.size() == maps.size(),
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "Number of circuits and symbol_values do not match. Got ",
+                    programs.size(), " circuits and ", maps.size(),
+                    " symbol values.")));
+
+    // Construct qsim circuits along with the generator gates and the
+    // circuit pieces between them.
+    std::vector<QsimCircuit> qsim_circuits(programs.size(), QsimCircuit());
+    std::vector<std::vector<qsim::GateFused<QsimGate>>> fused_circuits(
+        programs.size(), std::vector<qsim::GateFused<QsimGate>>({}));
+    std::vector<std::vector<GateMetaData>> gate_meta(
+        programs.size(), std::vector<GateMetaData>({}));
+    std::vector<std::vector<std::vector<qsim::GateFused<QsimGate>>>>
+        partial_fused_circuits(
+            programs.size(),
+            std::vector<std::vector<qsim::GateFused<QsimGate>>>({}));
+    std::vector<std::vector<GradientOfGate>> gradient_gates(
+        programs.size(), std::vector<GradientOfGate>({}));
+
+    auto construct_f = [&](int start, int end) {
+      for (int i = start; i < end; i++) {
+        OP_REQUIRES_OK(context, QsimCircuitFromBatch(
+                                    programs, i, maps[i], num_qubits[i],
+                                    &qsim_circuits[i], &fused_circuits[i],
+                                    &gate_meta[i]));
+        CreateGradientCircuit(qsim_circuits[i], gate_meta[i],
+                              &partial_fused_circuits[i], &gradient_gates[i]);
+      }
+    };
+
+    const int num_cycles = 1000;
+    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
+        programs.size(), num_cycles, construct_f);
+
+    int max_num_qubits = 0;
+    for (const int num : num_qubits) {
+      max_num_qubits = std::max(max_num_qubits, num);
+    }
+
+    // Column of every symbol differentiated in each circuit.
+    int max_num_params = 1;
+    std::vector<std::vector<std::vector<int>>> symbol_columns(
+        programs.size());
+    for (int i = 0; i < programs.size(); i++) {
+      for (const GradientOfGate& grad : gradient_gates[i]) {
+        std::vector<int> columns;
+        for (const std::string& param : grad.params) {
+          // Missing symbols already fail QsimCircuitFromProgram.
+          const auto it = maps[i].find(param);
+          OP_REQUIRES(context, it != maps[i].end(),
+                      tensorflow::errors::InvalidArgument(absl::StrCat(
+                          "Could not find symbol in parameter map: ", param)));
+          columns.push_back(it->second.first);
+        }
+        max_num_params = std::max(max_num_params, int(columns.size()));
+        symbol_columns[i].push_back(columns);
+      }
+    }
+
+    if (max_num_qubits >= 26 || programs.size() == 1) {
+      ComputeLarge(num_qubits, max_num_params, qsim_circuits,
+                   partial_fused_circuits, gradient_gates, symbol_columns,
+                   context, &output_tensor);
+    } else {
+      ComputeSmall(num_qubits, max_num_qubits, max_num_params,
+                   qsim_circuits, partial_fused_circuits, gradient_gates,
+                   symbol_columns, context, &output_tensor);
+    }
+
+    RecordStatePoolUsage(type_string(), pool_);
+  }
+
+ private:
+  bool block_diagonal_;
+
+  // Holds |psi>, a copy of it walked back for the off diagonal blocks, a
+  // scratch state and one generator state per parameter of a gate.
+  template <typename StateT>
+  struct RowStates {
+    RowStates(StatePool* pool, const uint64_t state_size,
+              const int num_params)
+        : psi(pool, state_size),
+          before(pool, state_size),
+          scratch(pool, state_size) {
+      for (int p = 0; p < num_params; p++) {
+        chis.emplace_back(new PooledState<StateT>(pool, state_size));
+      }
+    }
+
+    PooledState<StateT> psi;
+    PooledState<StateT> before;
+    PooledState<StateT> scratch;
+    std::vector<std::unique_ptr<PooledState<StateT>>> chis;
+  };
+
+  // Writes the QFIM of circuit i to row i of output_tensor.
+  template <typename SimT, typename ForT, typename StateT>
+  void ComputeRow(
+      const int i, const int nq, const ForT& for_obj,
+      const QsimCircuit& circuit,
+      const std::vector<std::vector<qsim::GateFused<QsimGate>>>& partial_fuses,
+      const std::vector<GradientOfGate>& grad_gates,
+      const std::vector<std::vector<int>>& symbol_columns,
+      RowStates<StateT>* states,
+      tensorflow::TTypes<float, 3>::Tensor* output_tensor) {
+    typedef typename SimT::StateSpace StateSpace;
+    SimT sim = SimT(nq, for_obj);
+    StateSpace ss = StateSpace(nq, for_obj);
+    StateT& psi = states->psi.get();
+    StateT& before = states->before.get();
+    StateT& scratch = states->scratch.get();
+
+    const int num_symbols = output_tensor->dimension(1);
+    std::vector<double> metric(num_symbols * num_symbols, 0.0);
+    // Adds <d_k psi | d_l psi> = val to the entries of the symbols of k
+    // and l, both ways unless k and l are the same generator.
+    auto add_pair = [&](const int col_k, const int col_l, const double val,
+                        const bool same) {
+      metric[col_k * num_symbols + col_l] += val;
+      if (!same) {
+        metric[col_l * num_symbols + col_k] += val;
+      }
+    };
+
+    ss.SetStateZero(psi);
+    for (int k = 0; k < partial_fuses.size(); k++) {
+      for (const auto& fused_gate : partial_fuses[k]) {
+        qsim::ApplyFusedGate(sim, fused_gate, psi);
+      }
+      if (k < grad_gates.size()) {
+        qsim::ApplyGate(sim, circuit.gates[grad_gates[k].index], psi);
+      }
+    }
+
+    // <d_k psi | psi> for every generator, for the second term.
+    std::vector<std::vector<std::complex<double>>> overlaps(grad_gates.size());
+
+    for (int k = partial_fuses.size() - 1; k >= 0; k--) {
+      for (int l = partial_fuses[k].size() - 1; l >= 0; l--) {
+        ApplyFusedGateDagger(sim, partial_fuses[k][l], psi);
+      }
+      if (k == 0) {
+        break;
+      }
+
+      // psi is now the state right after gate g. Take it back to right
+      // before g and apply each generator instead. Since the rest of the
+      // circuit is unitary, inner products with |d_g psi> can be taken
+      // here.
+      const int g = k - 1;
+      const GradientOfGate& grad = grad_gates[g];
+      const QsimGate& gate = circuit.gates[grad.index];
+      ApplyGateDagger(sim, gate, psi);
+      ss.CopyState(psi, scratch);
+      qsim::ApplyGate(sim, gate, scratch);
+      const int num_params = grad.grad_gates.size();
+      for (int p = 0; p < num_params; p++) {
+        StateT& chi = states->chis[p]->get();
+        ss.CopyState(psi, chi);
+        qsim::ApplyGate(sim, grad.grad_gates[p], chi);
+        overlaps[g].push_back(ss.InnerProduct(chi, scratch));
+      }
+      for (int p = 0; p < num_params; p++) {
+        for (int q = p; q < num_params; q++) {
+          add_pair(symbol_columns[g][p], symbol_columns[g][q],
+                   ss.RealInnerProduct(states->chis[p]->get(),
+                                       states->chis[q]->get()),
+                   p == q);
+        }
+      }
+      if (block_diagonal_) {
+        continue;
+      }
+
+      // Undo g on every |chi_p> and walk them back next to a copy of psi.
+      // When they reach an earlier gate h, the generators of h applied to
+      // the copy give <d_h psi | d_g psi>.
+      for (int p = 0; p < num_params; p++) {
+        ApplyGateDagger(sim, gate, states->chis[p]->get());
+      }
+      ss.CopyState(psi, before);
+      for (int k2 = g; k2 >= 0; k2--) {
+        for (int l = partial_fuses[k2].size() - 1; l >= 0; l--) {
+          ApplyFusedGateDagger(sim, partial_fuses[k2][l], before);
+          for (int p = 0; p < num_params; p++) {
+            ApplyFusedGateDagger(sim, partial_fuses[k2][l],
+                                 states->chis[p]->get());
+          }
+        }
+        if (k2 == 0) {
+          break;
+        }
+        const int h = k2 - 1;
+        const QsimGate& gate_h = circuit.gates[grad_gates[h].index];
+        ApplyGateDagger(sim, gate_h, before);
+        for (int q = 0; q < grad_gates[h].grad_gates.size(); q++) {
+          ss.CopyState(before, scratch);
+          qsim::ApplyGate(sim, grad_gates[h].grad_gates[q], scratch);
+          for (int p = 0; p < num_params; p++) {
+            add_pair(symbol_columns[h][q], symbol_columns[g][p],
+                     ss.RealInnerProduct(scratch, states->chis[p]->get()),
+                     false);
+          }
+        }
+        for (int p = 0; p < num_params; p++) {
+          ApplyGateDagger(sim, gate_h, states->chis[p]->get());
+        }
+      }
+    }
+
+    // Subtract Re[<d_k psi | psi><psi | d_l psi>] for the same pairs.
+    for (int g = 0; g < grad_gates.size(); g++) {
+      for (int h = 0; h < grad_gates.size(); h++) {
+        if (block_diagonal_ && g != h) {
+          continue;
+        }
+        for (int p = 0; p < overlaps[g].size(); p++) {
+          for (int q = 0; q < overlaps[h].size(); q++) {
+            metric[symbol_columns[g][p] * num_symbols +
+                   symbol_columns[h][q]] -=
+                (overlaps[g][p] * std::conj(overlaps[h][q])).real();
+          }
+        }
+      }
+    }
+
+    for (int a = 0; a < num_symbols; a++) {
+      for (int b = 0; b < num_symbols; b++) {
+        (*output_tensor)(i, a, b) = 4.0 * metric[a * num_symbols + b];
+      }
+    }
+  }
+
+  void ComputeLarge(
+      const std::vector<int>& num_qubits, const int max_num_params,
+      const std::vector<QsimCircuit>& qsim_circuits,
+      const std::vector<std::vector<std::vector<qsim::GateFused<QsimGate>>>>&
+          partial_fused_circuits,
+      const std::vector<std::vector<GradientOfGate>>& gradient_gates,
+      const std::vector<std::vector<std::vector<int>>>& symbol_columns,
+      tensorflow::OpKernelContext* context,
+      tensorflow::TTypes<float, 3>::Tensor* output_tensor) {
+    // Instantiate qsim objects.
+    const int max_num_qubits =
+        *std::max_element(num_qubits.begin(), num_qubits.end());
+    const auto tfq_for = tfq::QsimFor(context, max_num_qubits);
+    using Simulator = qsim::Simulator<const tfq::QsimFor&>;
+    using State = Simulator::StateSpace::State;
+
+    RowStates<State> states(&pool_, StateRawSize(max_num_qubits),
+                            max_num_params);
+
+    // Simulate programs one by one. Parallelizing over wavefunctions
+    // we no longer parallelize over circuits.
+    for (int i = 0; i < qsim_circuits.size(); i++) {
+      // (#679) Just ignore empty program
+      if (num_qubits[i] == 0) {
+        continue;
+      }
+      ComputeRow<Simulator>(i, num_qubits[i], tfq_for, qsim_circuits[i],
+                            partial_fused_circuits[i], gradient_gates[i],
+                            symbol_columns[i], &states, output_tensor);
+    }
+  }
+
+  void ComputeSmall(
+      const std::vector<int>& num_qubits, const int max_num_qubits,
+      const int max_num_params, const std::vector<QsimCircuit>& qsim_circuits,
+      const std::vector<std::vector<std::vector<qsim::GateFused<QsimGate>>>>&
+          partial_fused_circuits,
+      const std::vector<std::vector<GradientOfGate>>& gradient_gates,
+      const std::vector<std::vector<std::vector<int>>>& symbol_columns,
+      tensorflow::OpKernelContext* context,
+      tensorflow::TTypes<float, 3>::Tensor* output_tensor) {
+    const auto tfq_for = qsim::SequentialFor(1);
+    using Simulator = qsim::Simulator<const qsim::SequentialFor&>;
+    using State = Simulator::StateSpace::State;
+
+    // Every generator walks back over the part of the circuit before it.
+    std::vector<int64_t> costs(qsim_circuits.size(), 0);
+    for (int i = 0; i < qsim_circuits.size(); i++) {
+      uint64_t num_gates = 0;
+      for (const auto& partial : partial_fused_circuits[i]) {
+        num_gates += partial.size();
+      }
+      const uint64_t num_walks =
+          block_diagonal_ ? 2 : 2 + gradient_gates[i].size();
+      costs[i] = CircuitCost(num_qubits[i], num_walks * num_gates, 0);
+    }
+
+    auto DoWork = [&](CostOrderedQueue* queue) {
+      RowStates<State> states(&pool_, StateRawSize(max_num_qubits),
+                              max_num_params);
+      int i;
+      while (queue->Next(&i)) {
+        // (#679) Just ignore empty program
+        if (num_qubits[i] == 0) {
+          continue;
+        }
+        ComputeRow<Simulator>(i, num_qubits[i], tfq_for, qsim_circuits[i],
+                              partial_fused_circuits[i], gradient_gates[i],
+                              symbol_columns[i], &states, output_tensor);
+      }
+    };
+
+    ParallelForByCost(context, costs, DoWork);
+  }
+
+  // State buffers reused across Compute calls.
+  StatePool pool_;
+};
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqSimulateQfim").Device(tensorflow::DEVICE_CPU),
+    TfqSimulateQfimOp);
+
+REGISTER_OP("TfqSimulateQfim")
+    .Input("programs: string")
+    .Input("symbol_names: string")
+    .Input("symbol_values: float")
+    .Attr("allow_text_format: bool = true")
+    .Output("qfim: float")
+    .Attr("block_diagonal: bool = false")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
+      tensorflow::shape_inference::ShapeHandle programs_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &programs_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_names_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &symbol_names_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_values_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &symbol_values_shape));
+
+      tensorflow::shape_inference::DimensionHandle output_rows =
+          c->Dim(programs_shape, 0);
+      tensorflow::shape_inference::DimensionHandle num_symbols =
+          c->Dim(symbol_names_shape, 0);
+      c->set_output(0, c->MakeShape({output_rows, num_symbols, num_symbols}));
+
+      return tensorflow::Status::OK();
+    });
+
+}  // namespace tfq
@@ -15,6 +15,7 @@ limitations under the License.
 
 #include <stdlib.h>
 
+#include <numeric>
 #include <string>
 
 #include "../qsim/lib/circuit.h"
@@ -29,7 +30,9 @@ limitations under the License.
 #include "tensorflow/core/lib/core/error_codes.pb.h"
 #include "tensorflow/core/lib/core/status.h"
 #include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow/core/platform/env.h"
 #include "tensorflow_quantum/core/ops/parse_context.h"
+#include "tensorflow_quantum/core/src/program_resolution.h"
 #include "tensorflow_quantum/core/src/circuit_parser_qsim.h"
 #include "tensorflow_quantum/core/src/util_qsim.h"
 
@@ -48,10 +51,11 @@ class TfqSimulateSamplesOp : public tensorflow::OpKernel {
 
   void Compute(tensorflow::OpKernelContext* context) override {
     // TODO (mbbrough): add more dimension checks for other inputs here.
-    DCHECK_EQ(4, context->num_inputs());
+    DCHECK_GE(context->num_inputs(), 4);
+    DCHECK_LE(context->num_inputs(), 5);
 
     // Parse to Program Proto and num_qubits.
-    std::vector<Program> programs;
+    ProgramBatch programs(/*read_encoded_circuits=*/true);
     std::vector<int> num_qubits;
     OP_REQUIRES_OK(context,
                    GetProgramsAndNumQubits(context, &programs, &num_qubits));
@@ -68,16 +72,38 @@ class TfqSimulateSamplesOp : public tensorflow::OpKernel {
     int num_samples = 0;
     OP_REQUIRES_OK(context, GetIndividualSample(context, &num_samples));
 
+    // Circuits start from the given states instead of |0...0> if any.
+    InitialStates initial_states;
+    OP_REQUIRES_OK(context,
+                   GetInitialStates(context, num_qubits, &initial_states));
+
     // Construct qsim circuits.
     std::vector<QsimCircuit> qsim_circuits(programs.size(), QsimCircuit());
     std::vector<std::vector<qsim::GateFused<QsimGate>>> fused_circuits(
         programs.size(), std::vector<qsim::GateFused<QsimGate>>({}));
+    std::vector<std::vector<QubitCluster>> clusters(programs.size());
 
+    // Move the busiest qubits onto the lowest state bits, sampled bits are
+    // put back in their original order on output. Given initial states fix
+    // the qubit order and may entangle any of the qubits, so neither
+    // placement nor clustering applies to them.
+    std::vector<std::vector<unsigned int>> placements(programs.size());
     auto construct_f = [&](int start, int end) {
       for (int i = start; i < end; i++) {
-        OP_REQUIRES_OK(context, QsimCircuitFromProgram(
-                                    programs[i], maps[i], num_qubits[i],
+        if (initial_states.empty()) {
+          OP_REQUIRES_OK(context,
+                         PlaceQubitsByActivity(&programs, i, num_qubits[i],
+                                               nullptr, &placements[i]));
+        } else {
+          placements[i].resize(num_qubits[i]);
+          std::iota(placements[i].begin(), placements[i].end(), 0);
+        }
+        OP_REQUIRES_OK(context, QsimCircuitFromBatch(
+                                    programs, i, maps[i], num_qubits[i],
                                     &qsim_circuits[i], &fused_circuits[i]));
+        if (initial_states.empty()) {
+          GetQubitClusters(qsim_circuits[i], &clusters[i]);
+        }
       }
     };
 
@@ -108,131 +134,158 @@ class TfqSimulateSamplesOp : public tensorflow::OpKernel {
     // e2s4 = 4 CPU, 16GB -> Can safely do 25 since Memory = 8GB
     // ...
     if (max_num_qubits >= 26 || programs.size() == 1) {
-      ComputeLarge(num_qubits, max_num_qubits, num_samples, fused_circuits,
+      ComputeLarge(num_qubits, max_num_qubits, num_samples, qsim_circuits,
+                   fused_circuits, clusters, placements, initial_states,
                    context, &output_tensor);
     } else {
-      ComputeSmall(num_qubits, max_num_qubits, num_samples, fused_circuits,
+      ComputeSmall(num_qubits, max_num_qubits, num_samples, qsim_circuits,
+                   fused_circuits, clusters, placements, initial_states,
                    context, &output_tensor);
     }
 
+    RecordStatePoolUsage(type_string(), pool_);
+
     programs.clear();
     num_qubits.clear();
     maps.clear();
     qsim_circuits.clear();
     fused_circuits.clear();
+    clusters.clear();
   }
 
  private:
   void ComputeLarge(
       const std::vector<int>& num_qubits, const int max_num_qubits,
-      const int num_samples,
+      const int num_samples, const std::vector<QsimCircuit>& qsim_circuits,
       const std::vector<std::vector<qsim::GateFused<QsimGate>>>& fused_circuits,
-      tensorflow::OpKernelContext* context,
+      const std::vector<std::vector<QubitCluster>>& clusters,
+      const std::vector<std::vector<unsigned int>>& placements,
+      const InitialStates& initial_states, tensorflow::OpKernelContext* context,
       tensorflow::TTypes<int8_t, 3>::Tensor* output_tensor) {
     // Instantiate qsim objects.
-    const auto tfq_for = tfq::QsimFor(context);
+    const auto tfq_for = tfq::QsimFor(context, max_num_qubits);
     using Simulator = qsim::Simulator<const tfq::QsimFor&>;
     using StateSpace = Simulator::StateSpace;
     using State = StateSpace::State;
 
-    // Begin simulation.
-    int largest_nq = 1;
-    State sv = StateSpace(largest_nq, tfq_for).CreateState();
+    // Begin simulation. State buffers come from the kernel's pool and are
+    // sized for the largest circuit up front.
+    const uint64_t state_size = StateRawSize(max_num_qubits);
+    PooledState<State> pooled_sv(&pool_, state_size);
+    State& sv = pooled_sv.get();
 
     // Simulate programs one by one. Parallelizing over wavefunctions
-    // we no longer parallelize over circuits. Each time we encounter a
-    // a larger circuit we will grow the Statevector as nescessary.
+    // we no longer parallelize over circuits.
     for (int i = 0; i < fused_circuits.size(); i++) {
       int nq = num_qubits[i];
-      Simulator sim = Simulator(nq, tfq_for);
-      StateSpace ss = StateSpace(nq, tfq_for);
-      if (nq > largest_nq) {
-        // need to switch to larger statespace.
-        largest_nq = nq;
-        sv = ss.CreateState();
-      }
-      ss.SetStateZero(sv);
-      for (int j = 0; j < fused_circuits[i].size(); j++) {
-        qsim::ApplyFusedGate(sim, fused_circuits[i][j], sv);
-      }
-
-      auto samples = ss.Sample(sv, num_samples, rand() % 123456);
-      for (int j = 0; j < num_samples; j++) {
-        uint64_t q_ind = 0;
-        uint64_t mask = 1;
-        bool val = 0;
-        while (q_ind < nq) {
-          val = samples[j] & mask;
-          (*output_tensor)(
-              i, j, static_cast<ptrdiff_t>(max_num_qubits - q_ind - 1)) = val;
-          q_ind++;
-          mask <<= 1;
-        }
-        while (q_ind < max_num_qubits) {
-          (*output_tensor)(
-              i, j, static_cast<ptrdiff_t>(max_num_qubits - q_ind - 1)) = -2;
-          q_ind++;
+      std::vector<uint64_t> samples;
+      if (clusters[i].size() > 1) {
+        // Circuit is a product of unentangled clusters, sample each
+        // cluster from its own smaller state instead.
+        SampleClusteredQsim<Simulator>(qsim_circuits[i], clusters[i],
+                                       num_samples, rand() % 123456, tfq_for,
+                                       &samples);
+      } else {
+        Simulator sim = Simulator(nq, tfq_for);
+        StateSpace ss = StateSpace(nq, tfq_for);
+        if (initial_states.empty()) {
+          ss.SetStateZero(sv);
+        } else {
+          LoadAmplitudesQsim(tfq_for, nq, initial_states.row(i), sv.get());
         }
+        const uint64_t start_micros = tensorflow::Env::Default()->NowMicros();
+        const uint64_t num_sweeps =
+            ApplyFusedCircuitBlocked(fused_circuits[i], nq, sim, tfq_for, sv);
+        RecordStateBandwidth(
+            nq, num_sweeps,
+            tensorflow::Env::Default()->NowMicros() - start_micros);
+
+        samples = ss.Sample(sv, num_samples, rand() % 123456);
       }
+      WriteSamples(i, nq, max_num_qubits, placements[i], samples,
+                   output_tensor);
     }
-    sv.release();
   }
 
   void ComputeSmall(
       const std::vector<int>& num_qubits, const int max_num_qubits,
-      const int num_samples,
+      const int num_samples, const std::vector<QsimCircuit>& qsim_circuits,
       const std::vector<std::vector<qsim::GateFused<QsimGate>>>& fused_circuits,
-      tensorflow::OpKernelContext* context,
+      const std::vector<std::vector<QubitCluster>>& clusters,
+      const std::vector<std::vector<unsigned int>>& placements,
+      const InitialStates& initial_states, tensorflow::OpKernelContext* context,
       tensorflow::TTypes<int8_t, 3>::Tensor* output_tensor) {
     const auto tfq_for = qsim::SequentialFor(1);
     using Simulator = qsim::Simulator<const qsim::SequentialFor&>;
     using StateSpace = Simulator::StateSpace;
     using State = StateSpace::State;
 
-    auto DoWork = [&](int start, int end) {
-      int largest_nq = 1;
-      State sv = StateSpace(largest_nq, tfq_for).CreateState();
-      for (int i = start; i < end; i++) {
-        int nq = num_qubits[i];
-        Simulator sim = Simulator(nq, tfq_for);
-        StateSpace ss = StateSpace(nq, tfq_for);
-        if (nq > largest_nq) {
-          // need to switch to larger statespace.
-          largest_nq = nq;
-          sv = ss.CreateState();
-        }
-        ss.SetStateZero(sv);
-        for (int j = 0; j < fused_circuits[i].size(); j++) {
-          qsim::ApplyFusedGate(sim, fused_circuits[i][j], sv);
-        }
+    // Work is handed out one circuit at a time, most expensive first, so
+    // a few large circuits in a mixed batch do not leave threads idle.
+    std::vector<int64_t> costs(fused_circuits.size());
+    for (int i = 0; i < fused_circuits.size(); i++) {
+      costs[i] = CircuitCost(num_qubits[i], fused_circuits[i].size(), 0);
+    }
 
-        auto samples = ss.Sample(sv, num_samples, rand() % 123456);
-        for (int j = 0; j < num_samples; j++) {
-          uint64_t q_ind = 0;
-          uint64_t mask = 1;
-          bool val = 0;
-          while (q_ind < nq) {
-            val = samples[j] & mask;
-            (*output_tensor)(
-                i, j, static_cast<ptrdiff_t>(max_num_qubits - q_ind - 1)) = val;
-            q_ind++;
-            mask <<= 1;
+    auto DoWork = [&](CostOrderedQueue* queue) {
+      const uint64_t state_size = StateRawSize(max_num_qubits);
+      PooledState<State> pooled_sv(&pool_, state_size);
+      State& sv = pooled_sv.get();
+      int i;
+      while (queue->Next(&i)) {
+        int nq = num_qubits[i];
+        std::vector<uint64_t> samples;
+        if (clusters[i].size() > 1) {
+          // Product of unentangled clusters, sample each one separately.
+          SampleClusteredQsim<Simulator>(qsim_circuits[i], clusters[i],
+                                         num_samples, rand() % 123456,
+                                         tfq_for, &samples);
+        } else {
+          Simulator sim = Simulator(nq, tfq_for);
+          StateSpace ss = StateSpace(nq, tfq_for);
+          if (initial_states.empty()) {
+            ss.SetStateZero(sv);
+          } else {
+            LoadAmplitudesQsim(tfq_for, nq, initial_states.row(i), sv.get());
           }
-          while (q_ind < max_num_qubits) {
-            (*output_tensor)(
-                i, j, static_cast<ptrdiff_t>(max_num_qubits - q_ind - 1)) = -2;
-            q_ind++;
+          for (int j = 0; j < fused_circuits[i].size(); j++) {
+            qsim::ApplyFusedGate(sim, fused_circuits[i][j], sv);
           }
+
+          samples = ss.Sample(sv, num_samples, rand() % 123456);
         }
+        WriteSamples(i, nq, max_num_qubits, placements[i], samples,
+                     output_tensor);
       }
-      sv.release();
     };
 
-    const int64_t num_cycles =
-        200 * (int64_t(1) << static_cast<int64_t>(max_num_qubits));
-    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
-        fused_circuits.size(), num_cycles, DoWork);
+    ParallelForByCost(context, costs, DoWork);
   }
+
+  // Writes the samples of circuit i to its rows of the output. Bit b of a
+  // sample belongs to the qubit placed at id nq - b - 1, whose original id
+  // k goes to column k after the padding.
+  void WriteSamples(const int i, const int nq, const int max_num_qubits,
+                    const std::vector<unsigned int>& placement,
+                    const std::vector<uint64_t>& samples,
+                    tensorflow::TTypes<int8_t, 3>::Tensor* output_tensor) {
+    const int padding = max_num_qubits - nq;
+    std::vector<ptrdiff_t> columns(nq);
+    for (int k = 0; k < nq; k++) {
+      columns[nq - placement[k] - 1] = padding + k;
+    }
+    for (int j = 0; j < samples.size(); j++) {
+      for (int b = 0; b < nq; b++) {
+        (*output_tensor)(i, j, columns[b]) = (samples[j] >> b) & 1;
+      }
+      for (int k = 0; k < padding; k++) {
+        (*output_tensor)(i, j, static_cast<ptrdiff_t>(k)) = -2;
+      }
+    }
+  }
+
+  // State buffers reused across Compute calls.
+  StatePool pool_;
 };
 
 REGISTER_KERNEL_BUILDER(
@@ -244,6 +297,9 @@ REGISTER_OP("TfqSimulateSamples")
     .Input("symbol_names: string")
     .Input("symbol_values: float")
     .Input("num_samples: int32")
+    .Input("initial_states: Tinit")
+    .Attr("allow_text_format: bool = true")
+    .Attr("Tinit: list({complex64}) >= 0 = []")
     .Output("samples: int8")
     .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
       tensorflow::shape_inference::ShapeHandle programs_shape;
@@ -258,6 +314,14 @@ REGISTER_OP("TfqSimulateSamples")
       tensorflow::shape_inference::ShapeHandle num_samples_shape;
       TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 1, &num_samples_shape));
 
+      std::vector<tensorflow::shape_inference::ShapeHandle>
+          initial_states_shapes;
+      TF_RETURN_IF_ERROR(c->input("initial_states", &initial_states_shapes));
+      for (const auto& shape : initial_states_shapes) {
+        tensorflow::shape_inference::ShapeHandle initial_states_shape;
+        TF_RETURN_IF_ERROR(c->WithRank(shape, 2, &initial_states_shape));
+      }
+
       // [batch_size, n_samples, largest_n_qubits]
       c->set_output(
           0, c->MakeShape(
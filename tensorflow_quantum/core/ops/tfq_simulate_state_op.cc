@@ -27,6 +27,7 @@ limitations under the License.
 #include "tensorflow/core/lib/core/error_codes.pb.h"
 #include "tensorflow/core/lib/core/status.h"
 #include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow/core/platform/env.h"
 #include "tensorflow_quantum/core/ops/parse_context.h"
 #include "tensorflow_quantum/core/src/circuit_parser_qsim.h"
 #include "tensorflow_quantum/core/src/util_qsim.h"
@@ -46,10 +47,11 @@ class TfqSimulateStateOp : public tensorflow::OpKernel {
 
   void Compute(tensorflow::OpKernelContext* context) override {
     // TODO (mbbrough): add more dimension checks for other inputs here.
-    DCHECK_EQ(3, context->num_inputs());
+    DCHECK_GE(context->num_inputs(), 3);
+    DCHECK_LE(context->num_inputs(), 4);
 
     // Parse to Program Proto and num_qubits.
-    std::vector<Program> programs;
+    ProgramBatch programs(/*read_encoded_circuits=*/true);
     std::vector<int> num_qubits;
     OP_REQUIRES_OK(context,
                    GetProgramsAndNumQubits(context, &programs, &num_qubits));
@@ -63,6 +65,11 @@ class TfqSimulateStateOp : public tensorflow::OpKernel {
             "Number of circuits and values do not match. Got ", programs.size(),
             " circuits and ", maps.size(), " values.")));
 
+    // Circuits start from the given states instead of |0...0> if any.
+    InitialStates initial_states;
+    OP_REQUIRES_OK(context,
+                   GetInitialStates(context, num_qubits, &initial_states));
+
     // Construct qsim circuits.
     std::vector<QsimCircuit> qsim_circuits(programs.size(), QsimCircuit());
     std::vector<std::vector<qsim::GateFused<QsimGate>>> fused_circuits(
@@ -70,8 +77,8 @@ class TfqSimulateStateOp : public tensorflow::OpKernel {
 
     auto construct_f = [&](int start, int end) {
       for (int i = start; i < end; i++) {
-        OP_REQUIRES_OK(context, QsimCircuitFromProgram(
-                                    programs[i], maps[i], num_qubits[i],
+        OP_REQUIRES_OK(context, QsimCircuitFromBatch(
+                                    programs, i, maps[i], num_qubits[i],
                                     &qsim_circuits[i], &fused_circuits[i]));
       }
     };
@@ -103,13 +110,15 @@ class TfqSimulateStateOp : public tensorflow::OpKernel {
     // e2s4 = 4 CPU, 16GB -> Can safely do 25 since Memory = 8GB
     // ...
     if (max_num_qubits >= 26 || programs.size() == 1) {
-      ComputeLarge(num_qubits, max_num_qubits, fused_circuits, context,
-                   &output_tensor);
+      ComputeLarge(num_qubits, max_num_qubits, fused_circuits, initial_states,
+                   context, &output_tensor);
     } else {
-      ComputeSmall(num_qubits, max_num_qubits, fused_circuits, context,
-                   &output_tensor);
+      ComputeSmall(num_qubits, max_num_qubits, fused_circuits, initial_states,
+                   context, &output_tensor);
     }
 
+    RecordStatePoolUsage(type_string(), pool_);
+
     programs.clear();
     num_qubits.clear();
     maps.clear();
@@ -121,34 +130,44 @@ class TfqSimulateStateOp : public tensorflow::OpKernel {
   void ComputeLarge(
       const std::vector<int>& num_qubits, const int max_num_qubits,
       const std::vector<std::vector<qsim::GateFused<QsimGate>>>& fused_circuits,
-      tensorflow::OpKernelContext* context,
+      const InitialStates& initial_states, tensorflow::OpKernelContext* context,
       tensorflow::TTypes<std::complex<float>, 1>::Matrix* output_tensor) {
     // Instantiate qsim objects.
-    const auto tfq_for = tfq::QsimFor(context);
+    const auto tfq_for = tfq::QsimFor(context, max_num_qubits);
     using Simulator = qsim::Simulator<const tfq::QsimFor&>;
     using StateSpace = Simulator::StateSpace;
     using State = StateSpace::State;
 
-    // Begin simulation.
-    int largest_nq = 1;
-    State sv = StateSpace(largest_nq, tfq_for).CreateState();
+    // Begin simulation. State buffers come from the kernel's pool and are
+    // sized for the largest circuit up front.
+    const uint64_t state_size = StateRawSize(max_num_qubits);
+    PooledState<State> pooled_sv(&pool_, state_size);
+    State& sv = pooled_sv.get();
 
     // Simulate programs one by one. Parallelizing over wavefunctions
-    // we no longer parallelize over circuits. Each time we encounter a
-    // a larger circuit we will grow the Statevector as nescessary.
+    // we no longer parallelize over circuits.
     for (int i = 0; i < fused_circuits.size(); i++) {
       int nq = num_qubits[i];
+      if (SmallSimulator::Supports(nq) && initial_states.empty()) {
+        // Not worth spreading over threads, see ComputeSmall. The
+        // specialized kernels always start from |0...0>.
+        SimulateSmallRow(i, nq, max_num_qubits, fused_circuits[i],
+                         output_tensor);
+        continue;
+      }
       Simulator sim = Simulator(nq, tfq_for);
       StateSpace ss = StateSpace(nq, tfq_for);
-      if (nq > largest_nq) {
-        // need to switch to larger statespace.
-        largest_nq = nq;
-        sv = ss.CreateState();
-      }
-      ss.SetStateZero(sv);
-      for (int j = 0; j < fused_circuits[i].size(); j++) {
-        qsim::ApplyFusedGate(sim, fused_circuits[i][j], sv);
+      if (initial_states.empty()) {
+        ss.SetStateZero(sv);
+      } else {
+        LoadAmplitudesQsim(tfq_for, nq, initial_states.row(i), sv.get());
       }
+      const uint64_t start_micros = tensorflow::Env::Default()->NowMicros();
+      const uint64_t num_sweeps =
+          ApplyFusedCircuitBlocked(fused_circuits[i], nq, sim, tfq_for, sv);
+      RecordStateBandwidth(
+          nq, num_sweeps,
+          tensorflow::Env::Default()->NowMicros() - start_micros);
 
       // Parallel copy state vector information from qsim into tensorflow
       // tensors.
@@ -170,32 +189,44 @@ class TfqSimulateStateOp : public tensorflow::OpKernel {
       context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
           uint64_t(1) << max_num_qubits, num_cycles_copy, copy_f);
     }
-    sv.release();
   }
 
   void ComputeSmall(
       const std::vector<int>& num_qubits, const int max_num_qubits,
       const std::vector<std::vector<qsim::GateFused<QsimGate>>>& fused_circuits,
-      tensorflow::OpKernelContext* context,
+      const InitialStates& initial_states, tensorflow::OpKernelContext* context,
       tensorflow::TTypes<std::complex<float>, 1>::Matrix* output_tensor) {
     const auto tfq_for = qsim::SequentialFor(1);
     using Simulator = qsim::Simulator<const qsim::SequentialFor&>;
     using StateSpace = Simulator::StateSpace;
     using State = StateSpace::State;
 
-    auto DoWork = [&](int start, int end) {
-      int largest_nq = 1;
-      State sv = StateSpace(largest_nq, tfq_for).CreateState();
-      for (int i = start; i < end; i++) {
+    // Work is handed out one circuit at a time, most expensive first, so
+    // a few large circuits in a mixed batch do not leave threads idle.
+    std::vector<int64_t> costs(fused_circuits.size());
+    for (int i = 0; i < fused_circuits.size(); i++) {
+      costs[i] = CircuitCost(num_qubits[i], fused_circuits[i].size(), 0);
+    }
+
+    auto DoWork = [&](CostOrderedQueue* queue) {
+      const uint64_t state_size = StateRawSize(max_num_qubits);
+      PooledState<State> pooled_sv(&pool_, state_size);
+      State& sv = pooled_sv.get();
+      int i;
+      while (queue->Next(&i)) {
         int nq = num_qubits[i];
+        if (SmallSimulator::Supports(nq) && initial_states.empty()) {
+          SimulateSmallRow(i, nq, max_num_qubits, fused_circuits[i],
+                           output_tensor);
+          continue;
+        }
         Simulator sim = Simulator(nq, tfq_for);
         StateSpace ss = StateSpace(nq, tfq_for);
-        if (nq > largest_nq) {
-          // need to switch to larger statespace.
-          largest_nq = nq;
-          sv = ss.CreateState();
+        if (initial_states.empty()) {
+          ss.SetStateZero(sv);
+        } else {
+          LoadAmplitudesQsim(tfq_for, nq, initial_states.row(i), sv.get());
         }
-        ss.SetStateZero(sv);
         for (int j = 0; j < fused_circuits[i].size(); j++) {
           qsim::ApplyFusedGate(sim, fused_circuits[i][j], sv);
         }
@@ -208,14 +239,27 @@ class TfqSimulateStateOp : public tensorflow::OpKernel {
           (*output_tensor)(i, j) = std::complex<float>(-2, 0);
         }
       }
-      sv.release();
     };
 
-    const int64_t num_cycles =
-        200 * (int64_t(1) << static_cast<int64_t>(max_num_qubits));
-    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
-        fused_circuits.size(), num_cycles, DoWork);
+    ParallelForByCost(context, costs, DoWork);
+  }
+
+  // Simulates a circuit small enough for the specialized kernels straight
+  // into row i of the output and pads the rest of the row.
+  void SimulateSmallRow(
+      const int i, const int nq, const int max_num_qubits,
+      const std::vector<qsim::GateFused<QsimGate>>& fused_circuit,
+      tensorflow::TTypes<std::complex<float>, 1>::Matrix* output_tensor) {
+    SimulateSmall(fused_circuit, SmallSimulator(nq),
+                  reinterpret_cast<float*>(&(*output_tensor)(i, 0)));
+    for (uint64_t j = (uint64_t(1) << nq);
+         j < (uint64_t(1) << max_num_qubits); j++) {
+      (*output_tensor)(i, j) = std::complex<float>(-2, 0);
+    }
   }
+
+  // State buffers reused across Compute calls.
+  StatePool pool_;
 };
 
 REGISTER_KERNEL_BUILDER(Name("TfqSimulateState").Device(tensorflow::DEVICE_CPU),
@@ -225,6 +269,9 @@ REGISTER_OP("TfqSimulateState")
     .Input("programs: string")
     .Input("symbol_names: string")
     .Input("symbol_values: float")
+    .Input("initial_states: Tinit")
+    .Attr("allow_text_format: bool = true")
+    .Attr("Tinit: list({complex64}) >= 0 = []")
     .Output("wavefunction: complex64")
     .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
       tensorflow::shape_inference::ShapeHandle programs_shape;
@@ -236,6 +283,14 @@ REGISTER_OP("TfqSimulateState")
       tensorflow::shape_inference::ShapeHandle symbol_values_shape;
       TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &symbol_values_shape));
 
+      std::vector<tensorflow::shape_inference::ShapeHandle>
+          initial_states_shapes;
+      TF_RETURN_IF_ERROR(c->input("initial_states", &initial_states_shapes));
+      for (const auto& shape : initial_states_shapes) {
+        tensorflow::shape_inference::ShapeHandle initial_states_shape;
+        TF_RETURN_IF_ERROR(c->WithRank(shape, 2, &initial_states_shape));
+      }
+
       c->set_output(
           0, c->MakeShape(
                  {c->Dim(programs_shape, 0),
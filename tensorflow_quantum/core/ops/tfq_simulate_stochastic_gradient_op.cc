@@ -0,0 +1,568 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "../qsim/lib/circuit.h"
+#include "../qsim/lib/gate_appl.h"
+#include "../qsim/lib/gates_cirq.h"
+#include "../qsim/lib/seqfor.h"
+#include "../qsim/lib/simmux.h"
+#include "cirq/google/api/v2/program.pb.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/framework/tensor_shape.h"
+#include "tensorflow/core/lib/core/error_codes.pb.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow_quantum/core/ops/parse_context.h"
+#include "tensorflow_quantum/core/proto/pauli_sum.pb.h"
+#include "tensorflow_quantum/core/src/adj_util.h"
+#include "tensorflow_quantum/core/src/program_resolution.h"
+#include "tensorflow_quantum/core/src/util_qsim.h"
+
+namespace tfq {
+
+using ::cirq::google::api::v2::Program;
+using ::tensorflow::Status;
+using ::tfq::proto::PauliSum;
+
+typedef qsim::Cirq::GateCirq<float> QsimGate;
+typedef qsim::Circuit<QsimGate> QsimCircuit;
+
+// Computes an unbiased, sampled estimate of d<psi|O_j|psi>/d symbol for
+// every circuit. Each row draws its own subset of shift terms:
+//  - stochastic_coordinate picks one symbol per circuit.
+//  - stochastic_generator picks one of the gates that use a symbol.
+//  - stochastic_cost picks one of the ops.
+// Every choice is weighted by the inverse of its probability. The
+// probabilities follow the size of the terms, which is the norm of their
+// derivative gate for gates and the sum of |coefficients| for ops, or are
+// uniform with uniform_sampling. Gates are shifted in memory from the
+// parsed GateMetaData, so no shifted programs are ever serialized.
+class TfqSimulateStochasticGradientOp : public tensorflow::OpKernel {
+ public:
+  explicit TfqSimulateStochasticGradientOp(
+      tensorflow::OpKernelConstruction* context)
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("stochastic_coordinate",
+                                             &stochastic_coordinate_));
+    OP_REQUIRES_OK(context, context->GetAttr("stochastic_generator",
+                                             &stochastic_generator_));
+    OP_REQUIRES_OK(context,
+                   context->GetAttr("stochastic_cost", &stochastic_cost_));
+    OP_REQUIRES_OK(context,
+                   context->GetAttr("uniform_sampling", &uniform_sampling_));
+  }
+
+  void Compute(tensorflow::OpKernelContext* context) override {
+    const int num_inputs = context->num_inputs();
+    OP_REQUIRES(context, num_inputs == 5,
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "Expected 5 inputs, got ", num_inputs, " inputs.")));
+
+    const tensorflow::Tensor& seed_input = context->input(4);
+    OP_REQUIRES(context,
+                tensorflow::TensorShapeUtils::IsScalar(seed_input.shape()),
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "seed must be a scalar. Got rank ", seed_input.dims(),
+                    ".")));
+    const int seed = seed_input.scalar<int>()();
+
+    // Create the output Tensor.
+    const int output_dim_batch_size = context->input(0).dim_size(0);
+    const int output_dim_op_size = context->input(3).dim_size(1);
+    const int output_dim_symbol_size = context->input(1).dim_size(0);
+    tensorflow::TensorShape output_shape;
+    output_shape.AddDim(output_dim_batch_size);
+    output_shape.AddDim(output_dim_op_size);
+    output_shape.AddDim(output_dim_symbol_size);
+
+    tensorflow::Tensor* output = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &output));
+    auto output_tensor = output->tensor<float, 3>();
+    output_tensor.setZero();
+
+    // Parse program protos.
+    ProgramBatch programs(/*read_encoded_circuits=*/true);
+    std::vector<int> num_qubits;
+    std::vector<std::vector<PauliSum>> pauli_sums;
+    OP_REQUIRES_OK(context, GetProgramsAndNumQubits(context, &programs,
+                                                    &num_qubits, &pauli_sums));
+
+    std::vector<SymbolMap> maps;
+    OP_REQUIRES_OK(context, GetSymbolMaps(context, &maps));
+
+    OP_REQUIRES(context, pauli_sums.size() == programs.size(),
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "Number of circuits and PauliSums do not match. Got ",
+                    programs.size(), " circuits and ", pauli_sums.size(),
+                    " paulisums.")));
+
+    // Construct qsim circuits along with the gates to differentiate and
+    // the circuit pieces between them.
+    std::vector<QsimCircuit> qsim_circuits(programs.size(), QsimCircuit());
+    std::vector<std::vector<qsim::GateFused<QsimGate>>> fused_circuits(
+        programs.size(), std::vector<qsim::GateFused<QsimGate>>({}));
+    std::vector<std::vector<GateMetaData>> gate_meta(
+        programs.size(), std::vector<GateMetaData>({}));
+    std::vector<std::vector<std::vector<qsim::GateFused<QsimGate>>>>
+        partial_fused_circuits(
+            programs.size(),
+            std::vector<std::vector<qsim::GateFused<QsimGate>>>({}));
+    std::vector<std::vector<GradientOfGate>> gradient_gates(
+        programs.size(), std::vector<GradientOfGate>({}));
+
+    auto construct_f = [&](int start, int end) {
+      std::vector<unsigned int> placement;
+      for (int i = start; i < end; i++) {
+        OP_REQUIRES_OK(context, PlaceQubitsByActivity(&programs, i,
+                                                      num_qubits[i],
+                                                      &pauli_sums[i],
+                                                      &placement));
+        OP_REQUIRES_OK(context, QsimCircuitFromBatch(
+                                    programs, i, maps[i], num_qubits[i],
+                                    &qsim_circuits[i], &fused_circuits[i],
+                                    &gate_meta[i]));
+        CreateGradientCircuit(qsim_circuits[i], gate_meta[i],
+                              &partial_fused_circuits[i], &gradient_gates[i]);
+      }
+    };
+
+    const int num_cycles = 1000;
+    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
+        programs.size(), num_cycles, construct_f);
+
+    int max_num_qubits = 0;
+    for (const int num : num_qubits) {
+      max_num_qubits = std::max(max_num_qubits, num);
+    }
+
+    // Draw the shift terms of every row up front. Each row has its own
+    // generator seeded from (seed, row) so the estimate does not depend on
+    // how rows are spread over threads.
+    std::vector<RowSample> samples(programs.size());
+    for (int i = 0; i < programs.size(); i++) {
+      std::vector<int> columns;
+      for (const GradientOfGate& grad : gradient_gates[i]) {
+        for (const std::string& param : grad.params) {
+          // Missing symbols already fail QsimCircuitFromProgram.
+          const auto it = maps[i].find(param);
+          OP_REQUIRES(context, it != maps[i].end(),
+                      tensorflow::errors::InvalidArgument(absl::StrCat(
+                          "Could not find symbol in parameter map: ", param)));
+          columns.push_back(it->second.first);
+        }
+      }
+      SampleRow(seed, i, output_dim_symbol_size, gradient_gates[i], columns,
+                pauli_sums[i], &samples[i]);
+    }
+
+    if (max_num_qubits >= 26 || programs.size() == 1) {
+      ComputeLarge(num_qubits, qsim_circuits, partial_fused_circuits,
+                   gradient_gates, samples, pauli_sums, context,
+                   &output_tensor);
+    } else {
+      ComputeSmall(num_qubits, max_num_qubits, qsim_circuits,
+                   partial_fused_circuits, gradient_gates, samples,
+                   pauli_sums, context, &output_tensor);
+    }
+
+    RecordStatePoolUsage(type_string(), pool_);
+  }
+
+ private:
+  // One sampled shift term: parameter `param` of gradient gate `gate`,
+  // which feeds symbol `column` and is weighted by `scale`.
+  struct SampledTerm {
+    int gate;
+    int param;
+    int column;
+    float scale;
+  };
+
+  // Shift terms and ops drawn for one row. terms are sorted by gate.
+  struct RowSample {
+    std::vector<SampledTerm> terms;
+    std::vector<int> ops;
+    std::vector<float> op_scales;
+  };
+
+  // Holds the forward state, the final state of the unshifted circuit,
+  // a scratch state and O_j applied to the final state for every op used.
+  template <typename StateT>
+  struct RowStates {
+    RowStates(StatePool* pool, const uint64_t state_size, const int num_ops)
+        : psi(pool, state_size),
+          final_state(pool, state_size),
+          scratch(pool, state_size) {
+      for (int j = 0; j < num_ops; j++) {
+        phis.emplace_back(new PooledState<StateT>(pool, state_size));
+      }
+    }
+
+    PooledState<StateT> psi;
+    PooledState<StateT> final_state;
+    PooledState<StateT> scratch;
+    std::vector<std::unique_ptr<PooledState<StateT>>> phis;
+  };
+
+  // Picks index k with probability weights[k] / sum(weights) and returns
+  // sum(weights) / weights[k] in scale.
+  static int SampleIndex(const std::vector<float>& weights,
+                         std::mt19937* gen, float* scale) {
+    const int index =
+        std::discrete_distribution<int>(weights.begin(), weights.end())(*gen);
+    float total = 0.0;
+    for (const float w : weights) {
+      total += w;
+    }
+    *scale = total / weights[index];
+    return index;
+  }
+
+  // Size of a term, used as its (unnormalized) sampling probability.
+  float TermWeight(const QsimGate& grad_gate) const {
+    if (uniform_sampling_) {
+      return 1.0;
+    }
+    float norm = 0.0;
+    for (const float v : grad_gate.matrix) {
+      norm += v * v;
+    }
+    return std::sqrt(norm);
+  }
+
+  float OpWeight(const PauliSum& p_sum) const {
+    if (uniform_sampling_) {
+      return 1.0;
+    }
+    float weight = 0.0;
+    for (const auto& term : p_sum.terms()) {
+      weight += std::fabs(term.coefficient_real());
+    }
+    return weight;
+  }
+
+  // Draws the shift terms and ops of row i. columns holds the symbol
+  // column of every parameter of grad_gates in order.
+  void SampleRow(const int seed, const int i, const int num_symbols,
+                 const std::vector<GradientOfGate>& grad_gates,
+                 const std::vector<int>& columns,
+                 const std::vector<PauliSum>& p_sums,
+                 RowSample* sample) const {
+    std::seed_seq seq{static_cast<uint32_t>(seed), static_cast<uint32_t>(i)};
+    std::mt19937 gen(seq);
+
+    // Group every (gate, param) term with a nonzero derivative by symbol.
+    std::vector<std::vector<SampledTerm>> by_column(num_symbols);
+    std::vector<std::vector<float>> term_weights(num_symbols);
+    int c = 0;
+    for (int k = 0; k < grad_gates.size(); k++) {
+      for (int p = 0; p < grad_gates[k].grad_gates.size(); p++, c++) {
+        const float weight = TermWeight(grad_gates[k].grad_gates[p]);
+        if (weight <= 0.0) {
+          continue;
+        }
+        by_column[columns[c]].push_back({k, p, columns[c], 1.0});
+        term_weights[columns[c]].push_back(weight);
+      }
+    }
+
+    std::vector<int> used_columns;
+    std::vector<float> column_weights;
+    for (int s = 0; s < num_symbols; s++) {
+      if (by_column[s].empty()) {
+        continue;
+      }
+      float weight = 0.0;
+      for (const float w : term_weights[s]) {
+        weight += w;
+      }
+      used_columns.push_back(s);
+      column_weights.push_back(weight);
+    }
+    if (used_columns.empty()) {
+      return;
+    }
+
+    std::vector<std::pair<int, float>> chosen_columns;
+    if (stochastic_coordinate_) {
+      float scale;
+      const int index = SampleIndex(column_weights, &gen, &scale);
+      chosen_columns.push_back({used_columns[index], scale});
+    } else {
+      for (const int s : used_columns) {
+        chosen_columns.push_back({s, 1.0});
+      }
+    }
+
+    for (const auto& chosen : chosen_columns) {
+      const std::vector<SampledTerm>& terms = by_column[chosen.first];
+      if (stochastic_generator_) {
+        float scale;
+        const int index =
+            SampleIndex(term_weights[chosen.first], &gen, &scale);
+        sample->terms.push_back(terms[index]);
+        sample->terms.back().scale = chosen.second * scale;
+      } else {
+        for (const SampledTerm& term : terms) {
+          sample->terms.push_back(term);
+          sample->terms.back().scale = chosen.second;
+        }
+      }
+    }
+    std::sort(sample->terms.begin(), sample->terms.end(),
+              [](const SampledTerm& a, const SampledTerm& b) {
+                return a.gate < b.gate ||
+                       (a.gate == b.gate && a.param < b.param);
+              });
+
+    std::vector<float> op_weights;
+    float total_op_weight = 0.0;
+    for (const PauliSum& p_sum : p_sums) {
+      op_weights.push_back(OpWeight(p_sum));
+      total_op_weight += op_weights.back();
+    }
+    if (!stochastic_cost_) {
+      for (int j = 0; j < p_sums.size(); j++) {
+        sample->ops.push_back(j);
+        sample->op_scales.push_back(1.0);
+      }
+    } else if (total_op_weight > 0.0) {
+      float scale;
+      sample->ops.push_back(SampleIndex(op_weights, &gen, &scale));
+      sample->op_scales.push_back(scale);
+    }
+  }
+
+  // Applies everything in the gradient circuit from partial_fuses[start].
+  template <typename SimT, typename StateT>
+  static void ApplyRest(
+      const SimT& sim, const QsimCircuit& circuit,
+      const std::vector<std::vector<qsim::GateFused<QsimGate>>>& partial_fuses,
+      const std::vector<GradientOfGate>& grad_gates, const int start,
+      StateT& state) {
+    for (int k = start; k < partial_fuses.size(); k++) {
+      for (const auto& fused_gate : partial_fuses[k]) {
+        qsim::ApplyFusedGate(sim, fused_gate, state);
+      }
+      if (k < grad_gates.size()) {
+        qsim::ApplyGate(sim, circuit.gates[grad_gates[k].index], state);
+      }
+    }
+  }
+
+  // Simulates circuit i once to get O_j|psi_final>, then again up to every
+  // sampled gate G. There dG|psi> is run through the rest of the circuit A
+  // to get the shift term 2 Re <psi_final|O_j A dG|psi>.
+  template <typename SimT, typename ForT, typename StateT>
+  Status ComputeRow(
+      const int i, const int nq, const ForT& for_obj,
+      const QsimCircuit& circuit,
+      const std::vector<std::vector<qsim::GateFused<QsimGate>>>& partial_fuses,
+      const std::vector<GradientOfGate>& grad_gates, const RowSample& sample,
+      const std::vector<PauliSum>& p_sums, RowStates<StateT>* states,
+      tensorflow::TTypes<float, 3>::Tensor* output_tensor) {
+    typedef typename SimT::StateSpace StateSpace;
+    SimT sim = SimT(nq, for_obj);
+    StateSpace ss = StateSpace(nq, for_obj);
+    StateT& psi = states->psi.get();
+    StateT& final_state = states->final_state.get();
+    StateT& scratch = states->scratch.get();
+
+    if (sample.terms.empty() || sample.ops.empty()) {
+      return Status::OK();
+    }
+
+    // The final state is the same for every sampled gate.
+    ss.SetStateZero(final_state);
+    ApplyRest(sim, circuit, partial_fuses, grad_gates, 0, final_state);
+    for (int o = 0; o < sample.ops.size(); o++) {
+      TF_RETURN_IF_ERROR(AccumulateOperators(
+          {p_sums[sample.ops[o]]}, {sample.op_scales[o]}, for_obj, ss,
+          final_state, states->phis[o]->get()));
+    }
+
+    int t = 0;
+    ss.SetStateZero(psi);
+    for (int k = 0; k < grad_gates.size() && t < sample.terms.size(); k++) {
+      for (const auto& fused_gate : partial_fuses[k]) {
+        qsim::ApplyFusedGate(sim, fused_gate, psi);
+      }
+      const QsimGate& gate = circuit.gates[grad_gates[k].index];
+      for (; t < sample.terms.size() && sample.terms[t].gate == k; t++) {
+        const SampledTerm& term = sample.terms[t];
+        ss.CopyState(psi, scratch);
+        qsim::ApplyGate(sim, grad_gates[k].grad_gates[term.param], scratch);
+        ApplyRest(sim, circuit, partial_fuses, grad_gates, k + 1, scratch);
+        for (int o = 0; o < sample.ops.size(); o++) {
+          (*output_tensor)(i, sample.ops[o], term.column) +=
+              2.0 * term.scale *
+              ss.RealInnerProduct(states->phis[o]->get(), scratch);
+        }
+      }
+      qsim::ApplyGate(sim, gate, psi);
+    }
+
+    return Status::OK();
+  }
+
+  void ComputeLarge(
+      const std::vector<int>& num_qubits,
+      const std::vector<QsimCircuit>& qsim_circuits,
+      const std::vector<std::vector<std::vector<qsim::GateFused<QsimGate>>>>&
+          partial_fused_circuits,
+      const std::vector<std::vector<GradientOfGate>>& gradient_gates,
+      const std::vector<RowSample>& samples,
+      const std::vector<std::vector<PauliSum>>& pauli_sums,
+      tensorflow::OpKernelContext* context,
+      tensorflow::TTypes<float, 3>::Tensor* output_tensor) {
+    // Instantiate qsim objects.
+    const int max_num_qubits =
+        *std::max_element(num_qubits.begin(), num_qubits.end());
+    const auto tfq_for = tfq::QsimFor(context, max_num_qubits);
+    using Simulator = qsim::Simulator<const tfq::QsimFor&>;
+    using State = Simulator::StateSpace::State;
+
+    const int num_ops = stochastic_cost_ ? 1 : context->input(3).dim_size(1);
+    RowStates<State> states(&pool_, StateRawSize(max_num_qubits), num_ops);
+
+    // Simulate programs one by one. Parallelizing over wavefunctions
+    // we no longer parallelize over circuits.
+    for (int i = 0; i < qsim_circuits.size(); i++) {
+      // (#679) Just ignore empty program
+      if (num_qubits[i] == 0 || samples[i].terms.empty() ||
+          samples[i].ops.empty()) {
+        continue;
+      }
+      OP_REQUIRES_OK(context, ComputeRow<Simulator>(
+                                  i, num_qubits[i], tfq_for, qsim_circuits[i],
+                                  partial_fused_circuits[i], gradient_gates[i],
+                                  samples[i], pauli_sums[i], &states,
+                                  output_tensor));
+    }
+  }
+
+  void ComputeSmall(
+      const std::vector<int>& num_qubits, const int max_num_qubits,
+      const std::vector<QsimCircuit>& qsim_circuits,
+      const std::vector<std::vector<std::vector<qsim::GateFused<QsimGate>>>>&
+          partial_fused_circuits,
+      const std::vector<std::vector<GradientOfGate>>& gradient_gates,
+      const std::vector<RowSample>& samples,
+      const std::vector<std::vector<PauliSum>>& pauli_sums,
+      tensorflow::OpKernelContext* context,
+      tensorflow::TTypes<float, 3>::Tensor* output_tensor) {
+    const auto tfq_for = qsim::SequentialFor(1);
+    using Simulator = qsim::Simulator<const qsim::SequentialFor&>;
+    using State = Simulator::StateSpace::State;
+
+    // Every sampled term runs two states through the rest of the circuit.
+    std::vector<int64_t> costs(qsim_circuits.size(), 0);
+    for (int i = 0; i < qsim_circuits.size(); i++) {
+      uint64_t num_gates = 0;
+      for (const auto& partial : partial_fused_circuits[i]) {
+        num_gates += partial.size();
+      }
+      uint64_t num_terms = 0;
+      for (const int j : samples[i].ops) {
+        num_terms += pauli_sums[i][j].terms_size();
+      }
+      costs[i] = CircuitCost(num_qubits[i],
+                             (1 + 2 * samples[i].terms.size()) * num_gates,
+                             num_terms);
+    }
+
+    const int num_ops = stochastic_cost_ ? 1 : context->input(3).dim_size(1);
+    auto DoWork = [&](CostOrderedQueue* queue) {
+      RowStates<State> states(&pool_, StateRawSize(max_num_qubits),
+                              num_ops);
+      int i;
+      while (queue->Next(&i)) {
+        // (#679) Just ignore empty program
+        if (num_qubits[i] == 0 || samples[i].terms.empty() ||
+            samples[i].ops.empty()) {
+          continue;
+        }
+        OP_REQUIRES_OK(context,
+                       ComputeRow<Simulator>(
+                           i, num_qubits[i], tfq_for, qsim_circuits[i],
+                           partial_fused_circuits[i], gradient_gates[i],
+                           samples[i], pauli_sums[i], &states, output_tensor));
+      }
+    };
+
+    ParallelForByCost(context, costs, DoWork);
+  }
+
+  bool stochastic_coordinate_;
+  bool stochastic_generator_;
+  bool stochastic_cost_;
+  bool uniform_sampling_;
+
+  // State buffers reused across Compute calls.
+  StatePool pool_;
+};
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqSimulateStochasticGradient").Device(tensorflow::DEVICE_CPU),
+    TfqSimulateStochasticGradientOp);
+
+REGISTER_OP("TfqSimulateStochasticGradient")
+    .Input("programs: string")
+    .Input("symbol_names: string")
+    .Input("symbol_values: float")
+    .Input("pauli_sums: string")
+    .Input("seed: int32")
+    .Attr("allow_text_format: bool = true")
+    .Output("gradients: float")
+    .Attr("stochastic_coordinate: bool = true")
+    .Attr("stochastic_generator: bool = true")
+    .Attr("stochastic_cost: bool = true")
+    .Attr("uniform_sampling: bool = false")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
+      tensorflow::shape_inference::ShapeHandle programs_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &programs_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_names_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &symbol_names_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_values_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &symbol_values_shape));
+
+      tensorflow::shape_inference::ShapeHandle pauli_sums_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 2, &pauli_sums_shape));
+
+      tensorflow::shape_inference::ShapeHandle seed_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(4), 0, &seed_shape));
+
+      tensorflow::shape_inference::DimensionHandle output_rows =
+          c->Dim(programs_shape, 0);
+      tensorflow::shape_inference::DimensionHandle output_cols =
+          c->Dim(pauli_sums_shape, 1);
+      tensorflow::shape_inference::DimensionHandle num_symbols =
+          c->Dim(symbol_names_shape, 0);
+      c->set_output(0, c->MakeShape({output_rows, output_cols, num_symbols}));
+
+      return tensorflow::Status::OK();
+    });
+
+}  // namespace tfq
@@ -0,0 +1,543 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Simulated states as DT_VARIANT tensors. TfqSimulateStateHandle simulates
+// a batch of circuits once and the other ops here measure the resulting
+// states directly, so several quantities of one state cost a single
+// simulation and the amplitudes never leave qsim's layout.
+
+#include <complex>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../qsim/lib/circuit.h"
+#include "../qsim/lib/gate_appl.h"
+#include "../qsim/lib/gates_cirq.h"
+#include "../qsim/lib/seqfor.h"
+#include "../qsim/lib/simmux.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "cirq/google/api/v2/program.pb.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/framework/tensor_shape.h"
+#include "tensorflow/core/framework/variant.h"
+#include "tensorflow/core/framework/variant_encode_decode.h"
+#include "tensorflow/core/framework/variant_op_registry.h"
+#include "tensorflow/core/framework/variant_tensor_data.h"
+#include "tensorflow/core/lib/core/error_codes.pb.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow_quantum/core/ops/parse_context.h"
+#include "tensorflow_quantum/core/proto/pauli_sum.pb.h"
+#include "tensorflow_quantum/core/src/circuit_parser_qsim.h"
+#include "tensorflow_quantum/core/src/program_resolution.h"
+#include "tensorflow_quantum/core/src/util_qsim.h"
+
+namespace tfq {
+
+using ::cirq::google::api::v2::Program;
+using ::tensorflow::Status;
+using ::tfq::proto::PauliSum;
+
+typedef qsim::Cirq::GateCirq<float> QsimGate;
+typedef qsim::Circuit<QsimGate> QsimCircuit;
+typedef absl::flat_hash_map<std::string, std::string> QubitMap;
+
+// The final state of one circuit, held in a DT_VARIANT tensor element.
+// Copies of the variant share the state vector, which is freed along with
+// the last tensor referring to it. States are never written to after the
+// op that simulated them returns.
+struct SimulatedState {
+  using Simulator = qsim::Simulator<const tfq::QsimFor&>;
+  using StateSpace = Simulator::StateSpace;
+  using State = StateSpace::State;
+
+  int num_qubits = 0;
+  // The renaming ResolveQubitIds applied to the circuit, PauliSums are
+  // resolved against it when they are measured.
+  std::shared_ptr<const QubitMap> id_to_index;
+  std::shared_ptr<State> state;
+
+  std::string TypeName() const { return "tfq::SimulatedState"; }
+
+  std::string DebugString() const {
+    return absl::StrCat("SimulatedState on ", num_qubits, " qubits");
+  }
+
+  // Variants are only encoded when they cross a device or are saved, the
+  // amplitudes are copied out in order along with the register.
+  void Encode(tensorflow::VariantTensorData* data) const {
+    data->set_type_name(TypeName());
+    tensorflow::Tensor qubits(tensorflow::DT_STRING,
+                              tensorflow::TensorShape({num_qubits}));
+    for (const auto& pair : *id_to_index) {
+      int k;
+      (void)absl::SimpleAtoi(pair.second, &k);
+      qubits.vec<tensorflow::tstring>()(k) = pair.first;
+    }
+    *data->add_tensors() = qubits;
+
+    const tfq::QsimFor for_obj(nullptr);
+    StateSpace ss(num_qubits, for_obj);
+    tensorflow::Tensor amplitudes(
+        tensorflow::DT_COMPLEX64,
+        tensorflow::TensorShape({int64_t(1) << num_qubits}));
+    auto amplitudes_vec = amplitudes.vec<std::complex<float>>();
+    for (uint64_t j = 0; j < (uint64_t(1) << num_qubits); j++) {
+      amplitudes_vec(j) = ss.GetAmpl(*state, j);
+    }
+    *data->add_tensors() = amplitudes;
+  }
+
+  bool Decode(const tensorflow::VariantTensorData& data) {
+    if (data.tensors_size() != 2 ||
+        data.tensors(0).dtype() != tensorflow::DT_STRING ||
+        data.tensors(1).dtype() != tensorflow::DT_COMPLEX64) {
+      return false;
+    }
+    const auto qubits = data.tensors(0).vec<tensorflow::tstring>();
+    const auto amplitudes = data.tensors(1).vec<std::complex<float>>();
+    num_qubits = qubits.dimension(0);
+    if (amplitudes.dimension(0) != (int64_t(1) << num_qubits)) {
+      return false;
+    }
+    auto map = std::make_shared<QubitMap>();
+    for (int k = 0; k < num_qubits; k++) {
+      (*map)[std::string(qubits(k))] = absl::StrCat(k);
+    }
+    id_to_index = map;
+
+    // Only static members of the state space are used, no loop is run.
+    const tfq::QsimFor for_obj(nullptr);
+    StateSpace ss(num_qubits, for_obj);
+    state = std::make_shared<State>(ss.CreateState());
+    if (state->get() == nullptr) {
+      return false;
+    }
+    for (uint64_t j = 0; j < (uint64_t(1) << num_qubits); j++) {
+      ss.SetAmpl(*state, j, amplitudes(j));
+    }
+    return true;
+  }
+};
+
+REGISTER_UNARY_VARIANT_DECODE_FUNCTION(SimulatedState, "tfq::SimulatedState");
+
+namespace {
+
+// Reads the states out of the variant input `input_name`.
+Status GetSimulatedStates(tensorflow::OpKernelContext* context,
+                          const std::string& input_name,
+                          std::vector<const SimulatedState*>* states) {
+  const tensorflow::Tensor* input;
+  Status status = context->input(input_name, &input);
+  if (!status.ok()) {
+    return status;
+  }
+
+  if (input->dims() != 1) {
+    return Status(tensorflow::error::INVALID_ARGUMENT,
+                  absl::StrCat(input_name, " must be rank 1. Got rank ",
+                               input->dims(), "."));
+  }
+
+  const auto variants = input->vec<tensorflow::Variant>();
+  states->assign(variants.dimension(0), nullptr);
+  for (int i = 0; i < variants.dimension(0); i++) {
+    (*states)[i] = variants(i).get<SimulatedState>();
+    if ((*states)[i] == nullptr) {
+      return Status(
+          tensorflow::error::INVALID_ARGUMENT,
+          absl::StrCat(input_name, " must hold simulated states. Got ",
+                       variants(i).TypeName(), "."));
+    }
+  }
+
+  return Status::OK();
+}
+
+}  // namespace
+
+class TfqSimulateStateHandleOp : public tensorflow::OpKernel {
+ public:
+  explicit TfqSimulateStateHandleOp(tensorflow::OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(tensorflow::OpKernelContext* context) override {
+    DCHECK_EQ(3, context->num_inputs());
+
+    ProgramBatch programs;
+    OP_REQUIRES_OK(context, ParsePrograms(context, "programs", &programs));
+
+    std::vector<SymbolMap> maps;
+    OP_REQUIRES_OK(context, GetSymbolMaps(context, &maps));
+    OP_REQUIRES(
+        context, maps.size() == programs.size(),
+        tensorflow::errors::InvalidArgument(absl::StrCat(
+            "Number of circuits and values do not match. Got ", programs.size(),
+            " circuits and ", maps.size(), " values.")));
+
+    // Resolve qubits, keeping the renaming for later measurements, and
+    // construct qsim circuits.
+    std::vector<SimulatedState> states(programs.size());
+    std::vector<QsimCircuit> qsim_circuits(programs.size(), QsimCircuit());
+    std::vector<std::vector<qsim::GateFused<QsimGate>>> fused_circuits(
+        programs.size(), std::vector<qsim::GateFused<QsimGate>>({}));
+    auto construct_f = [&](int start, int end) {
+      for (int i = start; i < end; i++) {
+        unsigned int nq;
+        auto id_to_index = std::make_shared<QubitMap>();
+        OP_REQUIRES_OK(context, ResolveQubitIds(&programs[i], &nq, nullptr,
+                                                id_to_index.get()));
+        OP_REQUIRES_OK(context, QsimCircuitFromProgram(
+                                    programs[i], maps[i], nq,
+                                    &qsim_circuits[i], &fused_circuits[i]));
+        states[i].num_qubits = nq;
+        states[i].id_to_index = id_to_index;
+      }
+    };
+
+    const int num_cycles = 1000;
+    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
+        programs.size(), num_cycles, construct_f);
+    if (!context->status().ok()) {
+      return;
+    }
+
+    int max_num_qubits = 0;
+    for (const SimulatedState& state : states) {
+      max_num_qubits = std::max(max_num_qubits, state.num_qubits);
+    }
+
+    // The states outlive this call, so they are allocated on their own
+    // rather than leased from a StatePool.
+    for (SimulatedState& state : states) {
+      const auto tfq_for = tfq::QsimFor(context, state.num_qubits);
+      SimulatedState::StateSpace ss(state.num_qubits, tfq_for);
+      state.state = std::make_shared<SimulatedState::State>(ss.CreateState());
+      OP_REQUIRES(context, state.state->get() != nullptr,
+                  tensorflow::errors::ResourceExhausted(absl::StrCat(
+                      "Unable to allocate a state on ", state.num_qubits,
+                      " qubits.")));
+    }
+
+    // See TfqSimulateStateOp for the cutoff.
+    if (max_num_qubits >= 26 || programs.size() == 1) {
+      ComputeLarge(fused_circuits, context, &states);
+    } else {
+      ComputeSmall(fused_circuits, context, &states);
+    }
+
+    tensorflow::Tensor* output = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(
+                       0, tensorflow::TensorShape({int64_t(states.size())}),
+                       &output));
+    auto output_tensor = output->vec<tensorflow::Variant>();
+    for (int i = 0; i < states.size(); i++) {
+      output_tensor(i) = std::move(states[i]);
+    }
+  }
+
+ private:
+  void ComputeLarge(
+      const std::vector<std::vector<qsim::GateFused<QsimGate>>>& fused_circuits,
+      tensorflow::OpKernelContext* context,
+      std::vector<SimulatedState>* states) {
+    for (int i = 0; i < fused_circuits.size(); i++) {
+      const int nq = (*states)[i].num_qubits;
+      SimulatedState::State& sv = *(*states)[i].state;
+      const auto tfq_for = tfq::QsimFor(context, nq);
+      SimulatedState::Simulator sim(nq, tfq_for);
+      SimulatedState::StateSpace ss(nq, tfq_for);
+      ss.SetStateZero(sv);
+      const uint64_t start_micros = tensorflow::Env::Default()->NowMicros();
+      const uint64_t num_sweeps =
+          ApplyFusedCircuitBlocked(fused_circuits[i], nq, sim, tfq_for, sv);
+      RecordStateBandwidth(
+          nq, num_sweeps,
+          tensorflow::Env::Default()->NowMicros() - start_micros);
+    }
+  }
+
+  void ComputeSmall(
+      const std::vector<std::vector<qsim::GateFused<QsimGate>>>& fused_circuits,
+      tensorflow::OpKernelContext* context,
+      std::vector<SimulatedState>* states) {
+    const auto tfq_for = qsim::SequentialFor(1);
+    using Simulator = qsim::Simulator<const qsim::SequentialFor&>;
+    using StateSpace = Simulator::StateSpace;
+
+    std::vector<int64_t> costs(fused_circuits.size());
+    for (int i = 0; i < fused_circuits.size(); i++) {
+      costs[i] =
+          CircuitCost((*states)[i].num_qubits, fused_circuits[i].size(), 0);
+    }
+
+    auto DoWork = [&](CostOrderedQueue* queue) {
+      int i;
+      while (queue->Next(&i)) {
+        const int nq = (*states)[i].num_qubits;
+        SimulatedState::State& sv = *(*states)[i].state;
+        Simulator sim = Simulator(nq, tfq_for);
+        StateSpace ss = StateSpace(nq, tfq_for);
+        ss.SetStateZero(sv);
+        for (int j = 0; j < fused_circuits[i].size(); j++) {
+          qsim::ApplyFusedGate(sim, fused_circuits[i][j], sv);
+        }
+      }
+    };
+
+    ParallelForByCost(context, costs, DoWork);
+  }
+};
+
+class TfqStateHandleExpectationOp : public tensorflow::OpKernel {
+ public:
+  explicit TfqStateHandleExpectationOp(
+      tensorflow::OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(tensorflow::OpKernelContext* context) override {
+    std::vector<const SimulatedState*> states;
+    OP_REQUIRES_OK(context, GetSimulatedStates(context, "states", &states));
+
+    std::vector<std::vector<PauliSum>> p_sums;
+    OP_REQUIRES_OK(context, GetPauliSums(context, &p_sums));
+    OP_REQUIRES(context, p_sums.size() == states.size(),
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "Number of states and pauli_sums do not match. Got ",
+                    states.size(), " states and ", p_sums.size(),
+                    " pauli_sums.")));
+
+    const int output_dim_op_size = p_sums.empty() ? 0 : p_sums[0].size();
+    tensorflow::Tensor* output = nullptr;
+    OP_REQUIRES_OK(
+        context,
+        context->allocate_output(
+            0,
+            tensorflow::TensorShape({int64_t(states.size()),
+                                     int64_t(output_dim_op_size)}),
+            &output));
+    auto output_tensor = output->matrix<float>();
+
+    // Each state is measured by the whole thread pool in turn, the Pauli
+    // reductions already split the state over all threads.
+    for (int i = 0; i < states.size(); i++) {
+      const SimulatedState& state = *states[i];
+      // (#679) Empty programs are padded like tfq_simulate_expectation.
+      if (state.num_qubits == 0) {
+        for (int j = 0; j < p_sums[i].size(); j++) {
+          output_tensor(i, j) = -2.0;
+        }
+        continue;
+      }
+      OP_REQUIRES_OK(context, ResolveQubitIdsWithMap(*state.id_to_index,
+                                                     nullptr, &p_sums[i]));
+      const auto tfq_for = tfq::QsimFor(context, state.num_qubits);
+      SimulatedState::StateSpace ss(state.num_qubits, tfq_for);
+      for (int j = 0; j < p_sums[i].size(); j++) {
+        float exp_v = 0.0;
+        OP_REQUIRES_OK(context,
+                       ComputeExpectationQsim(p_sums[i][j], tfq_for, ss,
+                                              *state.state, &exp_v));
+        output_tensor(i, j) = exp_v;
+      }
+    }
+  }
+};
+
+class TfqStateHandleSamplesOp : public tensorflow::OpKernel {
+ public:
+  explicit TfqStateHandleSamplesOp(tensorflow::OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(tensorflow::OpKernelContext* context) override {
+    std::vector<const SimulatedState*> states;
+    OP_REQUIRES_OK(context, GetSimulatedStates(context, "states", &states));
+
+    int num_samples = 0;
+    OP_REQUIRES_OK(context, GetIndividualSample(context, &num_samples));
+
+    int max_num_qubits = 0;
+    for (const SimulatedState* state : states) {
+      max_num_qubits = std::max(max_num_qubits, state->num_qubits);
+    }
+
+    tensorflow::Tensor* output = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(
+                                0,
+                                tensorflow::TensorShape(
+                                    {int64_t(states.size()), num_samples,
+                                     max_num_qubits}),
+                                &output));
+    auto output_tensor = output->tensor<int8_t, 3>();
+
+    // Rows are padded on the left with -2 like tfq_simulate_samples.
+    for (int i = 0; i < states.size(); i++) {
+      const int nq = states[i]->num_qubits;
+      const auto tfq_for = tfq::QsimFor(context, nq);
+      SimulatedState::StateSpace ss(nq, tfq_for);
+      const std::vector<uint64_t> samples =
+          ss.Sample(*states[i]->state, num_samples, rand() % 123456);
+      const int padding = max_num_qubits - nq;
+      for (int j = 0; j < samples.size(); j++) {
+        for (int k = 0; k < padding; k++) {
+          output_tensor(i, j, k) = -2;
+        }
+        for (int k = 0; k < nq; k++) {
+          output_tensor(i, j, padding + k) = (samples[j] >> (nq - k - 1)) & 1;
+        }
+      }
+    }
+  }
+};
+
+class TfqStateHandleOverlapOp : public tensorflow::OpKernel {
+ public:
+  explicit TfqStateHandleOverlapOp(tensorflow::OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(tensorflow::OpKernelContext* context) override {
+    std::vector<const SimulatedState*> states;
+    OP_REQUIRES_OK(context, GetSimulatedStates(context, "states", &states));
+    std::vector<const SimulatedState*> other_states;
+    OP_REQUIRES_OK(context,
+                   GetSimulatedStates(context, "other_states", &other_states));
+    OP_REQUIRES(context, states.size() == other_states.size(),
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "states and other_states must have matching sizes. Got ",
+                    states.size(), " and ", other_states.size(), ".")));
+
+    tensorflow::Tensor* output = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(
+                       0, tensorflow::TensorShape({int64_t(states.size())}),
+                       &output));
+    auto output_tensor = output->vec<std::complex<float>>();
+
+    for (int i = 0; i < states.size(); i++) {
+      const SimulatedState& left = *states[i];
+      const SimulatedState& right = *other_states[i];
+      OP_REQUIRES(context, *left.id_to_index == *right.id_to_index,
+                  tensorflow::errors::InvalidArgument(absl::StrCat(
+                      "States at index ", i,
+                      " are not on the same qubits.")));
+      const auto tfq_for = tfq::QsimFor(context, left.num_qubits);
+      SimulatedState::StateSpace ss(left.num_qubits, tfq_for);
+      const std::complex<double> overlap =
+          ss.InnerProduct(*left.state, *right.state);
+      output_tensor(i) = std::complex<float>(overlap);
+    }
+  }
+};
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqSimulateStateHandle").Device(tensorflow::DEVICE_CPU),
+    TfqSimulateStateHandleOp);
+
+REGISTER_OP("TfqSimulateStateHandle")
+    .Input("programs: string")
+    .Input("symbol_names: string")
+    .Input("symbol_values: float")
+    .Attr("allow_text_format: bool = true")
+    .Output("states: variant")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
+      tensorflow::shape_inference::ShapeHandle programs_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &programs_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_names_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &symbol_names_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_values_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &symbol_values_shape));
+
+      c->set_output(0, c->MakeShape({c->Dim(programs_shape, 0)}));
+
+      return tensorflow::Status::OK();
+    });
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqStateHandleExpectation").Device(tensorflow::DEVICE_CPU),
+    TfqStateHandleExpectationOp);
+
+REGISTER_OP("TfqStateHandleExpectation")
+    .Input("states: variant")
+    .Input("pauli_sums: string")
+    .Attr("allow_text_format: bool = true")
+    .Output("expectations: float")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
+      tensorflow::shape_inference::ShapeHandle states_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &states_shape));
+
+      tensorflow::shape_inference::ShapeHandle pauli_sums_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 2, &pauli_sums_shape));
+
+      c->set_output(0, c->Matrix(c->Dim(states_shape, 0),
+                                 c->Dim(pauli_sums_shape, 1)));
+
+      return tensorflow::Status::OK();
+    });
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqStateHandleSamples").Device(tensorflow::DEVICE_CPU),
+    TfqStateHandleSamplesOp);
+
+REGISTER_OP("TfqStateHandleSamples")
+    .Input("states: variant")
+    .Input("num_samples: int32")
+    .Output("samples: int8")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
+      tensorflow::shape_inference::ShapeHandle states_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &states_shape));
+
+      tensorflow::shape_inference::ShapeHandle num_samples_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &num_samples_shape));
+
+      c->set_output(
+          0, c->MakeShape(
+                 {c->Dim(states_shape, 0),
+                  tensorflow::shape_inference::InferenceContext::kUnknownDim,
+                  tensorflow::shape_inference::InferenceContext::kUnknownDim}));
+
+      return tensorflow::Status::OK();
+    });
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqStateHandleOverlap").Device(tensorflow::DEVICE_CPU),
+    TfqStateHandleOverlapOp);
+
+REGISTER_OP("TfqStateHandleOverlap")
+    .Input("states: variant")
+    .Input("other_states: variant")
+    .Output("overlaps: complex64")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
+      tensorflow::shape_inference::ShapeHandle states_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &states_shape));
+
+      tensorflow::shape_inference::ShapeHandle other_states_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &other_states_shape));
+
+      c->set_output(0, c->MakeShape({c->Dim(states_shape, 0)}));
+
+      return tensorflow::Status::OK();
+    });
+
+}  // namespace tfq
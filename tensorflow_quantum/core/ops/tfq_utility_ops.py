@@ -96,3 +96,38 @@ def resolve_parameters(programs, symbol_names, symbol_values):
     """
     return UTILITY_OP_MODULE.tfq_resolve_parameters(
         programs, symbol_names, tf.cast(symbol_values, tf.float32))
+
+
+def encode_programs(programs):
+    """Convert a batch of programs to the compact binary circuit encoding.
+
+    Encoded programs store every string once and each operation as a flat run
+    of integer indices and float parameters. All TFQ ops accept them in place
+    of serialized `Program` protos and read them without protobuf parsing.
+    Circuits made of gates the simulators support also store their qubits
+    already numbered and their gates as kinds, which the simulate ops build
+    qsim circuits from directly. This makes them a cheaper input when the
+    same circuits are fed in repeatedly.
+
+    Args:
+        programs: `tf.Tensor` of strings with shape [batch_size] containing
+            the string representations of the circuits to be encoded.
+
+    Returns:
+        `tf.Tensor` with shape [batch_size] holding the encoded circuits.
+    """
+    return UTILITY_OP_MODULE.tfq_encode_programs(programs)
+
+
+def decode_programs(programs):
+    """Convert encoded programs back to serialized `Program` protos.
+
+    Args:
+        programs: `tf.Tensor` of strings with shape [batch_size] produced by
+            `encode_programs`.
+
+    Returns:
+        `tf.Tensor` with shape [batch_size] containing the circuits as binary
+            serialized `Program` protos, readable by `tfq.from_tensor`.
+    """
+    return UTILITY_OP_MODULE.tfq_decode_programs(programs)
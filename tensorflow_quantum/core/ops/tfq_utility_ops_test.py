@@ -20,6 +20,7 @@ import tensorflow as tf
 from absl.testing import parameterized
 import cirq
 
+from tensorflow_quantum.core.ops import tfq_simulate_ops
 from tensorflow_quantum.core.ops import tfq_utility_ops
 from tensorflow_quantum.core.serialize import serializer
 from tensorflow_quantum.python import util
@@ -352,5 +353,72 @@ class ResolveParametersOpTest(tf.test.TestCase, parameterized.TestCase):
                                         "{}".format(type(tg)))
 
 
+class CircuitEncodingOpTest(tf.test.TestCase, parameterized.TestCase):
+    """Tests encode_programs and decode_programs."""
+
+    def test_encoding_round_trip(self):
+        """Decoding an encoded batch gives back the original circuits."""
+        qubits = cirq.GridQubit.rect(1, 4)
+        symbol_names = ['a', 'b']
+        circuit_batch, _ = util.random_symbol_circuit_resolver_batch(
+            qubits, symbol_names, 5)
+        circuit_batch.append(cirq.Circuit())
+
+        encoded = tfq_utility_ops.encode_programs(
+            util.convert_to_tensor(circuit_batch))
+        self.assertEqual(encoded.shape, [len(circuit_batch)])
+        decoded = util.from_tensor(tfq_utility_ops.decode_programs(encoded))
+        for expected, actual in zip(circuit_batch, decoded):
+            self.assertEqual(expected, actual)
+
+        # Decoding accepts serialized protos too.
+        decoded = util.from_tensor(
+            tfq_utility_ops.decode_programs(
+                util.convert_to_tensor(circuit_batch)))
+        for expected, actual in zip(circuit_batch, decoded):
+            self.assertEqual(expected, actual)
+
+    def test_encoded_simulation(self):
+        """Simulate ops give the same results on encoded programs."""
+        qubits = cirq.GridQubit.rect(1, 4)
+        symbol_names = ['a', 'b']
+        circuit_batch, resolver_batch = \
+            util.random_symbol_circuit_resolver_batch(
+                qubits, symbol_names, 5)
+        symbol_values = np.array(
+            [[resolver[symbol]
+              for symbol in symbol_names]
+             for resolver in resolver_batch])
+        pauli_sums = util.random_pauli_sums(qubits, 3, len(circuit_batch))
+
+        programs = util.convert_to_tensor(circuit_batch)
+        encoded = tfq_utility_ops.encode_programs(programs)
+        ops = util.convert_to_tensor([[x] for x in pauli_sums])
+
+        expected = tfq_simulate_ops.tfq_simulate_expectation(
+            programs, symbol_names, symbol_values, ops)
+        actual = tfq_simulate_ops.tfq_simulate_expectation(
+            encoded, symbol_names, symbol_values, ops)
+        self.assertAllClose(expected, actual)
+
+        expected = tfq_simulate_ops.tfq_simulate_state(programs, symbol_names,
+                                                       symbol_values)
+        actual = tfq_simulate_ops.tfq_simulate_state(encoded, symbol_names,
+                                                     symbol_values)
+        self.assertAllClose(expected, actual)
+
+    def test_encoding_input_checking(self):
+        """Malformed inputs are rejected."""
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'programs must be rank 1'):
+            tfq_utility_ops.encode_programs([['junk']])
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'Unparseable proto'):
+            tfq_utility_ops.encode_programs(['junk'])
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'truncated or corrupt'):
+            tfq_utility_ops.decode_programs(['TFQC'])
+
+
 if __name__ == '__main__':
     tf.test.main()
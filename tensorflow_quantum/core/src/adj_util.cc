@@ -159,6 +159,63 @@ void CreateGradientCircuit(
       fuser.FuseGates(circuit.num_qubits, left, right);
 }
 
+QsimGate ShiftGateSymbol(const QsimGate& gate, const GateMetaData& metadata,
+                         const std::string& symbol, float shift) {
+  const bool phased =
+      gate.kind == qsim::Cirq::GateKind::kPhasedXPowGate ||
+      gate.kind == qsim::Cirq::GateKind::kPhasedISwapPowGate;
+  std::vector<float> params = metadata.gate_params;
+  bool found = false;
+  for (int j = 0; j < metadata.symbol_values.size(); j++) {
+    if (metadata.symbol_values[j] != symbol) {
+      continue;
+    }
+    found = true;
+    // gate_params holds (value, scalar) pairs in the order the gate
+    // takes them, followed by the global shift if there is one.
+    switch (metadata.placeholder_names[j]) {
+      case GateParamNames::kExponent:
+        params[phased ? 2 : 0] += shift;
+        break;
+      case GateParamNames::kPhaseExponent:
+      case GateParamNames::kTheta:
+        params[0] += shift;
+        break;
+      case GateParamNames::kPhi:
+        params[2] += shift;
+        break;
+    }
+  }
+  if (!found) {
+    return gate;
+  }
+
+  if (metadata.create_f1) {
+    return metadata.create_f1(gate.time, gate.qubits[0],
+                              params[0] * params[1], params[2]);
+  }
+  if (metadata.create_f2) {
+    return metadata.create_f2(gate.time, gate.qubits[0], gate.qubits[1],
+                              params[0] * params[1], params[2]);
+  }
+  switch (gate.kind) {
+    case qsim::Cirq::GateKind::kPhasedXPowGate:
+      return qsim::Cirq::PhasedXPowGate<float>::Create(
+          gate.time, gate.qubits[0], params[0] * params[1],
+          params[2] * params[3], params[4]);
+    case qsim::Cirq::GateKind::kFSimGate:
+      return qsim::Cirq::FSimGate<float>::Create(
+          gate.time, gate.qubits[0], gate.qubits[1], params[0] * params[1],
+          params[2] * params[3]);
+    case qsim::Cirq::GateKind::kPhasedISwapPowGate:
+      return qsim::Cirq::PhasedISwapPowGate<float>::Create(
+          gate.time, gate.qubits[0], gate.qubits[1], params[0] * params[1],
+          params[2] * params[3]);
+    default:
+      return gate;
+  }
+}
+
 void PopulateGradientSingleEigen(
     const std::function<QsimGate(unsigned int, unsigned int, float, float)>&
         create_f,
@@ -53,6 +53,13 @@ void CreateGradientCircuit(
         partial_fuses,
     std::vector<GradientOfGate>* grad_gates);
 
+// Rebuilds gate with symbol shifted by shift in every placeholder of the
+// gate that it fills. metadata is the GateMetaData of gate. Gates that do
+// not use symbol are returned unchanged.
+qsim::Cirq::GateCirq<float> ShiftGateSymbol(
+    const qsim::Cirq::GateCirq<float>& gate, const GateMetaData& metadata,
+    const std::string& symbol, float shift);
+
 void PopulateGradientSingleEigen(
     const std::function<qsim::Cirq::GateCirq<float>(unsigned int, unsigned int,
                                                     float, float)>& create_f,
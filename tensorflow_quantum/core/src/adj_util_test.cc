@@ -560,6 +560,59 @@ TEST(AdjUtilTest, PhasedISwapExponent) {
   Matrix4Equal(grad.grad_gates[0].matrix, expected, 1e-4);
 }
 
+TEST(AdjUtilTest, ShiftGateSymbolEigen) {
+  GateMetaData meta;
+  meta.symbol_values = {"alpha"};
+  meta.placeholder_names = {GateParamNames::kExponent};
+  meta.gate_params = {0.25, 2.0, 0.5};
+  meta.create_f1 = &qsim::Cirq::XPowGate<float>::Create;
+  QsimGate gate = qsim::Cirq::XPowGate<float>::Create(3, 1, 0.5, 0.5);
+
+  QsimGate shifted = ShiftGateSymbol(gate, meta, "alpha", 0.125);
+  QsimGate expected = qsim::Cirq::XPowGate<float>::Create(3, 1, 0.75, 0.5);
+  EXPECT_EQ(shifted.time, 3);
+  EXPECT_EQ(shifted.qubits, expected.qubits);
+  Matrix2Equal(shifted.matrix, expected.matrix, 1e-6);
+
+  QsimGate unchanged = ShiftGateSymbol(gate, meta, "beta", 0.125);
+  Matrix2Equal(unchanged.matrix, gate.matrix, 1e-6);
+}
+
+TEST(AdjUtilTest, ShiftGateSymbolPhasedX) {
+  GateMetaData meta;
+  meta.symbol_values = {"alpha", "beta"};
+  meta.placeholder_names = {GateParamNames::kPhaseExponent,
+                            GateParamNames::kExponent};
+  meta.gate_params = {0.5, 1.0, 0.25, 2.0, 0.0};
+  QsimGate gate =
+      qsim::Cirq::PhasedXPowGate<float>::Create(0, 0, 0.5, 0.5, 0.0);
+
+  QsimGate shifted = ShiftGateSymbol(gate, meta, "beta", 0.1);
+  Matrix2Equal(shifted.matrix,
+               qsim::Cirq::PhasedXPowGate<float>::Create(0, 0, 0.5, 0.7, 0.0)
+                   .matrix,
+               1e-6);
+
+  shifted = ShiftGateSymbol(gate, meta, "alpha", 0.1);
+  Matrix2Equal(shifted.matrix,
+               qsim::Cirq::PhasedXPowGate<float>::Create(0, 0, 0.6, 0.5, 0.0)
+                   .matrix,
+               1e-6);
+}
+
+TEST(AdjUtilTest, ShiftGateSymbolFSim) {
+  GateMetaData meta;
+  meta.symbol_values = {"phi"};
+  meta.placeholder_names = {GateParamNames::kPhi};
+  meta.gate_params = {0.3, 1.0, 0.2, -1.0};
+  QsimGate gate = qsim::Cirq::FSimGate<float>::Create(0, 0, 1, 0.3, -0.2);
+
+  QsimGate shifted = ShiftGateSymbol(gate, meta, "phi", 0.5);
+  Matrix4Equal(shifted.matrix,
+               qsim::Cirq::FSimGate<float>::Create(0, 0, 1, 0.3, -0.7).matrix,
+               1e-6);
+}
+
 TEST(AdjUtilTest, Matrix2Diff) {
   std::array<float, 8> u{1, 2, 3, 4, 5, 6, 7, 8};
   std::array<float, 8> u2{0, 1, 2, 3, 4, 5, 6, 7};
@@ -0,0 +1,254 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_quantum/core/src/batch_simulator.h"
+
+#include <algorithm>
+#include <bitset>
+#include <complex>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace tfq {
+
+namespace {
+
+// Lane operations for the widest vector unit this file is compiled for.
+// The gate kernel below is written once against this interface.
+#if defined(__AVX512F__)
+struct LaneOps {
+  typedef __m512 V;
+  static const unsigned int kLanes = 16;
+  static V Zero() { return _mm512_setzero_ps(); }
+  static V Load(const float* p) { return _mm512_loadu_ps(p); }
+  static void Store(float* p, V v) { _mm512_storeu_ps(p, v); }
+  static V Add(V a, V b) { return _mm512_add_ps(a, b); }
+  static V Sub(V a, V b) { return _mm512_sub_ps(a, b); }
+  static V Mul(V a, V b) { return _mm512_mul_ps(a, b); }
+};
+#elif defined(__AVX2__)
+struct LaneOps {
+  typedef __m256 V;
+  static const unsigned int kLanes = 8;
+  static V Zero() { return _mm256_setzero_ps(); }
+  static V Load(const float* p) { return _mm256_loadu_ps(p); }
+  static void Store(float* p, V v) { _mm256_storeu_ps(p, v); }
+  static V Add(V a, V b) { return _mm256_add_ps(a, b); }
+  static V Sub(V a, V b) { return _mm256_sub_ps(a, b); }
+  static V Mul(V a, V b) { return _mm256_mul_ps(a, b); }
+};
+#else
+struct LaneOps {
+  typedef float V;
+  static const unsigned int kLanes = 1;
+  static V Zero() { return 0; }
+  static V Load(const float* p) { return *p; }
+  static void Store(float* p, V v) { *p = v; }
+  static V Add(V a, V b) { return a + b; }
+  static V Sub(V a, V b) { return a - b; }
+  static V Mul(V a, V b) { return a * b; }
+};
+#endif
+
+}  // namespace
+
+BatchStateVector::BatchStateVector(const unsigned int num_qubits,
+                                   const unsigned int batch_size)
+    : num_qubits_(num_qubits),
+      batch_size_(batch_size),
+      stride_((batch_size + LaneOps::kLanes - 1) / LaneOps::kLanes *
+              LaneOps::kLanes),
+      re_(stride_ << num_qubits),
+      im_(stride_ << num_qubits),
+      matrices_(32 * stride_) {}
+
+void BatchStateVector::SetStateZero() {
+  std::fill(re_.begin(), re_.end(), 0);
+  std::fill(im_.begin(), im_.end(), 0);
+  std::fill(re_.begin(), re_.begin() + batch_size_, 1);
+}
+
+void BatchStateVector::CopyFrom(const BatchStateVector& other) {
+  re_ = other.re_;
+  im_ = other.im_;
+}
+
+void BatchStateVector::ApplyGate1(const unsigned int q,
+                                  const float* matrices) {
+  ApplyGate<1>(&q, matrices);
+}
+
+void BatchStateVector::ApplyGate2(const unsigned int q0, const unsigned int q1,
+                                  const float* matrices) {
+  const unsigned int qubits[2] = {q0, q1};
+  ApplyGate<2>(qubits, matrices);
+}
+
+template <unsigned int H>
+void BatchStateVector::ApplyGate(const unsigned int* qubits,
+                                 const float* matrices) {
+  typedef LaneOps::V V;
+  constexpr unsigned int dim = 1 << H;
+  constexpr unsigned int len = 2 * dim * dim;
+
+  // Transpose the per row matrices so a register load picks up the same
+  // element for consecutive rows. Padding rows get a zero matrix, their
+  // amplitudes are zero anyway.
+  std::fill(matrices_.begin(), matrices_.begin() + len * stride_, 0);
+  for (unsigned int b = 0; b < batch_size_; b++) {
+    for (unsigned int k = 0; k < len; k++) {
+      matrices_[k * stride_ + b] = matrices[len * b + k];
+    }
+  }
+
+  uint64_t offsets[dim];
+  uint64_t mask = 0;
+  for (unsigned int r = 0; r < dim; r++) {
+    offsets[r] = 0;
+    for (unsigned int h = 0; h < H; h++) {
+      if ((r >> h) & 1) {
+        offsets[r] |= uint64_t{1} << qubits[h];
+      }
+    }
+  }
+  for (unsigned int h = 0; h < H; h++) {
+    mask |= uint64_t{1} << qubits[h];
+  }
+
+  const float* m = matrices_.data();
+  const uint64_t size = uint64_t{1} << num_qubits_;
+  for (uint64_t a = 0; a < size; a++) {
+    if (a & mask) {
+      continue;
+    }
+    for (uint64_t b = 0; b < stride_; b += LaneOps::kLanes) {
+      V xr[dim];
+      V xi[dim];
+      for (unsigned int c = 0; c < dim; c++) {
+        xr[c] = LaneOps::Load(&re_[(a | offsets[c]) * stride_ + b]);
+        xi[c] = LaneOps::Load(&im_[(a | offsets[c]) * stride_ + b]);
+      }
+      for (unsigned int r = 0; r < dim; r++) {
+        V yr = LaneOps::Zero();
+        V yi = LaneOps::Zero();
+        for (unsigned int c = 0; c < dim; c++) {
+          const V mr = LaneOps::Load(m + (2 * (dim * r + c)) * stride_ + b);
+          const V mi =
+              LaneOps::Load(m + (2 * (dim * r + c) + 1) * stride_ + b);
+          yr = LaneOps::Add(
+              yr, LaneOps::Sub(LaneOps::Mul(mr, xr[c]),
+                               LaneOps::Mul(mi, xi[c])));
+          yi = LaneOps::Add(
+              yi, LaneOps::Add(LaneOps::Mul(mr, xi[c]),
+                               LaneOps::Mul(mi, xr[c])));
+        }
+        LaneOps::Store(&re_[(a | offsets[r]) * stride_ + b], yr);
+        LaneOps::Store(&im_[(a | offsets[r]) * stride_ + b], yi);
+      }
+    }
+  }
+}
+
+void BatchStateVector::PauliExpectation(const uint64_t x_mask,
+                                        const uint64_t z_mask,
+                                        std::vector<float>* values) const {
+  // P|a> = i^num_y (-1)^|a & z_mask| |a ^ x_mask>, so
+  // <psi|P|psi> = i^num_y sum_a (-1)^|a & z_mask| conj(psi[a ^ x]) psi[a].
+  std::vector<float> acc_re(stride_, 0);
+  std::vector<float> acc_im(stride_, 0);
+  const uint64_t size = uint64_t{1} << num_qubits_;
+  for (uint64_t a = 0; a < size; a++) {
+    const float sign =
+        std::bitset<64>(a & z_mask).count() & 1 ? -1.0f : 1.0f;
+    const float* ur = &re_[(a ^ x_mask) * stride_];
+    const float* ui = &im_[(a ^ x_mask) * stride_];
+    const float* vr = &re_[a * stride_];
+    const float* vi = &im_[a * stride_];
+    for (uint64_t b = 0; b < stride_; b++) {
+      acc_re[b] += sign * (ur[b] * vr[b] + ui[b] * vi[b]);
+      acc_im[b] += sign * (ur[b] * vi[b] - ui[b] * vr[b]);
+    }
+  }
+
+  const unsigned int num_y = std::bitset<64>(x_mask & z_mask).count() % 4;
+  values->resize(batch_size_);
+  for (unsigned int b = 0; b < batch_size_; b++) {
+    switch (num_y) {
+      case 0:
+        (*values)[b] = acc_re[b];
+        break;
+      case 1:
+        (*values)[b] = -acc_im[b];
+        break;
+      case 2:
+        (*values)[b] = -acc_re[b];
+        break;
+      default:
+        (*values)[b] = acc_im[b];
+    }
+  }
+}
+
+void BatchStateVector::Sample(const unsigned int row, const int num_samples,
+                              std::mt19937* rand_gen,
+                              std::vector<uint64_t>* samples) const {
+  samples->clear();
+  if (num_samples <= 0) {
+    return;
+  }
+  const uint64_t size = uint64_t{1} << num_qubits_;
+  double norm = 0;
+  for (uint64_t a = 0; a < size; a++) {
+    const float r = re_[a * stride_ + row];
+    const float i = im_[a * stride_ + row];
+    norm += r * r + i * i;
+  }
+
+  // Walk the cumulative distribution once against sorted draws.
+  std::uniform_real_distribution<double> distribution(0.0, norm);
+  std::vector<double> draws(num_samples);
+  for (int k = 0; k < num_samples; k++) {
+    draws[k] = distribution(*rand_gen);
+  }
+  std::sort(draws.begin(), draws.end());
+
+  samples->reserve(num_samples);
+  double csum = 0;
+  uint64_t last = 0;
+  int k = 0;
+  for (uint64_t a = 0; a < size && k < num_samples; a++) {
+    const float r = re_[a * stride_ + row];
+    const float i = im_[a * stride_ + row];
+    if (r * r + i * i > 0) {
+      last = a;
+    }
+    csum += r * r + i * i;
+    while (k < num_samples && draws[k] < csum) {
+      samples->push_back(a);
+      k++;
+    }
+  }
+  // Rounding can leave the last few draws past the final partial sum.
+  for (; k < num_samples; k++) {
+    samples->push_back(last);
+  }
+}
+
+}  // namespace tfq
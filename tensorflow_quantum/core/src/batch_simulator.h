@@ -0,0 +1,91 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef TFQ_CORE_SRC_BATCH_SIMULATOR_H_
+#define TFQ_CORE_SRC_BATCH_SIMULATOR_H_
+
+#include <complex>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+namespace tfq {
+
+// batch_size state vectors over the same num_qubits qubits, stored
+// structure-of-arrays: amplitude a of row b lives at a * stride + b of the
+// real and imaginary buffers. Every gate is applied to all rows at once
+// with a different matrix per row, so the inner loops run over rows and
+// fill whole SIMD registers even when the states themselves are tiny.
+//
+// Qubits use qsim (little-endian) indices and matrices use the qsim
+// layout: row major with interleaved real and imaginary parts. Two qubit
+// matrices are indexed by b0 + 2 * b1 where b0 is the bit of the lower
+// qubit.
+class BatchStateVector {
+ public:
+  BatchStateVector(const unsigned int num_qubits,
+                   const unsigned int batch_size);
+
+  // Sets every row to |00...0>.
+  void SetStateZero();
+
+  // Copies the amplitudes of other, which must have the same shape.
+  void CopyFrom(const BatchStateVector& other);
+
+  // Applies a 2x2 gate on qubit q. matrices holds batch_size matrices of
+  // 8 floats back to back, one for every row.
+  void ApplyGate1(const unsigned int q, const float* matrices);
+
+  // Applies a 4x4 gate on qubits q0 < q1. matrices holds batch_size
+  // matrices of 32 floats back to back, one for every row.
+  void ApplyGate2(const unsigned int q0, const unsigned int q1,
+                  const float* matrices);
+
+  // Computes <psi_b| P |psi_b> for every row b where P is the Pauli string
+  // with X or Y on the bits of x_mask and Z or Y on the bits of z_mask.
+  void PauliExpectation(const uint64_t x_mask, const uint64_t z_mask,
+                        std::vector<float>* values) const;
+
+  // Draws num_samples basis states of row.
+  void Sample(const unsigned int row, const int num_samples,
+              std::mt19937* rand_gen, std::vector<uint64_t>* samples) const;
+
+  std::complex<float> Amplitude(const unsigned int row,
+                                const uint64_t index) const {
+    return std::complex<float>(re_[index * stride_ + row],
+                               im_[index * stride_ + row]);
+  }
+
+  unsigned int NumQubits() const { return num_qubits_; }
+  unsigned int BatchSize() const { return batch_size_; }
+
+ private:
+  // Applies a gate on the H qubits in qubits (ascending).
+  template <unsigned int H>
+  void ApplyGate(const unsigned int* qubits, const float* matrices);
+
+  unsigned int num_qubits_;
+  unsigned int batch_size_;
+  // Rows padded up to a whole number of SIMD registers.
+  uint64_t stride_;
+  std::vector<float> re_;
+  std::vector<float> im_;
+  // Gate matrices transposed so element k of row b is at k * stride_ + b.
+  std::vector<float> matrices_;
+};
+
+}  // namespace tfq
+
+#endif  // TFQ_CORE_SRC_BATCH_SIMULATOR_H_
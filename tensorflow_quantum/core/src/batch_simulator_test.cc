@@ -0,0 +1,146 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_quantum/core/src/batch_simulator.h"
+
+#include <cmath>
+#include <complex>
+#include <random>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace tfq {
+namespace {
+
+static const float _INV_SQRT2 = 0.70710678;
+
+static const float _H[8] = {_INV_SQRT2, 0, _INV_SQRT2,  0,
+                            _INV_SQRT2, 0, -_INV_SQRT2, 0};
+
+// CNOT with the lower qubit as control.
+static const float _CNOT[32] = {1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                0, 0, 0, 1, 0, 0, 0, 0, 0, 1, 0,
+                                0, 0, 0, 0, 1, 0, 0, 0, 0, 0};
+
+// Appends the 2x2 matrix of exp(-i theta X / 2).
+void AppendRx(const float theta, std::vector<float>* matrices) {
+  const float c = std::cos(theta / 2);
+  const float s = std::sin(theta / 2);
+  const float rx[8] = {c, 0, 0, -s, 0, -s, c, 0};
+  matrices->insert(matrices->end(), rx, rx + 8);
+}
+
+TEST(BatchSimulatorTest, PerRowMatrices) {
+  // More rows than one register so the padded tail is exercised too.
+  const unsigned int batch_size = 19;
+  BatchStateVector state(2, batch_size);
+  state.SetStateZero();
+
+  std::vector<float> matrices;
+  for (unsigned int b = 0; b < batch_size; b++) {
+    AppendRx(0.3 * b, &matrices);
+  }
+  state.ApplyGate1(1, matrices.data());
+
+  for (unsigned int b = 0; b < batch_size; b++) {
+    EXPECT_NEAR(state.Amplitude(b, 0).real(), std::cos(0.15 * b), 1e-5);
+    EXPECT_NEAR(state.Amplitude(b, 2).imag(), -std::sin(0.15 * b), 1e-5);
+    EXPECT_NEAR(std::abs(state.Amplitude(b, 1)), 0.0, 1e-6);
+    EXPECT_NEAR(std::abs(state.Amplitude(b, 3)), 0.0, 1e-6);
+  }
+}
+
+TEST(BatchSimulatorTest, TwoQubitGate) {
+  const unsigned int batch_size = 3;
+  BatchStateVector state(3, batch_size);
+  state.SetStateZero();
+
+  std::vector<float> h_matrices;
+  std::vector<float> cnot_matrices;
+  for (unsigned int b = 0; b < batch_size; b++) {
+    h_matrices.insert(h_matrices.end(), _H, _H + 8);
+    cnot_matrices.insert(cnot_matrices.end(), _CNOT, _CNOT + 32);
+  }
+  state.ApplyGate1(0, h_matrices.data());
+  state.ApplyGate2(0, 2, cnot_matrices.data());
+
+  // (|000> + |101>) / sqrt(2) on every row.
+  for (unsigned int b = 0; b < batch_size; b++) {
+    for (uint64_t a = 0; a < 8; a++) {
+      const float expected = (a == 0 || a == 5) ? _INV_SQRT2 : 0.0;
+      EXPECT_NEAR(state.Amplitude(b, a).real(), expected, 1e-6);
+      EXPECT_NEAR(state.Amplitude(b, a).imag(), 0.0, 1e-6);
+    }
+  }
+}
+
+TEST(BatchSimulatorTest, PauliExpectation) {
+  const unsigned int batch_size = 5;
+  BatchStateVector state(2, batch_size);
+  state.SetStateZero();
+
+  std::vector<float> matrices;
+  for (unsigned int b = 0; b < batch_size; b++) {
+    AppendRx(0.4 * b, &matrices);
+  }
+  state.ApplyGate1(0, matrices.data());
+
+  // Rx(theta)|0> has <Z> = cos(theta), <Y> = -sin(theta) and <X> = 0.
+  std::vector<float> z_values;
+  std::vector<float> y_values;
+  std::vector<float> x_values;
+  std::vector<float> zz_values;
+  state.PauliExpectation(0, 1, &z_values);
+  state.PauliExpectation(1, 1, &y_values);
+  state.PauliExpectation(1, 0, &x_values);
+  state.PauliExpectation(0, 3, &zz_values);
+  for (unsigned int b = 0; b < batch_size; b++) {
+    EXPECT_NEAR(z_values[b], std::cos(0.4 * b), 1e-5);
+    EXPECT_NEAR(y_values[b], -std::sin(0.4 * b), 1e-5);
+    EXPECT_NEAR(x_values[b], 0.0, 1e-5);
+    EXPECT_NEAR(zz_values[b], std::cos(0.4 * b), 1e-5);
+  }
+}
+
+TEST(BatchSimulatorTest, SampleRow) {
+  BatchStateVector state(2, 2);
+  state.SetStateZero();
+
+  // Row 0 stays in |00>, row 1 goes to |+0>.
+  std::vector<float> matrices = {1, 0, 0, 0, 0, 0, 1, 0};
+  matrices.insert(matrices.end(), _H, _H + 8);
+  state.ApplyGate1(0, matrices.data());
+
+  std::mt19937 rand_gen(1234);
+  std::vector<uint64_t> samples;
+  state.Sample(0, 100, &rand_gen, &samples);
+  ASSERT_EQ(samples.size(), 100);
+  for (const uint64_t sample : samples) {
+    EXPECT_EQ(sample, 0);
+  }
+
+  state.Sample(1, 1000, &rand_gen, &samples);
+  ASSERT_EQ(samples.size(), 1000);
+  int ones = 0;
+  for (const uint64_t sample : samples) {
+    EXPECT_TRUE(sample == 0 || sample == 1);
+    ones += sample;
+  }
+  EXPECT_NEAR(ones / 1000.0, 0.5, 0.1);
+}
+
+}  // namespace
+}  // namespace tfq
@@ -0,0 +1,595 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_quantum/core/src/circuit_encoding.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "cirq/google/api/v2/program.pb.h"
+#include "tensorflow/core/lib/core/error_codes.pb.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow_quantum/core/src/program_resolution.h"
+
+namespace tfq {
+
+using cirq::google::api::v2::Arg;
+using cirq::google::api::v2::Circuit;
+using cirq::google::api::v2::Moment;
+using cirq::google::api::v2::Operation;
+using cirq::google::api::v2::Program;
+using cirq::google::api::v2::Qubit;
+using tensorflow::Status;
+
+namespace {
+
+constexpr char kMagic[] = "TFQC";
+constexpr size_t kMagicSize = 4;
+constexpr uint32_t kVersion = 2;
+
+enum ArgKind : uint8_t {
+  kArgEmpty = 0,
+  kArgFloat = 1,
+  kArgSymbol = 2,
+  kArgString = 3,
+  kArgBools = 4,
+};
+
+class Writer {
+ public:
+  explicit Writer(std::string* out) : out_(out) {}
+
+  void U8(uint8_t v) { out_->push_back(static_cast<char>(v)); }
+
+  void U32(uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+      out_->push_back(static_cast<char>((v >> (8 * i)) & 0xFF));
+    }
+  }
+
+  void F32(float f) {
+    uint32_t v;
+    std::memcpy(&v, &f, sizeof(v));
+    U32(v);
+  }
+
+  void Bytes(absl::string_view s) { out_->append(s.data(), s.size()); }
+
+ private:
+  std::string* out_;
+};
+
+class Reader {
+ public:
+  Reader() : pos_(0) {}
+  explicit Reader(absl::string_view in) : in_(in), pos_(0) {}
+
+  bool U8(uint8_t* v) {
+    if (pos_ + 1 > in_.size()) return false;
+    *v = static_cast<uint8_t>(in_[pos_++]);
+    return true;
+  }
+
+  bool U32(uint32_t* v) {
+    if (pos_ + 4 > in_.size()) return false;
+    *v = 0;
+    for (int i = 0; i < 4; i++) {
+      *v |= static_cast<uint32_t>(static_cast<uint8_t>(in_[pos_ + i]))
+            << (8 * i);
+    }
+    pos_ += 4;
+    return true;
+  }
+
+  bool F32(float* f) {
+    uint32_t v;
+    if (!U32(&v)) return false;
+    std::memcpy(f, &v, sizeof(v));
+    return true;
+  }
+
+  bool Bytes(uint32_t n, absl::string_view* s) {
+    if (n > in_.size() - pos_) return false;
+    *s = in_.substr(pos_, n);
+    pos_ += n;
+    return true;
+  }
+
+  bool Done() const { return pos_ == in_.size(); }
+
+ private:
+  absl::string_view in_;
+  size_t pos_;
+};
+
+// Interns strings in first seen order.
+class StringTable {
+ public:
+  uint32_t Add(const std::string& s) {
+    auto it = index_.find(s);
+    if (it != index_.end()) {
+      return it->second;
+    }
+    const uint32_t i = strings_.size();
+    index_[s] = i;
+    strings_.push_back(&s);
+    return i;
+  }
+
+  const std::vector<const std::string*>& strings() const { return strings_; }
+
+ private:
+  absl::flat_hash_map<absl::string_view, uint32_t> index_;
+  std::vector<const std::string*> strings_;
+};
+
+Status Corrupt() {
+  return Status(tensorflow::error::INVALID_ARGUMENT,
+                "Encoded program is truncated or corrupt.");
+}
+
+// Qubit count and arg names, in stored order, of every EncodedGateKind.
+struct GateDef {
+  const char* id;
+  int num_qubits;
+  std::vector<std::string> args;
+};
+
+// Indexed by EncodedGateKind.
+const std::vector<GateDef>& GateDefs() {
+  static const std::vector<GateDef>* defs = [] {
+    const std::vector<std::string> eigen = {"exponent", "exponent_scalar",
+                                            "global_shift"};
+    const std::vector<std::string> phased = {
+        "phase_exponent", "phase_exponent_scalar", "exponent",
+        "exponent_scalar"};
+    std::vector<std::string> phased_x = phased;
+    phased_x.push_back("global_shift");
+    return new std::vector<GateDef>(
+        {{"I", 1, {}},
+         {"I2", 2, {}},
+         {"HP", 1, eigen},
+         {"XP", 1, eigen},
+         {"XXP", 2, eigen},
+         {"YP", 1, eigen},
+         {"YYP", 2, eigen},
+         {"ZP", 1, eigen},
+         {"ZZP", 2, eigen},
+         {"CZP", 2, eigen},
+         {"CNP", 2, eigen},
+         {"SP", 2, eigen},
+         {"ISP", 2, eigen},
+         {"PXP", 1, phased_x},
+         {"FSIM", 2, {"theta", "theta_scalar", "phi", "phi_scalar"}},
+         {"PISP", 2, phased}});
+  }();
+  return *defs;
+}
+
+const absl::flat_hash_map<absl::string_view, EncodedGateKind>& GateKinds() {
+  static const absl::flat_hash_map<absl::string_view, EncodedGateKind>*
+      kinds = [] {
+        auto* kinds =
+            new absl::flat_hash_map<absl::string_view, EncodedGateKind>();
+        const std::vector<GateDef>& defs = GateDefs();
+        for (size_t k = 0; k < defs.size(); k++) {
+          (*kinds)[defs[k].id] = static_cast<EncodedGateKind>(k);
+        }
+        return kinds;
+      }();
+  return *kinds;
+}
+
+// Writes the resolved gates of `program` to `out`. Returns false if an
+// operation is not a gate the qsim parser accepts or the qubits cannot be
+// resolved, the simulators then parse the Program and report the error.
+// Every string written is already in `table`.
+bool EncodeResolved(const Program& program, StringTable* table,
+                    std::string* out) {
+  Program resolved = program;
+  unsigned int num_qubits;
+  if (!ResolveQubitIds(&resolved, &num_qubits).ok()) {
+    return false;
+  }
+
+  std::vector<const std::string*> qubit_ids(num_qubits, nullptr);
+  std::string gates;
+  Writer w(&gates);
+  uint32_t num_gates = 0;
+  for (int m = 0; m < program.circuit().moments_size(); m++) {
+    const Moment& moment = program.circuit().moments(m);
+    const Moment& resolved_moment = resolved.circuit().moments(m);
+    for (int o = 0; o < moment.operations_size(); o++) {
+      const Operation& op = moment.operations(o);
+      const auto kind = GateKinds().find(op.gate().id());
+      if (kind == GateKinds().end()) {
+        return false;
+      }
+      const GateDef& def = GateDefs()[static_cast<int>(kind->second)];
+      if (op.qubits_size() != def.num_qubits) {
+        return false;
+      }
+      w.U8(static_cast<uint8_t>(kind->second));
+      w.U32(m);
+      for (int q = 0; q < op.qubits_size(); q++) {
+        unsigned int k;
+        (void)absl::SimpleAtoi(resolved_moment.operations(o).qubits(q).id(),
+                               &k);
+        qubit_ids[k] = &op.qubits(q).id();
+        w.U32(k);
+      }
+      for (const std::string& name : def.args) {
+        const auto arg = op.args().find(name);
+        if (arg == op.args().end()) {
+          return false;
+        }
+        if (!arg->second.symbol().empty()) {
+          w.U8(1);
+          w.U32(table->Add(arg->second.symbol()));
+        } else {
+          w.U8(0);
+          w.F32(arg->second.arg_value().float_value());
+        }
+      }
+      num_gates++;
+    }
+  }
+
+  Writer section(out);
+  section.U32(num_qubits);
+  for (const std::string* id : qubit_ids) {
+    section.U32(table->Add(*id));
+  }
+  section.U32(num_gates);
+  section.Bytes(gates);
+  return true;
+}
+
+// Checks the header of `encoded` and reads its string table, leaving `r`
+// at the resolved gates.
+Status ReadHeader(absl::string_view encoded, Reader* r,
+                  std::vector<absl::string_view>* strings) {
+  if (!IsEncodedProgram(encoded)) {
+    return Status(tensorflow::error::INVALID_ARGUMENT,
+                  "Input is not an encoded program.");
+  }
+  *r = Reader(encoded.substr(kMagicSize));
+
+  uint32_t version;
+  if (!r->U32(&version)) return Corrupt();
+  if (version != kVersion) {
+    return Status(tensorflow::error::INVALID_ARGUMENT,
+                  absl::StrCat("Unsupported encoded program version ", version,
+                               ", expected ", kVersion, "."));
+  }
+
+  uint32_t num_strings;
+  if (!r->U32(&num_strings)) return Corrupt();
+  strings->clear();
+  strings->reserve(std::min<size_t>(num_strings, encoded.size()));
+  for (uint32_t i = 0; i < num_strings; i++) {
+    uint32_t length;
+    absl::string_view s;
+    if (!r->U32(&length) || !r->Bytes(length, &s)) return Corrupt();
+    strings->push_back(s);
+  }
+  return Status::OK();
+}
+
+}  // namespace
+
+bool IsEncodedProgram(absl::string_view data) {
+  return data.size() >= kMagicSize &&
+         data.substr(0, kMagicSize) == absl::string_view(kMagic, kMagicSize);
+}
+
+Status EncodeProgram(const Program& program, std::string* encoded) {
+  if (program.has_schedule()) {
+    return Status(tensorflow::error::INVALID_ARGUMENT,
+                  "Cannot encode programs containing a schedule.");
+  }
+
+  // Operations are written to a separate body since the string table has to
+  // come first and is only complete once every operation has been visited.
+  StringTable table;
+  const uint32_t gate_set = table.Add(program.language().gate_set());
+  const uint32_t arg_language =
+      table.Add(program.language().arg_function_language());
+
+  std::string body;
+  Writer w(&body);
+  w.U32(gate_set);
+  w.U32(arg_language);
+  w.U32(program.has_circuit() ? 1 : 0);
+  w.U32(static_cast<uint32_t>(program.circuit().scheduling_strategy()));
+  w.U32(program.circuit().moments_size());
+
+  std::vector<const std::string*> arg_names;
+  for (const Moment& moment : program.circuit().moments()) {
+    w.U32(moment.operations_size());
+    for (const Operation& op : moment.operations()) {
+      w.U32(table.Add(op.gate().id()));
+      w.U32(op.qubits_size());
+      for (const Qubit& qubit : op.qubits()) {
+        w.U32(table.Add(qubit.id()));
+      }
+
+      // Map iteration order is unspecified, sort so encodings are stable.
+      arg_names.clear();
+      for (const auto& pair : op.args()) {
+        arg_names.push_back(&pair.first);
+      }
+      std::sort(arg_names.begin(), arg_names.end(),
+                [](const std::string* a, const std::string* b) {
+                  return *a < *b;
+                });
+
+      w.U32(arg_names.size());
+      for (const std::string* name : arg_names) {
+        const Arg& arg = op.args().at(*name);
+        w.U32(table.Add(*name));
+        switch (arg.arg_case()) {
+          case Arg::kSymbol:
+            w.U8(kArgSymbol);
+            w.U32(table.Add(arg.symbol()));
+            break;
+          case Arg::kFunc:
+            return Status(
+                tensorflow::error::INVALID_ARGUMENT,
+                absl::StrCat("Cannot encode arg function in argument ", *name,
+                             " of gate ", op.gate().id(), "."));
+          case Arg::kArgValue:
+            switch (arg.arg_value().value_case()) {
+              case cirq::google::api::v2::ArgValue::kFloatValue:
+                w.U8(kArgFloat);
+                w.F32(arg.arg_value().float_value());
+                break;
+              case cirq::google::api::v2::ArgValue::kStringValue:
+                w.U8(kArgString);
+                w.U32(table.Add(arg.arg_value().string_value()));
+                break;
+              case cirq::google::api::v2::ArgValue::kBoolValues: {
+                const auto& values = arg.arg_value().bool_values().values();
+                w.U8(kArgBools);
+                w.U32(values.size());
+                for (const bool b : values) {
+                  w.U8(b ? 1 : 0);
+                }
+                break;
+              }
+              default:
+                w.U8(kArgEmpty);
+                break;
+            }
+            break;
+          default:
+            w.U8(kArgEmpty);
+            break;
+        }
+      }
+    }
+  }
+
+  std::string resolved;
+  if (!EncodeResolved(program, &table, &resolved)) {
+    resolved.clear();
+  }
+
+  encoded->clear();
+  Writer out(encoded);
+  out.Bytes(absl::string_view(kMagic, kMagicSize));
+  out.U32(kVersion);
+  out.U32(table.strings().size());
+  for (const std::string* s : table.strings()) {
+    out.U32(s->size());
+    out.Bytes(*s);
+  }
+  out.U32(resolved.size());
+  out.Bytes(resolved);
+  out.Bytes(body);
+  return Status::OK();
+}
+
+Status DecodeProgram(absl::string_view encoded, Program* program) {
+  Reader r;
+  std::vector<absl::string_view> strings;
+  Status status = ReadHeader(encoded, &r, &strings);
+  if (!status.ok()) {
+    return status;
+  }
+
+  // The Program is rebuilt from the full operations only.
+  uint32_t resolved_size;
+  absl::string_view resolved;
+  if (!r.U32(&resolved_size) || !r.Bytes(resolved_size, &resolved)) {
+    return Corrupt();
+  }
+
+  auto ReadString = [&](absl::string_view* s) {
+    uint32_t i;
+    if (!r.U32(&i) || i >= strings.size()) return false;
+    *s = strings[i];
+    return true;
+  };
+
+  program->Clear();
+  absl::string_view s;
+  if (!ReadString(&s)) return Corrupt();
+  program->mutable_language()->set_gate_set(s.data(), s.size());
+  if (!ReadString(&s)) return Corrupt();
+  program->mutable_language()->set_arg_function_language(s.data(), s.size());
+  if (program->language().ByteSizeLong() == 0) {
+    program->clear_language();
+  }
+
+  uint32_t has_circuit, strategy, num_moments;
+  if (!r.U32(&has_circuit) || !r.U32(&strategy) || !r.U32(&num_moments)) {
+    return Corrupt();
+  }
+  if (!Circuit::SchedulingStrategy_IsValid(strategy)) return Corrupt();
+  if (has_circuit) {
+    Circuit* circuit = program->mutable_circuit();
+    circuit->set_scheduling_strategy(
+        static_cast<Circuit::SchedulingStrategy>(strategy));
+  }
+
+  for (uint32_t m = 0; m < num_moments; m++) {
+    uint32_t num_ops;
+    if (!r.U32(&num_ops)) return Corrupt();
+    Moment* moment = program->mutable_circuit()->add_moments();
+    for (uint32_t o = 0; o < num_ops; o++) {
+      Operation* op = moment->add_operations();
+      uint32_t num_qubits;
+      if (!ReadString(&s) || !r.U32(&num_qubits)) return Corrupt();
+      op->mutable_gate()->set_id(s.data(), s.size());
+      for (uint32_t q = 0; q < num_qubits; q++) {
+        if (!ReadString(&s)) return Corrupt();
+        op->add_qubits()->set_id(s.data(), s.size());
+      }
+
+      uint32_t num_args;
+      if (!r.U32(&num_args)) return Corrupt();
+      for (uint32_t a = 0; a < num_args; a++) {
+        uint8_t kind;
+        if (!ReadString(&s) || !r.U8(&kind)) return Corrupt();
+        Arg& arg = (*op->mutable_args())[std::string(s)];
+        switch (kind) {
+          case kArgEmpty:
+            break;
+          case kArgFloat: {
+            float f;
+            if (!r.F32(&f)) return Corrupt();
+            arg.mutable_arg_value()->set_float_value(f);
+            break;
+          }
+          case kArgSymbol:
+            if (!ReadString(&s)) return Corrupt();
+            arg.set_symbol(s.data(), s.size());
+            break;
+          case kArgString:
+            if (!ReadString(&s)) return Corrupt();
+            arg.mutable_arg_value()->set_string_value(s.data(), s.size());
+            break;
+          case kArgBools: {
+            uint32_t n;
+            if (!r.U32(&n)) return Corrupt();
+            auto* values = arg.mutable_arg_value()
+                               ->mutable_bool_values()
+                               ->mutable_values();
+            for (uint32_t b = 0; b < n; b++) {
+              uint8_t v;
+              if (!r.U8(&v)) return Corrupt();
+              values->Add(v != 0);
+            }
+            break;
+          }
+          default:
+            return Corrupt();
+        }
+      }
+    }
+  }
+
+  if (!r.Done()) return Corrupt();
+  return Status::OK();
+}
+
+Status DecodeCircuit(absl::string_view encoded, EncodedCircuit* circuit,
+                     bool* resolved) {
+  *circuit = EncodedCircuit();
+  *resolved = false;
+  Reader header;
+  std::vector<absl::string_view> strings;
+  Status status = ReadHeader(encoded, &header, &strings);
+  if (!status.ok()) {
+    return status;
+  }
+
+  uint32_t size;
+  absl::string_view section;
+  if (!header.U32(&size) || !header.Bytes(size, &section)) return Corrupt();
+  if (size == 0) {
+    return Status::OK();
+  }
+
+  Reader r(section);
+  uint32_t num_qubits;
+  if (!r.U32(&num_qubits)) return Corrupt();
+  circuit->num_qubits = num_qubits;
+  circuit->qubit_ids.reserve(std::min<size_t>(num_qubits, section.size()));
+  for (uint32_t q = 0; q < num_qubits; q++) {
+    uint32_t i;
+    if (!r.U32(&i) || i >= strings.size()) return Corrupt();
+    circuit->qubit_ids.push_back(strings[i]);
+  }
+
+  // Symbols are numbered in the order gates first use them.
+  std::vector<int> symbol_index(strings.size(), -1);
+  const std::vector<GateDef>& defs = GateDefs();
+  uint32_t num_gates;
+  if (!r.U32(&num_gates)) return Corrupt();
+  circuit->gates.reserve(std::min<size_t>(num_gates, section.size()));
+  for (uint32_t g = 0; g < num_gates; g++) {
+    uint8_t kind;
+    uint32_t time;
+    if (!r.U8(&kind) || kind >= defs.size() || !r.U32(&time)) {
+      return Corrupt();
+    }
+    const GateDef& def = defs[kind];
+    EncodedGate gate;
+    gate.kind = static_cast<EncodedGateKind>(kind);
+    gate.time = time;
+    gate.num_qubits = def.num_qubits;
+    gate.qubits[0] = gate.qubits[1] = 0;
+    for (int q = 0; q < def.num_qubits; q++) {
+      uint32_t k;
+      if (!r.U32(&k) || k >= num_qubits) return Corrupt();
+      gate.qubits[q] = k;
+    }
+    for (int a = 0; a < kMaxEncodedArgs; a++) {
+      gate.args[a] = 0.0f;
+      gate.symbols[a] = -1;
+    }
+    for (size_t a = 0; a < def.args.size(); a++) {
+      uint8_t is_symbol;
+      if (!r.U8(&is_symbol)) return Corrupt();
+      if (!is_symbol) {
+        if (!r.F32(&gate.args[a])) return Corrupt();
+        continue;
+      }
+      uint32_t i;
+      if (!r.U32(&i) || i >= strings.size()) return Corrupt();
+      if (symbol_index[i] < 0) {
+        symbol_index[i] = circuit->symbols.size();
+        circuit->symbols.push_back(strings[i]);
+      }
+      gate.symbols[a] = symbol_index[i];
+    }
+    circuit->gates.push_back(gate);
+  }
+
+  if (!r.Done()) return Corrupt();
+  *resolved = true;
+  return Status::OK();
+}
+
+}  // namespace tfq
@@ -0,0 +1,121 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// A compact binary encoding of Cirq Programs. Every string in a program
+// (gate ids, arg names, qubit ids, symbols) is stored once in a table and
+// operations are flat runs of little endian integers indexing into it, so
+// decoding is a single linear pass with no varint or tag handling.
+//
+// Programs made only of gates the qsim parser accepts also carry their
+// gates resolved: a gate kind, the qubit indices ResolveQubitIds would
+// assign and the gate's args in a fixed order, each either a float or a
+// symbol. The simulators build their qsim circuits from these directly,
+// without a Program, qubit id or gate id in between.
+//
+// Layout, all integers are uint32:
+//   "TFQC" version
+//   num_strings {length bytes}*
+//   resolved_size [num_qubits {qubit}* num_gates {gate}*]
+//   gate_set arg_function_language has_circuit scheduling_strategy
+//   num_moments {num_ops {gate num_qubits {qubit}* num_args {arg}*}*}*
+// where each arg is a name index, a one byte kind and then a float, a
+// string index or a count followed by one byte per bool. A resolved gate is
+// a one byte kind, its moment, one index per qubit and then per arg a one
+// byte flag followed by a float or, for symbols, a string index.
+// resolved_size is 0 for programs that cannot be resolved.
+
+#ifndef TFQ_CORE_SRC_CIRCUIT_ENCODING
+#define TFQ_CORE_SRC_CIRCUIT_ENCODING
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "cirq/google/api/v2/program.pb.h"
+#include "tensorflow/core/lib/core/status.h"
+
+namespace tfq {
+
+// Returns true if `data` starts with the encoded program header. Serialized
+// Program protos never do, their first byte is a field tag.
+bool IsEncodedProgram(absl::string_view data);
+
+// Writes the encoding of `program` to `encoded`. Programs containing a
+// schedule or arg functions are rejected.
+tensorflow::Status EncodeProgram(const cirq::google::api::v2::Program& program,
+                                 std::string* encoded);
+
+// Rebuilds the Program stored in `encoded`.
+tensorflow::Status DecodeProgram(absl::string_view encoded,
+                                 cirq::google::api::v2::Program* program);
+
+// The gates of a resolved program. Args are stored in the order given for
+// each kind, eigen gates are (exponent, exponent_scalar, global_shift).
+enum class EncodedGateKind : uint8_t {
+  kI = 0,   // no args
+  kI2,      // no args
+  kH,
+  kX,
+  kXX,
+  kY,
+  kYY,
+  kZ,
+  kZZ,
+  kCZ,
+  kCNot,
+  kSwap,
+  kISwap,
+  // (phase_exponent, phase_exponent_scalar, exponent, exponent_scalar,
+  //  global_shift)
+  kPhasedX,
+  // (theta, theta_scalar, phi, phi_scalar)
+  kFSim,
+  // (phase_exponent, phase_exponent_scalar, exponent, exponent_scalar)
+  kPhasedISwap,
+  kNumKinds,
+};
+
+constexpr int kMaxEncodedArgs = 5;
+
+// A resolved gate. symbols[a] is the index in EncodedCircuit::symbols of the
+// symbol arg a takes its value from, or -1 if args[a] is its value.
+struct EncodedGate {
+  EncodedGateKind kind;
+  unsigned int time;
+  unsigned int num_qubits;
+  unsigned int qubits[2];
+  float args[kMaxEncodedArgs];
+  int symbols[kMaxEncodedArgs];
+};
+
+// The resolved gates of an encoded program. qubit_ids[k] is the original id
+// of qubit k, every string points into the encoded bytes.
+struct EncodedCircuit {
+  unsigned int num_qubits = 0;
+  std::vector<absl::string_view> qubit_ids;
+  std::vector<absl::string_view> symbols;
+  std::vector<EncodedGate> gates;
+};
+
+// Reads the resolved gates stored in `encoded` into `circuit`. Sets
+// `resolved` to false, leaving `circuit` empty, if the program was encoded
+// without them, such programs have to go through DecodeProgram.
+tensorflow::Status DecodeCircuit(absl::string_view encoded,
+                                 EncodedCircuit* circuit, bool* resolved);
+
+}  // namespace tfq
+
+#endif  // TFQ_CORE_SRC_CIRCUIT_ENCODING
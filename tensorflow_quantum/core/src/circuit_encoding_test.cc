@@ -0,0 +1,275 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_quantum/core/src/circuit_encoding.h"
+
+#include <google/protobuf/text_format.h>
+#include <google/protobuf/util/message_differencer.h>
+
+#include <string>
+
+#include "cirq/google/api/v2/program.pb.h"
+#include "gtest/gtest.h"
+#include "tensorflow/core/lib/core/status.h"
+
+namespace tfq {
+namespace {
+
+using cirq::google::api::v2::Program;
+
+const char kProgramText[] = R"(
+  language {
+    gate_set: "tfq_gate_set"
+    arg_function_language: "exact"
+  }
+  circuit {
+    scheduling_strategy: MOMENT_BY_MOMENT
+    moments {
+      operations {
+        gate { id: "HP" }
+        args {
+          key: "exponent"
+          value { arg_value { float_value: 1.0 } }
+        }
+        args {
+          key: "exponent_scalar"
+          value { arg_value { float_value: 0.5 } }
+        }
+        args {
+          key: "global_shift"
+          value { arg_value { float_value: -0.5 } }
+        }
+        qubits { id: "0_0" }
+      }
+    }
+    moments {
+      operations {
+        gate { id: "CNP" }
+        args {
+          key: "exponent"
+          value { symbol: "alpha" }
+        }
+        args {
+          key: "control_qubits"
+          value { arg_value { string_value: "0_0" } }
+        }
+        args {
+          key: "control_values"
+          value { arg_value { bool_values { values: true values: false } } }
+        }
+        qubits { id: "0_0" }
+        qubits { id: "0_1" }
+      }
+    }
+  }
+)";
+
+TEST(CircuitEncodingTest, RoundTrip) {
+  Program program;
+  ASSERT_TRUE(
+      google::protobuf::TextFormat::ParseFromString(kProgramText, &program));
+
+  std::string encoded;
+  ASSERT_EQ(EncodeProgram(program, &encoded), tensorflow::Status::OK());
+  EXPECT_TRUE(IsEncodedProgram(encoded));
+
+  Program decoded;
+  ASSERT_EQ(DecodeProgram(encoded, &decoded), tensorflow::Status::OK());
+  EXPECT_TRUE(
+      google::protobuf::util::MessageDifferencer::Equals(program, decoded));
+}
+
+TEST(CircuitEncodingTest, EmptyProgram) {
+  Program program;
+  program.mutable_circuit()->set_scheduling_strategy(
+      cirq::google::api::v2::Circuit::MOMENT_BY_MOMENT);
+
+  std::string encoded;
+  ASSERT_EQ(EncodeProgram(program, &encoded), tensorflow::Status::OK());
+  Program decoded;
+  ASSERT_EQ(DecodeProgram(encoded, &decoded), tensorflow::Status::OK());
+  EXPECT_TRUE(
+      google::protobuf::util::MessageDifferencer::Equals(program, decoded));
+}
+
+TEST(CircuitEncodingTest, NotEncoded) {
+  Program program;
+  ASSERT_TRUE(
+      google::protobuf::TextFormat::ParseFromString(kProgramText, &program));
+  std::string serialized;
+  program.SerializeToString(&serialized);
+  EXPECT_FALSE(IsEncodedProgram(serialized));
+  EXPECT_FALSE(IsEncodedProgram(kProgramText));
+
+  Program decoded;
+  EXPECT_EQ(DecodeProgram(serialized, &decoded),
+            tensorflow::Status(tensorflow::error::INVALID_ARGUMENT,
+                               "Input is not an encoded program."));
+}
+
+TEST(CircuitEncodingTest, Truncated) {
+  Program program;
+  ASSERT_TRUE(
+      google::protobuf::TextFormat::ParseFromString(kProgramText, &program));
+  std::string encoded;
+  ASSERT_EQ(EncodeProgram(program, &encoded), tensorflow::Status::OK());
+
+  Program decoded;
+  for (size_t n = 4; n < encoded.size(); n++) {
+    EXPECT_FALSE(DecodeProgram(encoded.substr(0, n), &decoded).ok());
+  }
+}
+
+const char kResolvableProgramText[] = R"(
+  circuit {
+    scheduling_strategy: MOMENT_BY_MOMENT
+    moments {
+      operations {
+        gate { id: "HP" }
+        args {
+          key: "exponent"
+          value { symbol: "alpha" }
+        }
+        args {
+          key: "exponent_scalar"
+          value { arg_value { float_value: 0.5 } }
+        }
+        args {
+          key: "global_shift"
+          value { arg_value { float_value: -0.5 } }
+        }
+        qubits { id: "1_0" }
+      }
+    }
+    moments {
+      operations {
+        gate { id: "FSIM" }
+        args {
+          key: "theta"
+          value { arg_value { float_value: 0.25 } }
+        }
+        args {
+          key: "theta_scalar"
+          value { arg_value { float_value: 1.0 } }
+        }
+        args {
+          key: "phi"
+          value { symbol: "beta" }
+        }
+        args {
+          key: "phi_scalar"
+          value { arg_value { float_value: 2.0 } }
+        }
+        qubits { id: "1_0" }
+        qubits { id: "0_3" }
+      }
+    }
+  }
+)";
+
+TEST(CircuitEncodingTest, DecodeCircuit) {
+  Program program;
+  ASSERT_TRUE(google::protobuf::TextFormat::ParseFromString(
+      kResolvableProgramText, &program));
+  std::string encoded;
+  ASSERT_EQ(EncodeProgram(program, &encoded), tensorflow::Status::OK());
+
+  EncodedCircuit circuit;
+  bool resolved = false;
+  ASSERT_EQ(DecodeCircuit(encoded, &circuit, &resolved),
+            tensorflow::Status::OK());
+  ASSERT_TRUE(resolved);
+
+  // Qubits are numbered by row and then column, like ResolveQubitIds does.
+  EXPECT_EQ(circuit.num_qubits, 2);
+  ASSERT_EQ(circuit.qubit_ids.size(), 2);
+  EXPECT_EQ(circuit.qubit_ids[0], "0_3");
+  EXPECT_EQ(circuit.qubit_ids[1], "1_0");
+  ASSERT_EQ(circuit.symbols.size(), 2);
+  EXPECT_EQ(circuit.symbols[0], "alpha");
+  EXPECT_EQ(circuit.symbols[1], "beta");
+
+  ASSERT_EQ(circuit.gates.size(), 2);
+  const EncodedGate& h = circuit.gates[0];
+  EXPECT_EQ(h.kind, EncodedGateKind::kH);
+  EXPECT_EQ(h.time, 0);
+  EXPECT_EQ(h.num_qubits, 1);
+  EXPECT_EQ(h.qubits[0], 1);
+  EXPECT_EQ(h.symbols[0], 0);
+  EXPECT_EQ(h.symbols[1], -1);
+  EXPECT_EQ(h.args[1], 0.5f);
+  EXPECT_EQ(h.args[2], -0.5f);
+
+  const EncodedGate& fsim = circuit.gates[1];
+  EXPECT_EQ(fsim.kind, EncodedGateKind::kFSim);
+  EXPECT_EQ(fsim.time, 1);
+  EXPECT_EQ(fsim.num_qubits, 2);
+  EXPECT_EQ(fsim.qubits[0], 1);
+  EXPECT_EQ(fsim.qubits[1], 0);
+  EXPECT_EQ(fsim.args[0], 0.25f);
+  EXPECT_EQ(fsim.symbols[0], -1);
+  EXPECT_EQ(fsim.symbols[2], 1);
+  EXPECT_EQ(fsim.args[3], 2.0f);
+
+  // The full operations are still there for DecodeProgram.
+  Program decoded;
+  ASSERT_EQ(DecodeProgram(encoded, &decoded), tensorflow::Status::OK());
+  EXPECT_TRUE(
+      google::protobuf::util::MessageDifferencer::Equals(program, decoded));
+
+  // Inputs cut short of the end of the resolved gates are an error.
+  EXPECT_FALSE(DecodeCircuit(encoded.substr(0, 40), &circuit, &resolved).ok());
+}
+
+TEST(CircuitEncodingTest, DecodeCircuitUnresolved) {
+  // The CNOT has no exponent_scalar or global_shift, so the simulators have
+  // to parse the Program and report that.
+  Program program;
+  ASSERT_TRUE(
+      google::protobuf::TextFormat::ParseFromString(kProgramText, &program));
+  std::string encoded;
+  ASSERT_EQ(EncodeProgram(program, &encoded), tensorflow::Status::OK());
+
+  EncodedCircuit circuit;
+  bool resolved = true;
+  ASSERT_EQ(DecodeCircuit(encoded, &circuit, &resolved),
+            tensorflow::Status::OK());
+  EXPECT_FALSE(resolved);
+  EXPECT_TRUE(circuit.gates.empty());
+}
+
+TEST(CircuitEncodingTest, RejectsFunc) {
+  Program program;
+  ASSERT_TRUE(google::protobuf::TextFormat::ParseFromString(R"(
+    circuit {
+      moments {
+        operations {
+          gate { id: "XP" }
+          args {
+            key: "exponent"
+            value { func { type: "mul" } }
+          }
+          qubits { id: "0_0" }
+        }
+      }
+    }
+  )",
+                                                            &program));
+  std::string encoded;
+  EXPECT_FALSE(EncodeProgram(program, &encoded).ok());
+}
+
+}  // namespace
+}  // namespace tfq
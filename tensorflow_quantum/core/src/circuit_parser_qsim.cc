@@ -15,7 +15,11 @@ limitations under the License.
 
 #include "tensorflow_quantum/core/src/circuit_parser_qsim.h"
 
+#include <algorithm>
+#include <cmath>
+#include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "../qsim/lib/circuit.h"
@@ -28,6 +32,7 @@ limitations under the License.
 #include "absl/types/optional.h"
 #include "cirq/google/api/v2/program.pb.h"
 #include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/monitoring/counter.h"
 #include "tensorflow_quantum/core/proto/pauli_sum.pb.h"
 
 namespace tfq {
@@ -491,6 +496,469 @@ tensorflow::Status ParseAppendGate(const Operation& op,
   return build_f->second(op, param_map, num_qubits, time, circuit, metadata);
 }
 
+// Whether a one or two qubit gate has a diagonal matrix. Diagonal gates
+// commute with each other.
+bool IsDiagonal(const QsimGate& gate) {
+  const unsigned int dim = 1 << gate.num_qubits;
+  if (gate.num_qubits > 2 || gate.matrix.size() != 2 * dim * dim) {
+    return false;
+  }
+  for (unsigned int r = 0; r < dim; r++) {
+    for (unsigned int c = 0; c < dim; c++) {
+      if (r != c && (gate.matrix[2 * (dim * r + c)] != 0 ||
+                     gate.matrix[2 * (dim * r + c) + 1] != 0)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Fused gate counts of circuits built by QsimCircuitFromProgram, in
+// program order and in the order that is simulated.
+tensorflow::monitoring::Counter<1>* FusedGatesCounter() {
+  static auto* counter = tensorflow::monitoring::Counter<1>::New(
+      "/tensorflow_quantum/qsim/fused_gates",
+      "Number of fused gates before and after commuting gates for fusion.",
+      "order");
+  return counter;
+}
+
+// Circuits on fewer qubits are fused once in program order. Every fused
+// gate saved by reordering saves one sweep over the state, which only
+// pays for scheduling and fusing the circuit a second time once the state
+// is this large.
+static const int _REORDER_MIN_QUBITS = 12;
+
+// Fuses circuit, reordering its gates first when that gives fewer fused
+// gates.
+void FuseWithReordering(QsimCircuit* circuit,
+                        std::vector<qsim::GateFused<QsimGate>>* fused_circuit) {
+  *fused_circuit = qsim::BasicGateFuser<qsim::IO, QsimGate>().FuseGates(
+      circuit->num_qubits, circuit->gates);
+  const int64_t original_size = fused_circuit->size();
+  std::vector<QsimGate> reordered;
+  if (circuit->num_qubits >= _REORDER_MIN_QUBITS &&
+      ReorderGatesForFusion(circuit->gates, &reordered)) {
+    std::vector<qsim::GateFused<QsimGate>> candidate =
+        qsim::BasicGateFuser<qsim::IO, QsimGate>().FuseGates(
+            circuit->num_qubits, reordered);
+    if (candidate.size() < fused_circuit->size()) {
+      // Fused gates point into reordered, moving the vector hands its
+      // buffer over and so keeps them valid.
+      circuit->gates = std::move(reordered);
+      *fused_circuit = std::move(candidate);
+    }
+  }
+  FusedGatesCounter()->GetCell("program")->IncrementBy(original_size);
+  FusedGatesCounter()->GetCell("reordered")->IncrementBy(
+      fused_circuit->size());
+}
+
+// Matrix entries this close to the identity count as identity when
+// dropping gates.
+static const float _IDENTITY_EPS = 1e-6;
+
+bool IsIdentity(const QsimGate& gate) {
+  const unsigned int dim = 1 << gate.num_qubits;
+  if (gate.matrix.size() != 2 * dim * dim) {
+    return false;
+  }
+  for (unsigned int r = 0; r < dim; r++) {
+    for (unsigned int c = 0; c < dim; c++) {
+      const float re = gate.matrix[2 * (dim * r + c)];
+      const float im = gate.matrix[2 * (dim * r + c) + 1];
+      if (std::fabs(re - (r == c ? 1 : 0)) > _IDENTITY_EPS ||
+          std::fabs(im) > _IDENTITY_EPS) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool IsSymbolic(const std::vector<GateMetaData>* metadata, const int i) {
+  return metadata != nullptr && !(*metadata)[i].symbol_values.empty();
+}
+
+// Replaces b with a * b for dim x dim complex matrices.
+void LeftMultiply(const unsigned int dim, const std::vector<float>& a,
+                  std::vector<float>* b) {
+  std::vector<float> product(2 * dim * dim, 0);
+  for (unsigned int r = 0; r < dim; r++) {
+    for (unsigned int c = 0; c < dim; c++) {
+      for (unsigned int k = 0; k < dim; k++) {
+        const float ar = a[2 * (dim * r + k)];
+        const float ai = a[2 * (dim * r + k) + 1];
+        const float br = (*b)[2 * (dim * k + c)];
+        const float bi = (*b)[2 * (dim * k + c) + 1];
+        product[2 * (dim * r + c)] += ar * br - ai * bi;
+        product[2 * (dim * r + c) + 1] += ar * bi + ai * br;
+      }
+    }
+  }
+  *b = product;
+}
+
+// Merges gate i into gate prev, which acts on the same qubits right before
+// it. Constant gates are multiplied together. A symbolic eigen gate and a
+// constant one of the same kind and global shift become one gate with the
+// summed exponent, the constant part is moved into the symbol's recorded
+// value so gradients of the merged gate are unchanged. Returns false if
+// the gates can't be merged.
+bool MergeGates(const int prev, const int i, QsimCircuit* circuit,
+                std::vector<GateMetaData>* metadata) {
+  QsimGate& first = circuit->gates[prev];
+  const QsimGate& second = circuit->gates[i];
+  const bool first_symbolic = IsSymbolic(metadata, prev);
+  const bool second_symbolic = IsSymbolic(metadata, i);
+  if (!first_symbolic && !second_symbolic) {
+    LeftMultiply(1 << first.num_qubits, second.matrix, &first.matrix);
+    if (metadata != nullptr) {
+      // Only the matrix describes a folded gate now.
+      GateMetaData& info = (*metadata)[prev];
+      info.gate_params.clear();
+      info.create_f1 = nullptr;
+      info.create_f2 = nullptr;
+    }
+    return true;
+  }
+  if (first_symbolic == second_symbolic || first.kind != second.kind) {
+    return false;
+  }
+
+  GateMetaData symbolic = (*metadata)[first_symbolic ? prev : i];
+  const GateMetaData& constant = (*metadata)[first_symbolic ? i : prev];
+  if (symbolic.gate_params.size() != 3 || constant.gate_params.size() != 3 ||
+      symbolic.placeholder_names.size() != 1 ||
+      symbolic.placeholder_names[0] != GateParamNames::kExponent ||
+      symbolic.gate_params[1] == 0 ||
+      symbolic.gate_params[2] != constant.gate_params[2]) {
+    return false;
+  }
+  if (!(symbolic.create_f1 && constant.create_f1) &&
+      !(symbolic.create_f2 && constant.create_f2)) {
+    return false;
+  }
+
+  // exponents add up for equal global shifts.
+  symbolic.gate_params[0] += constant.gate_params[0] *
+                             constant.gate_params[1] /
+                             symbolic.gate_params[1];
+  const float exponent = symbolic.gate_params[0] * symbolic.gate_params[1];
+  const float global_shift = symbolic.gate_params[2];
+  if (symbolic.create_f1) {
+    first = symbolic.create_f1(first.time, first.qubits[0], exponent,
+                               global_shift);
+  } else {
+    first = symbolic.create_f2(first.time, first.qubits[0], first.qubits[1],
+                               exponent, global_shift);
+  }
+  (*metadata)[prev] = symbolic;
+  return true;
+}
+
+// Appends a gate read with DecodeCircuit, args are its resolved arg values.
+// The metadata matches what ParseAppendGate records for the same gate.
+void AppendEncodedGate(const EncodedGate& gate, const float* args,
+                       const EncodedCircuit& encoded,
+                       const unsigned int num_qubits, QsimCircuit* circuit,
+                       std::vector<GateMetaData>* metadata) {
+  const unsigned int time = gate.time;
+  const unsigned int q0 = num_qubits - gate.qubits[0] - 1;
+  const unsigned int q1 = num_qubits - gate.qubits[1] - 1;
+  std::function<QsimGate(unsigned int, unsigned int, float, float)> create_f1;
+  std::function<QsimGate(unsigned int, unsigned int, unsigned int, float,
+                         float)>
+      create_f2;
+  int num_params = 0;
+  // Args whose symbols are recorded in the metadata, in recording order.
+  std::vector<std::pair<int, GateParamNames>> tracked;
+  switch (gate.kind) {
+    case EncodedGateKind::kI:
+      circuit->gates.push_back(qsim::Cirq::I<float>::Create(time, q0));
+      break;
+    case EncodedGateKind::kI2:
+      circuit->gates.push_back(qsim::Cirq::I2<float>::Create(time, q0, q1));
+      break;
+    case EncodedGateKind::kH:
+      create_f1 = &qsim::Cirq::HPowGate<float>::Create;
+      break;
+    case EncodedGateKind::kX:
+      create_f1 = &qsim::Cirq::XPowGate<float>::Create;
+      break;
+    case EncodedGateKind::kY:
+      create_f1 = &qsim::Cirq::YPowGate<float>::Create;
+      break;
+    case EncodedGateKind::kZ:
+      create_f1 = &qsim::Cirq::ZPowGate<float>::Create;
+      break;
+    case EncodedGateKind::kXX:
+      create_f2 = &qsim::Cirq::XXPowGate<float>::Create;
+      break;
+    case EncodedGateKind::kYY:
+      create_f2 = &qsim::Cirq::YYPowGate<float>::Create;
+      break;
+    case EncodedGateKind::kZZ:
+      create_f2 = &qsim::Cirq::ZZPowGate<float>::Create;
+      break;
+    case EncodedGateKind::kCZ:
+      create_f2 = &qsim::Cirq::CZPowGate<float>::Create;
+      break;
+    case EncodedGateKind::kCNot:
+      create_f2 = &qsim::Cirq::CXPowGate<float>::Create;
+      break;
+    case EncodedGateKind::kSwap:
+      create_f2 = &qsim::Cirq::SwapPowGate<float>::Create;
+      break;
+    case EncodedGateKind::kISwap:
+      create_f2 = &qsim::Cirq::ISwapPowGate<float>::Create;
+      break;
+    case EncodedGateKind::kPhasedX:
+      circuit->gates.push_back(qsim::Cirq::PhasedXPowGate<float>::Create(
+          time, q0, args[0] * args[1], args[2] * args[3], args[4]));
+      num_params = 5;
+      tracked = {{0, GateParamNames::kPhaseExponent},
+                 {2, GateParamNames::kExponent}};
+      break;
+    case EncodedGateKind::kFSim:
+      circuit->gates.push_back(qsim::Cirq::FSimGate<float>::Create(
+          time, q0, q1, args[0] * args[1], args[2] * args[3]));
+      num_params = 4;
+      tracked = {{0, GateParamNames::kTheta}, {2, GateParamNames::kPhi}};
+      break;
+    case EncodedGateKind::kPhasedISwap:
+      circuit->gates.push_back(qsim::Cirq::PhasedISwapPowGate<float>::Create(
+          time, q0, q1, args[0] * args[1], args[2] * args[3]));
+      num_params = 4;
+      tracked = {{0, GateParamNames::kPhaseExponent},
+                 {2, GateParamNames::kExponent}};
+      break;
+    default:
+      break;
+  }
+  if (create_f1) {
+    circuit->gates.push_back(create_f1(time, q0, args[0] * args[1], args[2]));
+  }
+  if (create_f2) {
+    circuit->gates.push_back(
+        create_f2(time, q0, q1, args[0] * args[1], args[2]));
+  }
+  if (create_f1 || create_f2) {
+    num_params = 3;
+    tracked = {{0, GateParamNames::kExponent}};
+  }
+
+  if (metadata == nullptr) {
+    return;
+  }
+  GateMetaData info;
+  info.index = circuit->gates.size() - 1;
+  info.gate_params.assign(args, args + num_params);
+  info.create_f1 = create_f1;
+  info.create_f2 = create_f2;
+  for (const auto& arg : tracked) {
+    const int symbol = gate.symbols[arg.first];
+    if (symbol >= 0) {
+      info.symbol_values.emplace_back(encoded.symbols[symbol]);
+      info.placeholder_names.push_back(arg.second);
+    }
+  }
+  metadata->push_back(info);
+}
+
+}  // namespace
+
+void OptimizeQsimCircuit(QsimCircuit* circuit,
+                         std::vector<GateMetaData>* metadata) {
+  std::vector<QsimGate>& gates = circuit->gates;
+  std::vector<bool> keep(gates.size(), true);
+  // Surviving gates on each qubit, so that cancelling a pair exposes the
+  // gate before it.
+  std::vector<std::vector<int>> wires(circuit->num_qubits);
+  for (int i = 0; i < gates.size(); i++) {
+    if (!IsSymbolic(metadata, i) && IsIdentity(gates[i])) {
+      keep[i] = false;
+      continue;
+    }
+    const std::vector<int>& wire = wires[gates[i].qubits[0]];
+    const int prev = wire.empty() ? -1 : wire.back();
+    bool adjacent = prev >= 0 && gates[prev].qubits == gates[i].qubits;
+    for (const unsigned int q : gates[i].qubits) {
+      adjacent = adjacent && !wires[q].empty() && wires[q].back() == prev;
+    }
+    if (adjacent && MergeGates(prev, i, circuit, metadata)) {
+      keep[i] = false;
+      if (!IsSymbolic(metadata, prev) && IsIdentity(gates[prev])) {
+        keep[prev] = false;
+        for (const unsigned int q : gates[prev].qubits) {
+          wires[q].pop_back();
+        }
+      }
+      continue;
+    }
+    for (const unsigned int q : gates[i].qubits) {
+      wires[q].push_back(i);
+    }
+  }
+
+  int num_kept = 0;
+  for (int i = 0; i < gates.size(); i++) {
+    if (!keep[i]) {
+      continue;
+    }
+    if (num_kept != i) {
+      gates[num_kept] = std::move(gates[i]);
+      if (metadata != nullptr) {
+        (*metadata)[num_kept] = std::move((*metadata)[i]);
+      }
+    }
+    if (metadata != nullptr) {
+      (*metadata)[num_kept].index = num_kept;
+    }
+    num_kept++;
+  }
+  gates.resize(num_kept);
+  if (metadata != nullptr) {
+    metadata->resize(num_kept);
+  }
+}
+
+bool ReorderGatesForFusion(const std::vector<QsimGate>& gates,
+                           std::vector<QsimGate>* reordered) {
+  reordered->clear();
+  unsigned int num_qubits = 0;
+  unsigned int num_two_qubit = 0;
+  for (const QsimGate& gate : gates) {
+    for (const unsigned int q : gate.qubits) {
+      num_qubits = std::max(num_qubits, q + 1);
+    }
+    num_two_qubit += gate.num_qubits > 1;
+  }
+  if (num_two_qubit < 2) {
+    // Nothing for a two qubit gate to fuse with.
+    return false;
+  }
+
+  // Dependencies, per qubit: a diagonal gate waits for the last
+  // non-diagonal gate, a non-diagonal gate also waits for every diagonal
+  // gate since then.
+  std::vector<std::vector<int>> successors(gates.size());
+  std::vector<int> num_waiting(gates.size(), 0);
+  std::vector<int> last_writer(num_qubits, -1);
+  std::vector<std::vector<int>> readers(num_qubits);
+  auto add_edge = [&](int from, int to) {
+    successors[from].push_back(to);
+    num_waiting[to]++;
+  };
+  for (int i = 0; i < gates.size(); i++) {
+    const bool diagonal = IsDiagonal(gates[i]);
+    for (const unsigned int q : gates[i].qubits) {
+      if (last_writer[q] >= 0) {
+        add_edge(last_writer[q], i);
+      }
+      if (diagonal) {
+        readers[q].push_back(i);
+        continue;
+      }
+      for (const int r : readers[q]) {
+        add_edge(r, i);
+      }
+      readers[q].clear();
+      last_writer[q] = i;
+    }
+  }
+
+  // List schedule in program order, except that after a two qubit gate any
+  // ready gate on a subset of its qubits goes next.
+  std::set<int> ready;
+  std::vector<std::set<int>> ready_on(num_qubits);
+  auto make_ready = [&](int i) {
+    ready.insert(i);
+    for (const unsigned int q : gates[i].qubits) {
+      ready_on[q].insert(i);
+    }
+  };
+  for (int i = 0; i < gates.size(); i++) {
+    if (num_waiting[i] == 0) {
+      make_ready(i);
+    }
+  }
+
+  std::vector<unsigned int> anchor;
+  reordered->reserve(gates.size());
+  bool changed = false;
+  // The fuser needs non-decreasing times overall and strictly increasing
+  // times along each qubit, so a gate goes one step after the last gate on
+  // any of its qubits.
+  std::vector<unsigned int> next_time(num_qubits, 0);
+  unsigned int time = 0;
+  while (!ready.empty()) {
+    int next = -1;
+    for (const unsigned int q : anchor) {
+      for (const int i : ready_on[q]) {
+        bool inside = true;
+        for (const unsigned int p : gates[i].qubits) {
+          inside = inside &&
+                   std::find(anchor.begin(), anchor.end(), p) != anchor.end();
+        }
+        if (inside) {
+          next = next < 0 ? i : std::min(next, i);
+          break;
+        }
+      }
+    }
+    if (next < 0) {
+      next = *ready.begin();
+    }
+
+    ready.erase(next);
+    for (const unsigned int q : gates[next].qubits) {
+      ready_on[q].erase(next);
+    }
+    for (const int s : successors[next]) {
+      if (--num_waiting[s] == 0) {
+        make_ready(s);
+      }
+    }
+    if (gates[next].num_qubits > 1) {
+      anchor = gates[next].qubits;
+    }
+
+    changed = changed || next != reordered->size();
+    for (const unsigned int q : gates[next].qubits) {
+      time = std::max(time, next_time[q]);
+    }
+    for (const unsigned int q : gates[next].qubits) {
+      next_time[q] = time + 1;
+    }
+    reordered->push_back(gates[next]);
+    reordered->back().time = time;
+  }
+  return changed;
+}
+
+namespace {
+
+// Simplifies a freshly parsed circuit and fuses it.
+void FinishQsimCircuit(QsimCircuit* circuit,
+                       std::vector<qsim::GateFused<QsimGate>>* fused_circuit,
+                       std::vector<GateMetaData>* metadata) {
+  OptimizeQsimCircuit(circuit, metadata);
+  if (fused_circuit == nullptr) {
+    return;
+  }
+
+  // Build fused circuit. Gates can only be reordered when nothing refers
+  // to them by index.
+  if (metadata == nullptr) {
+    FuseWithReordering(circuit, fused_circuit);
+    return;
+  }
+  *fused_circuit = qsim::BasicGateFuser<qsim::IO, QsimGate>().FuseGates(
+      circuit->num_qubits, circuit->gates);
+}
+
 }  // namespace
 
 tensorflow::Status QsimCircuitFromProgram(
@@ -516,10 +984,46 @@ tensorflow::Status QsimCircuitFromProgram(
     }
     time++;
   }
+  FinishQsimCircuit(circuit, fused_circuit, metadata);
+  return Status::OK();
+}
 
-  // Build fused circuit.
-  *fused_circuit = qsim::BasicGateFuser<qsim::IO, QsimGate>().FuseGates(
-      circuit->num_qubits, circuit->gates);
+tensorflow::Status QsimCircuitFromEncodedCircuit(
+    const EncodedCircuit& encoded, const SymbolMap& param_map,
+    const int num_qubits, QsimCircuit* circuit,
+    std::vector<qsim::GateFused<QsimGate>>* fused_circuit,
+    std::vector<GateMetaData>* metadata /*=nullptr*/) {
+  circuit->num_qubits = num_qubits;
+  // Special case empty.
+  if (num_qubits <= 0) {
+    return Status::OK();
+  }
+  if (static_cast<unsigned int>(num_qubits) != encoded.num_qubits) {
+    return Status(tensorflow::error::INVALID_ARGUMENT,
+                  "Encoded circuit has a different number of qubits.");
+  }
+
+  std::vector<float> symbol_values(encoded.symbols.size());
+  for (size_t s = 0; s < encoded.symbols.size(); s++) {
+    const auto iter = param_map.find(encoded.symbols[s]);
+    if (iter == param_map.end()) {
+      return Status(tensorflow::error::INVALID_ARGUMENT,
+                    "Could not find symbol in parameter map: " +
+                        std::string(encoded.symbols[s]));
+    }
+    symbol_values[s] = iter->second.second;
+  }
+
+  circuit->gates.reserve(encoded.gates.size());
+  float args[kMaxEncodedArgs];
+  for (const EncodedGate& gate : encoded.gates) {
+    for (int a = 0; a < kMaxEncodedArgs; a++) {
+      args[a] =
+          gate.symbols[a] < 0 ? gate.args[a] : symbol_values[gate.symbols[a]];
+    }
+    AppendEncodedGate(gate, args, encoded, num_qubits, circuit, metadata);
+  }
+  FinishQsimCircuit(circuit, fused_circuit, metadata);
   return Status::OK();
 }
 
@@ -26,6 +26,7 @@ limitations under the License.
 #include "cirq/google/api/v2/program.pb.h"
 #include "tensorflow/core/lib/core/status.h"
 #include "tensorflow_quantum/core/proto/pauli_sum.pb.h"
+#include "tensorflow_quantum/core/src/circuit_encoding.h"
 
 namespace tfq {
 
@@ -65,7 +66,12 @@ struct GateMetaData {
 
 // parse a serialized Cirq program into a qsim representation.
 // ingests a Cirq Circuit proto and produces a resolved qsim Circuit,
-// as well as a fused circuit.
+// as well as a fused circuit. the circuit is simplified with
+// OptimizeQsimCircuit. when metadata is not requested the gates
+// may be reordered with ReorderGatesForFusion if that fuses them into
+// fewer gates (only tried on larger circuits), metadata indices always
+// follow the program order. a null fused_circuit skips fusion for callers
+// that apply the gates one by one.
 tensorflow::Status QsimCircuitFromProgram(
     const cirq::google::api::v2::Program& program,
     const absl::flat_hash_map<std::string, std::pair<int, float>>& param_map,
@@ -73,6 +79,36 @@ tensorflow::Status QsimCircuitFromProgram(
     std::vector<qsim::GateFused<qsim::Cirq::GateCirq<float>>>* fused_circuit,
     std::vector<GateMetaData>* metdata = nullptr);
 
+// QsimCircuitFromProgram for a program read with DecodeCircuit. Gates are
+// created straight from their kinds and qubit indices and every symbol is
+// looked up in param_map once per circuit rather than once per arg.
+tensorflow::Status QsimCircuitFromEncodedCircuit(
+    const EncodedCircuit& encoded,
+    const absl::flat_hash_map<std::string, std::pair<int, float>>& param_map,
+    const int num_qubits, qsim::Circuit<qsim::Cirq::GateCirq<float>>* circuit,
+    std::vector<qsim::GateFused<qsim::Cirq::GateCirq<float>>>* fused_circuit,
+    std::vector<GateMetaData>* metdata = nullptr);
+
+// peephole pass over a parsed circuit: drops identity gates, multiplies
+// runs of constant gates on the same qubits into one gate (which also
+// merges same axis rotations) and drops the run if it cancels out. a
+// symbolic eigen gate is merged with a constant gate of the same kind by
+// adding exponents. when metadata is given it is kept aligned with the
+// gates, symbolic gates are never dropped and their metadata still
+// produces the right gradients.
+void OptimizeQsimCircuit(qsim::Circuit<qsim::Cirq::GateCirq<float>>* circuit,
+                         std::vector<GateMetaData>* metadata = nullptr);
+
+// reorder gates so that qsim's fuser can merge more of them. gates are
+// moved past gates they commute with (gates on other qubits, or a diagonal
+// gate past another diagonal gate) to sit next to earlier gates acting on
+// the same qubits. the result is written to reordered with non-decreasing
+// times that strictly increase along every qubit. returns false if the
+// order is unchanged.
+bool ReorderGatesForFusion(
+    const std::vector<qsim::Cirq::GateCirq<float>>& gates,
+    std::vector<qsim::Cirq::GateCirq<float>>* reordered);
+
 // parse a serialized pauliTerm from a larger cirq.Paulisum proto
 // into a qsim Circuit and fused circuit.
 tensorflow::Status QsimCircuitFromPauliTerm(
@@ -16,14 +16,19 @@ limitations under the License.
 #include "tensorflow_quantum/core/src/circuit_parser_qsim.h"
 
 #include <string>
+#include <vector>
 
 #include "../qsim/lib/circuit.h"
+#include "../qsim/lib/fuser_basic.h"
 #include "../qsim/lib/gates_cirq.h"
+#include "../qsim/lib/io.h"
 #include "absl/container/flat_hash_map.h"
 #include "absl/strings/numbers.h"
 #include "cirq/google/api/v2/program.pb.h"
 #include "gtest/gtest.h"
 #include "tensorflow/core/lib/core/status.h"
+#include "tensorflow_quantum/core/src/circuit_encoding.h"
+#include "tensorflow_quantum/core/src/program_resolution.h"
 
 namespace tfq {
 namespace {
@@ -67,6 +72,20 @@ inline void AssertOneQubitEqual(const QsimGate& a, const QsimGate& b) {
   ASSERT_EQ(a.qubits[0], b.qubits[0]);
 }
 
+// Whether a gate's matrix is exactly the identity.
+bool IsIdentityMatrix(const QsimGate& gate) {
+  const unsigned int dim = 1 << gate.num_qubits;
+  for (unsigned int r = 0; r < dim; r++) {
+    for (unsigned int c = 0; c < dim; c++) {
+      if (gate.matrix[2 * (dim * r + c)] != (r == c ? 1 : 0) ||
+          gate.matrix[2 * (dim * r + c) + 1] != 0) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
 class TwoQubitEigenFixture
     : public ::testing::TestWithParam<std::tuple<
           std::string, std::function<QsimGate(unsigned int, unsigned int,
@@ -308,14 +327,13 @@ TEST(QsimCircuitParserTest, SingleConstantGate) {
     SymbolMap empty_map;
     std::vector<GateMetaData> metadata;
 
+    // Identities parse but are dropped by OptimizeQsimCircuit.
     ASSERT_EQ(QsimCircuitFromProgram(program_proto, empty_map, 1, &test_circuit,
                                      &fused_circuit, &metadata),
               tensorflow::Status::OK());
-    AssertOneQubitEqual(test_circuit.gates[0], kv.second);
-    EXPECT_EQ(metadata.size(), 1);
-    EXPECT_EQ(metadata[0].placeholder_names.size(), 0);
-    EXPECT_EQ(metadata[0].symbol_values.size(), 0);
-    EXPECT_EQ(metadata[0].gate_params.size(), 0);
+    ASSERT_TRUE(IsIdentityMatrix(kv.second));
+    EXPECT_EQ(test_circuit.gates.size(), 0);
+    EXPECT_EQ(metadata.size(), 0);
   }
 }
 
@@ -344,14 +362,13 @@ TEST(QsimCircuitParserTest, TwoConstantGate) {
     SymbolMap empty_map;
     std::vector<GateMetaData> metadata;
 
+    // Identities parse but are dropped by OptimizeQsimCircuit.
     ASSERT_EQ(QsimCircuitFromProgram(program_proto, empty_map, 2, &test_circuit,
                                      &fused_circuit, &metadata),
               tensorflow::Status::OK());
-    AssertTwoQubitEqual(test_circuit.gates[0], kv.second);
-    EXPECT_EQ(metadata.size(), 1);
-    EXPECT_EQ(metadata[0].placeholder_names.size(), 0);
-    EXPECT_EQ(metadata[0].symbol_values.size(), 0);
-    EXPECT_EQ(metadata[0].gate_params.size(), 0);
+    ASSERT_TRUE(IsIdentityMatrix(kv.second));
+    EXPECT_EQ(test_circuit.gates.size(), 0);
+    EXPECT_EQ(metadata.size(), 0);
   }
 }
 
@@ -674,6 +691,96 @@ TEST(QsimCircuitParserTest, EmptyTest) {
   ASSERT_EQ(metadata.size(), 0);
 }
 
+TEST(QsimCircuitParserTest, EncodedCircuitMatchesProgram) {
+  Program program_proto;
+  Circuit* circuit_proto = program_proto.mutable_circuit();
+  circuit_proto->set_scheduling_strategy(circuit_proto->MOMENT_BY_MOMENT);
+
+  Operation* op = circuit_proto->add_moments()->add_operations();
+  op->mutable_gate()->set_id("HP");
+  (*op->mutable_args())["exponent"] = MakeArg("alpha");
+  (*op->mutable_args())["exponent_scalar"] = MakeArg(0.5);
+  (*op->mutable_args())["global_shift"] = MakeArg(0.1);
+  op->add_qubits()->set_id("0_1");
+
+  op = circuit_proto->add_moments()->add_operations();
+  op->mutable_gate()->set_id("FSIM");
+  (*op->mutable_args())["theta"] = MakeArg(0.3);
+  (*op->mutable_args())["theta_scalar"] = MakeArg(1.0);
+  (*op->mutable_args())["phi"] = MakeArg("beta");
+  (*op->mutable_args())["phi_scalar"] = MakeArg(0.7);
+  op->add_qubits()->set_id("0_1");
+  op->add_qubits()->set_id("0_0");
+
+  op = circuit_proto->add_moments()->add_operations();
+  op->mutable_gate()->set_id("PXP");
+  (*op->mutable_args())["phase_exponent"] = MakeArg("beta");
+  (*op->mutable_args())["phase_exponent_scalar"] = MakeArg(1.0);
+  (*op->mutable_args())["exponent"] = MakeArg("alpha");
+  (*op->mutable_args())["exponent_scalar"] = MakeArg(0.25);
+  (*op->mutable_args())["global_shift"] = MakeArg(0.0);
+  op->add_qubits()->set_id("0_0");
+
+  SymbolMap symbol_map = {{"alpha", std::pair<int, float>(0, 0.4)},
+                          {"beta", std::pair<int, float>(1, 0.9)}};
+
+  std::string encoded;
+  ASSERT_EQ(EncodeProgram(program_proto, &encoded), tensorflow::Status::OK());
+  EncodedCircuit encoded_circuit;
+  bool resolved;
+  ASSERT_EQ(DecodeCircuit(encoded, &encoded_circuit, &resolved),
+            tensorflow::Status::OK());
+  ASSERT_TRUE(resolved);
+
+  unsigned int num_qubits;
+  ASSERT_EQ(ResolveQubitIds(&program_proto, &num_qubits),
+            tensorflow::Status::OK());
+  ASSERT_EQ(num_qubits, encoded_circuit.num_qubits);
+
+  QsimCircuit expected, actual;
+  std::vector<qsim::GateFused<QsimGate>> expected_fused, actual_fused;
+  std::vector<GateMetaData> expected_meta, actual_meta;
+  ASSERT_EQ(QsimCircuitFromProgram(program_proto, symbol_map, num_qubits,
+                                   &expected, &expected_fused, &expected_meta),
+            tensorflow::Status::OK());
+  ASSERT_EQ(QsimCircuitFromEncodedCircuit(encoded_circuit, symbol_map,
+                                          num_qubits, &actual, &actual_fused,
+                                          &actual_meta),
+            tensorflow::Status::OK());
+
+  ASSERT_EQ(actual.gates.size(), expected.gates.size());
+  for (size_t i = 0; i < expected.gates.size(); i++) {
+    EXPECT_EQ(actual.gates[i].time, expected.gates[i].time);
+    EXPECT_EQ(actual.gates[i].qubits, expected.gates[i].qubits);
+    if (expected.gates[i].qubits.size() == 1) {
+      AssertOneQubitEqual(actual.gates[i], expected.gates[i]);
+    } else {
+      AssertTwoQubitEqual(actual.gates[i], expected.gates[i]);
+    }
+  }
+  EXPECT_EQ(actual_fused.size(), expected_fused.size());
+  ASSERT_EQ(actual_meta.size(), expected_meta.size());
+  for (size_t i = 0; i < expected_meta.size(); i++) {
+    EXPECT_EQ(actual_meta[i].index, expected_meta[i].index);
+    EXPECT_EQ(actual_meta[i].symbol_values, expected_meta[i].symbol_values);
+    EXPECT_EQ(actual_meta[i].placeholder_names,
+              expected_meta[i].placeholder_names);
+    EXPECT_EQ(actual_meta[i].gate_params, expected_meta[i].gate_params);
+    EXPECT_EQ(static_cast<bool>(actual_meta[i].create_f1),
+              static_cast<bool>(expected_meta[i].create_f1));
+    EXPECT_EQ(static_cast<bool>(actual_meta[i].create_f2),
+              static_cast<bool>(expected_meta[i].create_f2));
+  }
+
+  // Missing symbols fail the same way.
+  symbol_map.erase("beta");
+  actual.gates.clear();
+  EXPECT_EQ(QsimCircuitFromEncodedCircuit(encoded_circuit, symbol_map,
+                                          num_qubits, &actual, &actual_fused),
+            tensorflow::Status(tensorflow::error::INVALID_ARGUMENT,
+                               "Could not find symbol in parameter map: beta"));
+}
+
 TEST(QsimCircuitParserTest, CircuitFromPauliTermPauli) {
   tfq::proto::PauliTerm pauli_proto;
   // The created circuit should not depend on the coefficient
@@ -805,6 +912,96 @@ TEST(QsimCircuitParserTest, ZBasisCircuitFromPauliTermPauliCompound) {
   AssertOneQubitEqual(test_circuit.gates[1], reference2);
 }
 
+TEST(QsimCircuitParserTest, OptimizeQsimCircuitConstant) {
+  QsimCircuit circuit;
+  circuit.num_qubits = 2;
+  circuit.gates = {qsim::Cirq::I<float>::Create(0, 0),
+                   qsim::Cirq::XPowGate<float>::Create(1, 0, 1.0, 0.0),
+                   qsim::Cirq::HPowGate<float>::Create(1, 1, 1.0, 0.0),
+                   qsim::Cirq::XPowGate<float>::Create(2, 0, 1.0, 0.0),
+                   qsim::Cirq::ZPowGate<float>::Create(2, 1, 0.5, 0.0),
+                   qsim::Cirq::CZPowGate<float>::Create(3, 0, 1, 1.0, 0.0),
+                   qsim::Cirq::I2<float>::Create(4, 0, 1)};
+
+  // X X cancels, H and S fold into S * H, identities are dropped.
+  OptimizeQsimCircuit(&circuit);
+  ASSERT_EQ(circuit.gates.size(), 2);
+  const float h = 0.70710678;
+  const float expected[8] = {h, 0, h, 0, 0, h, 0, -h};
+  for (int i = 0; i < 8; i++) {
+    EXPECT_NEAR(circuit.gates[0].matrix[i], expected[i], 1e-5);
+  }
+  EXPECT_EQ(circuit.gates[0].qubits[0], 1);
+  AssertTwoQubitEqual(circuit.gates[1],
+                      qsim::Cirq::CZPowGate<float>::Create(3, 0, 1, 1.0, 0.0));
+}
+
+TEST(QsimCircuitParserTest, OptimizeQsimCircuitKeepsSymbols) {
+  QsimCircuit circuit;
+  circuit.num_qubits = 1;
+  circuit.gates = {qsim::Cirq::I<float>::Create(0, 0),
+                   qsim::Cirq::XPowGate<float>::Create(1, 0, 0.4 * 0.5, 0.0),
+                   qsim::Cirq::XPowGate<float>::Create(2, 0, 0.3, 0.0),
+                   qsim::Cirq::YPowGate<float>::Create(3, 0, 0.0, 0.0)};
+
+  std::vector<GateMetaData> metadata(4);
+  for (int i = 0; i < 4; i++) {
+    metadata[i].index = i;
+  }
+  metadata[1].gate_params = {0.4, 0.5, 0.0};
+  metadata[1].create_f1 = &qsim::Cirq::XPowGate<float>::Create;
+  metadata[1].symbol_values = {"alpha"};
+  metadata[1].placeholder_names = {GateParamNames::kExponent};
+  metadata[2].gate_params = {0.3, 1.0, 0.0};
+  metadata[2].create_f1 = &qsim::Cirq::XPowGate<float>::Create;
+  metadata[3].gate_params = {0.0, 1.0, 0.0};
+  metadata[3].create_f1 = &qsim::Cirq::YPowGate<float>::Create;
+  metadata[3].symbol_values = {"beta"};
+  metadata[3].placeholder_names = {GateParamNames::kExponent};
+
+  // The constant rotation is merged into the symbolic one, the symbolic
+  // identity stays.
+  OptimizeQsimCircuit(&circuit, &metadata);
+  ASSERT_EQ(circuit.gates.size(), 2);
+  ASSERT_EQ(metadata.size(), 2);
+  AssertOneQubitEqual(circuit.gates[0],
+                      qsim::Cirq::XPowGate<float>::Create(1, 0, 0.5, 0.0));
+  EXPECT_EQ(metadata[0].index, 0);
+  EXPECT_EQ(metadata[0].symbol_values[0], "alpha");
+  EXPECT_NEAR(metadata[0].gate_params[0], 1.0, 1e-6);
+  EXPECT_NEAR(metadata[0].gate_params[1], 0.5, 1e-6);
+  EXPECT_EQ(metadata[1].index, 1);
+  EXPECT_EQ(metadata[1].symbol_values[0], "beta");
+}
+
+TEST(QsimCircuitParserTest, ReorderGatesForFusion) {
+  // All diagonal, the second CZ(0, 1) commutes past CZ(1, 2).
+  std::vector<QsimGate> gates = {
+      qsim::Cirq::CZPowGate<float>::Create(0, 0, 1, 1.0, 0.0),
+      qsim::Cirq::CZPowGate<float>::Create(1, 1, 2, 1.0, 0.0),
+      qsim::Cirq::CZPowGate<float>::Create(2, 0, 1, 0.5, 0.0)};
+  std::vector<QsimGate> reordered;
+  ASSERT_TRUE(ReorderGatesForFusion(gates, &reordered));
+  ASSERT_EQ(reordered.size(), 3);
+  AssertTwoQubitEqual(reordered[0], gates[0]);
+  AssertTwoQubitEqual(reordered[1], gates[2]);
+  AssertTwoQubitEqual(reordered[2], gates[1]);
+  // Gates sharing a qubit never share a time.
+  EXPECT_EQ(reordered[0].time, 0);
+  EXPECT_EQ(reordered[1].time, 1);
+  EXPECT_EQ(reordered[2].time, 2);
+
+  qsim::BasicGateFuser<qsim::IO, QsimGate> fuser;
+  EXPECT_EQ(fuser.FuseGates(3, gates).size(), 3);
+  EXPECT_EQ(fuser.FuseGates(3, reordered).size(), 2);
+
+  // CNOT(1, 2) acts on the target of CNOT(0, 1), nothing can move.
+  gates = {qsim::Cirq::CXPowGate<float>::Create(0, 0, 1, 1.0, 0.0),
+           qsim::Cirq::CXPowGate<float>::Create(1, 1, 2, 1.0, 0.0),
+           qsim::Cirq::CXPowGate<float>::Create(2, 0, 1, 1.0, 0.0)};
+  EXPECT_FALSE(ReorderGatesForFusion(gates, &reordered));
+}
+
 TEST(QsimCircuitParserTest, ZBasisCircuitFromPauliTermEmpty) {
   tfq::proto::PauliTerm pauli_proto;
   tensorflow::Status status;
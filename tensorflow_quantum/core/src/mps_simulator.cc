@@ -0,0 +1,315 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_quantum/core/src/mps_simulator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "third_party/eigen3/Eigen/Core"
+#include "third_party/eigen3/Eigen/QR"
+#include "third_party/eigen3/Eigen/SVD"
+
+namespace tfq {
+
+namespace {
+
+// Singular values below this (relative to the largest) are always dropped.
+static const float _SVD_CUTOFF = 1e-7;
+
+static const float _SWAP_MATRIX[32] = {1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                       0, 1, 0, 0, 0, 0, 0, 1, 0, 0, 0,
+                                       0, 0, 0, 0, 0, 0, 0, 0, 1, 0};
+
+typedef Eigen::Matrix<std::complex<float>, 2, 2> Matrix2;
+
+Matrix2 PauliMatrix(const char pauli) {
+  Matrix2 p;
+  switch (pauli) {
+    case 'X':
+      p << 0, 1, 1, 0;
+      break;
+    case 'Y':
+      p << 0, std::complex<float>(0, -1), std::complex<float>(0, 1), 0;
+      break;
+    case 'Z':
+      p << 1, 0, 0, -1;
+      break;
+    default:
+      p << 1, 0, 0, 1;
+  }
+  return p;
+}
+
+}  // namespace
+
+MatrixProductState::MatrixProductState(const unsigned int num_qubits,
+                                       const unsigned int max_bond_dim)
+    : num_qubits_(num_qubits),
+      max_bond_dim_(std::max(max_bond_dim, 1u)),
+      truncation_error_(0.0),
+      center_(0),
+      tensors_(num_qubits) {
+  SetStateZero();
+}
+
+void MatrixProductState::SetStateZero() {
+  truncation_error_ = 0.0;
+  // A product state is canonical around every site.
+  center_ = 0;
+  for (auto& tensor : tensors_) {
+    tensor[0] = Matrix::Ones(1, 1);
+    tensor[1] = Matrix::Zero(1, 1);
+  }
+}
+
+unsigned int MatrixProductState::BondDim() const {
+  unsigned int bond_dim = 1;
+  for (const auto& tensor : tensors_) {
+    bond_dim = std::max(bond_dim, static_cast<unsigned int>(tensor[0].cols()));
+  }
+  return bond_dim;
+}
+
+void MatrixProductState::ApplyGate1(const unsigned int site,
+                                    const float* matrix) {
+  std::complex<float> u[4];
+  for (int i = 0; i < 4; i++) {
+    u[i] = std::complex<float>(matrix[2 * i], matrix[2 * i + 1]);
+  }
+  auto& tensor = tensors_[site];
+  Matrix new0 = u[0] * tensor[0] + u[1] * tensor[1];
+  tensor[1] = u[2] * tensor[0] + u[3] * tensor[1];
+  tensor[0] = std::move(new0);
+}
+
+void MatrixProductState::ApplyGate2(const unsigned int site0,
+                                    const unsigned int site1,
+                                    const float* matrix) {
+  if (site1 == site0 + 1) {
+    ApplyAdjacentGate2(site0, matrix);
+    return;
+  }
+
+  // Bring site1 next to site0, apply, then move it back.
+  for (unsigned int k = site1 - 1; k > site0; k--) {
+    SwapAdjacent(k);
+  }
+  ApplyAdjacentGate2(site0, matrix);
+  for (unsigned int k = site0 + 1; k < site1; k++) {
+    SwapAdjacent(k);
+  }
+}
+
+void MatrixProductState::SwapAdjacent(const unsigned int site) {
+  ApplyAdjacentGate2(site, _SWAP_MATRIX);
+}
+
+void MatrixProductState::MoveCenter(const unsigned int site) {
+  while (center_ < site) {
+    // Split [A[0]; A[1]] = QR, keep Q here and push R into the next site.
+    auto& tensor = tensors_[center_];
+    auto& next = tensors_[center_ + 1];
+    const int chi_l = tensor[0].rows();
+    Matrix m(2 * chi_l, tensor[0].cols());
+    m << tensor[0], tensor[1];
+    Eigen::HouseholderQR<Matrix> qr(m);
+    const int k = std::min(m.rows(), m.cols());
+    const Matrix q = qr.householderQ() * Matrix::Identity(m.rows(), k);
+    const Matrix r = qr.matrixQR().topRows(k).triangularView<Eigen::Upper>();
+    for (int s = 0; s < 2; s++) {
+      tensor[s] = q.block(s * chi_l, 0, chi_l, k);
+      next[s] = r * next[s];
+    }
+    center_++;
+  }
+  while (center_ > site) {
+    // Split [A[0], A[1]] = LQ through the QR of its adjoint and push L into
+    // the previous site.
+    auto& tensor = tensors_[center_];
+    auto& prev = tensors_[center_ - 1];
+    const int chi_r = tensor[0].cols();
+    Matrix m(tensor[0].rows(), 2 * chi_r);
+    m << tensor[0], tensor[1];
+    const Matrix m_adj = m.adjoint();
+    Eigen::HouseholderQR<Matrix> qr(m_adj);
+    const int k = std::min(m_adj.rows(), m_adj.cols());
+    const Matrix q_adj =
+        (qr.householderQ() * Matrix::Identity(m_adj.rows(), k)).adjoint();
+    const Matrix l =
+        Matrix(qr.matrixQR().topRows(k).triangularView<Eigen::Upper>())
+            .adjoint();
+    for (int s = 0; s < 2; s++) {
+      tensor[s] = q_adj.block(0, s * chi_r, k, chi_r);
+      prev[s] = prev[s] * l;
+    }
+    center_--;
+  }
+}
+
+void MatrixProductState::ApplyAdjacentGate2(const unsigned int site,
+                                            const float* matrix) {
+  // With the center on the pair, the SVD below holds the Schmidt values of
+  // the whole state across the bond.
+  MoveCenter(site);
+  auto& left = tensors_[site];
+  auto& right = tensors_[site + 1];
+  const int chi_l = left[0].rows();
+  const int chi_r = right[0].cols();
+
+  // theta(s, t) = left[s] * right[t].
+  Matrix theta[4];
+  for (int s = 0; s < 2; s++) {
+    for (int t = 0; t < 2; t++) {
+      theta[2 * s + t] = left[s] * right[t];
+    }
+  }
+
+  // Apply the gate and lay the result out as a (2 chi_l) x (2 chi_r)
+  // matrix with rows (s, a) and columns (t, c).
+  Matrix m = Matrix::Zero(2 * chi_l, 2 * chi_r);
+  for (int r = 0; r < 4; r++) {
+    auto block = m.block((r >> 1) * chi_l, (r & 1) * chi_r, chi_l, chi_r);
+    for (int c = 0; c < 4; c++) {
+      const std::complex<float> u(matrix[2 * (4 * r + c)],
+                                  matrix[2 * (4 * r + c) + 1]);
+      if (u != std::complex<float>(0, 0)) {
+        block += u * theta[c];
+      }
+    }
+  }
+
+  Eigen::BDCSVD<Matrix> svd(m, Eigen::ComputeThinU | Eigen::ComputeThinV);
+  const auto& sigma = svd.singularValues();
+
+  // Keep the largest singular values up to the bond dimension cap.
+  const float total = sigma.squaredNorm();
+  int keep = 1;
+  while (keep < sigma.size() && keep < static_cast<int>(max_bond_dim_) &&
+         sigma(keep) > _SVD_CUTOFF * sigma(0)) {
+    keep++;
+  }
+  const float kept = sigma.head(keep).squaredNorm();
+  if (total > 0) {
+    truncation_error_ += (total - kept) / total;
+  }
+
+  // Renormalize what is left so the state keeps its norm.
+  const float scale = kept > 0 ? std::sqrt(total / kept) : 1.0;
+  Matrix sv = (sigma.head(keep).cast<std::complex<float>>() * scale)
+                  .asDiagonal() *
+              svd.matrixV().leftCols(keep).adjoint();
+  for (int s = 0; s < 2; s++) {
+    left[s] = svd.matrixU().block(s * chi_l, 0, chi_l, keep);
+    right[s] = sv.block(0, s * chi_r, keep, chi_r);
+  }
+  // U is left-canonical, so the center is now the right site.
+  center_ = site + 1;
+}
+
+float MatrixProductState::PauliExpectation(
+    const std::vector<std::pair<unsigned int, char>>& paulis) const {
+  std::vector<char> ops(num_qubits_, 'I');
+  for (const auto& pauli : paulis) {
+    ops[pauli.first] = pauli.second;
+  }
+
+  // Contract <psi| P |psi> left to right through the transfer matrices.
+  Matrix env = Matrix::Ones(1, 1);
+  for (unsigned int k = 0; k < num_qubits_; k++) {
+    const auto& tensor = tensors_[k];
+    if (ops[k] == 'I') {
+      env = tensor[0].adjoint() * env * tensor[0] +
+            tensor[1].adjoint() * env * tensor[1];
+      continue;
+    }
+    const Matrix2 p = PauliMatrix(ops[k]);
+    Matrix next = Matrix::Zero(tensor[0].cols(), tensor[0].cols());
+    for (int s = 0; s < 2; s++) {
+      for (int t = 0; t < 2; t++) {
+        if (p(s, t) != std::complex<float>(0, 0)) {
+          next += p(s, t) * (tensor[s].adjoint() * env * tensor[t]);
+        }
+      }
+    }
+    env = std::move(next);
+  }
+  return env(0, 0).real();
+}
+
+void MatrixProductState::Sample(
+    const int num_samples, std::mt19937* rand_gen,
+    std::vector<std::vector<int8_t>>* samples) const {
+  samples->assign(num_samples, std::vector<int8_t>(num_qubits_, 0));
+  if (num_qubits_ == 0) {
+    return;
+  }
+
+  // right_env[k] = sum_s A_k[s] right_env[k + 1] A_k[s]^dagger, the norm of
+  // everything right of site k - 1.
+  std::vector<Matrix> right_env(num_qubits_ + 1);
+  right_env[num_qubits_] = Matrix::Ones(1, 1);
+  for (int k = num_qubits_ - 1; k >= 0; k--) {
+    const auto& tensor = tensors_[k];
+    right_env[k] = tensor[0] * right_env[k + 1] * tensor[0].adjoint() +
+                   tensor[1] * right_env[k + 1] * tensor[1].adjoint();
+  }
+
+  std::uniform_real_distribution<float> distribution(0.0, 1.0);
+  for (int i = 0; i < num_samples; i++) {
+    Matrix prefix = Matrix::Ones(1, 1);
+    for (unsigned int k = 0; k < num_qubits_; k++) {
+      Matrix branch[2];
+      float probs[2];
+      for (int s = 0; s < 2; s++) {
+        branch[s] = prefix * tensors_[k][s];
+        probs[s] = std::max(
+            (branch[s] * right_env[k + 1] * branch[s].adjoint())(0, 0).real(),
+            0.0f);
+      }
+      const float norm = probs[0] + probs[1];
+      const int s = distribution(*rand_gen) * norm < probs[0] ? 0 : 1;
+      (*samples)[i][k] = s;
+      // Renormalize the prefix to avoid underflow on long chains.
+      prefix = branch[s] / std::sqrt(probs[s] > 0 ? probs[s] : 1.0f);
+    }
+  }
+}
+
+void MatrixProductState::GetWavefunction(
+    std::vector<std::complex<float>>* wavefunction) const {
+  // Row p of partial holds the contraction of the first k sites for the
+  // bitstring p, with site 0 as the most significant bit.
+  Matrix partial = Matrix::Ones(1, 1);
+  for (unsigned int k = 0; k < num_qubits_; k++) {
+    const auto& tensor = tensors_[k];
+    Matrix next(2 * partial.rows(), tensor[0].cols());
+    for (int p = 0; p < partial.rows(); p++) {
+      next.row(2 * p) = partial.row(p) * tensor[0];
+      next.row(2 * p + 1) = partial.row(p) * tensor[1];
+    }
+    partial = std::move(next);
+  }
+  wavefunction->resize(partial.rows());
+  for (int p = 0; p < partial.rows(); p++) {
+    (*wavefunction)[p] = partial(p, 0);
+  }
+}
+
+}  // namespace tfq
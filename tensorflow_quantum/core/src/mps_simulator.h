@@ -0,0 +1,138 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef TFQ_CORE_SRC_MPS_SIMULATOR_H_
+#define TFQ_CORE_SRC_MPS_SIMULATOR_H_
+
+#include <array>
+#include <complex>
+#include <cstdint>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "third_party/eigen3/Eigen/Core"
+
+namespace tfq {
+
+// Matrix product state over num_qubits qubits with a cap on the bond
+// dimension. Sites are numbered in Cirq (big-endian) order: site k is the
+// qubit with resolved id k, so site 0 is the most significant bit of a
+// wavefunction index. Two qubit gates on non-adjacent sites are applied by
+// swapping the sites next to each other and back.
+//
+// The state is kept in mixed canonical form around an orthogonality center
+// so every truncated SVD drops the smallest Schmidt values of the whole
+// state and TruncationError is the weight that was really discarded.
+//
+// Gate matrices use the qsim layout: row major with interleaved real and
+// imaginary parts. Two qubit matrices are indexed by 2 * b0 + b1 where b0 is
+// the bit of the lower site.
+class MatrixProductState {
+ public:
+  MatrixProductState(const unsigned int num_qubits,
+                     const unsigned int max_bond_dim);
+
+  // Resets the state to |00...0> and the truncation error to zero.
+  void SetStateZero();
+
+  // Applies a 2x2 gate (8 floats) on site.
+  void ApplyGate1(const unsigned int site, const float* matrix);
+
+  // Applies a 4x4 gate (32 floats) on site0 < site1.
+  void ApplyGate2(const unsigned int site0, const unsigned int site1,
+                  const float* matrix);
+
+  // Applies a qsim gate whose qubits are qsim (little-endian) indices.
+  template <typename Gate>
+  void ApplyQsimGate(const Gate& gate);
+
+  // Computes <psi| P |psi> for the Pauli string P given as (site, pauli)
+  // pairs with pauli one of 'I', 'X', 'Y', 'Z'.
+  float PauliExpectation(
+      const std::vector<std::pair<unsigned int, char>>& paulis) const;
+
+  // Draws num_samples bitstrings. samples[i][k] is the bit of site k.
+  void Sample(const int num_samples, std::mt19937* rand_gen,
+              std::vector<std::vector<int8_t>>* samples) const;
+
+  // Contracts the state into a full wavefunction of size 2 ** num_qubits.
+  void GetWavefunction(std::vector<std::complex<float>>* wavefunction) const;
+
+  // Sum of the normalized squared singular values discarded so far.
+  float TruncationError() const { return truncation_error_; }
+
+  unsigned int NumQubits() const { return num_qubits_; }
+
+  // Largest bond dimension currently in the state.
+  unsigned int BondDim() const;
+
+ private:
+  typedef Eigen::Matrix<std::complex<float>, Eigen::Dynamic, Eigen::Dynamic>
+      Matrix;
+
+  // Applies a 4x4 gate on the neighbouring sites site and site + 1 and
+  // splits the result back with a truncated SVD.
+  void ApplyAdjacentGate2(const unsigned int site, const float* matrix);
+
+  // Swaps the qubits living on site and site + 1.
+  void SwapAdjacent(const unsigned int site);
+
+  // Moves the orthogonality center to site with QR decompositions, leaving
+  // the sites left of it left-canonical and those right of it
+  // right-canonical.
+  void MoveCenter(const unsigned int site);
+
+  unsigned int num_qubits_;
+  unsigned int max_bond_dim_;
+  float truncation_error_;
+  unsigned int center_;
+
+  // tensors_[k][s] is the (left bond x right bond) matrix of site k
+  // projected onto |s>.
+  std::vector<std::array<Matrix, 2>> tensors_;
+};
+
+template <typename Gate>
+void MatrixProductState::ApplyQsimGate(const Gate& gate) {
+  if (gate.num_qubits == 1) {
+    ApplyGate1(num_qubits_ - gate.qubits[0] - 1, gate.matrix.data());
+    return;
+  }
+  // qsim indexes two qubit matrices by b_lo + 2 * b_hi with
+  // qubits[0] < qubits[1]. The lower qsim qubit is the higher site, so this
+  // is already 2 * b(site0) + b(site1).
+  if (gate.qubits[0] < gate.qubits[1]) {
+    ApplyGate2(num_qubits_ - gate.qubits[1] - 1,
+               num_qubits_ - gate.qubits[0] - 1, gate.matrix.data());
+    return;
+  }
+  // Swap the roles of the qubits in the matrix.
+  float matrix[32];
+  for (unsigned int r = 0; r < 4; r++) {
+    for (unsigned int c = 0; c < 4; c++) {
+      const unsigned int rs = ((r & 1) << 1) | (r >> 1);
+      const unsigned int cs = ((c & 1) << 1) | (c >> 1);
+      matrix[2 * (4 * rs + cs)] = gate.matrix[2 * (4 * r + c)];
+      matrix[2 * (4 * rs + cs) + 1] = gate.matrix[2 * (4 * r + c) + 1];
+    }
+  }
+  ApplyGate2(num_qubits_ - gate.qubits[0] - 1,
+             num_qubits_ - gate.qubits[1] - 1, matrix);
+}
+
+}  // namespace tfq
+
+#endif  // TFQ_CORE_SRC_MPS_SIMULATOR_H_
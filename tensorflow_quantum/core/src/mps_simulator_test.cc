@@ -0,0 +1,180 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_quantum/core/src/mps_simulator.h"
+
+#include <cmath>
+#include <complex>
+#include <random>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace tfq {
+namespace {
+
+static const float _INV_SQRT2 = 0.70710678;
+
+static const float _H[8] = {_INV_SQRT2, 0, _INV_SQRT2,  0,
+                            _INV_SQRT2, 0, -_INV_SQRT2, 0};
+
+// CNOT with the lower site as control.
+static const float _CNOT[32] = {1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
+                                0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                1, 0, 0, 0, 0, 0, 1, 0, 0, 0};
+
+TEST(MpsSimulatorTest, ZeroState) {
+  MatrixProductState mps(3, 4);
+  std::vector<std::complex<float>> wf;
+  mps.GetWavefunction(&wf);
+  ASSERT_EQ(wf.size(), 8);
+  EXPECT_NEAR(wf[0].real(), 1.0, 1e-6);
+  for (int i = 1; i < 8; i++) {
+    EXPECT_NEAR(std::abs(wf[i]), 0.0, 1e-6);
+  }
+  EXPECT_NEAR(mps.PauliExpectation({{0, 'Z'}, {2, 'Z'}}), 1.0, 1e-6);
+  EXPECT_EQ(mps.BondDim(), 1);
+}
+
+TEST(MpsSimulatorTest, GhzStateNonAdjacent) {
+  // Entangle site 0 with site 3 through the swap network.
+  MatrixProductState mps(4, 4);
+  mps.ApplyGate1(0, _H);
+  mps.ApplyGate2(0, 3, _CNOT);
+  std::vector<std::complex<float>> wf;
+  mps.GetWavefunction(&wf);
+  ASSERT_EQ(wf.size(), 16);
+
+  // The state is (|0000> + |1001>) / sqrt(2) with the middle sites
+  // untouched by the swaps.
+  for (int i = 0; i < 16; i++) {
+    const float expected = (i == 0 || i == 9) ? _INV_SQRT2 : 0.0;
+    EXPECT_NEAR(wf[i].real(), expected, 1e-5) << i;
+    EXPECT_NEAR(wf[i].imag(), 0.0, 1e-5) << i;
+  }
+  EXPECT_NEAR(mps.PauliExpectation({{0, 'Z'}, {3, 'Z'}}), 1.0, 1e-5);
+  EXPECT_NEAR(mps.PauliExpectation({{0, 'X'}, {3, 'X'}}), 1.0, 1e-5);
+  EXPECT_NEAR(mps.PauliExpectation({{0, 'Y'}, {3, 'Y'}}), -1.0, 1e-5);
+  EXPECT_NEAR(mps.PauliExpectation({{0, 'Z'}}), 0.0, 1e-5);
+  EXPECT_NEAR(mps.TruncationError(), 0.0, 1e-6);
+}
+
+TEST(MpsSimulatorTest, QsimGateOrdering) {
+  // A qsim CNOT with control on qsim qubit 0 (site 1) and target on qsim
+  // qubit 1 (site 0), stored with qubits[0] > qubits[1].
+  struct FakeGate {
+    unsigned int num_qubits;
+    unsigned int qubits[2];
+    std::vector<float> matrix;
+  };
+  FakeGate x{1, {0, 0}, {0, 0, 1, 0, 1, 0, 0, 0}};
+  // Matrix index is b(qubits[0]) + 2 * b(qubits[1]); control is qubits[0].
+  FakeGate cnot{2, {0, 1}, {1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0,
+                            0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0}};
+  MatrixProductState mps(2, 2);
+  mps.ApplyQsimGate(x);
+  mps.ApplyQsimGate(cnot);
+  std::vector<std::complex<float>> wf;
+  mps.GetWavefunction(&wf);
+  // Both qubits flipped.
+  EXPECT_NEAR(wf[3].real(), 1.0, 1e-5);
+
+  FakeGate cnot_rev = cnot;
+  cnot_rev.qubits[0] = 1;
+  cnot_rev.qubits[1] = 0;
+  mps.ApplyQsimGate(cnot_rev);
+  mps.GetWavefunction(&wf);
+  // Control is now qsim qubit 1 (site 0) which is set, so qsim qubit 0
+  // (site 1) flips back.
+  EXPECT_NEAR(wf[2].real(), 1.0, 1e-5);
+}
+
+TEST(MpsSimulatorTest, TruncationError) {
+  // A chain of GHZ-like entanglement on every bond stays at bond dimension
+  // two, so a cap of one must truncate.
+  MatrixProductState exact(3, 2);
+  MatrixProductState truncated(3, 1);
+  for (MatrixProductState* mps : {&exact, &truncated}) {
+    mps->ApplyGate1(0, _H);
+    mps->ApplyGate2(0, 1, _CNOT);
+    mps->ApplyGate2(1, 2, _CNOT);
+  }
+  EXPECT_EQ(exact.BondDim(), 2);
+  EXPECT_NEAR(exact.TruncationError(), 0.0, 1e-6);
+  EXPECT_EQ(truncated.BondDim(), 1);
+  EXPECT_GT(truncated.TruncationError(), 0.1);
+  // The kept state is still normalized.
+  EXPECT_NEAR(truncated.PauliExpectation({}), 1.0, 1e-5);
+}
+
+TEST(MpsSimulatorTest, TruncationMatchesExactState) {
+  // Real rotations taking |0> to sqrt(0.8)|0> + sqrt(0.2)|1> and
+  // sqrt(0.7)|0> + sqrt(0.3)|1>.
+  const float a0 = std::sqrt(0.8), a1 = std::sqrt(0.2);
+  const float b0 = std::sqrt(0.7), b1 = std::sqrt(0.3);
+  const float ry_a[8] = {a0, 0, -a1, 0, a1, 0, a0, 0};
+  const float ry_b[8] = {b0, 0, -b1, 0, b1, 0, b0, 0};
+
+  // Pairs (0, 2) and (1, 3) are entangled over non-adjacent bonds, so the
+  // middle bond needs four Schmidt values with weights 0.56, 0.24, 0.14 and
+  // 0.06. A cap of two keeps 0.8 of the state in a single truncation.
+  MatrixProductState exact(4, 4);
+  MatrixProductState truncated(4, 2);
+  for (MatrixProductState* mps : {&exact, &truncated}) {
+    mps->ApplyGate1(0, ry_a);
+    mps->ApplyGate2(0, 2, _CNOT);
+    mps->ApplyGate1(1, ry_b);
+    mps->ApplyGate2(1, 3, _CNOT);
+  }
+  EXPECT_NEAR(exact.TruncationError(), 0.0, 1e-6);
+  EXPECT_EQ(truncated.BondDim(), 2);
+  EXPECT_NEAR(truncated.TruncationError(), 0.2, 1e-5);
+
+  std::vector<std::complex<float>> exact_wf, truncated_wf;
+  exact.GetWavefunction(&exact_wf);
+  truncated.GetWavefunction(&truncated_wf);
+  ASSERT_EQ(exact_wf.size(), 16);
+  ASSERT_EQ(truncated_wf.size(), 16);
+  std::complex<float> overlap(0, 0);
+  float norm = 0;
+  for (int i = 0; i < 16; i++) {
+    overlap += std::conj(exact_wf[i]) * truncated_wf[i];
+    norm += std::norm(truncated_wf[i]);
+  }
+  EXPECT_NEAR(norm, 1.0, 1e-5);
+  // The optimal truncation loses exactly the reported weight.
+  EXPECT_NEAR(std::norm(overlap), 1.0 - truncated.TruncationError(), 1e-5);
+}
+
+TEST(MpsSimulatorTest, SampleCorrelated) {
+  MatrixProductState mps(3, 4);
+  mps.ApplyGate1(0, _H);
+  mps.ApplyGate2(0, 2, _CNOT);
+  std::mt19937 gen(1234);
+  std::vector<std::vector<int8_t>> samples;
+  mps.Sample(1000, &gen, &samples);
+  ASSERT_EQ(samples.size(), 1000);
+  int ones = 0;
+  for (const auto& sample : samples) {
+    ASSERT_EQ(sample.size(), 3);
+    EXPECT_EQ(sample[0], sample[2]);
+    EXPECT_EQ(sample[1], 0);
+    ones += sample[0];
+  }
+  EXPECT_NEAR(ones / 1000.0, 0.5, 0.1);
+}
+
+}  // namespace
+}  // namespace tfq
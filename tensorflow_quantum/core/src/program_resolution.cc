@@ -15,11 +15,14 @@ limitations under the License.
 
 #include "tensorflow_quantum/core/src/program_resolution.h"
 
+#include <algorithm>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "absl/container/flat_hash_map.h"
 #include "absl/container/flat_hash_set.h"
+#include "absl/strings/numbers.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_split.h"
 #include "cirq/google/api/v2/program.pb.h"
@@ -39,8 +42,28 @@ using tfq::proto::PauliQubitPair;
 using tfq::proto::PauliSum;
 using tfq::proto::PauliTerm;
 
-Status ResolveQubitIds(Program* program, unsigned int* num_qubits,
-                       std::vector<PauliSum>* p_sums /*=nullptr*/) {
+namespace {
+
+// Parses a GridQubit id of the form "row_col".
+Status ParseQubitId(const std::string& id, std::pair<int, int>* loc) {
+  const std::vector<std::string> splits = absl::StrSplit(id, "_");
+  if (splits.size() != 2 || !absl::SimpleAtoi(splits[0], &loc->first) ||
+      !absl::SimpleAtoi(splits[1], &loc->second)) {
+    return Status(tensorflow::error::INVALID_ARGUMENT,
+                  "Unable to parse qubit: " + id);
+  }
+  return Status::OK();
+}
+
+}  // namespace
+
+Status ResolveQubitIds(
+    Program* program, unsigned int* num_qubits,
+    std::vector<PauliSum>* p_sums /*=nullptr*/,
+    absl::flat_hash_map<std::string, std::string>* id_map /*=nullptr*/) {
+  if (id_map) {
+    id_map->clear();
+  }
   if (program->circuit().moments().empty()) {
     // (#679) Just ignore empty program.
     // Number of qubits in empty programs is zero.
@@ -52,23 +75,13 @@ Status ResolveQubitIds(Program* program, unsigned int* num_qubits,
   for (const Moment& moment : program->circuit().moments()) {
     for (const Operation& operation : moment.operations()) {
       for (const Qubit& qubit : operation.qubits()) {
-        int r, c;
-        const std::vector<std::string> splits = absl::StrSplit(qubit.id(), "_");
-        if (splits.size() != 2) {
-          return Status(tensorflow::error::INVALID_ARGUMENT,
-                        "Unable to parse qubit: " + qubit.id());
+        std::pair<int, int> loc;
+        Status status = ParseQubitId(qubit.id(), &loc);
+        if (!status.ok()) {
+          return status;
         }
-        if (!absl::SimpleAtoi(splits[0], &r)) {
-          return Status(tensorflow::error::INVALID_ARGUMENT,
-                        "Unable to parse qubit: " + qubit.id());
-        }
-        if (!absl::SimpleAtoi(splits[1], &c)) {
-          return Status(tensorflow::error::INVALID_ARGUMENT,
-                        "Unable to parse qubit: " + qubit.id());
-        }
-        auto locs = std::pair<std::pair<int, int>, std::string>(
-            std::pair<int, int>(r, c), qubit.id());
-        id_set.insert(locs);
+        id_set.insert(
+            std::pair<std::pair<int, int>, std::string>(loc, qubit.id()));
       }
     }
   }
@@ -83,6 +96,9 @@ Status ResolveQubitIds(Program* program, unsigned int* num_qubits,
   for (size_t i = 0; i < ids.size(); i++) {
     id_to_index[ids[i].second] = absl::StrCat(i);
   }
+  if (id_map) {
+    *id_map = id_to_index;
+  }
 
   // Replace the Program Qubit ids with the indices.
   for (Moment& moment : *program->mutable_circuit()->mutable_moments()) {
@@ -113,6 +129,164 @@ Status ResolveQubitIds(Program* program, unsigned int* num_qubits,
   return Status::OK();
 }
 
+Status QubitRegisterIndices(
+    const std::vector<std::string>& qubits,
+    absl::flat_hash_map<std::string, std::string>* id_to_index) {
+  std::vector<std::pair<std::pair<int, int>, std::string>> ids;
+  ids.reserve(qubits.size());
+  for (const std::string& id : qubits) {
+    std::pair<int, int> loc;
+    Status status = ParseQubitId(id, &loc);
+    if (!status.ok()) {
+      return status;
+    }
+    ids.push_back(std::pair<std::pair<int, int>, std::string>(loc, id));
+  }
+  std::sort(ids.begin(), ids.end());
+
+  id_to_index->clear();
+  for (size_t i = 0; i < ids.size(); i++) {
+    if (i > 0 && ids[i].first == ids[i - 1].first) {
+      return Status(tensorflow::error::INVALID_ARGUMENT,
+                    "Duplicate qubit in register: " + ids[i].second);
+    }
+    (*id_to_index)[ids[i].second] = absl::StrCat(i);
+  }
+  return Status::OK();
+}
+
+Status ResolveQubitIdsWithMap(
+    const absl::flat_hash_map<std::string, std::string>& id_to_index,
+    Program* program, std::vector<PauliSum>* p_sums /*=nullptr*/) {
+  if (program) {
+    for (Moment& moment : *program->mutable_circuit()->mutable_moments()) {
+      for (Operation& operation : *moment.mutable_operations()) {
+        for (Qubit& qubit : *operation.mutable_qubits()) {
+          const auto result = id_to_index.find(qubit.id());
+          if (result == id_to_index.end()) {
+            return Status(tensorflow::error::INVALID_ARGUMENT,
+                          "Found a circuit operating on a qubit not found in "
+                          "the register: " +
+                              qubit.id());
+          }
+          qubit.set_id(result->second);
+        }
+      }
+    }
+  }
+
+  if (p_sums) {
+    for (PauliSum& p_sum : *p_sums) {
+      for (PauliTerm& term : *p_sum.mutable_terms()) {
+        for (PauliQubitPair& pair : *term.mutable_paulis()) {
+          const auto result = id_to_index.find(pair.qubit_id());
+          if (result == id_to_index.end()) {
+            return Status(tensorflow::error::INVALID_ARGUMENT,
+                          "Found a Pauli sum operating on a qubit not found "
+                          "in the register: " +
+                              pair.qubit_id());
+          }
+          pair.set_qubit_id(result->second);
+        }
+      }
+    }
+  }
+
+  return Status::OK();
+}
+
+Status PlaceQubitsByActivity(const std::vector<int>& activity,
+                             std::vector<PauliSum>* p_sums,
+                             std::vector<unsigned int>* placement) {
+  const unsigned int num_qubits = activity.size();
+  placement->resize(num_qubits);
+  for (unsigned int k = 0; k < num_qubits; k++) {
+    (*placement)[k] = k;
+  }
+
+  // Busiest qubits first. Among equals the highest id (lowest qsim bit)
+  // comes first so that it keeps its place.
+  std::vector<unsigned int> order(num_qubits);
+  for (unsigned int k = 0; k < num_qubits; k++) {
+    order[k] = num_qubits - k - 1;
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [&activity](unsigned int a, unsigned int b) {
+                     return activity[a] > activity[b];
+                   });
+  bool identity = true;
+  for (unsigned int r = 0; r < num_qubits; r++) {
+    (*placement)[order[r]] = num_qubits - r - 1;
+    identity = identity && order[r] == num_qubits - r - 1;
+  }
+  if (identity || !p_sums) {
+    return Status::OK();
+  }
+
+  std::vector<std::string> new_ids(num_qubits);
+  for (unsigned int k = 0; k < num_qubits; k++) {
+    new_ids[k] = absl::StrCat((*placement)[k]);
+  }
+  for (PauliSum& p_sum : *p_sums) {
+    for (PauliTerm& term : *p_sum.mutable_terms()) {
+      for (PauliQubitPair& pair : *term.mutable_paulis()) {
+        unsigned int k;
+        if (!absl::SimpleAtoi(pair.qubit_id(), &k) || k >= num_qubits) {
+          return Status(tensorflow::error::INVALID_ARGUMENT,
+                        "Found a Pauli sum operating on qubits not found in "
+                        "circuit.");
+        }
+        pair.set_qubit_id(new_ids[k]);
+      }
+    }
+  }
+  return Status::OK();
+}
+
+Status PlaceQubitsByActivity(Program* program, const unsigned int num_qubits,
+                             std::vector<PauliSum>* p_sums,
+                             std::vector<unsigned int>* placement) {
+  std::vector<int> activity(num_qubits, 0);
+  for (const Moment& moment : program->circuit().moments()) {
+    for (const Operation& operation : moment.operations()) {
+      for (const Qubit& qubit : operation.qubits()) {
+        unsigned int k;
+        if (!absl::SimpleAtoi(qubit.id(), &k) || k >= num_qubits) {
+          return Status(tensorflow::error::INVALID_ARGUMENT,
+                        "Qubit ids must be resolved before placement. Got: " +
+                            qubit.id());
+        }
+        activity[k]++;
+      }
+    }
+  }
+
+  Status status = PlaceQubitsByActivity(activity, p_sums, placement);
+  if (!status.ok()) {
+    return status;
+  }
+
+  bool identity = true;
+  std::vector<std::string> new_ids(num_qubits);
+  for (unsigned int k = 0; k < num_qubits; k++) {
+    new_ids[k] = absl::StrCat((*placement)[k]);
+    identity = identity && (*placement)[k] == k;
+  }
+  if (identity) {
+    return Status::OK();
+  }
+  for (Moment& moment : *program->mutable_circuit()->mutable_moments()) {
+    for (Operation& operation : *moment.mutable_operations()) {
+      for (Qubit& qubit : *operation.mutable_qubits()) {
+        unsigned int k;
+        (void)absl::SimpleAtoi(qubit.id(), &k);
+        qubit.set_id(new_ids[k]);
+      }
+    }
+  }
+  return Status::OK();
+}
+
 Status ResolveSymbols(
     const absl::flat_hash_map<std::string, std::pair<int, float>>& param_map,
     Program* program, bool resolve_all /*=true*/) {
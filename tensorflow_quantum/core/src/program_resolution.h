@@ -20,6 +20,7 @@ limitations under the License.
 #define TFQ_CORE_SRC_PROGRAM_RESOLUTION
 
 #include <string>
+#include <vector>
 
 #include "absl/container/flat_hash_map.h"
 #include "cirq/google/api/v2/program.pb.h"
@@ -34,11 +35,54 @@ namespace tfq {
 // are strings; all ids are extracted and lexicographically ordered, then simply
 // replaced with their location in that ordering.
 //
-// The number of qubits in the program is recorded in `num_qubits`.
+// The number of qubits in the program is recorded in `num_qubits`. If
+// id_map is provided the renaming is recorded in it, for use with
+// ResolveQubitIdsWithMap on operators that arrive later.
 tensorflow::Status ResolveQubitIds(
     cirq::google::api::v2::Program* program, unsigned int* num_qubits,
+    std::vector<tfq::proto::PauliSum>* p_sums = nullptr,
+    absl::flat_hash_map<std::string, std::string>* id_map = nullptr);
+
+// Builds the renaming ResolveQubitIds would apply to a program using exactly
+// the qubits in `qubits`: ids are ordered by row and column and mapped to
+// their position in that ordering. Duplicate ids are an error.
+tensorflow::Status QubitRegisterIndices(
+    const std::vector<std::string>& qubits,
+    absl::flat_hash_map<std::string, std::string>* id_to_index);
+
+// Renames the qubit ids of program and of every PauliSum in p_sums with a
+// fixed mapping from QubitRegisterIndices, so that circuits touching
+// different subsets of one register are numbered consistently. Qubits that
+// are not in the mapping are an error. Either of program and p_sums may be
+// null.
+tensorflow::Status ResolveQubitIdsWithMap(
+    const absl::flat_hash_map<std::string, std::string>& id_to_index,
+    cirq::google::api::v2::Program* program,
     std::vector<tfq::proto::PauliSum>* p_sums = nullptr);
 
+// Renumbers the qubits of a program already run through ResolveQubitIds so
+// that the qubits used by the most operations get the highest ids. qsim
+// stores qubit id k at bit num_qubits - k - 1 of an amplitude's index, so
+// the busiest qubits end up on the lowest bits, which qsim accesses
+// contiguously and inside of a single SIMD register. Ties keep their
+// current order, a circuit that uses all qubits evenly is left unchanged.
+//
+// PauliSums in p_sums are renumbered to match. placement[k] is the new id
+// of the qubit that had id k, callers use it to put sampled bits back in
+// the original order.
+tensorflow::Status PlaceQubitsByActivity(
+    cirq::google::api::v2::Program* program, const unsigned int num_qubits,
+    std::vector<tfq::proto::PauliSum>* p_sums,
+    std::vector<unsigned int>* placement);
+
+// The placement step of PlaceQubitsByActivity for a circuit that operates
+// activity[k] times on qubit k, for callers that renumber their own gates.
+// PauliSums in p_sums are renumbered in the same way.
+tensorflow::Status PlaceQubitsByActivity(
+    const std::vector<int>& activity,
+    std::vector<tfq::proto::PauliSum>* p_sums,
+    std::vector<unsigned int>* placement);
+
 // Resolves all of the symbols present in the Program. Iterates through all
 // operations in all moments, and if any Args have a symbol, replaces the one-of
 // with an ArgValue representing the value in the parameter map keyed by the
@@ -18,6 +18,7 @@ limitations under the License.
 #include <google/protobuf/text_format.h>
 
 #include <string>
+#include <vector>
 
 #include "absl/container/flat_hash_map.h"
 #include "cirq/google/api/v2/program.pb.h"
@@ -358,5 +359,157 @@ TEST(ProgramResolutionTest, ResolveSymbolsInvalidArg) {
       "v2");
 }
 
+TEST(ProgramResolutionTest, PlaceQubitsByActivity) {
+  // Qubit 0 is used three times, 1 and 2 once each.
+  const std::string text = R"(
+    circuit {
+      moments {
+        operations {
+          qubits {
+            id: "0"
+          }
+          qubits {
+            id: "1"
+          }
+        }
+      }
+      moments {
+        operations {
+          qubits {
+            id: "0"
+          }
+        }
+      }
+      moments {
+        operations {
+          qubits {
+            id: "0"
+          }
+          qubits {
+            id: "2"
+          }
+        }
+      }
+    }
+  )";
+
+  const std::string text_p_sum = R"(
+    terms {
+      coefficient_real: 1.0
+      coefficient_imag: 0.0
+      paulis {
+        qubit_id: "1"
+        pauli_type: "Z"
+      }
+    }
+  )";
+
+  Program program;
+  ASSERT_TRUE(google::protobuf::TextFormat::ParseFromString(text, &program));
+  tfq::proto::PauliSum p_sum;
+  ASSERT_TRUE(
+      google::protobuf::TextFormat::ParseFromString(text_p_sum, &p_sum));
+  std::vector<tfq::proto::PauliSum> p_sums({p_sum});
+
+  std::vector<unsigned int> placement;
+  ASSERT_TRUE(PlaceQubitsByActivity(&program, 3, &p_sums, &placement).ok());
+
+  // The busiest qubit takes the highest id, the tie keeps its order.
+  EXPECT_EQ(placement, std::vector<unsigned int>({2, 0, 1}));
+  EXPECT_EQ(program.circuit().moments(0).operations(0).qubits(0).id(), "2");
+  EXPECT_EQ(program.circuit().moments(0).operations(0).qubits(1).id(), "0");
+  EXPECT_EQ(program.circuit().moments(2).operations(0).qubits(1).id(), "1");
+  EXPECT_EQ(p_sums[0].terms(0).paulis(0).qubit_id(), "0");
+}
+
+TEST(ProgramResolutionTest, PlaceQubitsByActivityEven) {
+  const std::string text = R"(
+    circuit {
+      moments {
+        operations {
+          qubits {
+            id: "0"
+          }
+          qubits {
+            id: "1"
+          }
+        }
+      }
+    }
+  )";
+
+  Program program;
+  ASSERT_TRUE(google::protobuf::TextFormat::ParseFromString(text, &program));
+  std::vector<unsigned int> placement;
+  ASSERT_TRUE(PlaceQubitsByActivity(&program, 2, nullptr, &placement).ok());
+  EXPECT_EQ(placement, std::vector<unsigned int>({0, 1}));
+  EXPECT_EQ(program.circuit().moments(0).operations(0).qubits(0).id(), "0");
+}
+
+TEST(ProgramResolutionTest, ResolveQubitIdsWithMap) {
+  // Only the middle qubit of a three qubit register is used.
+  const std::string text = R"(
+    circuit {
+      moments {
+        operations {
+          qubits {
+            id: "1_0"
+          }
+        }
+      }
+    }
+  )";
+
+  const std::string text_p_sum = R"(
+    terms {
+      coefficient_real: 1.0
+      coefficient_imag: 0.0
+      paulis {
+        qubit_id: "0_1"
+        pauli_type: "Z"
+      }
+    }
+  )";
+
+  absl::flat_hash_map<std::string, std::string> id_to_index;
+  ASSERT_TRUE(
+      QubitRegisterIndices({"1_0", "0_1", "0_0"}, &id_to_index).ok());
+  EXPECT_EQ(id_to_index.at("0_0"), "0");
+  EXPECT_EQ(id_to_index.at("0_1"), "1");
+  EXPECT_EQ(id_to_index.at("1_0"), "2");
+
+  Program program;
+  ASSERT_TRUE(google::protobuf::TextFormat::ParseFromString(text, &program));
+  tfq::proto::PauliSum p_sum;
+  ASSERT_TRUE(
+      google::protobuf::TextFormat::ParseFromString(text_p_sum, &p_sum));
+  std::vector<tfq::proto::PauliSum> p_sums({p_sum});
+  ASSERT_TRUE(ResolveQubitIdsWithMap(id_to_index, &program, &p_sums).ok());
+  EXPECT_EQ(program.circuit().moments(0).operations(0).qubits(0).id(), "2");
+  EXPECT_EQ(p_sums[0].terms(0).paulis(0).qubit_id(), "1");
+
+  // Qubits outside of the register are rejected.
+  program.mutable_circuit()
+      ->mutable_moments(0)
+      ->mutable_operations(0)
+      ->mutable_qubits(0)
+      ->set_id("5_5");
+  EXPECT_FALSE(ResolveQubitIdsWithMap(id_to_index, &program).ok());
+
+  EXPECT_FALSE(QubitRegisterIndices({"0_0", "0_0"}, &id_to_index).ok());
+  EXPECT_FALSE(QubitRegisterIndices({"0"}, &id_to_index).ok());
+
+  // ResolveQubitIds hands out the same renaming for the qubits it finds.
+  Program unresolved;
+  ASSERT_TRUE(
+      google::protobuf::TextFormat::ParseFromString(text, &unresolved));
+  unsigned int num_qubits;
+  ASSERT_TRUE(
+      ResolveQubitIds(&unresolved, &num_qubits, nullptr, &id_to_index).ok());
+  EXPECT_EQ(num_qubits, 1);
+  EXPECT_EQ(id_to_index.size(), 1);
+  EXPECT_EQ(id_to_index.at("1_0"), "0");
+}
+
 }  // namespace
 }  // namespace tfq
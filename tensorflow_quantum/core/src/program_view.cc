@@ -0,0 +1,415 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_quantum/core/src/program_view.h"
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "cirq/google/api/v2/program.pb.h"
+#include "tensorflow/core/lib/core/error_codes.pb.h"
+#include "tensorflow/core/lib/core/status.h"
+
+namespace tfq {
+
+using cirq::google::api::v2::Arg;
+using cirq::google::api::v2::ArgValue;
+using cirq::google::api::v2::Circuit;
+using cirq::google::api::v2::Gate;
+using cirq::google::api::v2::Moment;
+using cirq::google::api::v2::Operation;
+using cirq::google::api::v2::Program;
+using cirq::google::api::v2::Qubit;
+using tensorflow::Status;
+
+namespace {
+
+enum WireType {
+  kVarint = 0,
+  kFixed64 = 1,
+  kLengthDelimited = 2,
+  kFixed32 = 5,
+};
+
+// Field numbers of map entries, fixed by the protobuf spec.
+constexpr int kMapKeyField = 1;
+constexpr int kMapValueField = 2;
+
+// Steps through the fields of one serialized message.
+class WireReader {
+ public:
+  explicit WireReader(absl::string_view data) : data_(data), pos_(0) {}
+
+  bool done() const { return pos_ >= data_.size(); }
+
+  size_t position() const { return pos_; }
+
+  // Reads the next field. Length delimited payloads are returned in
+  // `bytes`, fixed32 payloads in `fixed32`, others are skipped.
+  bool Next(int* field, int* wire_type, absl::string_view* bytes,
+            uint32_t* fixed32) {
+    uint64_t tag;
+    if (!ReadVarint(&tag)) return false;
+    *field = static_cast<int>(tag >> 3);
+    *wire_type = static_cast<int>(tag & 7);
+    if (*field == 0) return false;
+
+    uint64_t value;
+    switch (*wire_type) {
+      case kVarint:
+        return ReadVarint(&value);
+      case kFixed64:
+        return Advance(8);
+      case kLengthDelimited:
+        if (!ReadVarint(&value) || value > data_.size() - pos_) return false;
+        *bytes = data_.substr(pos_, value);
+        pos_ += value;
+        return true;
+      case kFixed32:
+        if (data_.size() - pos_ < 4) return false;
+        *fixed32 = 0;
+        for (int i = 0; i < 4; i++) {
+          const uint8_t byte = static_cast<uint8_t>(data_[pos_ + i]);
+          *fixed32 |= static_cast<uint32_t>(byte) << (8 * i);
+        }
+        pos_ += 4;
+        return true;
+      default:
+        // Groups are not used by any of the cirq protos.
+        return false;
+    }
+  }
+
+ private:
+  bool ReadVarint(uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (pos_ >= data_.size()) return false;
+      const uint8_t byte = static_cast<uint8_t>(data_[pos_++]);
+      *value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+      if (!(byte & 0x80)) return true;
+    }
+    return false;
+  }
+
+  bool Advance(size_t n) {
+    if (data_.size() - pos_ < n) return false;
+    pos_ += n;
+    return true;
+  }
+
+  absl::string_view data_;
+  size_t pos_;
+};
+
+// Visits every field of `data`, failing if the message is malformed.
+template <typename F>
+bool ForEachField(absl::string_view data, F f) {
+  WireReader reader(data);
+  int field, wire_type;
+  absl::string_view bytes;
+  uint32_t fixed32 = 0;
+  while (!reader.done()) {
+    if (!reader.Next(&field, &wire_type, &bytes, &fixed32)) return false;
+    if (!f(field, wire_type, bytes, fixed32)) return false;
+  }
+  return true;
+}
+
+// Reads the string field `number` out of a message, last one wins.
+bool ReadStringField(absl::string_view data, int number,
+                     absl::string_view* out) {
+  return ForEachField(data, [&](int field, int wire_type,
+                                absl::string_view bytes, uint32_t) {
+    if (field == number) {
+      if (wire_type != kLengthDelimited) return false;
+      *out = bytes;
+    }
+    return true;
+  });
+}
+
+bool ParseArgValue(absl::string_view data, ArgView* arg) {
+  return ForEachField(data, [&](int field, int wire_type,
+                                absl::string_view bytes, uint32_t fixed32) {
+    switch (field) {
+      case ArgValue::kFloatValueFieldNumber:
+        if (wire_type != kFixed32) return false;
+        arg->kind = ArgView::kFloat;
+        std::memcpy(&arg->float_value, &fixed32, sizeof(float));
+        arg->text = absl::string_view();
+        break;
+      case ArgValue::kBoolValuesFieldNumber:
+        if (wire_type != kLengthDelimited) return false;
+        arg->kind = ArgView::kBools;
+        arg->float_value = 0.0f;
+        arg->text = absl::string_view();
+        break;
+      case ArgValue::kStringValueFieldNumber:
+        if (wire_type != kLengthDelimited) return false;
+        arg->kind = ArgView::kString;
+        arg->float_value = 0.0f;
+        arg->text = bytes;
+        break;
+      default:
+        break;
+    }
+    return true;
+  });
+}
+
+bool ParseArg(absl::string_view data, ArgView* arg) {
+  *arg = ArgView();
+  return ForEachField(data, [&](int field, int wire_type,
+                                absl::string_view bytes, uint32_t) {
+    if (field != Arg::kArgValueFieldNumber &&
+        field != Arg::kSymbolFieldNumber && field != Arg::kFuncFieldNumber) {
+      return true;
+    }
+    if (wire_type != kLengthDelimited) return false;
+    *arg = ArgView();
+    if (field == Arg::kArgValueFieldNumber) {
+      return ParseArgValue(bytes, arg);
+    }
+    if (field == Arg::kSymbolFieldNumber) {
+      arg->kind = ArgView::kSymbol;
+      arg->text = bytes;
+    } else {
+      arg->kind = ArgView::kFunc;
+    }
+    return true;
+  });
+}
+
+// Splits a map entry into its key and value bytes.
+bool ParseMapEntry(absl::string_view data, absl::string_view* key,
+                   absl::string_view* value) {
+  *key = absl::string_view();
+  *value = absl::string_view();
+  return ForEachField(data, [&](int field, int wire_type,
+                                absl::string_view bytes, uint32_t) {
+    if (field == kMapKeyField || field == kMapValueField) {
+      if (wire_type != kLengthDelimited) return false;
+      *(field == kMapKeyField ? key : value) = bytes;
+    }
+    return true;
+  });
+}
+
+void WriteVarint(uint64_t value, std::string* out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>((value & 0x7F) | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+Status Malformed(const char* what) {
+  return Status(tensorflow::error::INVALID_ARGUMENT,
+                std::string("Malformed serialized ") + what + ".");
+}
+
+}  // namespace
+
+Status OperationView::Reset(absl::string_view data) {
+  data_ = data;
+  gate_id_ = absl::string_view();
+  num_qubits_ = 0;
+  ArgView unused;
+  const bool ok = ForEachField(data, [&](int field, int wire_type,
+                                         absl::string_view bytes, uint32_t) {
+    absl::string_view key, value, id;
+    switch (field) {
+      case Operation::kGateFieldNumber:
+        return wire_type == kLengthDelimited &&
+               ReadStringField(bytes, Gate::kIdFieldNumber, &gate_id_);
+      case Operation::kArgsFieldNumber:
+        return wire_type == kLengthDelimited &&
+               ParseMapEntry(bytes, &key, &value) && ParseArg(value, &unused);
+      case Operation::kQubitsFieldNumber:
+        num_qubits_++;
+        return wire_type == kLengthDelimited &&
+               ReadStringField(bytes, Qubit::kIdFieldNumber, &id);
+      default:
+        return true;
+    }
+  });
+  return ok ? Status::OK() : Malformed("Operation");
+}
+
+void OperationView::ForEachQubit(
+    const std::function<void(absl::string_view)>& f) const {
+  ForEachField(data_, [&](int field, int, absl::string_view bytes, uint32_t) {
+    if (field == Operation::kQubitsFieldNumber) {
+      absl::string_view id;
+      ReadStringField(bytes, Qubit::kIdFieldNumber, &id);
+      f(id);
+    }
+    return true;
+  });
+}
+
+bool OperationView::GetArg(absl::string_view name, ArgView* arg) const {
+  // Map entries may repeat a key, the last one wins as in the parser.
+  bool found = false;
+  ForEachField(data_, [&](int field, int, absl::string_view bytes, uint32_t) {
+    if (field == Operation::kArgsFieldNumber) {
+      absl::string_view key, value;
+      ParseMapEntry(bytes, &key, &value);
+      if (key == name) {
+        ParseArg(value, arg);
+        found = true;
+      }
+    }
+    return true;
+  });
+  return found;
+}
+
+bool IsSerializedProgram(absl::string_view data) {
+  return ForEachField(data, [](int field, int wire_type, absl::string_view,
+                               uint32_t) {
+    switch (field) {
+      case Program::kLanguageFieldNumber:
+      case Program::kCircuitFieldNumber:
+      case Program::kScheduleFieldNumber:
+        return wire_type == kLengthDelimited;
+      default:
+        return false;
+    }
+  });
+}
+
+Status ForEachOperation(
+    absl::string_view program,
+    const std::function<Status(int, const OperationView&)>& f) {
+  int moment_index = 0;
+  OperationView op;
+  Status status;
+  const bool ok = ForEachField(program, [&](int field, int wire_type,
+                                            absl::string_view circuit,
+                                            uint32_t) {
+    if (field == Program::kScheduleFieldNumber) {
+      status = Status(tensorflow::error::INVALID_ARGUMENT,
+                      "Programs with a schedule are not supported.");
+      return false;
+    }
+    if (field != Program::kCircuitFieldNumber) return true;
+    if (wire_type != kLengthDelimited) return false;
+
+    return ForEachField(circuit, [&](int circuit_field, int circuit_wire_type,
+                                     absl::string_view moment, uint32_t) {
+      if (circuit_field != Circuit::kMomentsFieldNumber) return true;
+      if (circuit_wire_type != kLengthDelimited) return false;
+
+      const bool moment_ok = ForEachField(
+          moment, [&](int moment_field, int moment_wire_type,
+                      absl::string_view operation, uint32_t) {
+            if (moment_field != Moment::kOperationsFieldNumber) return true;
+            if (moment_wire_type != kLengthDelimited) return false;
+            status = op.Reset(operation);
+            if (status.ok()) {
+              status = f(moment_index, op);
+            }
+            return status.ok();
+          });
+      moment_index++;
+      return moment_ok;
+    });
+  });
+
+  if (!status.ok()) {
+    return status;
+  }
+  return ok ? Status::OK() : Malformed("Program");
+}
+
+Status AppendMoments(absl::string_view program, absl::string_view to_append,
+                     std::string* out) {
+  auto AppendError = [] {
+    return Status(tensorflow::error::INVALID_ARGUMENT,
+                  "Can only append to and from binary programs without a "
+                  "schedule.");
+  };
+  auto NoSchedule = [](int field, int, absl::string_view, uint32_t) {
+    return field != Program::kScheduleFieldNumber;
+  };
+  if (!ForEachField(program, NoSchedule)) {
+    return AppendError();
+  }
+
+  // Runs of consecutive moment records in to_append, usually just one.
+  std::vector<absl::string_view> runs;
+  size_t total = 0;
+  const bool ok = ForEachField(to_append, [&](int field, int wire_type,
+                                              absl::string_view circuit,
+                                              uint32_t) {
+    if (field == Program::kScheduleFieldNumber) return false;
+    if (field != Program::kCircuitFieldNumber) return true;
+    if (wire_type != kLengthDelimited) return false;
+
+    WireReader reader(circuit);
+    int circuit_field, circuit_wire_type;
+    absl::string_view bytes;
+    uint32_t fixed32;
+    bool extend = false;
+    while (!reader.done()) {
+      const size_t begin = reader.position();
+      if (!reader.Next(&circuit_field, &circuit_wire_type, &bytes, &fixed32)) {
+        return false;
+      }
+      if (circuit_field != Circuit::kMomentsFieldNumber) {
+        extend = false;
+        continue;
+      }
+      if (circuit_wire_type != kLengthDelimited) return false;
+      const size_t size = reader.position() - begin;
+      if (extend) {
+        runs.back() = absl::string_view(runs.back().data(),
+                                        runs.back().size() + size);
+      } else {
+        runs.push_back(circuit.substr(begin, size));
+      }
+      extend = true;
+      total += size;
+    }
+    return true;
+  });
+  if (!ok) {
+    return AppendError();
+  }
+
+  out->clear();
+  out->reserve(program.size() + total + 11);
+  out->append(program.data(), program.size());
+  if (total == 0) {
+    return Status::OK();
+  }
+
+  // A second circuit field is merged into the first by the parser, which
+  // appends its moments.
+  WriteVarint((Program::kCircuitFieldNumber << 3) | kLengthDelimited, out);
+  WriteVarint(total, out);
+  for (const absl::string_view run : runs) {
+    out->append(run.data(), run.size());
+  }
+  return Status::OK();
+}
+
+}  // namespace tfq
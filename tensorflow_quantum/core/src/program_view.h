@@ -0,0 +1,90 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Read only access to binary serialized Cirq Programs without building the
+// Program message. The reader walks the protobuf wire format in place, every
+// string it hands out points into the serialized bytes, so scanning a
+// circuit allocates nothing. Use it for ops that only inspect circuits.
+
+#ifndef TFQ_CORE_SRC_PROGRAM_VIEW
+#define TFQ_CORE_SRC_PROGRAM_VIEW
+
+#include <functional>
+#include <string>
+
+#include "absl/strings/string_view.h"
+#include "tensorflow/core/lib/core/status.h"
+
+namespace tfq {
+
+// One Arg of an Operation. float_value is 0 and text is empty unless the
+// kind says otherwise, matching the defaults of the proto accessors.
+struct ArgView {
+  enum Kind { kNotSet, kFloat, kSymbol, kString, kBools, kFunc };
+  Kind kind = kNotSet;
+  float float_value = 0.0f;
+  // The symbol name for kSymbol, the value for kString.
+  absl::string_view text;
+};
+
+// A single serialized Operation. Views are only handed out after the whole
+// operation has been checked, so the accessors cannot fail.
+class OperationView {
+ public:
+  absl::string_view gate_id() const { return gate_id_; }
+
+  int num_qubits() const { return num_qubits_; }
+
+  // Calls f with the id of every qubit in order.
+  void ForEachQubit(const std::function<void(absl::string_view)>& f) const;
+
+  // Looks up the arg called `name`. Returns false if the operation has no
+  // such arg.
+  bool GetArg(absl::string_view name, ArgView* arg) const;
+
+  // Checks `data` is a well formed Operation and points the view at it.
+  tensorflow::Status Reset(absl::string_view data);
+
+ private:
+  absl::string_view data_;
+  absl::string_view gate_id_;
+  int num_qubits_ = 0;
+};
+
+// Returns true if the outer fields of `data` look like a binary Program.
+// Text format and encoded programs (circuit_encoding.h) return false.
+bool IsSerializedProgram(absl::string_view data);
+
+// Calls f(moment_index, operation) for every operation of the binary
+// serialized Program in `program`, in circuit order. Stops at the first
+// error returned by f. Programs with a schedule instead of a circuit are
+// rejected.
+tensorflow::Status ForEachOperation(
+    absl::string_view program,
+    const std::function<tensorflow::Status(int, const OperationView&)>& f);
+
+// Writes the binary serialized Program `program` with the moments of the
+// binary serialized Program `to_append` added to the end of its circuit into
+// `out`. Repeated fields concatenate on the wire, so the moment bytes are
+// copied over as they are and neither program is parsed past its circuit
+// header. Only moments are taken from `to_append`, the language and
+// scheduling strategy of `program` are kept.
+tensorflow::Status AppendMoments(absl::string_view program,
+                                 absl::string_view to_append,
+                                 std::string* out);
+
+}  // namespace tfq
+
+#endif  // TFQ_CORE_SRC_PROGRAM_VIEW
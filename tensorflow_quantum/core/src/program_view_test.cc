@@ -0,0 +1,190 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_quantum/core/src/program_view.h"
+
+#include <google/protobuf/text_format.h>
+#include <google/protobuf/util/message_differencer.h>
+
+#include <string>
+#include <vector>
+
+#include "cirq/google/api/v2/program.pb.h"
+#include "gtest/gtest.h"
+#include "tensorflow/core/lib/core/error_codes.pb.h"
+#include "tensorflow/core/lib/core/status.h"
+
+namespace tfq {
+namespace {
+
+using cirq::google::api::v2::Program;
+
+const char kProgramText[] = R"(
+  language {
+    gate_set: "tfq_gate_set"
+  }
+  circuit {
+    scheduling_strategy: MOMENT_BY_MOMENT
+    moments {
+      operations {
+        gate { id: "HP" }
+        args {
+          key: "exponent"
+          value { arg_value { float_value: 0.25 } }
+        }
+        args {
+          key: "global_shift"
+          value { arg_value { float_value: -0.5 } }
+        }
+        qubits { id: "0_0" }
+      }
+      operations {
+        gate { id: "XP" }
+        args {
+          key: "exponent"
+          value { symbol: "alpha" }
+        }
+        qubits { id: "0_1" }
+      }
+    }
+    moments {
+      operations {
+        gate { id: "CNP" }
+        args {
+          key: "control_qubits"
+          value { arg_value { string_value: "0_0" } }
+        }
+        qubits { id: "0_0" }
+        qubits { id: "0_1" }
+      }
+    }
+  }
+)";
+
+std::string SerializedProgram() {
+  Program program;
+  EXPECT_TRUE(
+      google::protobuf::TextFormat::ParseFromString(kProgramText, &program));
+  std::string serialized;
+  program.SerializeToString(&serialized);
+  return serialized;
+}
+
+TEST(ProgramViewTest, ForEachOperation) {
+  const std::string serialized = SerializedProgram();
+  ASSERT_TRUE(IsSerializedProgram(serialized));
+
+  std::vector<int> moments;
+  std::vector<std::string> gates;
+  std::vector<std::string> qubits;
+  ASSERT_EQ(ForEachOperation(serialized,
+                             [&](int moment, const OperationView& op) {
+                               moments.push_back(moment);
+                               gates.push_back(std::string(op.gate_id()));
+                               op.ForEachQubit([&](absl::string_view id) {
+                                 qubits.push_back(std::string(id));
+                               });
+                               return tensorflow::Status::OK();
+                             }),
+            tensorflow::Status::OK());
+
+  EXPECT_EQ(moments, std::vector<int>({0, 0, 1}));
+  EXPECT_EQ(gates, std::vector<std::string>({"HP", "XP", "CNP"}));
+  EXPECT_EQ(qubits, std::vector<std::string>({"0_0", "0_1", "0_0", "0_1"}));
+}
+
+TEST(ProgramViewTest, GetArg) {
+  const std::string serialized = SerializedProgram();
+  std::vector<ArgView> exponents;
+  std::vector<ArgView> controls;
+  std::vector<int> num_qubits;
+  ASSERT_EQ(ForEachOperation(serialized,
+                             [&](int, const OperationView& op) {
+                               ArgView arg;
+                               if (op.GetArg("exponent", &arg)) {
+                                 exponents.push_back(arg);
+                               }
+                               if (op.GetArg("control_qubits", &arg)) {
+                                 controls.push_back(arg);
+                               }
+                               num_qubits.push_back(op.num_qubits());
+                               return tensorflow::Status::OK();
+                             }),
+            tensorflow::Status::OK());
+
+  ASSERT_EQ(exponents.size(), 2);
+  EXPECT_EQ(exponents[0].kind, ArgView::kFloat);
+  EXPECT_FLOAT_EQ(exponents[0].float_value, 0.25);
+  EXPECT_EQ(exponents[1].kind, ArgView::kSymbol);
+  EXPECT_EQ(exponents[1].text, "alpha");
+  ASSERT_EQ(controls.size(), 1);
+  EXPECT_EQ(controls[0].kind, ArgView::kString);
+  EXPECT_EQ(controls[0].text, "0_0");
+  EXPECT_EQ(num_qubits, std::vector<int>({1, 1, 2}));
+}
+
+TEST(ProgramViewTest, StopsOnError) {
+  const std::string serialized = SerializedProgram();
+  int calls = 0;
+  const tensorflow::Status status =
+      ForEachOperation(serialized, [&](int, const OperationView&) {
+        calls++;
+        return tensorflow::Status(tensorflow::error::INVALID_ARGUMENT, "stop");
+      });
+  EXPECT_EQ(status.error_message(), "stop");
+  EXPECT_EQ(calls, 1);
+}
+
+TEST(ProgramViewTest, Malformed) {
+  EXPECT_FALSE(IsSerializedProgram("circuit { moments { } }"));
+
+  const std::string serialized = SerializedProgram();
+  auto noop = [](int, const OperationView&) {
+    return tensorflow::Status::OK();
+  };
+  // The language field comes first and is a valid program on its own, every
+  // cut inside of the circuit that follows it must be rejected.
+  for (size_t n = serialized.size() / 2; n < serialized.size(); n++) {
+    EXPECT_FALSE(ForEachOperation(serialized.substr(0, n), noop).ok());
+  }
+}
+
+TEST(ProgramViewTest, AppendMoments) {
+  const std::string serialized = SerializedProgram();
+  Program program;
+  ASSERT_TRUE(program.ParseFromString(serialized));
+
+  std::string appended;
+  ASSERT_EQ(AppendMoments(serialized, serialized, &appended),
+            tensorflow::Status::OK());
+  Program expected = program;
+  for (const auto& moment : program.circuit().moments()) {
+    *expected.mutable_circuit()->add_moments() = moment;
+  }
+  Program actual;
+  ASSERT_TRUE(actual.ParseFromString(appended));
+  EXPECT_TRUE(
+      google::protobuf::util::MessageDifferencer::Equals(expected, actual));
+
+  // Appending an empty program changes nothing.
+  ASSERT_EQ(AppendMoments(serialized, "", &appended),
+            tensorflow::Status::OK());
+  EXPECT_EQ(appended, serialized);
+
+  EXPECT_FALSE(AppendMoments(serialized, "circuit { }", &appended).ok());
+}
+
+}  // namespace
+}  // namespace tfq
@@ -0,0 +1,172 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_quantum/core/src/small_simulator.h"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace tfq {
+
+namespace {
+
+typedef void (*Kernel)(const float* matrix, float* state);
+
+// Applies a 2x2 gate on qubit Q of an N qubit state. All strides and trip
+// counts are constants, so the compiler unrolls and vectorizes the inner
+// loop and keeps the matrix in registers.
+template <unsigned int N, unsigned int Q>
+void ApplyGate1Kernel(const float* matrix, float* state) {
+  constexpr uint64_t kSize = uint64_t{1} << N;
+  constexpr uint64_t kStep = uint64_t{1} << Q;
+
+  float m[8];
+  std::copy(matrix, matrix + 8, m);
+
+  for (uint64_t base = 0; base < kSize; base += 2 * kStep) {
+    for (uint64_t k = 0; k < kStep; k++) {
+      float* p0 = state + 2 * (base + k);
+      float* p1 = state + 2 * (base + k + kStep);
+      const float r0 = p0[0];
+      const float i0 = p0[1];
+      const float r1 = p1[0];
+      const float i1 = p1[1];
+      p0[0] = m[0] * r0 - m[1] * i0 + m[2] * r1 - m[3] * i1;
+      p0[1] = m[0] * i0 + m[1] * r0 + m[2] * i1 + m[3] * r1;
+      p1[0] = m[4] * r0 - m[5] * i0 + m[6] * r1 - m[7] * i1;
+      p1[1] = m[4] * i0 + m[5] * r0 + m[6] * i1 + m[7] * r1;
+    }
+  }
+}
+
+// Applies a 4x4 gate on qubits Q0 < Q1 of an N qubit state.
+template <unsigned int N, unsigned int Q0, unsigned int Q1>
+void ApplyGate2Kernel(const float* matrix, float* state) {
+  constexpr uint64_t kSize = uint64_t{1} << N;
+  constexpr uint64_t kStep0 = uint64_t{1} << Q0;
+  constexpr uint64_t kStep1 = uint64_t{1} << Q1;
+  constexpr uint64_t kOffsets[4] = {0, kStep0, kStep1, kStep0 + kStep1};
+
+  float m[32];
+  std::copy(matrix, matrix + 32, m);
+
+  for (uint64_t hi = 0; hi < kSize; hi += 2 * kStep1) {
+    for (uint64_t mid = 0; mid < kStep1; mid += 2 * kStep0) {
+      for (uint64_t k = 0; k < kStep0; k++) {
+        float* p = state + 2 * (hi + mid + k);
+        float r[4];
+        float i[4];
+        for (unsigned int c = 0; c < 4; c++) {
+          r[c] = p[2 * kOffsets[c]];
+          i[c] = p[2 * kOffsets[c] + 1];
+        }
+        for (unsigned int row = 0; row < 4; row++) {
+          const float* mr = m + 8 * row;
+          float yr = 0;
+          float yi = 0;
+          for (unsigned int c = 0; c < 4; c++) {
+            yr += mr[2 * c] * r[c] - mr[2 * c + 1] * i[c];
+            yi += mr[2 * c] * i[c] + mr[2 * c + 1] * r[c];
+          }
+          p[2 * kOffsets[row]] = yr;
+          p[2 * kOffsets[row] + 1] = yi;
+        }
+      }
+    }
+  }
+}
+
+// gate1[n][q] and gate2[n][q0][q1] hold the kernels for n qubits.
+struct KernelTable {
+  Kernel gate1[_MAX_SMALL_QUBITS + 1][_MAX_SMALL_QUBITS];
+  Kernel gate2[_MAX_SMALL_QUBITS + 1][_MAX_SMALL_QUBITS][_MAX_SMALL_QUBITS];
+};
+
+// Fills gate2[N][Q0][Q1], ..., gate2[N][Q0][N - 1].
+template <unsigned int N, unsigned int Q0, unsigned int Q1>
+struct FillGate2 {
+  static void Run(KernelTable* table) {
+    table->gate2[N][Q0][Q1] = &ApplyGate2Kernel<N, Q0, Q1>;
+    FillGate2<N, Q0, Q1 + 1>::Run(table);
+  }
+};
+
+template <unsigned int N, unsigned int Q0>
+struct FillGate2<N, Q0, N> {
+  static void Run(KernelTable* table) {}
+};
+
+// Fills every kernel of N qubits whose lowest target is Q or above.
+template <unsigned int N, unsigned int Q>
+struct FillQubitCount {
+  static void Run(KernelTable* table) {
+    table->gate1[N][Q] = &ApplyGate1Kernel<N, Q>;
+    FillGate2<N, Q, Q + 1>::Run(table);
+    FillQubitCount<N, Q + 1>::Run(table);
+  }
+};
+
+template <unsigned int N>
+struct FillQubitCount<N, N> {
+  static void Run(KernelTable* table) {}
+};
+
+// Fills every kernel of 1 to N qubits.
+template <unsigned int N>
+struct FillTable {
+  static void Run(KernelTable* table) {
+    FillQubitCount<N, 0>::Run(table);
+    FillTable<N - 1>::Run(table);
+  }
+};
+
+template <>
+struct FillTable<0> {
+  static void Run(KernelTable* table) {}
+};
+
+const KernelTable& GetKernelTable() {
+  static const KernelTable* table = []() {
+    KernelTable* t = new KernelTable();
+    FillTable<_MAX_SMALL_QUBITS>::Run(t);
+    return t;
+  }();
+  return *table;
+}
+
+}  // namespace
+
+SmallSimulator::SmallSimulator(const unsigned int num_qubits)
+    : num_qubits_(num_qubits) {
+  // Build the table up front instead of on the first gate.
+  GetKernelTable();
+}
+
+void SmallSimulator::SetStateZero(float* state) const {
+  std::fill(state, state + (uint64_t{2} << num_qubits_), 0);
+  state[0] = 1;
+}
+
+void SmallSimulator::ApplyGate1(const unsigned int q, const float* matrix,
+                                float* state) const {
+  GetKernelTable().gate1[num_qubits_][q](matrix, state);
+}
+
+void SmallSimulator::ApplyGate2(const unsigned int q0, const unsigned int q1,
+                                const float* matrix, float* state) const {
+  GetKernelTable().gate2[num_qubits_][q0][q1](matrix, state);
+}
+
+}  // namespace tfq
@@ -0,0 +1,67 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef TFQ_CORE_SRC_SMALL_SIMULATOR_H_
+#define TFQ_CORE_SRC_SMALL_SIMULATOR_H_
+
+#include <cstdint>
+
+namespace tfq {
+
+// Largest number of qubits with specialized kernels. Up to here the whole
+// state fits in L1/L2 and the cost of a gate is mostly loop and index
+// arithmetic, which the specialized kernels resolve at compile time.
+static const unsigned int _MAX_SMALL_QUBITS = 12;
+
+// State vector simulator for 1 to _MAX_SMALL_QUBITS qubits. Every
+// (number of qubits, target qubits) combination has its own kernel
+// instantiated at compile time, the constructor and the gate calls pick
+// one from a dispatch table.
+//
+// States are 2 ** num_qubits complex amplitudes stored as interleaved
+// floats (the layout of std::complex<float>), so a simulator can write
+// straight into a complex64 tensor. Qubits and matrices follow qsim:
+// little-endian qubit indices, row major matrices with interleaved real and
+// imaginary parts, two qubit matrices indexed by b0 + 2 * b1 where b0 is
+// the bit of the lower qubit.
+class SmallSimulator {
+ public:
+  explicit SmallSimulator(const unsigned int num_qubits);
+
+  // Whether num_qubits has specialized kernels.
+  static bool Supports(const unsigned int num_qubits) {
+    return num_qubits >= 1 && num_qubits <= _MAX_SMALL_QUBITS;
+  }
+
+  // Sets state to |00...0>.
+  void SetStateZero(float* state) const;
+
+  // Applies a 2x2 gate (8 floats) on qubit q.
+  void ApplyGate1(const unsigned int q, const float* matrix,
+                  float* state) const;
+
+  // Applies a 4x4 gate (32 floats) on qubits q0 < q1.
+  void ApplyGate2(const unsigned int q0, const unsigned int q1,
+                  const float* matrix, float* state) const;
+
+  unsigned int NumQubits() const { return num_qubits_; }
+
+ private:
+  unsigned int num_qubits_;
+};
+
+}  // namespace tfq
+
+#endif  // TFQ_CORE_SRC_SMALL_SIMULATOR_H_
@@ -0,0 +1,119 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_quantum/core/src/small_simulator.h"
+
+#include <complex>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace tfq {
+namespace {
+
+typedef std::vector<std::complex<float>> Wavefunction;
+
+// Reference gate application with the target bits found at runtime.
+void ReferenceApply(const std::vector<unsigned int>& qubits,
+                    const float* matrix, Wavefunction* wf) {
+  const unsigned int dim = 1 << qubits.size();
+  Wavefunction out(wf->size(), 0);
+  for (uint64_t a = 0; a < wf->size(); a++) {
+    unsigned int row = 0;
+    for (unsigned int h = 0; h < qubits.size(); h++) {
+      row |= ((a >> qubits[h]) & 1) << h;
+    }
+    for (unsigned int col = 0; col < dim; col++) {
+      uint64_t b = a;
+      for (unsigned int h = 0; h < qubits.size(); h++) {
+        b &= ~(uint64_t{1} << qubits[h]);
+        b |= uint64_t((col >> h) & 1) << qubits[h];
+      }
+      const std::complex<float> m(matrix[2 * (dim * row + col)],
+                                  matrix[2 * (dim * row + col) + 1]);
+      out[a] += m * (*wf)[b];
+    }
+  }
+  *wf = out;
+}
+
+void ExpectSame(const Wavefunction& expected, const Wavefunction& actual) {
+  ASSERT_EQ(expected.size(), actual.size());
+  for (uint64_t a = 0; a < expected.size(); a++) {
+    EXPECT_NEAR(expected[a].real(), actual[a].real(), 1e-4);
+    EXPECT_NEAR(expected[a].imag(), actual[a].imag(), 1e-4);
+  }
+}
+
+TEST(SmallSimulatorTest, Supports) {
+  EXPECT_FALSE(SmallSimulator::Supports(0));
+  EXPECT_TRUE(SmallSimulator::Supports(1));
+  EXPECT_TRUE(SmallSimulator::Supports(_MAX_SMALL_QUBITS));
+  EXPECT_FALSE(SmallSimulator::Supports(_MAX_SMALL_QUBITS + 1));
+}
+
+TEST(SmallSimulatorTest, EveryKernelMatchesReference) {
+  std::mt19937 rand_gen(1234);
+  std::uniform_real_distribution<float> distribution(-1.0, 1.0);
+  float matrix[32];
+
+  for (unsigned int n = 1; n <= 6; n++) {
+    SmallSimulator sim(n);
+    Wavefunction wf(uint64_t{1} << n);
+    sim.SetStateZero(reinterpret_cast<float*>(wf.data()));
+    Wavefunction expected = wf;
+
+    // Random (non unitary) matrices still have to match exactly.
+    for (unsigned int q0 = 0; q0 < n; q0++) {
+      for (float& x : matrix) {
+        x = distribution(rand_gen);
+      }
+      sim.ApplyGate1(q0, matrix, reinterpret_cast<float*>(wf.data()));
+      ReferenceApply({q0}, matrix, &expected);
+      ExpectSame(expected, wf);
+
+      for (unsigned int q1 = q0 + 1; q1 < n; q1++) {
+        for (float& x : matrix) {
+          x = distribution(rand_gen) / 2;
+        }
+        sim.ApplyGate2(q0, q1, matrix, reinterpret_cast<float*>(wf.data()));
+        ReferenceApply({q0, q1}, matrix, &expected);
+        ExpectSame(expected, wf);
+      }
+    }
+  }
+}
+
+TEST(SmallSimulatorTest, LargestSize) {
+  const unsigned int n = _MAX_SMALL_QUBITS;
+  const float h = 0.70710678;
+  const float hadamard[8] = {h, 0, h, 0, h, 0, -h, 0};
+  SmallSimulator sim(n);
+  Wavefunction wf(uint64_t{1} << n);
+  sim.SetStateZero(reinterpret_cast<float*>(wf.data()));
+  for (unsigned int q = 0; q < n; q++) {
+    sim.ApplyGate1(q, hadamard, reinterpret_cast<float*>(wf.data()));
+  }
+  const float amplitude = 1.0 / 64.0;
+  for (const auto& x : wf) {
+    EXPECT_NEAR(x.real(), amplitude, 1e-5);
+    EXPECT_NEAR(x.imag(), 0.0, 1e-5);
+  }
+}
+
+}  // namespace
+}  // namespace tfq
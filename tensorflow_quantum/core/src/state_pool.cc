@@ -0,0 +1,180 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_quantum/core/src/state_pool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+
+#include "tensorflow/core/platform/mem.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace tfq {
+
+namespace {
+
+// qsim needs 64 byte alignment for AVX.
+static const uint64_t _STATE_ALIGNMENT = 64;
+static const uint64_t _HUGE_PAGE_SIZE = uint64_t(1) << 21;
+
+}  // namespace
+
+StateLease::StateLease(StateLease&& other)
+    : pool_(other.pool_),
+      index_(other.index_),
+      data_(other.data_),
+      size_(other.size_) {
+  other.pool_ = nullptr;
+}
+
+StateLease::~StateLease() {
+  if (pool_ != nullptr) {
+    pool_->Release(index_);
+  }
+}
+
+StatePool::~StatePool() {
+  for (const Buffer& buffer : buffers_) {
+    tensorflow::port::AlignedFree(buffer.data);
+  }
+}
+
+StateLease StatePool::Acquire(const uint64_t num_floats) {
+  std::lock_guard<std::mutex> lock(mu_);
+
+  // Best fit among the free buffers, remembering the largest free one in
+  // case nothing fits.
+  int best = -1;
+  int largest_free = -1;
+  int empty_slot = -1;
+  for (int i = 0; i < buffers_.size(); i++) {
+    const Buffer& buffer = buffers_[i];
+    if (buffer.in_use) {
+      continue;
+    }
+    if (buffer.data == nullptr) {
+      empty_slot = i;
+      continue;
+    }
+    if (buffer.size >= num_floats &&
+        (best == -1 || buffer.size < buffers_[best].size)) {
+      best = i;
+    }
+    if (largest_free == -1 || buffer.size > buffers_[largest_free].size) {
+      largest_free = i;
+    }
+  }
+
+  if (best == -1) {
+    const uint64_t bytes = std::max(num_floats, uint64_t(1)) * sizeof(float);
+    const bool huge = huge_pages_ && bytes >= _HUGE_PAGE_SIZE;
+    float* data = static_cast<float*>(tensorflow::port::AlignedMalloc(
+        bytes, huge ? _HUGE_PAGE_SIZE : _STATE_ALIGNMENT));
+#ifdef __linux__
+    if (huge && data != nullptr) {
+      madvise(data, bytes, MADV_HUGEPAGE);
+    }
+#endif
+    if (largest_free != -1) {
+      // Grow the largest free buffer instead of keeping a buffer around
+      // that is too small for this kernel's circuits.
+      tensorflow::port::AlignedFree(buffers_[largest_free].data);
+      buffers_[largest_free] = {data, num_floats, false};
+      best = largest_free;
+    } else if (empty_slot != -1) {
+      buffers_[empty_slot] = {data, num_floats, false};
+      best = empty_slot;
+    } else {
+      buffers_.push_back({data, num_floats, false});
+      best = buffers_.size() - 1;
+    }
+  }
+
+  Buffer& buffer = buffers_[best];
+  buffer.in_use = true;
+  leased_bytes_ += buffer.size * sizeof(float);
+  leased_buffers_++;
+  high_water_bytes_ = std::max(high_water_bytes_, leased_bytes_);
+  high_water_buffers_ = std::max(high_water_buffers_, leased_buffers_);
+  return StateLease(this, best, buffer.data, buffer.size);
+}
+
+void StatePool::Release(const int index) {
+  std::lock_guard<std::mutex> lock(mu_);
+  Buffer& buffer = buffers_[index];
+  buffer.in_use = false;
+  leased_bytes_ -= buffer.size * sizeof(float);
+  leased_buffers_--;
+  Trim();
+}
+
+void StatePool::Trim() {
+  uint64_t cached = 0;
+  for (const Buffer& buffer : buffers_) {
+    if (!buffer.in_use) {
+      cached += buffer.size * sizeof(float);
+    }
+  }
+  while (cached > max_cached_bytes_) {
+    int largest_free = -1;
+    for (int i = 0; i < buffers_.size(); i++) {
+      const Buffer& buffer = buffers_[i];
+      if (!buffer.in_use && buffer.data != nullptr &&
+          (largest_free == -1 || buffer.size > buffers_[largest_free].size)) {
+        largest_free = i;
+      }
+    }
+    Buffer& buffer = buffers_[largest_free];
+    cached -= buffer.size * sizeof(float);
+    tensorflow::port::AlignedFree(buffer.data);
+    buffer = {nullptr, 0, false};
+  }
+}
+
+uint64_t StatePool::AllocatedBytes() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  uint64_t total = 0;
+  for (const Buffer& buffer : buffers_) {
+    total += buffer.size * sizeof(float);
+  }
+  return total;
+}
+
+uint64_t StatePool::CachedBytes() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  uint64_t total = 0;
+  for (const Buffer& buffer : buffers_) {
+    if (!buffer.in_use) {
+      total += buffer.size * sizeof(float);
+    }
+  }
+  return total;
+}
+
+uint64_t StatePool::HighWaterBytes() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return high_water_bytes_;
+}
+
+int StatePool::HighWaterBuffers() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return high_water_buffers_;
+}
+
+}  // namespace tfq
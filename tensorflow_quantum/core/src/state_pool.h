@@ -0,0 +1,149 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef TFQ_CORE_SRC_STATE_POOL_H_
+#define TFQ_CORE_SRC_STATE_POOL_H_
+
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <vector>
+
+namespace tfq {
+
+class StatePool;
+
+// A buffer checked out of a StatePool. The buffer goes back to the pool when
+// the lease is destroyed.
+class StateLease {
+ public:
+  StateLease(StatePool* pool, const int index, float* data,
+             const uint64_t size)
+      : pool_(pool), index_(index), data_(data), size_(size) {}
+  StateLease(StateLease&& other);
+  StateLease(const StateLease&) = delete;
+  StateLease& operator=(const StateLease&) = delete;
+  ~StateLease();
+
+  float* data() const { return data_; }
+
+  // Capacity of the buffer in floats.
+  uint64_t size() const { return size_; }
+
+ private:
+  StatePool* pool_;
+  int index_;
+  float* data_;
+  uint64_t size_;
+};
+
+// Free buffers kept by a StatePool between leases, 1 GB (a 27 qubit state).
+static const uint64_t _MAX_CACHED_STATE_BYTES = uint64_t(1) << 30;
+
+// Aligned state vector buffers that live as long as the owning op kernel
+// and are reused across Compute calls and across the shards of a call.
+// A request that does not fit in any free buffer replaces the largest free
+// one, or adds a new buffer if none is free. When a returned buffer takes
+// the free buffers past max_cached_bytes the largest free buffers are
+// released, so one oversized batch does not pin its memory for the life
+// of the kernel. Buffers of at least 2 MB are huge page aligned and, on
+// Linux, advised to be backed by transparent huge pages when huge_pages is
+// set.
+//
+// Thread safe. Each shard of a ParallelFor should Acquire its own buffers
+// once and hold them for all of its work.
+class StatePool {
+ public:
+  explicit StatePool(const bool huge_pages = true,
+                     const uint64_t max_cached_bytes = _MAX_CACHED_STATE_BYTES)
+      : huge_pages_(huge_pages), max_cached_bytes_(max_cached_bytes) {}
+  StatePool(const StatePool&) = delete;
+  StatePool& operator=(const StatePool&) = delete;
+  ~StatePool();
+
+  // Checks out a buffer holding at least num_floats floats. Contents are
+  // unspecified.
+  StateLease Acquire(const uint64_t num_floats);
+
+  // Bytes currently held by the pool, leased or not.
+  uint64_t AllocatedBytes() const;
+
+  // Bytes held by the pool in free buffers.
+  uint64_t CachedBytes() const;
+
+  // Largest number of bytes that were leased out at the same time.
+  uint64_t HighWaterBytes() const;
+
+  // Largest number of buffers that were leased out at the same time.
+  int HighWaterBuffers() const;
+
+ private:
+  friend class StateLease;
+
+  // Released buffers leave an empty slot with a null data so the indices
+  // held by leases stay valid.
+  struct Buffer {
+    float* data;
+    uint64_t size;
+    bool in_use;
+  };
+
+  void Release(const int index);
+
+  // Frees the largest free buffers until at most max_cached_bytes_ are
+  // cached. mu_ must be held.
+  void Trim();
+
+  bool huge_pages_;
+  uint64_t max_cached_bytes_;
+  mutable std::mutex mu_;
+  std::vector<Buffer> buffers_;
+  uint64_t leased_bytes_ = 0;
+  int leased_buffers_ = 0;
+  uint64_t high_water_bytes_ = 0;
+  int high_water_buffers_ = 0;
+};
+
+// Deleter of qsim States that view memory owned by someone else.
+inline void KeepStateMemory(void*) noexcept {}
+
+// Wraps data as a qsim State without taking ownership. qsim states own
+// their memory through a unique_ptr with free as the deleter, the view
+// swaps in a deleter that does nothing. data must outlive the view.
+template <typename StateT>
+StateT StateView(float* data) {
+  return StateT(data, &KeepStateMemory);
+}
+
+// Wraps a leased buffer as a qsim State, the pool keeps ownership.
+template <typename StateT>
+class PooledState {
+ public:
+  PooledState(StatePool* pool, const uint64_t num_floats)
+      : lease_(pool->Acquire(num_floats)),
+        state_(StateView<StateT>(lease_.data())) {}
+  PooledState(const PooledState&) = delete;
+  PooledState& operator=(const PooledState&) = delete;
+
+  StateT& get() { return state_; }
+
+ private:
+  StateLease lease_;
+  StateT state_;
+};
+
+}  // namespace tfq
+
+#endif  // TFQ_CORE_SRC_STATE_POOL_H_
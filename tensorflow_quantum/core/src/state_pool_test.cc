@@ -0,0 +1,118 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_quantum/core/src/state_pool.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+
+#include "gtest/gtest.h"
+
+namespace tfq {
+namespace {
+
+TEST(StatePoolTest, ReusesBuffers) {
+  StatePool pool;
+  float* first = nullptr;
+  {
+    StateLease lease = pool.Acquire(128);
+    first = lease.data();
+    EXPECT_EQ(lease.size(), 128);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(first) % 64, 0);
+  }
+  {
+    // Smaller requests reuse the free buffer.
+    StateLease lease = pool.Acquire(64);
+    EXPECT_EQ(lease.data(), first);
+    EXPECT_EQ(lease.size(), 128);
+  }
+  EXPECT_EQ(pool.AllocatedBytes(), 128 * sizeof(float));
+}
+
+TEST(StatePoolTest, GrowsLargestFreeBuffer) {
+  StatePool pool;
+  { StateLease lease = pool.Acquire(16); }
+  { StateLease lease = pool.Acquire(1024); }
+  // The small buffer was replaced, not kept alongside.
+  EXPECT_EQ(pool.AllocatedBytes(), 1024 * sizeof(float));
+}
+
+TEST(StatePoolTest, HighWaterMarks) {
+  StatePool pool;
+  {
+    StateLease a = pool.Acquire(100);
+    StateLease b = pool.Acquire(200);
+    EXPECT_NE(a.data(), b.data());
+  }
+  { StateLease c = pool.Acquire(50); }
+  EXPECT_EQ(pool.HighWaterBuffers(), 2);
+  EXPECT_EQ(pool.HighWaterBytes(), 300 * sizeof(float));
+  EXPECT_EQ(pool.AllocatedBytes(), 300 * sizeof(float));
+}
+
+TEST(StatePoolTest, TrimsCachedBuffers) {
+  StatePool pool(/*huge_pages=*/false, /*max_cached_bytes=*/256);
+  {
+    StateLease big = pool.Acquire(1024);
+    StateLease small = pool.Acquire(32);
+    EXPECT_EQ(pool.AllocatedBytes(), 1056 * sizeof(float));
+    EXPECT_EQ(pool.CachedBytes(), 0);
+  }
+  // The oversized buffer is released, the small one stays cached.
+  EXPECT_EQ(pool.AllocatedBytes(), 32 * sizeof(float));
+  EXPECT_EQ(pool.CachedBytes(), 32 * sizeof(float));
+  EXPECT_EQ(pool.HighWaterBytes(), 1056 * sizeof(float));
+
+  // Empty slots are reused.
+  {
+    StateLease a = pool.Acquire(16);
+    StateLease b = pool.Acquire(48);
+    EXPECT_EQ(a.size(), 32);
+    EXPECT_EQ(b.size(), 48);
+    EXPECT_EQ(pool.AllocatedBytes(), 80 * sizeof(float));
+  }
+  // Both together are over the cap again, the larger one goes.
+  EXPECT_EQ(pool.AllocatedBytes(), 32 * sizeof(float));
+}
+
+TEST(StatePoolTest, PooledStateKeepsOwnership) {
+  typedef std::unique_ptr<float, decltype(&free)> State;
+  StatePool pool;
+  float* data = nullptr;
+  {
+    PooledState<State> state(&pool, 32);
+    data = state.get().get();
+    state.get().get()[31] = 1.0;
+  }
+  // Destroying the PooledState must not free the buffer.
+  PooledState<State> state(&pool, 32);
+  EXPECT_EQ(state.get().get(), data);
+  EXPECT_EQ(state.get().get()[31], 1.0);
+}
+
+TEST(StatePoolTest, StateViewKeepsOwnership) {
+  typedef std::unique_ptr<float, decltype(&free)> State;
+  std::vector<float> data(8, 0.0);
+  {
+    State view = StateView<State>(data.data() + 4);
+    view.get()[0] = 1.0;
+  }
+  // Destroying the view must not free memory it does not own.
+  EXPECT_EQ(data[4], 1.0);
+}
+
+}  // namespace
+}  // namespace tfq
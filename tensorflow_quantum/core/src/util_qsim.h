@@ -16,34 +16,305 @@ limitations under the License.
 #ifndef UTIL_QSIM_H_
 #define UTIL_QSIM_H_
 
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
 #include <bitset>
+#include <cmath>
+#include <complex>
 #include <cstdint>
+#include <functional>
+#include <map>
+#include <random>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "../qsim/lib/circuit.h"
 #include "../qsim/lib/fuser.h"
+#include "../qsim/lib/fuser_basic.h"
 #include "../qsim/lib/gate_appl.h"
+#include "../qsim/lib/io.h"
 #include "../qsim/lib/gates_cirq.h"
 #include "../qsim/lib/matrix.h"
+#include "../qsim/lib/seqfor.h"
+#include "../qsim/lib/simmux.h"
+#include "absl/strings/numbers.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/monitoring/counter.h"
+#include "tensorflow/core/lib/monitoring/gauge.h"
+#include "tensorflow/core/lib/monitoring/sampler.h"
+#include "tensorflow/core/platform/numa.h"
 #include "tensorflow/core/platform/threadpool.h"
 #include "tensorflow_quantum/core/proto/pauli_sum.pb.h"
+#include "tensorflow_quantum/core/src/batch_simulator.h"
 #include "tensorflow_quantum/core/src/circuit_parser_qsim.h"
+#include "tensorflow_quantum/core/src/mps_simulator.h"
+#include "tensorflow_quantum/core/src/small_simulator.h"
+#include "tensorflow_quantum/core/src/state_pool.h"
 
 namespace tfq {
 
 typedef qsim::Cirq::GateCirq<float> QsimGate;
 typedef qsim::Circuit<QsimGate> QsimCircuit;
 
+// Number of floats a state vector of num_qubits qubits occupies. Large
+// enough for every qsim StateSpace, the SIMD ones pad small states up to
+// one full register block.
+inline uint64_t StateRawSize(const int num_qubits) {
+  return std::max(uint64_t(16), uint64_t(2) << num_qubits);
+}
+
+// High-water mark of the state buffers leased by a kernel's StatePool.
+inline void RecordStatePoolUsage(const std::string& op_name,
+                                 const StatePool& pool) {
+  static auto* gauge =
+      tensorflow::monitoring::Gauge<tensorflow::int64, 1>::New(
+          "/tensorflow_quantum/state_pool/high_water_bytes",
+          "Largest number of state vector bytes leased at once by a kernel.",
+          "op");
+  gauge->GetCell(op_name)->Set(pool.HighWaterBytes());
+}
+
+// States with at least this many qubits are spread over NUMA nodes when
+// QsimFor is asked to place them and the host has more than one node.
+static const int _NUMA_MIN_QUBITS = 24;
+
+// Bytes read and written by qsim while applying gates in ComputeLarge.
+inline tensorflow::monitoring::Counter<0>* StateBytesCounter() {
+  static auto* counter = tensorflow::monitoring::Counter<0>::New(
+      "/tensorflow_quantum/qsim/state_bytes",
+      "Bytes of state vector streamed through memory by gate application.");
+  return counter;
+}
+
+// Effective memory bandwidth of gate application, one sample per circuit.
+inline tensorflow::monitoring::Sampler<0>* StateBandwidthSampler() {
+  static auto* sampler = tensorflow::monitoring::Sampler<0>::New(
+      {"/tensorflow_quantum/qsim/state_bandwidth_gbps",
+       "Memory bandwidth in GB/s achieved while applying gates to a state."},
+      tensorflow::monitoring::Buckets::Exponential(0.25, 2, 12));
+  return sampler;
+}
+
+// Records the bandwidth of num_sweeps passes over a state of num_qubits
+// qubits that took micros. Every pass (one fused gate, or one run of gates
+// in the blocked executor) reads and writes the whole state.
+inline void RecordStateBandwidth(const int num_qubits,
+                                 const uint64_t num_sweeps,
+                                 const uint64_t micros) {
+  const uint64_t bytes =
+      num_sweeps * 2 * 2 * sizeof(float) * (uint64_t(1) << num_qubits);
+  StateBytesCounter()->GetCell()->IncrementBy(bytes);
+  if (micros > 0) {
+    StateBandwidthSampler()->GetCell()->Add(double(bytes) / (micros * 1e3));
+  }
+}
+
+// Rough number of cycles a fused gate or Pauli term spends per amplitude
+// of the state it sweeps over.
+static const int _CYCLES_PER_AMPLITUDE = 20;
+
+// Estimated cycles to simulate a circuit with num_gates fused gates on
+// num_qubits qubits and then measure num_terms Pauli terms on it. Every
+// fused gate sweeps the state once and every term sweeps it twice, once
+// to apply the Paulis and once for the inner product.
+inline int64_t CircuitCost(const int num_qubits, const uint64_t num_gates,
+                           const uint64_t num_terms) {
+  return (int64_t(_CYCLES_PER_AMPLITUDE) << num_qubits) *
+         int64_t(num_gates + 2 * num_terms + 1);
+}
+
+// Hands out item indices in order of decreasing cost. Threads that finish
+// cheap items keep pulling from the same queue while others work through
+// the expensive ones, so no thread is stuck with a fixed block of large
+// circuits.
+class CostOrderedQueue {
+ public:
+  explicit CostOrderedQueue(const std::vector<int64_t>& costs)
+      : order_(costs.size()), next_(0) {
+    for (int i = 0; i < order_.size(); i++) {
+      order_[i] = i;
+    }
+    std::stable_sort(order_.begin(), order_.end(), [&costs](int a, int b) {
+      return costs[a] > costs[b];
+    });
+  }
+
+  // Writes the next item to item. Returns false once all items are taken.
+  bool Next(int* item) {
+    const int k = next_.fetch_add(1);
+    if (k >= order_.size()) {
+      return false;
+    }
+    *item = order_[k];
+    return true;
+  }
+
+ private:
+  std::vector<int> order_;
+  std::atomic<int> next_;
+};
+
+// Calls shard_f(&queue) once per shard on the threadpool of context, where
+// queue hands out every index of costs exactly once, most expensive first.
+// Shards do their own per thread setup (scratch states and the like) and
+// then drain the queue. Uses no more shards than threads, items or what
+// the total cost can pay for.
+template <typename Function>
+void ParallelForByCost(tensorflow::OpKernelContext* context,
+                       const std::vector<int64_t>& costs, Function&& shard_f) {
+  CostOrderedQueue queue(costs);
+  int64_t total_cost = 0;
+  for (const int64_t cost : costs) {
+    total_cost += cost;
+  }
+
+  auto* workers = context->device()->tensorflow_cpu_worker_threads()->workers;
+  const int64_t min_shard_cost = 10000;
+  const int64_t num_shards = std::min(
+      {int64_t(workers->NumThreads()), int64_t(costs.size()),
+       std::max(int64_t(1), total_cost / min_shard_cost)});
+  if (num_shards <= 1) {
+    shard_f(&queue);
+    return;
+  }
+
+  tensorflow::thread::ThreadPool::SchedulingParams scheduling_params(
+      tensorflow::thread::ThreadPool::SchedulingStrategy::kFixedBlockSize,
+      absl::nullopt, 1);
+  workers->ParallelFor(num_shards, scheduling_params,
+                       [&queue, &shard_f](int64_t start, int64_t end) {
+                         for (int64_t i = start; i < end; i++) {
+                           shard_f(&queue);
+                         }
+                       });
+}
+
+// Number of blocks QsimFor splits every reduction into.
+static const int _REDUCE_BLOCKS = 64;
+static const int _CACHE_LINE_SIZE = 64;
+
+// Combines values in a balanced binary tree whose shape only depends on
+// values.size(): ((v0 + v1) + (v2 + v3)) + ... Odd elements out are carried
+// up a level unchanged.
+template <typename T, typename Op>
+T PairwiseReduce(std::vector<T> values, Op&& op) {
+  if (values.empty()) {
+    return T(0);
+  }
+  uint64_t n = values.size();
+  while (n > 1) {
+    const uint64_t half = n / 2;
+    for (uint64_t i = 0; i < half; i++) {
+      values[i] = op(values[2 * i], values[2 * i + 1]);
+    }
+    if (n % 2 == 1) {
+      values[half] = values[n - 1];
+    }
+    n = half + n % 2;
+  }
+  return values[0];
+}
+
+// First index of shard out of num_shards equal, contiguous shards of
+// [0, size). Shard k covers [ShardBegin(k), ShardBegin(k + 1)).
+inline uint64_t ShardBegin(const uint64_t size, const unsigned shard,
+                           const unsigned num_shards) {
+  return size * shard / num_shards;
+}
+
+// NUMA node that works on shard out of num_shards, or -1 if the work is
+// not placed (numa_nodes <= 1). Consecutive shards share a node and every
+// node gets the same number of shards, give or take one.
+inline int ShardNumaNode(const unsigned shard, const unsigned num_shards,
+                         const int numa_nodes) {
+  if (numa_nodes <= 1) {
+    return -1;
+  }
+  return uint64_t(shard) * numa_nodes / num_shards;
+}
+
+// Binds the calling thread to a NUMA node for the lifetime of the object
+// and then puts back the CPU set the thread had before. Worker threads
+// (and the caller, which runs one block inline) are shared with every
+// other op, so a binding must not outlive the shard it was made for. Only
+// Linux lets us save and restore the CPU set, elsewhere and for node -1
+// the thread is left alone.
+class ScopedNumaAffinity {
+ public:
+  explicit ScopedNumaAffinity(const int node) {
+#ifdef __linux__
+    if (node < 0) {
+      return;
+    }
+    saved_ = sched_getaffinity(0, sizeof(cpu_set_), &cpu_set_) == 0;
+    if (saved_) {
+      tensorflow::port::NUMASetThreadNodeAffinity(node);
+    }
+#endif
+  }
+
+  ~ScopedNumaAffinity() {
+#ifdef __linux__
+    if (saved_) {
+      sched_setaffinity(0, sizeof(cpu_set_), &cpu_set_);
+    }
+#endif
+  }
+
+  ScopedNumaAffinity(const ScopedNumaAffinity&) = delete;
+  ScopedNumaAffinity& operator=(const ScopedNumaAffinity&) = delete;
+
+ private:
+#ifdef __linux__
+  cpu_set_t cpu_set_;
+#endif
+  bool saved_ = false;
+};
+
 // Custom FOR loop struct to use TF threadpool instead of native
 // qsim OpenMP or serial FOR implementations.
+//
+// When numa_nodes > 1 every loop is cut into one fixed, contiguous shard
+// per worker thread and shard k always runs on NUMA node
+// ShardNumaNode(k, num_threads, numa_nodes). qsim allocates states without
+// touching them, so the SetStateZero issued through this struct
+// first-touches each slice of the state on the node that later works on
+// it. Threads are only bound while they work on a shard.
 struct QsimFor {
   tensorflow::OpKernelContext* context;
-  QsimFor(tensorflow::OpKernelContext* cxt) { context = cxt; }
+  int numa_nodes;
+  int state_qubits;
+  QsimFor(tensorflow::OpKernelContext* cxt) {
+    context = cxt;
+    numa_nodes = 1;
+    state_qubits = 0;
+  }
+
+  // Sizes the loop shards for states of up to max_num_qubits qubits and
+  // places the loops over NUMA nodes if the largest state is big enough to
+  // be bound by memory bandwidth. NUMA placement is a no-op on single node
+  // hosts and on TensorFlow builds without NUMA support.
+  QsimFor(tensorflow::OpKernelContext* cxt, const int max_num_qubits) {
+    context = cxt;
+    numa_nodes = 1;
+    state_qubits = max_num_qubits;
+    if (max_num_qubits >= _NUMA_MIN_QUBITS) {
+      numa_nodes = std::max(tensorflow::port::NUMANumNodes(), 1);
+    }
+  }
 
   template <typename Function, typename... Args>
   void Run(uint64_t size, Function&& func, Args&&... args) const {
+    if (numa_nodes > 1) {
+      RunNuma(size, func, args...);
+      return;
+    }
     auto worker_f = [&func, &args...](int64_t start, int64_t end) {
       for (uint64_t i = start; i < end; i++) {
         // First two arguments in RUN appear to be unused.
@@ -52,97 +323,262 @@ struct QsimFor {
     };
     // estimated number of cpu cycles needed for one unit of work.
     //   https://github.com/quantumlib/qsim/issues/147
-    const int cycle_estimate = 100;
+    // qsim splits one sweep over the state into size units, so larger
+    // states mean more work per unit.
+    const int64_t state_cycles = int64_t(_CYCLES_PER_AMPLITUDE)
+                                 << state_qubits;
+    const int64_t cycle_estimate = std::max(
+        int64_t(100), state_cycles / int64_t(std::max(size, uint64_t(1))));
     context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
         size, cycle_estimate, worker_f);
   }
 
+  // Reductions are always cut into _REDUCE_BLOCKS fixed blocks, whatever
+  // the number of threads. qsim locates the blocks of RunReduceP results
+  // (e.g. when sampling from partial norms) through these two.
   uint64_t GetIndex0(uint64_t size, unsigned thread_id) const {
-    unsigned int num_threads = context->device()
-                                   ->tensorflow_cpu_worker_threads()
-                                   ->workers->NumThreads();
-    return size * thread_id / num_threads;
+    return ShardBegin(size, thread_id, _REDUCE_BLOCKS);
   }
 
   uint64_t GetIndex1(uint64_t size, unsigned thread_id) const {
+    return ShardBegin(size, thread_id + 1, _REDUCE_BLOCKS);
+  }
+
+  template <typename Function, typename... Args>
+  void RunNuma(uint64_t size, Function&& func, Args&&... args) const {
     unsigned int num_threads = context->device()
                                    ->tensorflow_cpu_worker_threads()
                                    ->workers->NumThreads();
-    return size * (thread_id + 1) / num_threads;
+    auto worker_f = [this, size, num_threads, &func, &args...](int64_t start,
+                                                               int64_t end) {
+      for (int64_t shard = start; shard < end; shard++) {
+        ScopedNumaAffinity affinity(
+            ShardNumaNode(shard, num_threads, numa_nodes));
+        const uint64_t i1 = ShardBegin(size, shard + 1, num_threads);
+        for (uint64_t i = ShardBegin(size, shard, num_threads); i < i1; i++) {
+          func(-10, -10, i, args...);
+        }
+      }
+    };
+
+    // block_size = 1, so that shard k always covers the same slice.
+    tensorflow::thread::ThreadPool::SchedulingParams scheduling_params(
+        tensorflow::thread::ThreadPool::SchedulingStrategy::kFixedBlockSize,
+        absl::nullopt, 1);
+    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
+        num_threads, scheduling_params, worker_f);
   }
 
+  // Reduces func over [0, size) in _REDUCE_BLOCKS fixed blocks and returns
+  // one partial result per block. Each block is summed sequentially and
+  // the blocks do not depend on the thread count, so the partials are
+  // bitwise reproducible on any pool size. Partials are written one cache
+  // line apart to avoid false sharing between blocks.
   template <typename Function, typename Op, typename... Args>
   std::vector<typename Op::result_type> RunReduceP(uint64_t size,
                                                    Function&& func, Op&& op,
                                                    Args&&... args) const {
-    unsigned int num_threads = context->device()
-                                   ->tensorflow_cpu_worker_threads()
-                                   ->workers->NumThreads();
-
-    std::vector<typename Op::result_type> partial_results(num_threads, 0);
-
-    std::function<void(int64_t, int64_t)> fn =
-        [this, &size, &num_threads, &partial_results, &func, &op, &args...](
-            int64_t start, int64_t end) {
-          // Here we expect end = start + 1 because block_size = 1.
-          uint64_t i0 = GetIndex0(size, start);
-          uint64_t i1 = GetIndex1(size, start);
-
-          typename Op::result_type partial_result = 0;
-
-          for (uint64_t i = i0; i < i1; i++) {
-            partial_result =
-                op(partial_result, func(num_threads, start, i, args...));
-          }
+    using result_type = typename Op::result_type;
+    const uint64_t stride =
+        (_CACHE_LINE_SIZE + sizeof(result_type) - 1) / sizeof(result_type);
+    std::vector<result_type> padded_results(_REDUCE_BLOCKS * stride, 0);
 
-          partial_results[start] = partial_result;
-        };
+    auto fn = [this, size, stride, &padded_results, &func, &op, &args...](
+                  int64_t start, int64_t end) {
+      for (int64_t block = start; block < end; block++) {
+        ScopedNumaAffinity affinity(
+            ShardNumaNode(block, _REDUCE_BLOCKS, numa_nodes));
+        const uint64_t i0 = GetIndex0(size, block);
+        const uint64_t i1 = GetIndex1(size, block);
 
-    // block_size = 1.
-    tensorflow::thread::ThreadPool::SchedulingParams scheduling_params(
-        tensorflow::thread::ThreadPool::SchedulingStrategy::kFixedBlockSize,
-        absl::nullopt, 1);
+        result_type partial_result = 0;
+        for (uint64_t i = i0; i < i1; i++) {
+          partial_result =
+              op(partial_result, func(_REDUCE_BLOCKS, block, i, args...));
+        }
+        padded_results[block * stride] = partial_result;
+      }
+    };
 
-    // Parallelize where num_threads = num_shards. Very important!
+    const int64_t block_cycles = std::max(
+        int64_t(100), int64_t(size / _REDUCE_BLOCKS) * _CYCLES_PER_AMPLITUDE);
     context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
-        num_threads, scheduling_params, fn);
+        _REDUCE_BLOCKS, block_cycles, fn);
 
+    std::vector<result_type> partial_results(_REDUCE_BLOCKS);
+    for (int block = 0; block < _REDUCE_BLOCKS; block++) {
+      partial_results[block] = padded_results[block * stride];
+    }
     return partial_results;
   }
 
+  // Same as RunReduceP, with the block results combined in a fixed
+  // pairwise tree.
   template <typename Function, typename Op, typename... Args>
   typename Op::result_type RunReduce(uint64_t size, Function&& func, Op&& op,
                                      Args&&... args) const {
-    auto partial_results = RunReduceP(size, func, std::move(op), args...);
+    return PairwiseReduce(RunReduceP(size, func, op, args...), op);
+  }
+};
+
+// Number of amplitudes the qsim state space picked by simmux.h stores as a
+// run of real parts followed by a run of imaginary parts.
+#if defined(__AVX2__)
+static const uint64_t _AMPLITUDE_RUN = 8;
+#elif defined(__SSE4_1__)
+static const uint64_t _AMPLITUDE_RUN = 4;
+#else
+static const uint64_t _AMPLITUDE_RUN = 1;
+#endif
+
+// Offset of the real part of amplitude i in a raw qsim state. The
+// imaginary part sits _AMPLITUDE_RUN floats after it.
+inline uint64_t AmplitudeOffset(const uint64_t i) {
+  return 2 * _AMPLITUDE_RUN * (i / _AMPLITUDE_RUN) + i % _AMPLITUDE_RUN;
+}
+
+// Amplitudes handled by one unit of work in the Pauli string kernels.
+static const uint64_t _PAULI_CHUNK = 1024;
+
+// Finds the qsim bitmasks of the X or Y and Z or Y factors of term.
+inline tensorflow::Status PauliTermMasks(const tfq::proto::PauliTerm& term,
+                                         const unsigned int num_qubits,
+                                         uint64_t* x_mask, uint64_t* z_mask) {
+  *x_mask = 0;
+  *z_mask = 0;
+  for (const tfq::proto::PauliQubitPair& pair : term.paulis()) {
+    unsigned int location;
+    if (!absl::SimpleAtoi(pair.qubit_id(), &location) ||
+        location >= num_qubits) {
+      return tensorflow::Status(
+          tensorflow::error::INVALID_ARGUMENT,
+          "Could not resolve qubit id " + pair.qubit_id() + " in PauliSum.");
+    }
+    const std::string& pauli = pair.pauli_type();
+    if (pauli != "X" && pauli != "Y" && pauli != "Z") {
+      return tensorflow::Status(tensorflow::error::INVALID_ARGUMENT,
+                                "Unknown Pauli type '" + pauli +
+                                    "' in PauliSum. Expected X, Y or Z.");
+    }
+    // Little-endian indexing.
+    const uint64_t bit = uint64_t(1) << (num_qubits - location - 1);
+    if (pauli != "Z") {
+      *x_mask |= bit;
+    }
+    if (pauli != "X") {
+      *z_mask |= bit;
+    }
+  }
+  return tensorflow::Status::OK();
+}
+
+// <state | P | state> for the Pauli string P with the given masks, in a
+// single read-only pass over state. P|a> = i^num_y (-1)^|a & z_mask|
+// |a ^ x_mask>, so the expectation is the real part of
+// i^num_y sum_a (-1)^|a & z_mask| conj(psi[a ^ x_mask]) psi[a].
+template <typename ForT>
+double PauliExpectationQsim(const ForT& for_obj, const unsigned int num_qubits,
+                            const float* state, const uint64_t x_mask,
+                            const uint64_t z_mask) {
+  // Only one of the real or imaginary part of the sum is needed.
+  const unsigned int num_y = std::bitset<64>(x_mask & z_mask).count() % 4;
+  const bool use_imag = num_y % 2 == 1;
+  const double factor = (num_y == 0 || num_y == 3) ? 1.0 : -1.0;
 
-    typename Op::result_type result = 0;
+  const uint64_t size = uint64_t(1) << num_qubits;
+  const uint64_t chunk = std::min(size, _PAULI_CHUNK);
+  auto f = [&](unsigned n, unsigned m, uint64_t i) -> double {
+    double acc = 0;
+    for (uint64_t a = i * chunk; a < (i + 1) * chunk; a++) {
+      const uint64_t pu = AmplitudeOffset(a ^ x_mask);
+      const uint64_t pv = AmplitudeOffset(a);
+      const float ur = state[pu];
+      const float ui = state[pu + _AMPLITUDE_RUN];
+      const float vr = state[pv];
+      const float vi = state[pv + _AMPLITUDE_RUN];
+      const float term = use_imag ? ur * vi - ui * vr : ur * vr + ui * vi;
+      acc += std::bitset<64>(a & z_mask).count() & 1 ? -term : term;
+    }
+    return acc;
+  };
+  return factor * for_obj.RunReduce(size / chunk, f, std::plus<double>());
+}
 
-    for (auto partial_result : partial_results) {
-      result = op(result, partial_result);
+// dest += coeff * P |source> for the Pauli string P with the given masks,
+// in a single pass that reads source and updates dest in place.
+template <typename ForT>
+void AccumulatePauliQsim(const ForT& for_obj, const unsigned int num_qubits,
+                         const float coeff, const float* source,
+                         const uint64_t x_mask, const uint64_t z_mask,
+                         float* dest) {
+  // (P psi)[a] = i^num_y (-1)^|(a ^ x_mask) & z_mask| psi[a ^ x_mask].
+  const unsigned int num_y = std::bitset<64>(x_mask & z_mask).count() % 4;
+  const uint64_t size = uint64_t(1) << num_qubits;
+  const uint64_t chunk = std::min(size, _PAULI_CHUNK);
+  auto f = [&](unsigned n, unsigned m, uint64_t i) {
+    for (uint64_t a = i * chunk; a < (i + 1) * chunk; a++) {
+      const uint64_t b = a ^ x_mask;
+      const uint64_t pb = AmplitudeOffset(b);
+      const float sign = std::bitset<64>(b & z_mask).count() & 1 ? -coeff
+                                                                 : coeff;
+      const float r = sign * source[pb];
+      const float im = sign * source[pb + _AMPLITUDE_RUN];
+      const uint64_t pa = AmplitudeOffset(a);
+      switch (num_y) {
+        case 0:
+          dest[pa] += r;
+          dest[pa + _AMPLITUDE_RUN] += im;
+          break;
+        case 1:
+          dest[pa] -= im;
+          dest[pa + _AMPLITUDE_RUN] += r;
+          break;
+        case 2:
+          dest[pa] -= r;
+          dest[pa + _AMPLITUDE_RUN] -= im;
+          break;
+        default:
+          dest[pa] += im;
+          dest[pa + _AMPLITUDE_RUN] -= r;
+      }
     }
+  };
+  for_obj.Run(size / chunk, f);
+}
 
-    return result;
+// Writes 2 ** num_qubits amplitudes, given in the order that GetAmpl reads
+// them, into a raw qsim state. Takes the place of SetStateZero for circuits
+// that start from a given state and converts to qsim's layout in the same
+// single pass.
+template <typename ForT>
+void LoadAmplitudesQsim(const ForT& for_obj, const unsigned int num_qubits,
+                        const std::complex<float>* amplitudes, float* state) {
+  const uint64_t size = uint64_t(1) << num_qubits;
+  if (size < _AMPLITUDE_RUN) {
+    // Lanes past the last amplitude are read by the SIMD kernels.
+    std::fill(state, state + 2 * _AMPLITUDE_RUN, 0.0f);
   }
-};
+  const uint64_t chunk = std::min(size, _PAULI_CHUNK);
+  auto f = [&](unsigned n, unsigned m, uint64_t i) {
+    for (uint64_t a = i * chunk; a < (i + 1) * chunk; a++) {
+      const uint64_t p = AmplitudeOffset(a);
+      state[p] = amplitudes[a].real();
+      state[p + _AMPLITUDE_RUN] = amplitudes[a].imag();
+    }
+  };
+  for_obj.Run(size / chunk, f);
+}
 
 // bad style standards here that we are forced to follow from qsim.
-// computes the expectation value <state | p_sum | state > using
-// scratch to save on memory. Implementation does this:
-// 1. Copy state onto scratch
-// 2. Evolve scratch forward with p_sum terms
-// 3. Compute < state | scratch >
-// 4. Sum and repeat.
-// scratch is required to have memory initialized, but does not require
-// values in memory to be set.
-template <typename SimT, typename StateSpaceT, typename StateT>
+// computes the expectation value <state | p_sum | state > term by term
+// with PauliExpectationQsim. No scratch state is needed and state is only
+// read.
+template <typename ForT, typename StateSpaceT, typename StateT>
 tensorflow::Status ComputeExpectationQsim(const tfq::proto::PauliSum& p_sum,
-                                          const SimT& sim,
-                                          const StateSpaceT& ss, StateT& state,
-                                          StateT& scratch,
+                                          const ForT& for_obj,
+                                          const StateSpaceT& ss,
+                                          const StateT& state,
                                           float* expectation_value) {
-  // apply the  gates of the pauliterms to a copy of the wavefunction
-  // and add up expectation value term by term.
-  tensorflow::Status status = tensorflow::Status::OK();
   for (const tfq::proto::PauliTerm& term : p_sum.terms()) {
     // catch identity terms
     if (term.paulis_size() == 0) {
@@ -151,28 +587,18 @@ tensorflow::Status ComputeExpectationQsim(const tfq::proto::PauliSum& p_sum,
       continue;
     }
 
-    QsimCircuit main_circuit;
-    std::vector<qsim::GateFused<QsimGate>> fused_circuit;
-
-    status = QsimCircuitFromPauliTerm(term, ss.num_qubits_, &main_circuit,
-                                      &fused_circuit);
-
-    if (!status.ok()) {
-      return status;
-    }
-    // copy from src to scratch.
-    ss.CopyState(state, scratch);
-    for (int j = 0; j < fused_circuit.size(); j++) {
-      qsim::ApplyFusedGate(sim, fused_circuit[j], scratch);
-    }
-
+    uint64_t x_mask, z_mask;
+    tensorflow::Status status =
+        PauliTermMasks(term, ss.num_qubits_, &x_mask, &z_mask);
     if (!status.ok()) {
       return status;
     }
     *expectation_value +=
-        term.coefficient_real() * ss.RealInnerProduct(state, scratch);
+        term.coefficient_real() * PauliExpectationQsim(for_obj, ss.num_qubits_,
+                                                       state.get(), x_mask,
+                                                       z_mask);
   }
-  return status;
+  return tensorflow::Status::OK();
 }
 
 // bad style standards here that we are forced to follow from qsim.
@@ -256,6 +682,378 @@ tensorflow::Status ComputeSampledExpectationQsim(
   return status;
 }
 
+// A set of PauliTerms that all share the same backward light cone
+// through a circuit. Every term in the group can be measured on a single
+// simulation of the gates in gate_indices over the qubits in qubits.
+struct LightConeGroup {
+  // qsim (little-endian) indices of the qubits inside of the cone, sorted.
+  std::vector<unsigned int> qubits;
+
+  // indices of the gates of the original circuit inside of the cone,
+  // in circuit order.
+  std::vector<unsigned int> gate_indices;
+
+  // (PauliSum index, PauliTerm index) of every term using this cone.
+  std::vector<std::pair<int, int>> terms;
+};
+
+// Computes the backward light cone of support (qsim qubit indices) through
+// circuit. Gates are visited from last to first and a gate is kept if it
+// touches a qubit already inside of the cone, which then grows to include
+// all of the qubits of that gate.
+inline void GetLightCone(const QsimCircuit& circuit,
+                         const std::vector<unsigned int>& support,
+                         std::vector<unsigned int>* cone_qubits,
+                         std::vector<unsigned int>* gate_indices) {
+  std::vector<bool> in_cone(circuit.num_qubits, false);
+  for (const unsigned int q : support) {
+    in_cone[q] = true;
+  }
+
+  gate_indices->clear();
+  for (int i = circuit.gates.size() - 1; i >= 0; i--) {
+    const QsimGate& gate = circuit.gates[i];
+    bool touches_cone = false;
+    for (unsigned int k = 0; k < gate.num_qubits; k++) {
+      touches_cone = touches_cone || in_cone[gate.qubits[k]];
+    }
+    if (!touches_cone) {
+      continue;
+    }
+    for (unsigned int k = 0; k < gate.num_qubits; k++) {
+      in_cone[gate.qubits[k]] = true;
+    }
+    gate_indices->push_back(i);
+  }
+  std::reverse(gate_indices->begin(), gate_indices->end());
+
+  cone_qubits->clear();
+  for (unsigned int q = 0; q < circuit.num_qubits; q++) {
+    if (in_cone[q]) {
+      cone_qubits->push_back(q);
+    }
+  }
+}
+
+// Groups all of the terms in p_sums by their backward light cone through
+// circuit. Identity terms have an empty cone, their coefficients are summed
+// into offsets instead (one entry per PauliSum). Assumes the qubit ids in
+// p_sums have already been resolved against the program that produced
+// circuit.
+inline tensorflow::Status GetLightConeGroups(
+    const std::vector<tfq::proto::PauliSum>& p_sums,
+    const QsimCircuit& circuit, std::vector<LightConeGroup>* groups,
+    std::vector<float>* offsets) {
+  // std::map keeps the group order (and so the order in which partial
+  // expectations are summed) deterministic.
+  std::map<std::pair<std::vector<unsigned int>, std::vector<unsigned int>>,
+           int>
+      group_ids;
+  groups->clear();
+  offsets->assign(p_sums.size(), 0.0);
+
+  std::vector<unsigned int> support;
+  std::vector<unsigned int> cone_qubits;
+  std::vector<unsigned int> gate_indices;
+  for (int i = 0; i < p_sums.size(); i++) {
+    for (int j = 0; j < p_sums[i].terms_size(); j++) {
+      const tfq::proto::PauliTerm& term = p_sums[i].terms(j);
+      if (term.paulis_size() == 0) {
+        (*offsets)[i] += term.coefficient_real();
+        continue;
+      }
+
+      support.clear();
+      for (const tfq::proto::PauliQubitPair& pair : term.paulis()) {
+        unsigned int location;
+        if (!absl::SimpleAtoi(pair.qubit_id(), &location) ||
+            location >= circuit.num_qubits) {
+          return tensorflow::Status(
+              tensorflow::error::INVALID_ARGUMENT,
+              "Unresolved qubit id in PauliTerm: " + pair.qubit_id());
+        }
+        support.push_back(circuit.num_qubits - location - 1);
+      }
+
+      GetLightCone(circuit, support, &cone_qubits, &gate_indices);
+      auto key = std::make_pair(cone_qubits, gate_indices);
+      auto iter = group_ids.find(key);
+      if (iter == group_ids.end()) {
+        iter = group_ids.emplace(key, groups->size()).first;
+        LightConeGroup group;
+        group.qubits = cone_qubits;
+        group.gate_indices = gate_indices;
+        groups->push_back(group);
+      }
+      (*groups)[iter->second].terms.push_back({i, j});
+    }
+  }
+  return tensorflow::Status::OK();
+}
+
+// Builds the circuit made of the gates in gate_indices acting on qubits
+// (sorted qsim indices). Qubits are relabeled 0..qubits.size() - 1 keeping
+// their relative order, so two qubit gates still have
+// qubits[0] < qubits[1]. fused_circuit points into reduced, which must
+// outlive it.
+inline void QsimCircuitFromSubset(
+    const QsimCircuit& circuit, const std::vector<unsigned int>& qubits,
+    const std::vector<unsigned int>& gate_indices, QsimCircuit* reduced,
+    std::vector<qsim::GateFused<QsimGate>>* fused_circuit) {
+  std::vector<unsigned int> remap(circuit.num_qubits, 0);
+  for (unsigned int r = 0; r < qubits.size(); r++) {
+    remap[qubits[r]] = r;
+  }
+
+  reduced->num_qubits = qubits.size();
+  reduced->gates.clear();
+  reduced->gates.reserve(gate_indices.size());
+  for (const unsigned int i : gate_indices) {
+    QsimGate gate = circuit.gates[i];
+    for (unsigned int k = 0; k < gate.num_qubits; k++) {
+      gate.qubits[k] = remap[gate.qubits[k]];
+    }
+    reduced->gates.push_back(gate);
+  }
+
+  *fused_circuit = qsim::BasicGateFuser<qsim::IO, QsimGate>().FuseGates(
+      reduced->num_qubits, reduced->gates);
+}
+
+// Rewrites the resolved qubit ids of term so that they refer to the same
+// qubits inside of a circuit built by QsimCircuitFromSubset. Paulis acting
+// on qubits outside of the subset are dropped.
+inline void PauliTermFromSubset(const tfq::proto::PauliTerm& term,
+                                const unsigned int num_qubits,
+                                const std::vector<unsigned int>& qubits,
+                                tfq::proto::PauliTerm* reduced_term) {
+  const unsigned int subset_size = qubits.size();
+  reduced_term->set_coefficient_real(term.coefficient_real());
+  reduced_term->set_coefficient_imag(term.coefficient_imag());
+  for (const tfq::proto::PauliQubitPair& pair : term.paulis()) {
+    unsigned int location;
+    bool unused = absl::SimpleAtoi(pair.qubit_id(), &location);
+    const unsigned int q = num_qubits - location - 1;
+    auto iter = std::lower_bound(qubits.begin(), qubits.end(), q);
+    if (iter == qubits.end() || *iter != q) {
+      continue;
+    }
+    const unsigned int r = iter - qubits.begin();
+    tfq::proto::PauliQubitPair* new_pair = reduced_term->add_paulis();
+    new_pair->set_qubit_id(std::to_string(subset_size - r - 1));
+    new_pair->set_pauli_type(pair.pauli_type());
+  }
+}
+
+// Simulates only the light cone in group and computes the contribution of
+// every term in the group. partial_values[k] holds the (coefficient scaled)
+// expectation of group.terms[k]. Simulator and StateSpace are built for the
+// size of the cone using for_args.
+template <typename SimT, typename ForT>
+tensorflow::Status ComputeLightConeGroupQsim(
+    const LightConeGroup& group,
+    const std::vector<tfq::proto::PauliSum>& p_sums,
+    const QsimCircuit& circuit, ForT&& for_args,
+    std::vector<float>* partial_values) {
+  using StateSpace = typename SimT::StateSpace;
+  using State = typename StateSpace::State;
+
+  QsimCircuit reduced;
+  std::vector<qsim::GateFused<QsimGate>> fused_circuit;
+  QsimCircuitFromSubset(circuit, group.qubits, group.gate_indices, &reduced,
+                        &fused_circuit);
+
+  const unsigned int nq = reduced.num_qubits;
+  SimT sim = SimT(nq, for_args);
+  StateSpace ss = StateSpace(nq, for_args);
+  State sv = ss.CreateState();
+  ss.SetStateZero(sv);
+  for (int j = 0; j < fused_circuit.size(); j++) {
+    qsim::ApplyFusedGate(sim, fused_circuit[j], sv);
+  }
+
+  tensorflow::Status status = tensorflow::Status::OK();
+  partial_values->assign(group.terms.size(), 0.0);
+  for (int k = 0; k < group.terms.size(); k++) {
+    const auto& term_id = group.terms[k];
+    tfq::proto::PauliSum reduced_sum;
+    PauliTermFromSubset(p_sums[term_id.first].terms(term_id.second),
+                        circuit.num_qubits, group.qubits,
+                        reduced_sum.add_terms());
+    status = ComputeExpectationQsim(reduced_sum, for_args, ss, sv,
+                                    &(*partial_values)[k]);
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  return status;
+}
+
+// A set of qubits that is never entangled with the qubits outside of it,
+// along with the gates of the circuit acting on it.
+struct QubitCluster {
+  // sorted qsim (little-endian) indices of the qubits in the cluster.
+  std::vector<unsigned int> qubits;
+
+  // indices of the gates of the original circuit acting on the cluster,
+  // in circuit order.
+  std::vector<unsigned int> gate_indices;
+};
+
+// Splits the qubits of circuit into clusters such that two qubits are in
+// the same cluster iff they are connected by a chain of multi-qubit gates.
+// The final state of circuit is then the tensor product of the final states
+// of each cluster. Clusters are ordered by their lowest qubit.
+inline void GetQubitClusters(const QsimCircuit& circuit,
+                             std::vector<QubitCluster>* clusters) {
+  // Union find over qubits.
+  std::vector<unsigned int> parent(circuit.num_qubits);
+  for (unsigned int q = 0; q < circuit.num_qubits; q++) {
+    parent[q] = q;
+  }
+  auto find = [&parent](unsigned int q) {
+    while (parent[q] != q) {
+      parent[q] = parent[parent[q]];
+      q = parent[q];
+    }
+    return q;
+  };
+  for (const QsimGate& gate : circuit.gates) {
+    for (unsigned int k = 1; k < gate.num_qubits; k++) {
+      const unsigned int a = find(gate.qubits[0]);
+      const unsigned int b = find(gate.qubits[k]);
+      parent[std::max(a, b)] = std::min(a, b);
+    }
+  }
+
+  // Roots are the lowest qubit of their cluster, so iterating over qubits
+  // in order creates the clusters in order.
+  std::vector<int> cluster_ids(circuit.num_qubits, -1);
+  clusters->clear();
+  for (unsigned int q = 0; q < circuit.num_qubits; q++) {
+    const unsigned int root = find(q);
+    if (cluster_ids[root] == -1) {
+      cluster_ids[root] = clusters->size();
+      clusters->push_back(QubitCluster());
+    }
+    (*clusters)[cluster_ids[root]].qubits.push_back(q);
+  }
+  for (unsigned int i = 0; i < circuit.gates.size(); i++) {
+    const unsigned int root = find(circuit.gates[i].qubits[0]);
+    (*clusters)[cluster_ids[root]].gate_indices.push_back(i);
+  }
+}
+
+// Computes <psi | p_sums[i] | psi> for every i where |psi> = circuit|0> is
+// a product state over clusters (see GetQubitClusters). Each cluster is
+// simulated on its own and the expectation of every term is the product of
+// the expectations of its restrictions to each cluster.
+template <typename SimT, typename ForT>
+tensorflow::Status ComputeClusteredExpectationQsim(
+    const std::vector<tfq::proto::PauliSum>& p_sums,
+    const QsimCircuit& circuit, const std::vector<QubitCluster>& clusters,
+    ForT&& for_args, std::vector<float>* expectation_values) {
+  using StateSpace = typename SimT::StateSpace;
+  using State = typename StateSpace::State;
+
+  // products[i][j] holds the running product over clusters of term j of
+  // p_sums[i] restricted to each cluster.
+  std::vector<std::vector<float>> products(p_sums.size());
+  for (int i = 0; i < p_sums.size(); i++) {
+    products[i].assign(p_sums[i].terms_size(), 1.0);
+  }
+
+  tensorflow::Status status = tensorflow::Status::OK();
+  for (const QubitCluster& cluster : clusters) {
+    QsimCircuit reduced;
+    std::vector<qsim::GateFused<QsimGate>> fused_circuit;
+    QsimCircuitFromSubset(circuit, cluster.qubits, cluster.gate_indices,
+                          &reduced, &fused_circuit);
+
+    const unsigned int nq = reduced.num_qubits;
+    SimT sim = SimT(nq, for_args);
+    StateSpace ss = StateSpace(nq, for_args);
+    State sv = ss.CreateState();
+    ss.SetStateZero(sv);
+    for (int j = 0; j < fused_circuit.size(); j++) {
+      qsim::ApplyFusedGate(sim, fused_circuit[j], sv);
+    }
+
+    for (int i = 0; i < p_sums.size(); i++) {
+      for (int j = 0; j < p_sums[i].terms_size(); j++) {
+        tfq::proto::PauliSum restricted;
+        tfq::proto::PauliTerm* term = restricted.add_terms();
+        PauliTermFromSubset(p_sums[i].terms(j), circuit.num_qubits,
+                            cluster.qubits, term);
+        if (term->paulis_size() == 0) {
+          // term acts as identity on this cluster.
+          continue;
+        }
+        term->set_coefficient_real(1.0);
+        float exp_v = 0.0;
+        status = ComputeExpectationQsim(restricted, for_args, ss, sv, &exp_v);
+        if (!status.ok()) {
+          return status;
+        }
+        products[i][j] *= exp_v;
+      }
+    }
+  }
+
+  expectation_values->assign(p_sums.size(), 0.0);
+  for (int i = 0; i < p_sums.size(); i++) {
+    for (int j = 0; j < p_sums[i].terms_size(); j++) {
+      (*expectation_values)[i] +=
+          p_sums[i].terms(j).coefficient_real() * products[i][j];
+    }
+  }
+  return status;
+}
+
+// Draws num_samples bitstrings from circuit|0> where circuit is a product
+// over clusters (see GetQubitClusters). Every cluster is sampled on its own
+// and the bits are scattered back into qsim (little-endian) order, matching
+// the output of StateSpace::Sample on the full state.
+template <typename SimT, typename ForT>
+void SampleClusteredQsim(const QsimCircuit& circuit,
+                         const std::vector<QubitCluster>& clusters,
+                         const int num_samples, const unsigned int seed,
+                         ForT&& for_args, std::vector<uint64_t>* samples) {
+  using StateSpace = typename SimT::StateSpace;
+  using State = typename StateSpace::State;
+
+  samples->assign(num_samples, 0);
+  std::mt19937 rand_gen(seed);
+  for (const QubitCluster& cluster : clusters) {
+    QsimCircuit reduced;
+    std::vector<qsim::GateFused<QsimGate>> fused_circuit;
+    QsimCircuitFromSubset(circuit, cluster.qubits, cluster.gate_indices,
+                          &reduced, &fused_circuit);
+
+    const unsigned int nq = reduced.num_qubits;
+    SimT sim = SimT(nq, for_args);
+    StateSpace ss = StateSpace(nq, for_args);
+    State sv = ss.CreateState();
+    ss.SetStateZero(sv);
+    for (int j = 0; j < fused_circuit.size(); j++) {
+      qsim::ApplyFusedGate(sim, fused_circuit[j], sv);
+    }
+
+    std::vector<uint64_t> cluster_samples =
+        ss.Sample(sv, num_samples, rand_gen());
+    // Samples come back sorted by bitstring, shuffle them so that samples
+    // of different clusters are not correlated once concatenated.
+    std::shuffle(cluster_samples.begin(), cluster_samples.end(), rand_gen);
+    for (int k = 0; k < cluster_samples.size(); k++) {
+      for (unsigned int r = 0; r < nq; r++) {
+        if ((cluster_samples[k] >> r) & 1) {
+          (*samples)[k] |= uint64_t(1) << cluster.qubits[r];
+        }
+      }
+    }
+  }
+}
+
 template <typename Gate, typename Simulator, typename State>
 inline void ApplyGateDagger(const Simulator& simulator, const Gate& gate,
                             State& state) {
@@ -292,20 +1090,15 @@ inline void ApplyFusedGateDagger(const Simulator& simulator, const Gate& gate,
 }
 
 // Assumes p_sums.size() == op_coeffs.size()
-// state stores |psi>. scratch has been created, but does not
-// require initialization. dest has been created, but does not require
-// initialization.
-// After termination scratch will contain a copy of source.
-template <typename SimT, typename StateSpaceT, typename StateT>
+// state stores |psi>. dest has been created, but does not require
+// initialization. Every term is added to dest with AccumulatePauliQsim,
+// source is left untouched.
+template <typename ForT, typename StateSpaceT, typename StateT>
 tensorflow::Status AccumulateOperators(
     const std::vector<tfq::proto::PauliSum>& p_sums,
-    const std::vector<float>& op_coeffs, const SimT& sim, const StateSpaceT& ss,
-    StateT& source, StateT& scratch, StateT& dest) {
-  // apply the  gates of the pauliterms to a copy of the wavefunction
-  // accumulating results as we go. Effectively doing O|psi> for an arbitrary
-  // O. Result is stored on scratch.
-  tensorflow::Status status = tensorflow::Status::OK();
-  ss.CopyState(source, scratch);
+    const std::vector<float>& op_coeffs, const ForT& for_obj,
+    const StateSpaceT& ss, const StateT& source, StateT& dest) {
+  // Effectively doing O|psi> for an arbitrary O. Result is stored on dest.
   ss.SetAllZeros(dest);
 
   for (int i = 0; i < p_sums.size(); i++) {
@@ -316,36 +1109,520 @@ tensorflow::Status AccumulateOperators(
         // errors.
         continue;
       }
-      if (term.paulis_size() == 0) {
-        // identity term. Scalar multiply, add, then revert.
-        ss.Multiply(leading_coeff, scratch);
-        ss.AddState(scratch, dest);
-        ss.CopyState(source, scratch);
+
+      // identity terms have both masks empty.
+      uint64_t x_mask, z_mask;
+      tensorflow::Status status =
+          PauliTermMasks(term, ss.num_qubits_, &x_mask, &z_mask);
+      if (!status.ok()) {
+        return status;
+      }
+      AccumulatePauliQsim(for_obj, ss.num_qubits_, leading_coeff,
+                          source.get(), x_mask, z_mask, dest.get());
+    }
+  }
+
+  return tensorflow::Status::OK();
+}
+
+// Applies every gate in circuit to mps in time order. Gates are not fused
+// since fusion would only grow the bonds that the MPS has to split.
+inline void SimulateMps(const QsimCircuit& circuit, MatrixProductState* mps) {
+  for (const QsimGate& gate : circuit.gates) {
+    mps->ApplyQsimGate(gate);
+  }
+}
+
+// Computes <psi | p_sum | psi> on a matrix product state.
+inline tensorflow::Status ComputeExpectationMps(
+    const tfq::proto::PauliSum& p_sum, const MatrixProductState& mps,
+    float* expectation_value) {
+  std::vector<std::pair<unsigned int, char>> paulis;
+  for (const tfq::proto::PauliTerm& term : p_sum.terms()) {
+    // catch identity terms
+    if (term.paulis_size() == 0) {
+      *expectation_value += term.coefficient_real();
+      continue;
+    }
+
+    paulis.clear();
+    for (const tfq::proto::PauliQubitPair& pair : term.paulis()) {
+      unsigned int location;
+      if (!absl::SimpleAtoi(pair.qubit_id(), &location) ||
+          location >= mps.NumQubits()) {
+        return tensorflow::Status(
+            tensorflow::error::INVALID_ARGUMENT,
+            "Could not resolve qubit id " + pair.qubit_id() +
+                " in PauliSum.");
+      }
+      paulis.push_back(std::make_pair(location, pair.pauli_type()[0]));
+    }
+    *expectation_value +=
+        term.coefficient_real() * mps.PauliExpectation(paulis);
+  }
+  return tensorflow::Status::OK();
+}
+
+// Qubits in one cache tile of the blocked executor. 2 ** 16 amplitudes are
+// 512KB, which stays resident in L2 while a run of gates goes over it.
+static const unsigned int _BLOCK_QUBITS = 16;
+
+// Smallest state that is simulated tile by tile. Below this the state is
+// mostly cache resident anyway.
+static const int _BLOCKED_MIN_QUBITS = 22;
+
+// A high qubit is swapped into the tile if it is used again within this
+// many fused gates.
+static const int _BLOCK_LOOKAHEAD = 32;
+
+// One step of a blocked circuit execution. Qubits are physical positions
+// in the state, which differ from the circuit's qubits once swaps were
+// made.
+struct BlockedStep {
+  enum Kind {
+    // Apply gates (all on qubits below the tile size) to every tile, one
+    // tile at a time.
+    kTiled,
+    // Apply gates[0] to the whole state.
+    kSweep,
+    // Swap the qubits at positions swap_qubits[0] < swap_qubits[1].
+    kSwap,
+  };
+  Kind kind;
+  std::vector<int> gates;
+  unsigned int swap_qubits[2];
+};
+
+// Plans the execution of fused_circuit on num_qubits qubits with tiles of
+// 2 ** block_qubits amplitudes. Consecutive gates that only touch qubits
+// below block_qubits become one kTiled step, which streams the state
+// through memory once instead of once per gate. A gate on a high qubit
+// that is used again soon first swaps that qubit with the low qubit whose
+// next use is farthest away. The plan ends with the swaps that restore
+// the original qubit order.
+template <typename Gate>
+void PlanBlockedCircuit(const std::vector<Gate>& fused_circuit,
+                        const unsigned int num_qubits,
+                        const unsigned int block_qubits,
+                        std::vector<BlockedStep>* steps) {
+  steps->clear();
+  // perm[q] is the position of circuit qubit q, inv the reverse.
+  std::vector<unsigned int> perm(num_qubits);
+  std::vector<unsigned int> inv(num_qubits);
+  for (unsigned int q = 0; q < num_qubits; q++) {
+    perm[q] = q;
+    inv[q] = q;
+  }
+
+  BlockedStep run;
+  run.kind = BlockedStep::kTiled;
+  auto flush_run = [&]() {
+    if (!run.gates.empty()) {
+      steps->push_back(run);
+      run.gates.clear();
+    }
+  };
+  auto swap_positions = [&](unsigned int p0, unsigned int p1) {
+    flush_run();
+    BlockedStep swap;
+    swap.kind = BlockedStep::kSwap;
+    swap.swap_qubits[0] = std::min(p0, p1);
+    swap.swap_qubits[1] = std::max(p0, p1);
+    steps->push_back(swap);
+    std::swap(inv[p0], inv[p1]);
+    perm[inv[p0]] = p0;
+    perm[inv[p1]] = p1;
+  };
+  auto touches = [&](int j, unsigned int q) {
+    const auto& gate = fused_circuit[j];
+    for (unsigned int k = 0; k < gate.num_qubits; k++) {
+      if (gate.qubits[k] == q) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  for (int j = 0; j < fused_circuit.size(); j++) {
+    const auto& gate = fused_circuit[j];
+    for (unsigned int k = 0; k < gate.num_qubits; k++) {
+      const unsigned int q = gate.qubits[k];
+      if (perm[q] < block_qubits) {
         continue;
       }
+      // Only worth a swap (itself a full sweep) if q comes back soon.
+      const int end = std::min<int>(j + 1 + _BLOCK_LOOKAHEAD,
+                                    fused_circuit.size());
+      bool reused = false;
+      for (int l = j + 1; l < end && !reused; l++) {
+        reused = touches(l, q);
+      }
+      if (!reused) {
+        continue;
+      }
+      // Evict the low qubit needed last, never one of this gate's.
+      int victim = -1;
+      int victim_next = -1;
+      for (unsigned int p = 0; p < block_qubits; p++) {
+        if (touches(j, inv[p])) {
+          continue;
+        }
+        int next = j + 1;
+        while (next < end && !touches(next, inv[p])) {
+          next++;
+        }
+        if (next > victim_next) {
+          victim = p;
+          victim_next = next;
+        }
+      }
+      if (victim >= 0) {
+        swap_positions(victim, perm[q]);
+      }
+    }
 
-      QsimCircuit main_circuit;
-      std::vector<qsim::GateFused<QsimGate>> fused_circuit;
+    bool low = true;
+    for (unsigned int k = 0; k < gate.num_qubits; k++) {
+      low = low && perm[gate.qubits[k]] < block_qubits;
+    }
+    if (low) {
+      run.gates.push_back(j);
+      continue;
+    }
+    flush_run();
+    BlockedStep sweep;
+    sweep.kind = BlockedStep::kSweep;
+    sweep.gates.push_back(j);
+    steps->push_back(sweep);
+  }
+  flush_run();
 
-      status = QsimCircuitFromPauliTerm(term, ss.num_qubits_, &main_circuit,
-                                        &fused_circuit);
-      if (!status.ok()) {
-        return status;
+  // Put every qubit back where it started.
+  for (unsigned int q = 0; q < num_qubits; q++) {
+    if (perm[q] != q) {
+      swap_positions(q, perm[q]);
+    }
+  }
+}
+
+// Computes the matrix of gate acting on positions perm[gate.qubits[k]].
+// Writes the positions in increasing order to qubits and the matrix in the
+// matching qsim layout to matrix.
+inline void PermutedFusedMatrix(const qsim::GateFused<QsimGate>& gate,
+                                const std::vector<unsigned int>& perm,
+                                unsigned int* qubits, float* matrix) {
+  if (gate.num_qubits == 1) {
+    qsim::CalcMatrix2(gate.gates, matrix);
+    qubits[0] = perm[gate.qubits[0]];
+    return;
+  }
+  qsim::CalcMatrix4(gate.qubits[0], gate.qubits[1], gate.gates, matrix);
+  qubits[0] = perm[gate.qubits[0]];
+  qubits[1] = perm[gate.qubits[1]];
+  if (qubits[0] < qubits[1]) {
+    return;
+  }
+  // Swap the roles of the two qubits in the matrix.
+  std::swap(qubits[0], qubits[1]);
+  float swapped[32];
+  for (unsigned int r = 0; r < 4; r++) {
+    for (unsigned int c = 0; c < 4; c++) {
+      const unsigned int rs = ((r & 1) << 1) | (r >> 1);
+      const unsigned int cs = ((c & 1) << 1) | (c >> 1);
+      swapped[2 * (4 * rs + cs)] = matrix[2 * (4 * r + c)];
+      swapped[2 * (4 * rs + cs) + 1] = matrix[2 * (4 * r + c) + 1];
+    }
+  }
+  std::copy(swapped, swapped + 32, matrix);
+}
+
+// Applies a matrix from PermutedFusedMatrix to state.
+template <typename SimT, typename StateT>
+void ApplyPermutedGate(const SimT& sim, const unsigned int num_gate_qubits,
+                       const unsigned int* qubits, const float* matrix,
+                       StateT& state) {
+  if (num_gate_qubits == 1) {
+    sim.ApplyGate1(qubits[0], matrix, state);
+  } else {
+    sim.ApplyGate2(qubits[0], qubits[1], matrix, state);
+  }
+}
+
+// Applies fused_circuit to state, a state of num_qubits qubits simulated
+// by sim. States of _BLOCKED_MIN_QUBITS qubits or more are simulated tile
+// by tile following PlanBlockedCircuit, tiles run in parallel through
+// for_args so they keep the NUMA placement of the state. Returns the number
+// of times the whole state was streamed through memory.
+template <typename SimT, typename StateT>
+uint64_t ApplyFusedCircuitBlocked(
+    const std::vector<qsim::GateFused<QsimGate>>& fused_circuit,
+    const int num_qubits, const SimT& sim, const QsimFor& for_args,
+    StateT& state) {
+  if (num_qubits < _BLOCKED_MIN_QUBITS) {
+    for (int j = 0; j < fused_circuit.size(); j++) {
+      qsim::ApplyFusedGate(sim, fused_circuit[j], state);
+    }
+    return fused_circuit.size();
+  }
+
+  static const float swap_matrix[32] = {1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                        0, 1, 0, 0, 0, 0, 0, 1, 0, 0, 0,
+                                        0, 0, 0, 0, 0, 0, 0, 0, 1, 0};
+  using TileSimulator = qsim::Simulator<const qsim::SequentialFor&>;
+  const auto tile_for = qsim::SequentialFor(1);
+
+  std::vector<BlockedStep> steps;
+  PlanBlockedCircuit(fused_circuit, num_qubits, _BLOCK_QUBITS, &steps);
+
+  std::vector<unsigned int> perm(num_qubits);
+  std::vector<unsigned int> inv(num_qubits);
+  for (int q = 0; q < num_qubits; q++) {
+    perm[q] = q;
+    inv[q] = q;
+  }
+
+  uint64_t num_sweeps = 0;
+  std::vector<std::vector<float>> matrices;
+  std::vector<std::vector<unsigned int>> qubits;
+  for (const BlockedStep& step : steps) {
+    num_sweeps++;
+    if (step.kind == BlockedStep::kSwap) {
+      sim.ApplyGate2(step.swap_qubits[0], step.swap_qubits[1], swap_matrix,
+                     state);
+      const unsigned int p0 = step.swap_qubits[0];
+      const unsigned int p1 = step.swap_qubits[1];
+      std::swap(inv[p0], inv[p1]);
+      perm[inv[p0]] = p0;
+      perm[inv[p1]] = p1;
+      continue;
+    }
+
+    // Matrices are computed once per step, not once per tile.
+    matrices.assign(step.gates.size(), std::vector<float>(32));
+    qubits.assign(step.gates.size(), std::vector<unsigned int>(2));
+    for (int k = 0; k < step.gates.size(); k++) {
+      PermutedFusedMatrix(fused_circuit[step.gates[k]], perm,
+                          qubits[k].data(), matrices[k].data());
+    }
+
+    if (step.kind == BlockedStep::kSweep) {
+      ApplyPermutedGate(sim, fused_circuit[step.gates[0]].num_qubits,
+                        qubits[0].data(), matrices[0].data(), state);
+      continue;
+    }
+
+    // Tiles are contiguous in every qsim layout, so each one is a valid
+    // _BLOCK_QUBITS qubit state on its own. for_args shards the tiles like
+    // any other sweep over the state, tile t stays on the node that owns
+    // its memory.
+    const uint64_t tile_floats = uint64_t(2) << _BLOCK_QUBITS;
+    auto tile_f = [&](unsigned int, unsigned int, uint64_t t) {
+      TileSimulator tile_sim(_BLOCK_QUBITS, tile_for);
+      StateT tile = StateView<StateT>(state.get() + t * tile_floats);
+      for (int k = 0; k < step.gates.size(); k++) {
+        ApplyPermutedGate(tile_sim, fused_circuit[step.gates[k]].num_qubits,
+                          qubits[k].data(), matrices[k].data(), tile);
       }
+    };
+    for_args.Run(uint64_t(1) << (num_qubits - _BLOCK_QUBITS), tile_f);
+  }
+  return num_sweeps;
+}
+
+// Circuits with more qubits than this are not batched, past this a single
+// state already fills the vector units on its own.
+static const int _MAX_BATCH_QUBITS = 12;
+
+// Most rows simulated together on one BatchStateVector.
+static const int _MAX_BATCH_SIZE = 64;
 
-      // Apply scaled gates, accumulate, undo.
-      for (int j = 0; j < fused_circuit.size(); j++) {
-        qsim::ApplyFusedGate(sim, fused_circuit[j], scratch);
+// Groups rows that can be simulated together on a BatchStateVector: rows
+// with the same number of qubits whose fused circuits touch the same qubits
+// gate for gate (typically the same circuit with different symbol values)
+// and that measure the same PauliSums. Only groups of two or more rows
+// are returned, split into chunks of at most _MAX_BATCH_SIZE rows.
+inline void GetBatchGroups(
+    const std::vector<int>& num_qubits,
+    const std::vector<std::vector<qsim::GateFused<QsimGate>>>& fused_circuits,
+    const std::vector<std::vector<tfq::proto::PauliSum>>& pauli_sums,
+    std::vector<std::vector<int>>* groups) {
+  groups->clear();
+  std::map<std::string, std::vector<int>> by_skeleton;
+  for (int i = 0; i < fused_circuits.size(); i++) {
+    // (#679) empty programs have their own output.
+    if (num_qubits[i] > _MAX_BATCH_QUBITS || num_qubits[i] == 0) {
+      continue;
+    }
+    std::string key = std::to_string(num_qubits[i]) + ":";
+    for (const auto& gate : fused_circuits[i]) {
+      key += std::to_string(gate.num_qubits);
+      for (unsigned int k = 0; k < gate.num_qubits; k++) {
+        key += "," + std::to_string(gate.qubits[k]);
       }
+      key += ";";
+    }
+    for (const tfq::proto::PauliSum& p_sum : pauli_sums[i]) {
+      key += "|" + p_sum.SerializeAsString();
+    }
+    by_skeleton[key].push_back(i);
+  }
 
-      ss.Multiply(leading_coeff, scratch);
-      ss.AddState(scratch, dest);
-      ss.CopyState(source, scratch);
-      // scratch should now be reverted back to original source.
+  for (const auto& entry : by_skeleton) {
+    const std::vector<int>& rows = entry.second;
+    if (rows.size() < 2) {
+      continue;
+    }
+    for (int start = 0; start < rows.size(); start += _MAX_BATCH_SIZE) {
+      const int end = std::min<int>(start + _MAX_BATCH_SIZE, rows.size());
+      groups->push_back(std::vector<int>(rows.begin() + start,
+                                         rows.begin() + end));
     }
   }
+}
 
-  return status;
+// Applies fused gate j of every circuit to state, row b uses the matrix of
+// (*circuits[b])[j]. All circuits must share the same skeleton.
+// matrices is scratch space.
+template <typename FusedGate>
+void ApplyFusedGateBatch(
+    const std::vector<const std::vector<FusedGate>*>& circuits, const int j,
+    BatchStateVector* state, std::vector<float>* matrices) {
+  const FusedGate& first = (*circuits[0])[j];
+  if (first.num_qubits == 1) {
+    matrices->resize(8 * circuits.size());
+    for (int b = 0; b < circuits.size(); b++) {
+      float* matrix = matrices->data() + 8 * b;
+      qsim::CalcMatrix2((*circuits[b])[j].gates, matrix);
+    }
+    state->ApplyGate1(first.qubits[0], matrices->data());
+  } else if (first.num_qubits == 2) {
+    matrices->resize(32 * circuits.size());
+    for (int b = 0; b < circuits.size(); b++) {
+      float* matrix = matrices->data() + 32 * b;
+      qsim::CalcMatrix4(first.qubits[0], first.qubits[1],
+                        (*circuits[b])[j].gates, matrix);
+    }
+    state->ApplyGate2(first.qubits[0], first.qubits[1], matrices->data());
+  }
+}
+
+// Simulates circuits[b]|0> into row b of state.
+template <typename FusedGate>
+void SimulateBatchQsim(
+    const std::vector<const std::vector<FusedGate>*>& circuits,
+    BatchStateVector* state) {
+  std::vector<float> matrices;
+  state->SetStateZero();
+  for (int j = 0; j < circuits[0]->size(); j++) {
+    ApplyFusedGateBatch(circuits, j, state, &matrices);
+  }
+}
+
+// Adds <psi_b | p_sum | psi_b> to expectation_values[b] for every row b.
+inline tensorflow::Status ComputeExpectationBatch(
+    const tfq::proto::PauliSum& p_sum, const BatchStateVector& state,
+    std::vector<float>* expectation_values) {
+  std::vector<float> term_values;
+  for (const tfq::proto::PauliTerm& term : p_sum.terms()) {
+    // catch identity terms
+    if (term.paulis_size() == 0) {
+      for (float& value : *expectation_values) {
+        value += term.coefficient_real();
+      }
+      continue;
+    }
+    uint64_t x_mask, z_mask;
+    tensorflow::Status status =
+        PauliTermMasks(term, state.NumQubits(), &x_mask, &z_mask);
+    if (!status.ok()) {
+      return status;
+    }
+    state.PauliExpectation(x_mask, z_mask, &term_values);
+    for (int b = 0; b < expectation_values->size(); b++) {
+      (*expectation_values)[b] += term.coefficient_real() * term_values[b];
+    }
+  }
+  return tensorflow::Status::OK();
+}
+
+// Batched version of ComputeSampledExpectationQsim. Adds the sampled
+// estimate of <psi_b | p_sum | psi_b> using num_samples[b] shots to
+// expectation_values[b]. scratch must have the shape of state.
+inline tensorflow::Status ComputeSampledExpectationBatch(
+    const tfq::proto::PauliSum& p_sum, const BatchStateVector& state,
+    const std::vector<int>& num_samples, BatchStateVector* scratch,
+    std::vector<float>* expectation_values) {
+  std::vector<float> matrices;
+  std::vector<uint64_t> state_samples;
+  for (const tfq::proto::PauliTerm& term : p_sum.terms()) {
+    // catch identity terms
+    if (term.paulis_size() == 0) {
+      for (int b = 0; b < expectation_values->size(); b++) {
+        if (num_samples[b] != 0) {
+          (*expectation_values)[b] += term.coefficient_real();
+        }
+      }
+      continue;
+    }
+
+    // Transform every row into the measurement basis, the rotation is the
+    // same for all of them.
+    QsimCircuit main_circuit;
+    std::vector<qsim::GateFused<QsimGate>> fused_circuit;
+    tensorflow::Status status = QsimZBasisCircuitFromPauliTerm(
+        term, state.NumQubits(), &main_circuit, &fused_circuit);
+    if (!status.ok()) {
+      return status;
+    }
+    uint64_t x_mask, z_mask;
+    status = PauliTermMasks(term, state.NumQubits(), &x_mask, &z_mask);
+    if (!status.ok()) {
+      return status;
+    }
+    const uint64_t mask = x_mask | z_mask;
+
+    scratch->CopyFrom(state);
+    const std::vector<const std::vector<qsim::GateFused<QsimGate>>*> rotation(
+        state.BatchSize(), &fused_circuit);
+    for (int j = 0; j < fused_circuit.size(); j++) {
+      ApplyFusedGateBatch(rotation, j, scratch, &matrices);
+    }
+
+    for (int b = 0; b < expectation_values->size(); b++) {
+      if (num_samples[b] == 0) {
+        continue;
+      }
+      std::mt19937 rand_gen(1234);
+      scratch->Sample(b, num_samples[b], &rand_gen, &state_samples);
+      int parity_total = 0;
+      for (const uint64_t sample : state_samples) {
+        parity_total += std::bitset<64>(sample & mask).count() & 1 ? -1 : 1;
+      }
+      (*expectation_values)[b] += static_cast<float>(parity_total) *
+                                  term.coefficient_real() /
+                                  static_cast<float>(num_samples[b]);
+    }
+  }
+  return tensorflow::Status::OK();
+}
+
+// Simulates fused_circuit|0> into state with the kernels specialized for
+// sim.NumQubits(). state holds 2 ** num_qubits interleaved complex
+// amplitudes.
+inline void SimulateSmall(
+    const std::vector<qsim::GateFused<QsimGate>>& fused_circuit,
+    const SmallSimulator& sim, float* state) {
+  float matrix[32];
+  sim.SetStateZero(state);
+  for (const qsim::GateFused<QsimGate>& gate : fused_circuit) {
+    if (gate.num_qubits == 1) {
+      qsim::CalcMatrix2(gate.gates, matrix);
+      sim.ApplyGate1(gate.qubits[0], matrix, state);
+    } else if (gate.num_qubits == 2) {
+      qsim::CalcMatrix4(gate.qubits[0], gate.qubits[1], gate.gates, matrix);
+      sim.ApplyGate2(gate.qubits[0], gate.qubits[1], matrix, state);
+    }
+  }
 }
 
 }  // namespace tfq
@@ -15,6 +15,9 @@ limitations under the License.
 
 #include "tensorflow_quantum/core/src/util_qsim.h"
 
+#include <complex>
+#include <functional>
+#include <string>
 #include <vector>
 
 #include "../qsim/lib/circuit.h"
@@ -128,7 +131,7 @@ TEST_P(TwoTermExpectationFixture, CorrectnessTest) {
   qsim::Simulator<qsim::SequentialFor>::StateSpace ss(2, 1);
   auto sv = ss.CreateState();
   ss.SetStateZero(sv);
-  auto scratch = ss.CreateState();
+  qsim::SequentialFor seq_for(1);
 
   // Prepare initial state.
   ss.SetStateZero(sv);
@@ -151,7 +154,7 @@ TEST_P(TwoTermExpectationFixture, CorrectnessTest) {
 
   // Compute expectation and compare to reference values.
   float exp_v = 0;
-  Status s = tfq::ComputeExpectationQsim(p_sum, sim, ss, sv, scratch, &exp_v);
+  Status s = tfq::ComputeExpectationQsim(p_sum, seq_for, ss, sv, &exp_v);
 
   EXPECT_NEAR(exp_v, std::get<1>(GetParam()), 1e-5);
 }
@@ -202,7 +205,7 @@ TEST(UtilQsimTest, EmptyTermCase) {
   qsim::Simulator<qsim::SequentialFor>::StateSpace ss(2, 1);
   auto sv = ss.CreateState();
   ss.SetStateZero(sv);
-  auto scratch = ss.CreateState();
+  qsim::SequentialFor seq_for(1);
 
   PauliSum p_sum_empty;
 
@@ -213,7 +216,7 @@ TEST(UtilQsimTest, EmptyTermCase) {
   // Compute expectation and compare to reference values.
   float exp_v = 0;
   Status s =
-      tfq::ComputeExpectationQsim(p_sum_empty, sim, ss, sv, scratch, &exp_v);
+      tfq::ComputeExpectationQsim(p_sum_empty, seq_for, ss, sv, &exp_v);
 
   EXPECT_NEAR(exp_v, 0.1234, 1e-5);
 }
@@ -295,7 +298,7 @@ TEST(UtilQsimTest, CompoundCase) {
   qsim::Simulator<qsim::SequentialFor>::StateSpace ss(2, 1);
   auto sv = ss.CreateState();
   ss.SetStateZero(sv);
-  auto scratch = ss.CreateState();
+  qsim::SequentialFor seq_for(1);
 
   // Prepare initial state.
   ss.SetStateZero(sv);
@@ -328,7 +331,7 @@ TEST(UtilQsimTest, CompoundCase) {
   p_term_scratch->set_coefficient_real(4.0);
   // Compute expectation and compare to reference values.
   float exp_v = 0;
-  Status s = tfq::ComputeExpectationQsim(p_sum, sim, ss, sv, scratch, &exp_v);
+  Status s = tfq::ComputeExpectationQsim(p_sum, seq_for, ss, sv, &exp_v);
 
   EXPECT_NEAR(exp_v, 4.1234, 1e-5);
 }
@@ -431,7 +434,7 @@ TEST(UtilQsimTest, AccumulateOperatorsBasic) {
   qsim::Simulator<qsim::SequentialFor>::StateSpace ss(2, 1);
   auto sv = ss.CreateState();
   ss.SetStateZero(sv);
-  auto scratch = ss.CreateState();
+  qsim::SequentialFor seq_for(1);
   auto dest = ss.CreateState();
 
   // Prepare initial state.
@@ -470,7 +473,7 @@ TEST(UtilQsimTest, AccumulateOperatorsBasic) {
   p_term_scratch2->set_coefficient_real(-5.0);
 
   // 0.5 * (0.123ZX -3X + 4I) + 0.25 * (-5I) applied onto psi.
-  AccumulateOperators({p_sum, p_sum2}, {0.5, 0.25}, sim, ss, sv, scratch, dest);
+  AccumulateOperators({p_sum, p_sum2}, {0.5, 0.25}, seq_for, ss, sv, dest);
 
   // Check that dest got accumulated onto.
   EXPECT_NEAR(ss.GetAmpl(dest, 0).real(), 0.577925, 1e-5);
@@ -492,15 +495,6 @@ TEST(UtilQsimTest, AccumulateOperatorsBasic) {
   EXPECT_NEAR(ss.GetAmpl(sv, 3).real(), 0.25, 1e-5);
   EXPECT_NEAR(ss.GetAmpl(sv, 3).imag(), -0.10355, 1e-5);
 
-  // Check that as a consequence of running scratch is a copy of sv.
-  EXPECT_NEAR(ss.GetAmpl(scratch, 0).real(), 0.25, 1e-5);
-  EXPECT_NEAR(ss.GetAmpl(scratch, 0).imag(), 0.60355, 1e-5);
-  EXPECT_NEAR(ss.GetAmpl(scratch, 1).real(), 0.25, 1e-5);
-  EXPECT_NEAR(ss.GetAmpl(scratch, 1).imag(), 0.60355, 1e-5);
-  EXPECT_NEAR(ss.GetAmpl(scratch, 2).real(), -0.25, 1e-5);
-  EXPECT_NEAR(ss.GetAmpl(scratch, 2).imag(), 0.10355, 1e-5);
-  EXPECT_NEAR(ss.GetAmpl(scratch, 3).real(), 0.25, 1e-5);
-  EXPECT_NEAR(ss.GetAmpl(scratch, 3).imag(), -0.10355, 1e-5);
 }
 
 TEST(UtilQsimTest, AccumulateOperatorsEmpty) {
@@ -509,10 +503,10 @@ TEST(UtilQsimTest, AccumulateOperatorsEmpty) {
   qsim::Simulator<qsim::SequentialFor>::StateSpace ss(2, 1);
   auto sv = ss.CreateState();
   ss.SetStateZero(sv);
-  auto scratch = ss.CreateState();
+  qsim::SequentialFor seq_for(1);
   auto dest = ss.CreateState();
 
-  AccumulateOperators({}, {}, sim, ss, sv, scratch, dest);
+  AccumulateOperators({}, {}, seq_for, ss, sv, dest);
 
   // Check sv is still in zero state.
   EXPECT_NEAR(ss.GetAmpl(sv, 0).real(), 1.0, 1e-5);
@@ -524,15 +518,6 @@ TEST(UtilQsimTest, AccumulateOperatorsEmpty) {
   EXPECT_NEAR(ss.GetAmpl(sv, 3).real(), 0.0, 1e-5);
   EXPECT_NEAR(ss.GetAmpl(sv, 3).imag(), 0.0, 1e-5);
 
-  // Check scratch is a copy of sv.
-  EXPECT_NEAR(ss.GetAmpl(scratch, 0).real(), 1.0, 1e-5);
-  EXPECT_NEAR(ss.GetAmpl(scratch, 0).imag(), 0.0, 1e-5);
-  EXPECT_NEAR(ss.GetAmpl(scratch, 1).real(), 0.0, 1e-5);
-  EXPECT_NEAR(ss.GetAmpl(scratch, 1).imag(), 0.0, 1e-5);
-  EXPECT_NEAR(ss.GetAmpl(scratch, 2).real(), 0.0, 1e-5);
-  EXPECT_NEAR(ss.GetAmpl(scratch, 2).imag(), 0.0, 1e-5);
-  EXPECT_NEAR(ss.GetAmpl(scratch, 3).real(), 0.0, 1e-5);
-  EXPECT_NEAR(ss.GetAmpl(scratch, 3).imag(), 0.0, 1e-5);
 
   // Check that dest contains all zeros.
   EXPECT_NEAR(ss.GetAmpl(dest, 0).real(), 0.0, 1e-5);
@@ -542,7 +527,425 @@ TEST(UtilQsimTest, AccumulateOperatorsEmpty) {
   EXPECT_NEAR(ss.GetAmpl(dest, 2).real(), 0.0, 1e-5);
   EXPECT_NEAR(ss.GetAmpl(dest, 2).imag(), 0.0, 1e-5);
   EXPECT_NEAR(ss.GetAmpl(dest, 3).real(), 0.0, 1e-5);
-  EXPECT_NEAR(ss.GetAmpl(scratch, 3).imag(), 0.0, 1e-5);
+  EXPECT_NEAR(ss.GetAmpl(dest, 3).imag(), 0.0, 1e-5);
+}
+
+TEST(UtilQsimTest, PauliKernelsMatchGates) {
+  QsimCircuit circuit;
+  circuit.num_qubits = 3;
+  circuit.gates.push_back(qsim::Cirq::HPowGate<float>::Create(0, 0, 1.0, 0.0));
+  circuit.gates.push_back(
+      qsim::Cirq::XPowGate<float>::Create(0, 1, 0.3, 0.0));
+  circuit.gates.push_back(
+      qsim::Cirq::CXPowGate<float>::Create(1, 0, 2, 1.0, 0.0));
+  circuit.gates.push_back(
+      qsim::Cirq::YPowGate<float>::Create(2, 2, 0.7, 0.0));
+  circuit.gates.push_back(
+      qsim::Cirq::ZPowGate<float>::Create(2, 1, 0.4, 0.0));
+
+  qsim::SequentialFor seq_for(1);
+  qsim::Simulator<qsim::SequentialFor> sim(3, 1);
+  qsim::Simulator<qsim::SequentialFor>::StateSpace ss(3, 1);
+  auto sv = ss.CreateState();
+  auto scratch = ss.CreateState();
+  auto dest = ss.CreateState();
+  ss.SetStateZero(sv);
+  for (const QsimGate& gate : circuit.gates) {
+    qsim::ApplyGate(sim, gate, sv);
+  }
+
+  const std::vector<std::string> strings = {"XYZ", "YYI", "ZIX", "YXY",
+                                            "IZI"};
+  for (const std::string& p_string : strings) {
+    PauliTerm term;
+    term.set_coefficient_real(1.0);
+    for (int q = 0; q < 3; q++) {
+      if (p_string[q] == 'I') {
+        continue;
+      }
+      PauliQubitPair* pair = term.add_paulis();
+      pair->set_qubit_id(std::to_string(q));
+      pair->set_pauli_type(p_string.substr(q, 1));
+    }
+
+    // P|psi> through the gate kernels.
+    QsimCircuit p_circuit;
+    std::vector<qsim::GateFused<QsimGate>> p_fused;
+    ASSERT_TRUE(QsimCircuitFromPauliTerm(term, 3, &p_circuit, &p_fused).ok());
+    ss.CopyState(sv, scratch);
+    for (const auto& gate : p_fused) {
+      qsim::ApplyFusedGate(sim, gate, scratch);
+    }
+
+    uint64_t x_mask, z_mask;
+    ASSERT_TRUE(PauliTermMasks(term, 3, &x_mask, &z_mask).ok());
+    EXPECT_NEAR(PauliExpectationQsim(seq_for, 3, sv.get(), x_mask, z_mask),
+                ss.RealInnerProduct(sv, scratch), 1e-5);
+
+    ss.SetAllZeros(dest);
+    AccumulatePauliQsim(seq_for, 3, -0.5, sv.get(), x_mask, z_mask,
+                        dest.get());
+    for (uint64_t a = 0; a < 8; a++) {
+      EXPECT_NEAR(ss.GetAmpl(dest, a).real(),
+                  -0.5 * ss.GetAmpl(scratch, a).real(), 1e-5);
+      EXPECT_NEAR(ss.GetAmpl(dest, a).imag(),
+                  -0.5 * ss.GetAmpl(scratch, a).imag(), 1e-5);
+    }
+  }
+}
+
+TEST(UtilQsimTest, PauliTermMasksRejectsUnknownTypes) {
+  for (const std::string& pauli_type : {"", "I", "x", "XY"}) {
+    PauliTerm term;
+    term.set_coefficient_real(1.0);
+    PauliQubitPair* pair = term.add_paulis();
+    pair->set_qubit_id("0");
+    pair->set_pauli_type(pauli_type);
+
+    uint64_t x_mask, z_mask;
+    EXPECT_EQ(PauliTermMasks(term, 3, &x_mask, &z_mask),
+              tensorflow::Status(tensorflow::error::INVALID_ARGUMENT,
+                                 "Unknown Pauli type '" + pauli_type +
+                                     "' in PauliSum. Expected X, Y or Z."));
+  }
+}
+
+TEST(UtilQsimTest, LoadAmplitudesMatchesGetAmpl) {
+  qsim::SequentialFor seq_for(1);
+  for (const unsigned int nq : {1, 4}) {
+    qsim::Simulator<qsim::SequentialFor>::StateSpace ss(nq, 1);
+    auto sv = ss.CreateState();
+    std::vector<std::complex<float>> amplitudes(uint64_t(1) << nq);
+    for (uint64_t a = 0; a < amplitudes.size(); a++) {
+      amplitudes[a] = std::complex<float>(0.1 * a, -0.2 * a);
+    }
+    LoadAmplitudesQsim(seq_for, nq, amplitudes.data(), sv.get());
+    for (uint64_t a = 0; a < amplitudes.size(); a++) {
+      EXPECT_EQ(ss.GetAmpl(sv, a), amplitudes[a]);
+    }
+  }
+}
+
+TEST(UtilQsimTest, GetLightCone) {
+  // q3 -- X -- CX(3, 2) -----------
+  // q2 ------- CX(3, 2) -- CZ(2, 1)
+  // q1 ------------------- CZ(2, 1)
+  // q0 -- Y -----------------------
+  QsimCircuit circuit;
+  circuit.num_qubits = 4;
+  circuit.gates.push_back(qsim::Cirq::XPowGate<float>::Create(0, 3, 0.5, 0.0));
+  circuit.gates.push_back(qsim::Cirq::YPowGate<float>::Create(0, 0, 0.5, 0.0));
+  circuit.gates.push_back(
+      qsim::Cirq::CXPowGate<float>::Create(1, 2, 3, 1.0, 0.0));
+  circuit.gates.push_back(
+      qsim::Cirq::CZPowGate<float>::Create(2, 1, 2, 1.0, 0.0));
+
+  std::vector<unsigned int> cone_qubits;
+  std::vector<unsigned int> gate_indices;
+
+  GetLightCone(circuit, {0}, &cone_qubits, &gate_indices);
+  EXPECT_EQ(cone_qubits, std::vector<unsigned int>({0}));
+  EXPECT_EQ(gate_indices, std::vector<unsigned int>({1}));
+
+  GetLightCone(circuit, {3}, &cone_qubits, &gate_indices);
+  EXPECT_EQ(cone_qubits, std::vector<unsigned int>({2, 3}));
+  EXPECT_EQ(gate_indices, std::vector<unsigned int>({0, 2}));
+
+  GetLightCone(circuit, {1}, &cone_qubits, &gate_indices);
+  EXPECT_EQ(cone_qubits, std::vector<unsigned int>({1, 2, 3}));
+  EXPECT_EQ(gate_indices, std::vector<unsigned int>({0, 2, 3}));
+}
+
+TEST(UtilQsimTest, LightConeExpectationMatchesFull) {
+  QsimCircuit circuit;
+  circuit.num_qubits = 4;
+  circuit.gates.push_back(qsim::Cirq::XPowGate<float>::Create(0, 3, 0.3, 0.0));
+  circuit.gates.push_back(qsim::Cirq::YPowGate<float>::Create(0, 0, 0.7, 0.0));
+  circuit.gates.push_back(qsim::Cirq::HPowGate<float>::Create(0, 1, 1.0, 0.0));
+  circuit.gates.push_back(
+      qsim::Cirq::CXPowGate<float>::Create(1, 2, 3, 1.0, 0.0));
+  circuit.gates.push_back(
+      qsim::Cirq::ZZPowGate<float>::Create(2, 1, 2, 0.4, 0.0));
+
+  auto fused_circuit = qsim::BasicGateFuser<qsim::IO, QsimGate>().FuseGates(
+      circuit.num_qubits, circuit.gates);
+
+  qsim::Simulator<qsim::SequentialFor> sim(4, 1);
+  qsim::Simulator<qsim::SequentialFor>::StateSpace ss(4, 1);
+  auto sv = ss.CreateState();
+  ss.SetStateZero(sv);
+  for (int j = 0; j < fused_circuit.size(); j++) {
+    qsim::ApplyFusedGate(sim, fused_circuit[j], sv);
+  }
+
+  // Resolved qubit ids are big-endian: id "k" is qsim qubit 3 - k.
+  std::vector<std::pair<std::string, std::string>> terms = {
+      {"3", "Y"}, {"0", "Z"}, {"1", "X"}, {"2", "Z"}};
+  std::vector<PauliSum> p_sums;
+  for (const auto& t : terms) {
+    PauliSum p_sum;
+    PauliTerm* term = p_sum.add_terms();
+    term->set_coefficient_real(0.5);
+    PauliQubitPair* pair = term->add_paulis();
+    pair->set_qubit_id(t.first);
+    pair->set_pauli_type(t.second);
+    // Add an identity and a two qubit term sharing a cone.
+    p_sum.add_terms()->set_coefficient_real(-1.0);
+    term = p_sum.add_terms();
+    term->set_coefficient_real(2.0);
+    pair = term->add_paulis();
+    pair->set_qubit_id("0");
+    pair->set_pauli_type("X");
+    pair = term->add_paulis();
+    pair->set_qubit_id("1");
+    pair->set_pauli_type("Z");
+    p_sums.push_back(p_sum);
+  }
+
+  // Sum the cone contributions the way tfq_simulate_expectation does.
+  std::vector<LightConeGroup> groups;
+  std::vector<float> pruned;
+  Status s = GetLightConeGroups(p_sums, circuit, &groups, &pruned);
+  ASSERT_TRUE(s.ok());
+  ASSERT_EQ(pruned.size(), p_sums.size());
+
+  qsim::SequentialFor seq_for(1);
+  for (const LightConeGroup& group : groups) {
+    std::vector<float> partial_values;
+    s = ComputeLightConeGroupQsim<qsim::Simulator<const qsim::SequentialFor&>>(
+        group, p_sums, circuit, seq_for, &partial_values);
+    ASSERT_TRUE(s.ok());
+    for (int k = 0; k < group.terms.size(); k++) {
+      pruned[group.terms[k].first] += partial_values[k];
+    }
+  }
+
+  for (int i = 0; i < p_sums.size(); i++) {
+    float exp_v = 0;
+    s = ComputeExpectationQsim(p_sums[i], seq_for, ss, sv, &exp_v);
+    EXPECT_NEAR(pruned[i], exp_v, 1e-5);
+  }
+}
+
+TEST(UtilQsimTest, GetQubitClusters) {
+  // q3 -- X -- CX(3, 2) --
+  // q2 ------- CX(3, 2) --
+  // q1 -- H ---------------
+  // q0 -- Y ---------------
+  QsimCircuit circuit;
+  circuit.num_qubits = 4;
+  circuit.gates.push_back(qsim::Cirq::XPowGate<float>::Create(0, 3, 0.5, 0.0));
+  circuit.gates.push_back(qsim::Cirq::HPowGate<float>::Create(0, 1, 1.0, 0.0));
+  circuit.gates.push_back(qsim::Cirq::YPowGate<float>::Create(0, 0, 0.5, 0.0));
+  circuit.gates.push_back(
+      qsim::Cirq::CXPowGate<float>::Create(1, 2, 3, 1.0, 0.0));
+
+  std::vector<QubitCluster> clusters;
+  GetQubitClusters(circuit, &clusters);
+
+  ASSERT_EQ(clusters.size(), 3);
+  EXPECT_EQ(clusters[0].qubits, std::vector<unsigned int>({0}));
+  EXPECT_EQ(clusters[0].gate_indices, std::vector<unsigned int>({2}));
+  EXPECT_EQ(clusters[1].qubits, std::vector<unsigned int>({1}));
+  EXPECT_EQ(clusters[1].gate_indices, std::vector<unsigned int>({1}));
+  EXPECT_EQ(clusters[2].qubits, std::vector<unsigned int>({2, 3}));
+  EXPECT_EQ(clusters[2].gate_indices, std::vector<unsigned int>({0, 3}));
+}
+
+TEST(UtilQsimTest, ClusteredExpectationMatchesFull) {
+  QsimCircuit circuit;
+  circuit.num_qubits = 4;
+  circuit.gates.push_back(qsim::Cirq::XPowGate<float>::Create(0, 3, 0.3, 0.0));
+  circuit.gates.push_back(qsim::Cirq::HPowGate<float>::Create(0, 1, 1.0, 0.0));
+  circuit.gates.push_back(qsim::Cirq::YPowGate<float>::Create(0, 0, 0.7, 0.0));
+  circuit.gates.push_back(
+      qsim::Cirq::CXPowGate<float>::Create(1, 2, 3, 1.0, 0.0));
+  circuit.gates.push_back(qsim::Cirq::XPowGate<float>::Create(2, 1, 0.2, 0.0));
+
+  auto fused_circuit = qsim::BasicGateFuser<qsim::IO, QsimGate>().FuseGates(
+      circuit.num_qubits, circuit.gates);
+
+  qsim::Simulator<qsim::SequentialFor> sim(4, 1);
+  qsim::Simulator<qsim::SequentialFor>::StateSpace ss(4, 1);
+  auto sv = ss.CreateState();
+  ss.SetStateZero(sv);
+  for (int j = 0; j < fused_circuit.size(); j++) {
+    qsim::ApplyFusedGate(sim, fused_circuit[j], sv);
+  }
+
+  // 0.5 Y0 X2 Z3 - 1.0 I + 2.0 X1.
+  PauliSum p_sum;
+  PauliTerm* term = p_sum.add_terms();
+  term->set_coefficient_real(0.5);
+  std::vector<std::pair<std::string, std::string>> paulis = {
+      {"0", "Y"}, {"2", "X"}, {"3", "Z"}};
+  for (const auto& p : paulis) {
+    PauliQubitPair* pair = term->add_paulis();
+    pair->set_qubit_id(p.first);
+    pair->set_pauli_type(p.second);
+  }
+  p_sum.add_terms()->set_coefficient_real(-1.0);
+  term = p_sum.add_terms();
+  term->set_coefficient_real(2.0);
+  PauliQubitPair* pair = term->add_paulis();
+  pair->set_qubit_id("1");
+  pair->set_pauli_type("X");
+
+  std::vector<QubitCluster> clusters;
+  GetQubitClusters(circuit, &clusters);
+  ASSERT_EQ(clusters.size(), 3);
+
+  std::vector<float> clustered;
+  qsim::SequentialFor seq_for(1);
+  Status s = ComputeClusteredExpectationQsim<
+      qsim::Simulator<const qsim::SequentialFor&>>({p_sum}, circuit, clusters,
+                                                   seq_for, &clustered);
+  ASSERT_TRUE(s.ok());
+
+  float exp_v = 0;
+  s = ComputeExpectationQsim(p_sum, seq_for, ss, sv, &exp_v);
+  EXPECT_NEAR(clustered[0], exp_v, 1e-5);
+}
+
+TEST(UtilQsimTest, SampleClusteredIndependent) {
+  // Two Hadamards on unentangled qubits: all four bitstrings should
+  // appear with equal frequency.
+  QsimCircuit circuit;
+  circuit.num_qubits = 2;
+  circuit.gates.push_back(qsim::Cirq::HPowGate<float>::Create(0, 0, 1.0, 0.0));
+  circuit.gates.push_back(qsim::Cirq::HPowGate<float>::Create(0, 1, 1.0, 0.0));
+
+  std::vector<QubitCluster> clusters;
+  GetQubitClusters(circuit, &clusters);
+  ASSERT_EQ(clusters.size(), 2);
+
+  const int num_samples = 100000;
+  std::vector<uint64_t> samples;
+  qsim::SequentialFor seq_for(1);
+  SampleClusteredQsim<qsim::Simulator<const qsim::SequentialFor&>>(
+      circuit, clusters, num_samples, 1234, seq_for, &samples);
+
+  ASSERT_EQ(samples.size(), num_samples);
+  std::vector<int> counts(4, 0);
+  for (const uint64_t sample : samples) {
+    ASSERT_LT(sample, 4);
+    counts[sample]++;
+  }
+  for (int i = 0; i < 4; i++) {
+    EXPECT_NEAR(static_cast<float>(counts[i]) / num_samples, 0.25, 1e-2);
+  }
+}
+
+TEST(UtilQsimTest, QsimForNumaPlacement) {
+  // Small states never get spread over NUMA nodes.
+  EXPECT_EQ(QsimFor(nullptr).numa_nodes, 1);
+  EXPECT_EQ(QsimFor(nullptr, 10).numa_nodes, 1);
+}
+
+TEST(UtilQsimTest, ShardPartitioning) {
+  for (const uint64_t size : {1, 7, 64, 1000}) {
+    for (const unsigned num_shards : {1, 3, 8, 64}) {
+      // Shards are contiguous, in order and cover [0, size) exactly once.
+      EXPECT_EQ(ShardBegin(size, 0, num_shards), 0);
+      EXPECT_EQ(ShardBegin(size, num_shards, num_shards), size);
+      for (unsigned k = 0; k < num_shards; k++) {
+        const uint64_t length = ShardBegin(size, k + 1, num_shards) -
+                                ShardBegin(size, k, num_shards);
+        EXPECT_LE(length, size / num_shards + 1);
+        EXPECT_GE(length, size / num_shards);
+      }
+    }
+  }
+
+  // No placement on a single node.
+  EXPECT_EQ(ShardNumaNode(3, 8, 1), -1);
+  EXPECT_EQ(ShardNumaNode(3, 8, 0), -1);
+
+  // Consecutive shards share a node, every node gets its share.
+  const int numa_nodes = 3;
+  const unsigned num_shards = 8;
+  std::vector<int> shards_per_node(numa_nodes, 0);
+  int last_node = 0;
+  for (unsigned k = 0; k < num_shards; k++) {
+    const int node = ShardNumaNode(k, num_shards, numa_nodes);
+    ASSERT_GE(node, last_node);
+    ASSERT_LT(node, numa_nodes);
+    shards_per_node[node]++;
+    last_node = node;
+  }
+  EXPECT_EQ(shards_per_node, std::vector<int>({3, 3, 2}));
+}
+
+TEST(UtilQsimTest, RecordStateBandwidth) {
+  const int64_t before = StateBytesCounter()->GetCell()->value();
+  RecordStateBandwidth(10, 3, 5);
+  // 3 gates, each reading and writing 2 ** 10 complex floats.
+  EXPECT_EQ(StateBytesCounter()->GetCell()->value() - before,
+            3 * 2 * 8 * 1024);
+}
+
+TEST(UtilQsimTest, CircuitCost) {
+  EXPECT_GT(CircuitCost(10, 5, 0), CircuitCost(9, 5, 0));
+  EXPECT_GT(CircuitCost(10, 5, 1), CircuitCost(10, 5, 0));
+  EXPECT_GT(CircuitCost(10, 6, 0), CircuitCost(10, 5, 0));
+}
+
+TEST(UtilQsimTest, CostOrderedQueue) {
+  CostOrderedQueue queue({5, 100, 5, 30});
+  std::vector<int> order;
+  int item;
+  while (queue.Next(&item)) {
+    order.push_back(item);
+  }
+  // Most expensive first, ties in index order.
+  EXPECT_EQ(order, std::vector<int>({1, 3, 0, 2}));
+  EXPECT_FALSE(queue.Next(&item));
+}
+
+TEST(UtilQsimTest, PairwiseReduceShape) {
+  auto concat = [](const std::string& a, const std::string& b) {
+    return "(" + a + b + ")";
+  };
+  EXPECT_EQ(PairwiseReduce(std::vector<std::string>({"a"}), concat), "a");
+  EXPECT_EQ(
+      PairwiseReduce(std::vector<std::string>({"a", "b", "c", "d"}), concat),
+      "((ab)(cd))");
+  EXPECT_EQ(PairwiseReduce(
+                std::vector<std::string>({"a", "b", "c", "d", "e"}), concat),
+            "(((ab)(cd))e)");
+  EXPECT_EQ(PairwiseReduce(std::vector<float>({1, 2, 3}), std::plus<float>()),
+            6);
+}
+
+TEST(UtilQsimTest, PlanBlockedCircuit) {
+  // Six qubits in tiles of three. Qubit 5 is used twice in a row and is
+  // swapped into the tile, qubit 4 only once and gets a full sweep.
+  std::vector<QsimGate> gates;
+  gates.push_back(qsim::Cirq::XPowGate<float>::Create(0, 0, 0.5, 0.0));
+  gates.push_back(qsim::Cirq::CXPowGate<float>::Create(0, 1, 2, 1.0, 0.0));
+  gates.push_back(qsim::Cirq::XPowGate<float>::Create(1, 5, 0.5, 0.0));
+  gates.push_back(qsim::Cirq::CXPowGate<float>::Create(2, 0, 5, 1.0, 0.0));
+  gates.push_back(qsim::Cirq::HPowGate<float>::Create(2, 1, 1.0, 0.0));
+  gates.push_back(qsim::Cirq::XPowGate<float>::Create(3, 4, 0.5, 0.0));
+
+  std::vector<BlockedStep> steps;
+  PlanBlockedCircuit(gates, 6, 3, &steps);
+
+  ASSERT_EQ(steps.size(), 5);
+  EXPECT_EQ(steps[0].kind, BlockedStep::kTiled);
+  EXPECT_EQ(steps[0].gates, std::vector<int>({0, 1}));
+  // Qubit 2 is not needed again and makes room.
+  EXPECT_EQ(steps[1].kind, BlockedStep::kSwap);
+  EXPECT_EQ(steps[1].swap_qubits[0], 2);
+  EXPECT_EQ(steps[1].swap_qubits[1], 5);
+  EXPECT_EQ(steps[2].kind, BlockedStep::kTiled);
+  EXPECT_EQ(steps[2].gates, std::vector<int>({2, 3, 4}));
+  EXPECT_EQ(steps[3].kind, BlockedStep::kSweep);
+  EXPECT_EQ(steps[3].gates, std::vector<int>({5}));
+  // The original order is restored at the end.
+  EXPECT_EQ(steps[4].kind, BlockedStep::kSwap);
+  EXPECT_EQ(steps[4].swap_qubits[0], 2);
+  EXPECT_EQ(steps[4].swap_qubits[1], 5);
 }
 
 }  // namespace
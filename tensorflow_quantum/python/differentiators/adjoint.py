@@ -0,0 +1,146 @@
+# Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+# ==============================================================================
+"""Compute gradients in the same op as the forward pass."""
+import tensorflow as tf
+
+from tensorflow_quantum.core.ops import circuit_execution_ops
+from tensorflow_quantum.core.ops import tfq_simulate_ops
+from tensorflow_quantum.python.differentiators import differentiator
+
+
+class Adjoint(differentiator.Differentiator):
+    """Differentiate with the adjoint method inside of the forward pass.
+
+    The op generated by this differentiator computes expectation values and
+    their gradients with respect to every symbol in a single call to the C++
+    simulator. Every circuit is parsed and simulated once, then walked back
+    from its final state to produce all of its gradients. The backward pass
+    only has to multiply the stored gradients with the incoming `grad`, no
+    circuits are simulated again.
+
+    >>> non_diff_op = tfq.get_expectation_op()
+    >>> adjoint_differentiator = tfq.differentiators.Adjoint()
+    >>> op = adjoint_differentiator.generate_differentiable_op(
+    ...     analytic_op=non_diff_op
+    ... )
+    >>> qubit = cirq.GridQubit(0, 0)
+    >>> circuit = tfq.convert_to_tensor([
+    ...     cirq.Circuit(cirq.X(qubit) ** sympy.Symbol('alpha'))
+    ... ])
+    >>> psums = tfq.convert_to_tensor([[cirq.Z(qubit)]])
+    >>> symbol_values_array = np.array([[0.123]], dtype=np.float32)
+    >>> symbol_values_tensor = tf.convert_to_tensor(symbol_values_array)
+    >>> with tf.GradientTape() as g:
+    ...     g.watch(symbol_values_tensor)
+    ...     expectations = op(circuit, ['alpha'], symbol_values_tensor, psums)
+    >>> grads = g.gradient(expectations, symbol_values_tensor)
+    >>> grads
+    tf.Tensor([[-1.1839752]], shape=(1, 1), dtype=float32)
+
+    Only the native C++ simulator (`backend=None`) and analytic expectations
+    are supported, other ops are rejected. The gradients are computed on
+    every forward pass, which costs about two more simulations of each
+    circuit, so this is not the default differentiator. Prefer it for
+    training, where every forward pass is followed by a backward pass.
+    """
+
+    def generate_differentiable_op(self, *, sampled_op=None, analytic_op=None):
+        """Generate a differentiable op by attaching self to an op.
+
+        See `tfq.differentiators.Differentiator`. `analytic_op` has to be
+        the op returned by `tfq.get_expectation_op()` for the native
+        simulator, the returned op calls the simulator that also computes
+        gradients in its place.
+
+        Args:
+            sampled_op: Not supported, must be None.
+            analytic_op: The native `callable` expectation op to make
+                differentiable.
+
+        Returns:
+            A `callable` op that computes expectations along with their
+            gradients.
+        """
+        if sampled_op is not None:
+            raise ValueError('Adjoint differentiator cannot differentiate '
+                             'sample based expectations. Please provide '
+                             'analytic_op instead.')
+
+        # Run the common argument checks.
+        super().generate_differentiable_op(analytic_op=analytic_op)
+
+        if not circuit_execution_ops.is_native_expectation_op(analytic_op):
+            raise ValueError('Adjoint differentiator only supports the '
+                             'native expectation op from '
+                             'tfq.get_expectation_op() with backend=None.')
+
+        @tf.custom_gradient
+        def op_wrapper_adjoint(programs, symbol_names, symbol_values,
+                               pauli_sums):
+            forward_pass_vals, jacobian = \
+                tfq_simulate_ops.tfq_simulate_expectation_and_gradient(
+                    programs, symbol_names, symbol_values, pauli_sums)
+
+            def gradient(grad):
+                return None, None, tf.einsum('co,cos->cs', grad,
+                                             jacobian), None
+
+            return forward_pass_vals, gradient
+
+        return op_wrapper_adjoint
+
+    @tf.function
+    def differentiate_analytic(self, programs, symbol_names, symbol_values,
+                               pauli_sums, forward_pass_vals, grad):
+        """Calculate the gradient with the adjoint method.
+
+        Only used when this differentiator is called directly, the op from
+        `generate_differentiable_op` already has the gradients from its
+        forward pass.
+
+        Args:
+            programs: `tf.Tensor` of strings with shape [batch_size] containing
+                the string representations of the circuits to be executed.
+            symbol_names: `tf.Tensor` of strings with shape [n_params], which
+                is used to specify the order in which the values in
+                `symbol_values` should be placed inside of the circuits in
+                `programs`.
+            symbol_values: `tf.Tensor` of real numbers with shape
+                [batch_size, n_params] specifying parameter values to resolve
+                into the circuits specified by programs, following the ordering
+                dictated by `symbol_names`.
+            pauli_sums: `tf.Tensor` of strings with shape [batch_size, n_ops]
+                containing the string representation of the operators that will
+                be used on all of the circuits in the expectation calculations.
+            forward_pass_vals: `tf.Tensor` of real numbers with shape
+                [batch_size, n_ops] containing the output of the forward pass
+                through the op you are differentiating.
+            grad: `tf.Tensor` of real numbers with shape [batch_size, n_ops]
+                representing the gradient backpropagated to the output of the
+                op you are differentiating through.
+
+        Returns:
+            Backward gradient values for each program & each pauli sum. It has
+            the shape of [batch_size, n_symbols].
+        """
+        _, jacobian = tfq_simulate_ops.tfq_simulate_expectation_and_gradient(
+            programs, symbol_names, symbol_values, pauli_sums)
+        return tf.einsum('co,cos->cs', grad, jacobian)
+
+    def differentiate_sampled(self, programs, symbol_names, symbol_values,
+                              pauli_sums, num_samples, forward_pass_vals, grad):
+        """Sample based expectations are not supported."""
+        raise NotImplementedError('Adjoint differentiator cannot differentiate '
+                                  'sample based expectations.')
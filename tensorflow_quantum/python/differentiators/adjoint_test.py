@@ -0,0 +1,105 @@
+# Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+# ==============================================================================
+"""Basic tests for the Adjoint differentiator."""
+import numpy as np
+import tensorflow as tf
+import sympy
+import cirq
+
+from tensorflow_quantum.core.ops import circuit_execution_ops
+from tensorflow_quantum.python import util
+from tensorflow_quantum.python.differentiators import adjoint
+from tensorflow_quantum.python.differentiators import linear_combination
+
+
+class AdjointTest(tf.test.TestCase):
+    """Test the Adjoint differentiator."""
+
+    def test_adjoint_simple_circuit(self):
+        """Expectations and gradients of Y**alpha measured on X."""
+        qubit = cirq.GridQubit(0, 0)
+        circuit = util.convert_to_tensor(
+            [cirq.Circuit(cirq.Y(qubit)**sympy.Symbol('alpha'))])
+        psums = util.convert_to_tensor([[cirq.X(qubit)]])
+        value = 0.3
+        symbol_values = tf.convert_to_tensor([[value]])
+
+        op = adjoint.Adjoint().generate_differentiable_op(
+            analytic_op=circuit_execution_ops.get_expectation_op())
+        with tf.GradientTape() as g:
+            g.watch(symbol_values)
+            expectations = op(circuit, tf.convert_to_tensor(['alpha']),
+                              symbol_values, psums)
+        grads = g.gradient(expectations, symbol_values)
+        self.assertAllClose(expectations, [[np.sin(np.pi * value)]],
+                            atol=1e-5)
+        self.assertAllClose(grads, [[np.pi * np.cos(np.pi * value)]],
+                            atol=1e-3)
+
+    def test_adjoint_matches_central_difference(self):
+        """Gradients of random circuits with several ops and symbols."""
+        n_qubits = 4
+        batch_size = 5
+        symbol_names = ['alpha', 'beta', 'gamma']
+        qubits = cirq.GridQubit.rect(1, n_qubits)
+        circuit_batch, resolver_batch = \
+            util.random_symbol_circuit_resolver_batch(
+                qubits, symbol_names, batch_size)
+        symbol_values = tf.convert_to_tensor(
+            np.array([[resolver[symbol]
+                       for symbol in symbol_names]
+                      for resolver in resolver_batch],
+                     dtype=np.float32))
+        pauli_sums = [
+            util.random_pauli_sums(qubits, 3, batch_size) for _ in range(2)
+        ]
+        programs = util.convert_to_tensor(circuit_batch)
+        ops = util.convert_to_tensor(list(zip(*pauli_sums)))
+        names = tf.convert_to_tensor(symbol_names)
+
+        adjoint_op = adjoint.Adjoint().generate_differentiable_op(
+            analytic_op=circuit_execution_ops.get_expectation_op())
+        central_op = linear_combination.CentralDifference(
+            error_order=4).generate_differentiable_op(
+                analytic_op=circuit_execution_ops.get_expectation_op())
+
+        with tf.GradientTape() as g:
+            g.watch(symbol_values)
+            adjoint_vals = adjoint_op(programs, names, symbol_values, ops)
+        adjoint_grads = g.gradient(adjoint_vals, symbol_values)
+        with tf.GradientTape() as g:
+            g.watch(symbol_values)
+            central_vals = central_op(programs, names, symbol_values, ops)
+        central_grads = g.gradient(central_vals, symbol_values)
+
+        self.assertAllClose(adjoint_vals, central_vals, atol=1e-5)
+        self.assertAllClose(adjoint_grads, central_grads, atol=1e-2, rtol=1e-2)
+
+    def test_adjoint_native_only(self):
+        """Ops from other backends cannot be bypassed."""
+        with self.assertRaisesRegex(ValueError, expected_regex='native'):
+            adjoint.Adjoint().generate_differentiable_op(
+                analytic_op=circuit_execution_ops.get_expectation_op(
+                    backend=cirq.DensityMatrixSimulator()))
+
+    def test_adjoint_no_sampled(self):
+        """Sample based expectations cannot be differentiated."""
+        with self.assertRaisesRegex(ValueError, expected_regex='analytic_op'):
+            adjoint.Adjoint().generate_differentiable_op(
+                sampled_op=circuit_execution_ops.get_sampled_expectation_op())
+
+
+if __name__ == '__main__':
+    tf.test.main()
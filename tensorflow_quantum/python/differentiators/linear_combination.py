@@ -18,6 +18,8 @@ import numbers
 import numpy as np
 import tensorflow as tf
 
+from tensorflow_quantum.core.ops import circuit_execution_ops
+from tensorflow_quantum.core.ops import tfq_simulate_ops
 from tensorflow_quantum.python.differentiators import differentiator
 
 
@@ -26,6 +28,11 @@ class LinearCombination(differentiator.Differentiator):
     linearly combining values obtained by evaluating the op using parameter
     values perturbed about their forward-pass values.
 
+    When the op is the native expectation op from `tfq.get_expectation_op()`,
+    analytic gradients are evaluated by the C++ simulator, which parses every
+    circuit once for all of its perturbations. Any other op is evaluated on
+    tiled, perturbed copies of the circuits.
+
 
     >>> my_op = tfq.get_expectation_op()
     >>> weights = [5, 6, 7]
@@ -99,6 +106,31 @@ class LinearCombination(differentiator.Differentiator):
     def differentiate_analytic(self, programs, symbol_names, symbol_values,
                                pauli_sums, forward_pass_vals, grad):
 
+        if not circuit_execution_ops.is_native_expectation_op(
+                self.expectation_op):
+            return self._differentiate_analytic_tiled(programs, symbol_names,
+                                                      symbol_values,
+                                                      pauli_sums,
+                                                      forward_pass_vals, grad)
+
+        # The C++ op parses every program once and evaluates all perturbed
+        # copies of it in place, no programs or ops are tiled.
+        # partials has shape [n_programs, n_ops, n_symbols].
+        partials = tfq_simulate_ops.tfq_simulate_linear_combination(
+            programs, symbol_names, symbol_values, pauli_sums, self.weights,
+            self.perturbations)
+
+        # now apply the chain rule
+        return tf.einsum('cos,co->cs', partials, grad)
+
+    def _differentiate_analytic_tiled(self, programs, symbol_names,
+                                      symbol_values, pauli_sums,
+                                      forward_pass_vals, grad):
+        """Linear combination gradient through self.expectation_op.
+
+        Every perturbed copy of every program is tiled out and evaluated by
+        self.expectation_op. Arguments are as in `differentiate_analytic`.
+        """
         # these get used a lot
         n_symbols = tf.gather(tf.shape(symbol_names), 0)
         n_programs = tf.gather(tf.shape(programs), 0)
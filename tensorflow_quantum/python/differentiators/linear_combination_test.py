@@ -169,6 +169,27 @@ class LinearCombinationTest(tf.test.TestCase, parameterized.TestCase):
                             atol=1e-2,
                             rtol=1e-2)
 
+    @parameterized.parameters([{
+        'diff': linear_combination.ForwardDifference()
+    }, {
+        'diff': linear_combination.CentralDifference()
+    }])
+    def test_analytic_functional_cirq_backend(self, diff):
+        """Test that non-native expectation ops use the tiled path."""
+        differentiable_op = diff.generate_differentiable_op(
+            analytic_op=circuit_execution_ops.get_expectation_op(
+                backend=cirq.DensityMatrixSimulator()))
+        circuit, names, values, ops, _, true_f, true_g = _simple_op_inputs()
+        with tf.GradientTape() as g:
+            g.watch(values)
+            res = differentiable_op(circuit, names, values, ops)
+
+        self.assertAllClose(true_f, res, atol=1e-2, rtol=1e-2)
+        self.assertAllClose(true_g,
+                            g.gradient(res, values),
+                            atol=1e-2,
+                            rtol=1e-2)
+
     @parameterized.parameters([{
         'diff': linear_combination.ForwardDifference()
     }, {
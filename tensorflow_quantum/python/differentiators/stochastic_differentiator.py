@@ -18,6 +18,8 @@ For the test of this SGDifferentiator's consistency & convergence, please see:
 """
 import tensorflow as tf
 
+from tensorflow_quantum.core.ops import circuit_execution_ops
+from tensorflow_quantum.core.ops import tfq_simulate_ops
 from tensorflow_quantum.python.differentiators import differentiator, \
     parameter_shift_util, stochastic_differentiator_util as sd_util
 
@@ -113,16 +115,20 @@ class SGDifferentiator(differentiator.Differentiator):
     def differentiate_analytic(self, programs, symbol_names, symbol_values,
                                pauli_sums, forward_pass_vals, grad):
         """Compute the sampled gradient with cascaded stochastic processes.
-        The gradient calculations follows the following steps:
-        1. Compute the decomposition of the incoming circuits so that we have
-            their generator information (done using cirq in a tf.py_function)
+        The stochastic processes run inside of a single C++ op:
+        1. Parse the programs and find the parameterized gates of every
+            symbol.
         2. Construct probability distributions & perform stochastic processes
-            to select parameter-shift terms.
+            to select parameter-shift terms for every program.
             - Stochastic generator : sampling on parameter-shifted gates.
             - Stochastic coordinate : sampling on symbols.
             - Stochastic cost : sampling on pauli sums
-        3. Sum up terms and reshape for the total gradient that is compatible
-            with tensorflow differentiation.
+        3. Shift the selected gates in memory, simulate them and sum up the
+            reweighted terms.
+        The chain rule with `grad` is applied afterwards. This only happens
+        when differentiating the native expectation op, any other op (e.g.
+        a cirq or noisy backend) is evaluated on tiled, shifted programs
+        instead so that the gradients come from the same simulator.
         Args:
             programs: `tf.Tensor` of strings with shape [n_programs] containing
                 the string representations of the circuits to be executed.
@@ -145,6 +151,36 @@ class SGDifferentiator(differentiator.Differentiator):
             A `tf.Tensor` of real numbers for sampled gradients from the above
             samplers with the shape of [n_programs, n_symbols]
         """
+        if not circuit_execution_ops.is_native_expectation_op(
+                self.expectation_op):
+            return self._differentiate_analytic_tiled(programs, symbol_names,
+                                                      symbol_values,
+                                                      pauli_sums, grad)
+
+        seed = tf.random.uniform([], maxval=tf.int32.max, dtype=tf.int32)
+        # [n_programs, n_ops, n_symbols]
+        partials = tfq_simulate_ops.tfq_simulate_stochastic_gradient(
+            programs,
+            symbol_names,
+            symbol_values,
+            pauli_sums,
+            seed,
+            stochastic_coordinate=self.stochastic_coordinate,
+            stochastic_generator=self.stochastic_generator,
+            stochastic_cost=self.stochastic_cost,
+            uniform_sampling=self.uniform_sampling)
+
+        # now apply the chain rule
+        return tf.einsum('cos,co->cs', partials, grad)
+
+    def _differentiate_analytic_tiled(self, programs, symbol_names,
+                                      symbol_values, pauli_sums, grad):
+        """Stochastic gradient through self.expectation_op.
+
+        The shift terms are chosen with TensorFlow ops and every chosen
+        shifted program is tiled out and evaluated by self.expectation_op.
+        Arguments are as in `differentiate_analytic`.
+        """
         n_symbols = tf.gather(tf.shape(symbol_values), 1)
         n_programs = tf.gather(tf.shape(programs), 0)
         n_ops = tf.gather(tf.shape(pauli_sums), 1)
@@ -99,6 +99,22 @@ class SGDifferentiatorTest(tf.test.TestCase, parameterized.TestCase):
         self.assertAllClose(expectations, true_f, atol=1e-2, rtol=1e-2)
         self.assertAllClose(grads, true_g, atol=1e-2, rtol=1e-2)
 
+    def test_stochastic_differentiator_call_analytic_cirq_backend(self):
+        """Test that non-native expectation ops use the tiled shift path."""
+        programs, names, values, ops, _, true_f, true_g = \
+        _simple_op_inputs()
+        diff = stochastic_differentiator.SGDifferentiator()
+        op = diff.generate_differentiable_op(
+            analytic_op=circuit_execution_ops.get_expectation_op(
+                backend=cirq.DensityMatrixSimulator()))
+
+        with tf.GradientTape() as g:
+            g.watch(values)
+            expectations = op(programs, names, values, ops)
+        grads = g.gradient(expectations, values)
+        self.assertAllClose(expectations, true_f, atol=1e-2, rtol=1e-2)
+        self.assertAllClose(grads, true_g, atol=1e-2, rtol=1e-2)
+
     @parameterized.parameters(
         list(
             util.kwargs_cartesian_product(